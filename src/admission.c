@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "logging.h"
+
+enum {
+  ADMISSION_FLOWS = 1024,  // power of 2
+  NO_FLOW = UINT16_MAX,
+};
+
+static const uint32_t NO_ENTRY = UINT32_MAX;
+
+struct pending {
+  void *item;
+  ev_tstamp enqueued;
+  uint32_t older;  // of all entries
+  uint32_t newer;
+  uint32_t next;  // of the flow, or free entries
+  uint16_t flow;
+};
+
+struct flow {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t count;
+  uint16_t next_active;
+  uint8_t active;  // in the round of active flows, possibly emptied since
+};
+
+struct admission_s {
+  struct ev_loop *loop;
+  uint32_t max_in_flight;
+  uint32_t max_pending;
+  ev_tstamp queue_timeout;
+  admission_start_cb start_cb;
+  admission_shed_cb shed_cb;
+  void *cb_data;
+
+  uint32_t in_flight;
+  struct pending *entries;  // max_pending of them
+  uint32_t free_entry;
+  uint32_t oldest;
+  uint32_t newest;
+  uint32_t count;
+  struct flow flows[ADMISSION_FLOWS];
+  uint16_t active_head;  // round robin of flows with waiting items
+  uint16_t active_tail;
+  ev_timer expiry;  // of the oldest waiting item
+  ev_prepare dispatch;  // fed, never started: starts waiting items after the current callback
+  uint8_t stopped;
+
+  struct admission_stats stats;
+};
+
+static void shed(admission_t *a, void *item, uint8_t reason) {
+  a->stats.shed[reason]++;
+  a->shed_cb(a->cb_data, item, reason);
+}
+
+static void start(admission_t *a, void *item) {
+  a->in_flight++;
+  a->start_cb(a->cb_data, item);
+}
+
+static void activate(admission_t *a, uint16_t flow) {
+  a->flows[flow].active = 1;
+  a->flows[flow].next_active = NO_FLOW;
+  if (a->active_head == NO_FLOW) {
+    a->active_head = flow;
+  } else {
+    a->flows[a->active_tail].next_active = flow;
+  }
+  a->active_tail = flow;
+}
+
+// Removes the first, and oldest, item of 'flow'.
+static struct pending take(admission_t *a, uint16_t flow) {
+  struct flow *f = &a->flows[flow];
+  const uint32_t i = f->head;
+  struct pending *e = &a->entries[i];
+  f->head = e->next;
+  f->count--;
+  if (e->older == NO_ENTRY) {
+    a->oldest = e->newer;
+  } else {
+    a->entries[e->older].newer = e->newer;
+  }
+  if (e->newer == NO_ENTRY) {
+    a->newest = e->older;
+  } else {
+    a->entries[e->newer].older = e->older;
+  }
+  const struct pending p = *e;
+  e->next = a->free_entry;
+  a->free_entry = i;
+  a->count--;
+  if (a->count == 0) {
+    ev_timer_stop(a->loop, &a->expiry);
+  }
+  return p;
+}
+
+// Takes from the flows in turn, a deficit round robin with the same cost
+// for every query.
+static struct pending take_next(admission_t *a) {
+  for (;;) {
+    const uint16_t flow = a->active_head;
+    struct flow *f = &a->flows[flow];
+    a->active_head = f->next_active;
+    f->active = 0;
+    if (f->count == 0) {
+      continue;  // emptied by shedding
+    }
+    const struct pending p = take(a, flow);
+    if (f->count > 0) {
+      activate(a, flow);
+    }
+    return p;
+  }
+}
+
+// The flow with the most waiting items, most likely of a flooding client.
+static uint16_t largest_flow(admission_t *a) {
+  uint16_t largest = a->entries[a->oldest].flow;
+  for (uint16_t flow = a->active_head; flow != NO_FLOW; flow = a->flows[flow].next_active) {
+    if (a->flows[flow].count > a->flows[largest].count) {
+      largest = flow;
+    }
+  }
+  return largest;
+}
+
+static void expiry_cb(struct ev_loop __attribute__((unused)) *loop,
+                      ev_timer *w, int __attribute__((unused)) revents) {
+  admission_t *a = (admission_t *)w->data;
+  const ev_tstamp now = ev_now(a->loop);
+  while (a->count > 0 && now - a->entries[a->oldest].enqueued >= a->queue_timeout) {
+    shed(a, take(a, a->entries[a->oldest].flow).item, ADMISSION_SHED_EXPIRED);
+  }
+  if (a->count > 0) {
+    ev_timer_set(&a->expiry, a->entries[a->oldest].enqueued + a->queue_timeout - now, 0.);
+    ev_timer_start(a->loop, &a->expiry);
+  }
+}
+
+static void dispatch_cb(struct ev_loop __attribute__((unused)) *loop,
+                        ev_prepare *w, int __attribute__((unused)) revents) {
+  admission_t *a = (admission_t *)w->data;
+  const ev_tstamp now = ev_now(a->loop);
+  while (a->count > 0 && a->in_flight < a->max_in_flight) {
+    const struct pending p = take_next(a);
+    const ev_tstamp waited = now - p.enqueued;
+    if (waited >= a->queue_timeout) {
+      shed(a, p.item, ADMISSION_SHED_EXPIRED);
+      continue;
+    }
+    a->stats.dequeued++;
+    a->stats.wait_sum += waited;
+    start(a, p.item);
+  }
+}
+
+admission_t * admission_create(struct ev_loop *loop, uint32_t max_in_flight,
+                               uint32_t max_pending, ev_tstamp queue_timeout,
+                               admission_start_cb start_cb, admission_shed_cb shed_cb,
+                               void *cb_data) {
+  admission_t *a = (admission_t *)calloc(1, sizeof(admission_t));
+  if (a == NULL) {
+    FLOG("Out of mem");
+  }
+  a->free_entry = NO_ENTRY;
+  if (max_pending > 0) {
+    a->entries = (struct pending *)calloc(max_pending, sizeof(struct pending));
+    if (a->entries == NULL) {
+      FLOG("Out of mem");
+    }
+    for (uint32_t i = max_pending; i > 0; i--) {
+      a->entries[i - 1].next = a->free_entry;
+      a->free_entry = i - 1;
+    }
+  }
+  a->loop = loop;
+  a->max_in_flight = max_in_flight;
+  a->max_pending = max_pending;
+  a->queue_timeout = queue_timeout;
+  a->start_cb = start_cb;
+  a->shed_cb = shed_cb;
+  a->cb_data = cb_data;
+  a->oldest = NO_ENTRY;
+  a->newest = NO_ENTRY;
+  a->active_head = NO_FLOW;
+  a->active_tail = NO_FLOW;
+  ev_timer_init(&a->expiry, expiry_cb, queue_timeout, 0.);
+  a->expiry.data = a;
+  ev_prepare_init(&a->dispatch, dispatch_cb);
+  a->dispatch.data = a;
+  return a;
+}
+
+void admission_submit(admission_t *a, void *item, uint32_t client, uint8_t may_wait) {
+  if (a->stopped) {
+    shed(a, item, ADMISSION_SHED_STOPPED);
+    return;
+  }
+  if (a->in_flight < a->max_in_flight) {
+    start(a, item);
+    return;
+  }
+  if (!may_wait || a->max_pending == 0) {
+    shed(a, item, ADMISSION_SHED_FULL);
+    return;
+  }
+  if (a->count == a->max_pending) {
+    shed(a, take(a, largest_flow(a)).item, ADMISSION_SHED_FULL);
+  }
+  const uint16_t flow = (uint16_t)(client & (ADMISSION_FLOWS - 1));
+  const uint32_t i = a->free_entry;
+  struct pending *e = &a->entries[i];
+  a->free_entry = e->next;
+  e->item = item;
+  e->enqueued = ev_now(a->loop);
+  e->flow = flow;
+  e->next = NO_ENTRY;
+  e->older = a->newest;
+  e->newer = NO_ENTRY;
+  if (a->newest == NO_ENTRY) {
+    a->oldest = i;
+  } else {
+    a->entries[a->newest].newer = i;
+  }
+  a->newest = i;
+  struct flow *f = &a->flows[flow];
+  if (f->count == 0) {
+    f->head = i;
+  } else {
+    a->entries[f->tail].next = i;
+  }
+  f->tail = i;
+  f->count++;
+  if (!f->active) {
+    activate(a, flow);
+  }
+  a->count++;
+  if (a->count > a->stats.max_queued) {
+    a->stats.max_queued = a->count;
+  }
+  if (a->count == 1) {
+    ev_timer_set(&a->expiry, a->queue_timeout, 0.);
+    ev_timer_start(a->loop, &a->expiry);
+  }
+}
+
+void admission_done(admission_t *a) {
+  a->in_flight--;
+  if (a->count > 0) {
+    // Fed rather than started: a prepare watcher started now would run
+    // before the next poll, but the batching watchers of the clients it
+    // starts fetches on would then miss that poll and stall until the next
+    // event. Pending events are invoked in this iteration, after the
+    // callback that finished the request.
+    ev_feed_event(a->loop, &a->dispatch, EV_PREPARE);
+  }
+}
+
+void admission_stats(admission_t *a, struct admission_stats *stats) {
+  *stats = a->stats;
+  stats->in_flight = a->in_flight;
+  stats->queued = a->count;
+  memset(&a->stats, 0, sizeof(a->stats));
+  a->stats.max_queued = a->count;
+}
+
+void admission_stop(admission_t *a) {
+  a->stopped = 1;
+  while (a->count > 0) {
+    shed(a, take(a, a->entries[a->oldest].flow).item, ADMISSION_SHED_STOPPED);
+  }
+}
+
+void admission_free(admission_t *a) {
+  ev_timer_stop(a->loop, &a->expiry);
+  ev_prepare_stop(a->loop, &a->dispatch);
+  free(a->entries);
+  free(a);
+}
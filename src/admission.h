@@ -0,0 +1,62 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+// Admission control of upstream requests, so a query flood does not turn
+// into unbounded transfers, memory and latency for everyone.
+//
+// At most 'max_in_flight' requests are sent upstream at a time. Further ones
+// wait in a queue of at most 'max_pending' entries, for at most
+// 'queue_timeout' seconds. Waiting requests are started by turns of their
+// clients, hashed into a fixed number of flows, so a flooding client does not
+// delay everyone else. When the queue is full the oldest request of the
+// client with the most waiting is shed to make room. So are requests waiting
+// longer than the timeout.
+
+#include <stdint.h>
+#include <ev.h>
+
+enum admission_shed_reason {
+  ADMISSION_SHED_FULL = 0,
+  ADMISSION_SHED_EXPIRED,
+  ADMISSION_SHED_STOPPED,  // shutdown
+};
+
+// Sends 'item' upstream.
+typedef void (*admission_start_cb)(void *data, void *item);
+// Answers and frees 'item' without sending it upstream.
+typedef void (*admission_shed_cb)(void *data, void *item, uint8_t reason);
+
+typedef struct admission_s admission_t;
+
+admission_t * admission_create(struct ev_loop *loop, uint32_t max_in_flight,
+                               uint32_t max_pending, ev_tstamp queue_timeout,
+                               admission_start_cb start_cb, admission_shed_cb shed_cb,
+                               void *cb_data);
+
+// Starts 'item' right away if below the in-flight limit, queues it otherwise
+// among the items of the same 'client' hash. Items which are not worth
+// waiting for, like cache warm-up, are shed instead of queued if 'may_wait'
+// is 0.
+void admission_submit(admission_t *a, void *item, uint32_t client, uint8_t may_wait);
+
+// Called when a started item finished. The next waiting one is started
+// before the loop polls again, not from the caller's callback.
+void admission_done(admission_t *a);
+
+struct admission_stats {
+  uint32_t in_flight;
+  uint32_t queued;
+  uint32_t max_queued;  // counters since the previous call
+  uint64_t dequeued;
+  ev_tstamp wait_sum;  // seconds waited by the dequeued items
+  uint64_t shed[ADMISSION_SHED_STOPPED + 1];
+};
+
+void admission_stats(admission_t *a, struct admission_stats *stats);
+
+// Sheds the waiting items, later ones too, for shutdown.
+void admission_stop(admission_t *a);
+
+void admission_free(admission_t *a);
+
+#endif // _ADMISSION_H_
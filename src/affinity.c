@@ -0,0 +1,74 @@
+//NOLINTNEXTLINE(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+#define _GNU_SOURCE  // needed for cpu_set_t and pthread_setaffinity_np()
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "logging.h"
+
+static int parse_cpu(const char *str, char **endptr) {
+  errno = 0;
+  unsigned long cpu = strtoul(str, endptr, 10);
+  if (errno != 0 || *endptr == str || cpu >= CPU_SETSIZE) {
+    return -1;
+  }
+  return (int)cpu;
+}
+
+static int parse_cpu_list(const char *cpus, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *pos = cpus;
+  while (*pos != '\0') {
+    char *end = NULL;
+    int first = parse_cpu(pos, &end);
+    int last = first;
+    if (first >= 0 && *end == '-') {
+      last = parse_cpu(end + 1, &end);
+    }
+    if (first < 0 || last < first || (*end != ',' && *end != '\0')) {
+      return -1;
+    }
+    for (size_t cpu = (size_t)first; cpu <= (size_t)last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    pos = (*end == ',') ? end + 1 : end;
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int affinity_check(const char *cpus) {
+  cpu_set_t set;
+  return parse_cpu_list(cpus, &set);
+}
+
+void affinity_pin_self(const char *cpus, int index, const char *name) {
+  cpu_set_t set;
+  if (parse_cpu_list(cpus, &set) != 0) {
+    FLOG("Invalid CPU list of %s thread: %s", name, cpus);
+  }
+  int pinned_cpu = -1;
+  if (index >= 0) {
+    int skip = index % CPU_COUNT(&set);
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set) && skip-- == 0) {
+        pinned_cpu = (int)cpu;
+        break;
+      }
+    }
+    CPU_ZERO(&set);
+    CPU_SET((size_t)pinned_cpu, &set);
+  }
+  int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (res != 0) {
+    FLOG("Failed to pin %s thread to CPUs %s: %s", name, cpus, strerror(res));
+  }
+  if (pinned_cpu >= 0) {
+    ILOG("Pinned %s thread to CPU %d", name, pinned_cpu);
+  } else {
+    ILOG("Pinned %s thread to CPUs %s", name, cpus);
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+// CPU placement of threads. CPU lists are comma-separated CPU numbers and
+// ranges, e.g. "0-3,8".
+//
+// Memory of a thread (loops, buffers, curl handles) should be allocated by the
+// thread itself after pinning, so the kernel places it on the local NUMA node
+// (first touch).
+
+// Returns 0 if 'cpus' is a valid CPU list.
+int affinity_check(const char *cpus);
+
+// Pins the calling thread to the CPUs of 'cpus', or if 'index' is not
+// negative, to the index-th CPU of the list (wrapping around).
+void affinity_pin_self(const char *cpus, int index, const char *name);
+
+#endif // _AFFINITY_H_
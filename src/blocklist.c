@@ -0,0 +1,421 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocklist.h"
+#include "dns_wire.h"
+#include "logging.h"
+
+// Hack for platforms that don't support O_CLOEXEC.
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+enum {
+  BLOCKLIST_VERSION = 1,
+  BLOCKLIST_TTL = 300,
+  BLOCKLIST_BUCKET_SIZE = 4,  // hashes per bucket on average
+  BLOCKLIST_MAX_BUCKET_BITS = 28,
+  MAX_LABELS = DNS_WIRE_MAX_NAME_LENGTH / 2,
+};
+
+static const char BLOCKLIST_MAGIC[8] = {'H', 'D', 'P', 'B', 'L', 'O', 'C', 'K'};
+
+// Boilerplate of hosts files, not meant to be blocked.
+static const char *ignored_names[] = {
+  "localhost", "localhost.localdomain", "local", "broadcasthost",
+  "ip6-localhost", "ip6-loopback", "0.0.0.0",
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct blocklist_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t bucket_bits;
+  uint64_t count;
+};  // followed by the buckets and the hashes, aligned to 8 bytes
+
+static size_t hashes_offset(uint32_t bucket_bits) {
+  const size_t end = sizeof(struct blocklist_header) +
+                     (((size_t)1 << bucket_bits) + 1) * sizeof(uint32_t);
+  return (end + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+static uint64_t hash_label(uint64_t hash, const char *label) {
+  const uint8_t length = (uint8_t)label[0];
+  hash ^= length;  // FNV-1a
+  hash *= 1099511628211ULL;
+  for (uint8_t i = 1; i <= length; i++) {
+    hash ^= (uint8_t)tolower((unsigned char)label[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Offsets of the labels of a wire format name, returns their number.
+static int label_offsets(const char *name, size_t length, size_t *offsets) {
+  int count = 0;
+  for (size_t pos = 0; pos < length && name[pos] != 0 && count < MAX_LABELS;
+       pos += 1 + (uint8_t)name[pos]) {
+    offsets[count++] = pos;
+  }
+  return count;
+}
+
+static uint64_t name_hash(const char *name, size_t length) {
+  size_t offsets[MAX_LABELS];
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = label_offsets(name, length, offsets) - 1; i >= 0; i--) {
+    hash = hash_label(hash, name + offsets[i]);
+  }
+  return hash;
+}
+
+static int contains(const blocklist_t *b, uint64_t hash) {
+  const uint64_t bucket = hash >> (64 - b->bucket_bits);
+  for (uint32_t i = b->buckets[bucket]; i < b->buckets[bucket + 1]; i++) {
+    if (b->hashes[i] >= hash) {
+      return b->hashes[i] == hash;
+    }
+  }
+  return 0;
+}
+
+// Compiling
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct hash_list {
+  uint64_t *hashes;
+  size_t count;
+  size_t capacity;
+};
+
+static void add_domain(struct hash_list *list, const char *name) {
+  char wire[DNS_WIRE_MAX_NAME_LENGTH];
+  const int length = dns_wire_encode_name(wire, sizeof(wire), name);
+  if (length <= 1) {
+    return;
+  }
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 65536;
+    list->hashes = (uint64_t *)realloc(list->hashes, list->capacity * sizeof(uint64_t));
+    if (list->hashes == NULL) {
+      FLOG("Out of mem");
+    }
+  }
+  list->hashes[list->count++] = name_hash(wire, (size_t)length);
+}
+
+static int is_ignored(const char *name) {
+  for (size_t i = 0; i < sizeof(ignored_names) / sizeof(ignored_names[0]); i++) {
+    if (strcasecmp(name, ignored_names[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns the domain of a list entry, or NULL if it is not supported.
+static char * entry_domain(char *entry) {
+  if (strncmp(entry, "||", 2) == 0) {  // Adblock style, without options
+    entry += 2;
+    char *end = strchr(entry, '^');
+    if (end == NULL || end[1] != '\0') {
+      return NULL;
+    }
+    *end = '\0';
+  }
+  if (strncmp(entry, "*.", 2) == 0) {
+    entry += 2;
+  }
+  char wire[DNS_WIRE_MAX_NAME_LENGTH];
+  if (dns_wire_encode_name(wire, sizeof(wire), entry) <= 1) {
+    return NULL;
+  }
+  return entry;
+}
+
+static int read_source(struct hash_list *list, const char *path, unsigned *invalid) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    ELOG("Failed to open blocklist source %s: %s", path, strerror(errno));
+    return -1;
+  }
+  char *line = NULL;
+  size_t line_size = 0;
+  unsigned line_number = 0;
+  while (getline(&line, &line_size, file) != -1) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    if (line[0] == '!' || line[0] == '[') {  // Adblock comments and header
+      continue;
+    }
+    char *save = NULL;
+    char *token = strtok_r(line, " \t\r\n", &save);
+    if (token == NULL) {
+      continue;
+    }
+    uint8_t addr[16];
+    const int hosts_format = inet_pton(AF_INET, token, addr) == 1 ||
+                             inet_pton(AF_INET6, token, addr) == 1;
+    if (hosts_format) {
+      token = strtok_r(NULL, " \t\r\n", &save);
+    } else if (strtok_r(NULL, " \t\r\n", &save) != NULL) {
+      (*invalid)++;
+      DLOG("Invalid line %u of %s", line_number, path);
+      continue;
+    }
+    for (; token != NULL; token = hosts_format ? strtok_r(NULL, " \t\r\n", &save) : NULL) {
+      if (is_ignored(token)) {
+        continue;
+      }
+      const char *domain = entry_domain(token);
+      if (domain == NULL) {
+        (*invalid)++;
+        DLOG("Invalid entry %s on line %u of %s", token, line_number, path);
+        continue;
+      }
+      add_domain(list, domain);
+    }
+  }
+  free(line);
+  fclose(file);
+  return 0;
+}
+
+static int compare_hashes(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static int write_blocklist(const char *path, const uint64_t *hashes, size_t count) {
+  uint32_t bucket_bits = 1;
+  while (bucket_bits < BLOCKLIST_MAX_BUCKET_BITS &&
+         ((size_t)1 << bucket_bits) * BLOCKLIST_BUCKET_SIZE < count) {
+    bucket_bits++;
+  }
+  const size_t bucket_count = (size_t)1 << bucket_bits;
+  uint32_t *buckets = (uint32_t *)calloc(bucket_count + 1, sizeof(uint32_t));
+  if (buckets == NULL) {
+    FLOG("Out of mem");
+  }
+  size_t next = 0;
+  for (size_t bucket = 0; bucket <= bucket_count; bucket++) {
+    while (next < count && (hashes[next] >> (64 - bucket_bits)) < bucket) {
+      next++;
+    }
+    buckets[bucket] = (uint32_t)next;
+  }
+  buckets[bucket_count] = (uint32_t)count;
+
+  struct blocklist_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BLOCKLIST_MAGIC, sizeof(header.magic));
+  header.version = BLOCKLIST_VERSION;
+  header.bucket_bits = bucket_bits;
+  header.count = count;
+  const uint64_t padding = 0;
+  const size_t padding_length = hashes_offset(bucket_bits) - sizeof(header) -
+                                (bucket_count + 1) * sizeof(uint32_t);
+
+  const size_t tmp_path_size = strlen(path) + sizeof(".tmp");
+  char *tmp_path = (char *)malloc(tmp_path_size);
+  if (tmp_path == NULL) {
+    FLOG("Out of mem");
+  }
+  (void)snprintf(tmp_path, tmp_path_size, "%s.tmp", path);
+  FILE *file = fopen(tmp_path, "w");
+  int failed = file == NULL;
+  if (!failed) {
+    failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+             fwrite(buckets, sizeof(uint32_t), bucket_count + 1, file) != bucket_count + 1 ||
+             fwrite(&padding, 1, padding_length, file) != padding_length ||
+             (count > 0 && fwrite(hashes, sizeof(uint64_t), count, file) != count) ||
+             fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed = fclose(file) != 0 || failed;
+  }
+  // replaced atomically, a running proxy keeps the old one mapped
+  if (failed || rename(tmp_path, path) != 0) {
+    ELOG("Failed to write blocklist %s: %s", path, strerror(errno));
+    (void)unlink(tmp_path);
+    failed = 1;
+  }
+  free(tmp_path);
+  free(buckets);
+  return failed ? -1 : 0;
+}
+
+int64_t blocklist_compile(const char *path, char **sources, int source_count) {
+  struct hash_list list = {NULL, 0, 0};
+  unsigned invalid = 0;
+  for (int i = 0; i < source_count; i++) {
+    if (read_source(&list, sources[i], &invalid) != 0) {
+      free(list.hashes);
+      return -1;
+    }
+  }
+  if (list.count > UINT32_MAX) {
+    ELOG("Too many domains for a blocklist: %zu", list.count);
+    free(list.hashes);
+    return -1;
+  }
+  if (list.count > 0) {
+    qsort(list.hashes, list.count, sizeof(uint64_t), compare_hashes);
+  }
+  size_t unique = 0;
+  for (size_t i = 0; i < list.count; i++) {
+    if (unique == 0 || list.hashes[unique - 1] != list.hashes[i]) {
+      list.hashes[unique++] = list.hashes[i];
+    }
+  }
+  if (invalid > 0) {
+    WLOG("Skipped %u unsupported blocklist entries", invalid);
+  }
+  const int rc = write_blocklist(path, list.hashes, unique);
+  free(list.hashes);
+  return rc == 0 ? (int64_t)unique : -1;
+}
+
+// Loading
+
+static int map_blocklist(blocklist_t *b) {
+  int fd = open(b->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    ELOG("Failed to open blocklist %s: %s", b->path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct blocklist_header)) {
+    ELOG("Invalid blocklist %s", b->path);
+    close(fd);
+    return -1;
+  }
+  const size_t map_size = (size_t)st.st_size;
+  void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ELOG("Failed to map blocklist %s: %s", b->path, strerror(errno));
+    return -1;
+  }
+  const struct blocklist_header *header = (const struct blocklist_header *)map;
+  const uint32_t *buckets = (const uint32_t *)(header + 1);
+  int valid = memcmp(header->magic, BLOCKLIST_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == BLOCKLIST_VERSION && header->bucket_bits > 0 &&
+              header->bucket_bits <= BLOCKLIST_MAX_BUCKET_BITS &&
+              header->count <= UINT32_MAX &&
+              map_size == hashes_offset(header->bucket_bits) + header->count * sizeof(uint64_t);
+  // bounds of the buckets are trusted by lookups
+  const size_t bucket_count = valid ? (size_t)1 << header->bucket_bits : 0;
+  for (size_t i = 0; valid && i < bucket_count; i++) {
+    valid = buckets[i] <= buckets[i + 1];
+  }
+  if (!valid || buckets[bucket_count] != header->count) {
+    ELOG("Invalid blocklist %s", b->path);
+    munmap(map, map_size);
+    return -1;
+  }
+  if (b->map != NULL) {
+    munmap(b->map, b->map_size);
+  }
+  b->map = map;
+  b->map_size = map_size;
+  b->bucket_bits = header->bucket_bits;
+  b->buckets = buckets;
+  b->hashes = (const uint64_t *)(const void *)((const char *)map +
+                                               hashes_offset(header->bucket_bits));
+  b->count = header->count;
+  ILOG("Loaded blocklist %s with %llu domains", b->path, (unsigned long long)b->count);
+  return 0;
+}
+
+void blocklist_init(blocklist_t *b, const char *path, uint8_t answer) {
+  memset(b, 0, sizeof(blocklist_t));
+  b->path = path;
+  b->answer = answer;
+  (void)map_blocklist(b);
+}
+
+void blocklist_reload(blocklist_t *b) {
+  (void)map_blocklist(b);
+}
+
+void blocklist_cleanup(blocklist_t *b) {
+  if (b->map != NULL) {
+    munmap(b->map, b->map_size);
+    b->map = NULL;
+  }
+}
+
+// Answers
+
+// Returns the offset in 'name' of the blocked domain it is or is below, -1
+// if it is not blocked.
+static int blocked_domain(const blocklist_t *b, const char *name, size_t length) {
+  size_t offsets[MAX_LABELS];
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = label_offsets(name, length, offsets) - 1; i >= 0; i--) {
+    hash = hash_label(hash, name + offsets[i]);
+    if (contains(b, hash)) {
+      return (int)offsets[i];
+    }
+  }
+  return -1;
+}
+
+char * blocklist_answer(blocklist_t *b, const char *req, size_t req_len, size_t *resp_len) {
+  struct dns_wire_question q;
+  if (b->map == NULL || req_len < DNS_WIRE_HEADER_LENGTH || DNS_WIRE_QR(req) ||
+      DNS_WIRE_OPCODE(req) != 0 || dns_wire_question(req, req_len, &q) != 0 ||
+      q.qclass != DNS_WIRE_CLASS_IN) {
+    return NULL;
+  }
+  const int domain = blocked_domain(b, req + q.qname_offset, q.qname_length);
+  if (domain < 0) {
+    return NULL;
+  }
+  struct dns_wire_rr opt;
+  const int edns = dns_wire_find_opt(req, req_len, &q, &opt) == 0;
+  uint16_t rdlength = 0;
+  if (b->answer == BLOCKLIST_NULL) {
+    rdlength = q.qtype == DNS_WIRE_TYPE_A ? 4 : q.qtype == DNS_WIRE_TYPE_AAAA ? 16 : 0;
+  }
+  char *resp = (char *)malloc(q.end + 2 + DNS_WIRE_RR_FIXED_LENGTH + rdlength +
+                              DNS_WIRE_SOA_LENGTH + DNS_WIRE_OPT_LENGTH);
+  if (resp == NULL) {
+    FLOG("Out of mem");
+  }
+  size_t len = dns_wire_start_response(
+      resp, req, &q,
+      b->answer == BLOCKLIST_NULL ? DNS_WIRE_RCODE_NOERROR : DNS_WIRE_RCODE_NXDOMAIN);
+  if (rdlength > 0) {
+    char *p = resp + len;
+    dns_wire_set_u16(p, 0, 0xc000 | DNS_WIRE_HEADER_LENGTH);  // question name
+    dns_wire_set_u16(p, 2, q.qtype);
+    dns_wire_set_u16(p, 4, DNS_WIRE_CLASS_IN);
+    dns_wire_set_u32(p, 6, BLOCKLIST_TTL);
+    dns_wire_set_u16(p, 10, rdlength);
+    memset(p + 2 + DNS_WIRE_RR_FIXED_LENGTH, 0, rdlength);  // unspecified address
+    len += 2 + DNS_WIRE_RR_FIXED_LENGTH + rdlength;
+    dns_wire_set_u16(resp, 6, 1);
+  } else {
+    // NXDOMAIN, or NODATA of other types, negative-cached for the blocked domain
+    len = dns_wire_add_soa(resp, len, DNS_WIRE_HEADER_LENGTH + (size_t)domain, BLOCKLIST_TTL);
+  }
+  if (edns) {
+    len = dns_wire_add_opt(resp, len);
+  }
+  *resp_len = len;
+  return resp;
+}
@@ -0,0 +1,52 @@
+#ifndef _BLOCKLIST_H_
+#define _BLOCKLIST_H_
+
+// Domain blocklist, compiled from text lists into a file which is mapped
+// into memory as is.
+//
+// A blocked domain blocks its subdomains too. The compiled file holds sorted
+// 64-bit hashes of the domains with their labels in reverse order, bucketed
+// by their top bits. The hash of every suffix of a question name is computed
+// in one pass from the root, so a lookup costs a bucket probe per label.
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum blocklist_answer {
+  BLOCKLIST_NXDOMAIN = 0,
+  BLOCKLIST_NULL,  // 0.0.0.0 and :: addresses
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+typedef struct {
+  const char *path;
+  uint8_t answer;
+
+  void *map;
+  size_t map_size;
+  uint32_t bucket_bits;
+  const uint32_t *buckets;  // start of each bucket, and the end
+  const uint64_t *hashes;
+  uint64_t count;
+} blocklist_t;
+
+// Compiles text lists into 'path'. Lines hold a domain, hosts format
+// entries like "0.0.0.0 ads.example.com" or Adblock style "||example.com^".
+// Returns the number of domains, -1 on failure.
+int64_t blocklist_compile(const char *path, char **sources, int source_count);
+
+// Maps the compiled blocklist, errors are logged and nothing is blocked.
+void blocklist_init(blocklist_t *b, const char *path, uint8_t answer);
+
+// Maps the file again, e.g. after it was replaced. Keeps the old list if the
+// new one is invalid.
+void blocklist_reload(blocklist_t *b);
+
+// Returns a response (to be freed by the caller) if the question of 'req'
+// is blocked, NULL otherwise. Answers without addresses carry an SOA of the
+// blocked domain, so clients cache them as negative answers (RFC 2308).
+char * blocklist_answer(blocklist_t *b, const char *req, size_t req_len, size_t *resp_len);
+
+void blocklist_cleanup(blocklist_t *b);
+
+#endif // _BLOCKLIST_H_
@@ -0,0 +1,644 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "dns_wire.h"
+#include "logging.h"
+
+enum {
+  CACHE_SHARDS = 64,  // power of 2
+  CACHE_MIN_BUCKETS = 16,  // per shard, power of 2
+  CACHE_LINE_SIZE = 64,
+  CACHE_MAX_RECORDS = 64,  // responses with more records are not cached
+  CACHE_MAX_TTL = 86400,
+  CACHE_SMALL_PERCENT = 10,  // of the shard budget, for entries not seen twice yet
+  CACHE_MAX_FREQ = 3,
+  CACHE_GHOST_ENTRY_BYTES = 256,  // average entry size assumed to size ghost tables
+  CACHE_KEY_FLAG_RD = 0x01,
+  CACHE_KEY_FLAG_CD = 0x02,
+  CACHE_KEY_FLAG_DO = 0x04,
+  CACHE_KEY_FLAG_EDNS = 0x08,  // OPT is only answered to requests having one
+  CACHE_KEY_FLAG_ECS = 0x10,  // client subnet follows the question
+  CACHE_KEY_ECS_FIXED_LENGTH = 3,  // family, source prefix
+  CACHE_KEY_ECS_MAX_LENGTH = CACHE_KEY_ECS_FIXED_LENGTH + 16,
+  // flags, qname, qtype, qclass, client subnet
+  CACHE_MAX_KEY_LENGTH = 1 + DNS_WIRE_MAX_NAME_LENGTH + 4 + CACHE_KEY_ECS_MAX_LENGTH,
+  EDNS_DO_BIT = 0x8000,  // in the TTL field of OPT
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct cache_entry {
+  struct cache_entry *next;  // hash chain
+  struct cache_entry *older;  // eviction order
+  struct cache_entry *newer;
+  uint64_t hash;
+  uint32_t stored;  // monotonic seconds
+  uint32_t expire;
+  uint32_t size;  // allocated bytes, accounted to the budget
+  uint16_t ttl_count;
+  uint16_t key_length;
+  uint16_t resp_length;
+  uint8_t fifo;  // enum cache_fifo_id
+  uint8_t freq;  // hits since insertion or last reinsertion, saturating
+  char data[];  // TTL offsets (uint16_t), key, response
+};
+
+// S3-FIFO eviction (Yang et al., SOSP 2023): new entries go to a small FIFO
+// and only those hit while there are moved to the main FIFO, which reinserts
+// entries hit since their last pass. Names evicted from the small FIFO are
+// remembered in a ghost table and go straight to the main FIFO when stored
+// again. One-hit wonders, like random subdomain floods, only churn the small
+// FIFO and leave the working set alone.
+enum cache_fifo_id {
+  CACHE_FIFO_SMALL,
+  CACHE_FIFO_MAIN,
+  CACHE_FIFO_COUNT,
+};
+
+struct cache_fifo {
+  struct cache_entry *oldest;
+  struct cache_entry *newest;
+  size_t bytes;
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct cache_shard {
+  pthread_mutex_t lock;
+  struct cache_entry **buckets;
+  uint32_t bucket_count;
+  uint32_t entries;
+  size_t bytes;
+  struct cache_fifo fifos[CACHE_FIFO_COUNT];
+  uint32_t *ghost;  // fingerprints of evicted keys, direct mapped by hash
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} __attribute__((aligned(CACHE_LINE_SIZE)));  // no false sharing between shards
+
+struct cache_s {
+  struct cache_shard shards[CACHE_SHARDS];
+  size_t shard_max_bytes;
+  size_t small_max_bytes;
+  uint32_t ghost_mask;
+};
+
+static uint32_t cache_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec;
+}
+
+static uint16_t * entry_ttl_offsets(struct cache_entry *e) {
+  return (uint16_t *)(void *)e->data;
+}
+
+static char * entry_key(struct cache_entry *e) {
+  return e->data + e->ttl_count * sizeof(uint16_t);
+}
+
+static char * entry_resp(struct cache_entry *e) {
+  return entry_key(e) + e->key_length;
+}
+
+static uint64_t key_hash(const uint8_t *key, size_t key_length) {
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+  for (size_t i = 0; i < key_length; i++) {
+    hash ^= key[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Writes the client subnet option at 'offset' of 'req' into the key, returns
+// its length or 0 if it is malformed.
+static size_t build_key_ecs(const char *req, size_t offset, uint16_t length, uint8_t *key) {
+  const size_t address_length = (size_t)length - CACHE_KEY_ECS_FIXED_LENGTH - 1;  // no scope
+  const uint8_t prefix = (uint8_t)req[offset + DNS_WIRE_OPTION_HEADER_LENGTH + 2];
+  if (length < CACHE_KEY_ECS_FIXED_LENGTH + 1 || address_length != (prefix + 7U) / 8U ||
+      address_length > CACHE_KEY_ECS_MAX_LENGTH - CACHE_KEY_ECS_FIXED_LENGTH) {
+    return 0;
+  }
+  memcpy(key, req + offset + DNS_WIRE_OPTION_HEADER_LENGTH, CACHE_KEY_ECS_FIXED_LENGTH);
+  memcpy(key + CACHE_KEY_ECS_FIXED_LENGTH,
+         req + offset + DNS_WIRE_OPTION_HEADER_LENGTH + CACHE_KEY_ECS_FIXED_LENGTH + 1,
+         address_length);
+  if (prefix % 8 != 0) {
+    key[CACHE_KEY_ECS_FIXED_LENGTH + address_length - 1] &= (uint8_t)(0xff << (8 - prefix % 8));
+  }
+  return CACHE_KEY_ECS_FIXED_LENGTH + address_length;
+}
+
+// Returns the key length, 0 if the request can not be answered from cache.
+// '*ecs_offset' is set to the start of the client subnet in the key, 0 if
+// the request has none.
+static size_t build_key(const char *req, size_t req_len, struct dns_wire_question *q,
+                        uint8_t *key, size_t *ecs_offset) {
+  if (req_len < DNS_WIRE_HEADER_LENGTH || DNS_WIRE_QR(req) || DNS_WIRE_OPCODE(req) != 0 ||
+      dns_wire_question(req, req_len, q) != 0) {
+    return 0;
+  }
+  uint8_t flags = 0;
+  if (DNS_WIRE_RD(req)) {
+    flags |= CACHE_KEY_FLAG_RD;
+  }
+  if (DNS_WIRE_CD(req)) {
+    flags |= CACHE_KEY_FLAG_CD;
+  }
+  struct dns_wire_rr opt;
+  size_t ecs_option = 0;
+  uint16_t ecs_length = 0;
+  if (dns_wire_find_opt(req, req_len, q, &opt) == 0) {
+    flags |= CACHE_KEY_FLAG_EDNS;
+    if (opt.ttl & EDNS_DO_BIT) {
+      flags |= CACHE_KEY_FLAG_DO;
+    }
+    if (dns_wire_find_option(req, &opt, DNS_WIRE_OPTION_ECS, &ecs_option, &ecs_length) == 0) {
+      flags |= CACHE_KEY_FLAG_ECS;
+    }
+  }
+  size_t pos = 0;
+  key[pos++] = flags;
+  for (size_t i = 0; i < q->qname_length; i++) {
+    key[pos++] = (uint8_t)tolower((unsigned char)req[q->qname_offset + i]);
+  }
+  memcpy(key + pos, req + q->end - 4, 4);  // qtype, qclass
+  pos += 4;
+  *ecs_offset = 0;
+  if (flags & CACHE_KEY_FLAG_ECS) {
+    const size_t length = build_key_ecs(req, ecs_option, ecs_length, key + pos);
+    if (length == 0) {
+      return 0;
+    }
+    *ecs_offset = pos;
+    pos += length;
+  }
+  return pos;
+}
+
+// Turns a key with client subnet into the one of answers valid for all
+// clients (scope prefix 0), returns its length.
+static size_t global_key(uint8_t *key, size_t ecs_offset) {
+  memset(key + ecs_offset, 0, CACHE_KEY_ECS_FIXED_LENGTH);
+  return ecs_offset + CACHE_KEY_ECS_FIXED_LENGTH;
+}
+
+static struct cache_shard * key_shard(cache_t *c, uint64_t hash) {
+  return &c->shards[hash >> 58];  // top bits, buckets use the low ones
+}
+
+static struct cache_entry ** bucket_of(struct cache_shard *s, uint64_t hash) {
+  return &s->buckets[hash & (s->bucket_count - 1)];
+}
+
+static struct cache_entry ** buckets_alloc(uint32_t count) {
+  size_t size = count * sizeof(struct cache_entry *);
+  struct cache_entry **buckets = (struct cache_entry **)aligned_alloc(CACHE_LINE_SIZE, size);
+  if (buckets == NULL) {
+    FLOG("Out of mem");
+  }
+  memset((void *)buckets, 0, size);
+  return buckets;
+}
+
+static void shard_grow(struct cache_shard *s) {
+  const uint32_t old_count = s->bucket_count;
+  struct cache_entry **old_buckets = s->buckets;
+  s->bucket_count = old_count * 2;
+  s->buckets = buckets_alloc(s->bucket_count);
+  for (uint32_t i = 0; i < old_count; i++) {
+    struct cache_entry *e = old_buckets[i];
+    while (e != NULL) {
+      struct cache_entry *next = e->next;
+      struct cache_entry **bucket = bucket_of(s, e->hash);
+      e->next = *bucket;
+      *bucket = e;
+      e = next;
+    }
+  }
+  free((void *)old_buckets);
+}
+
+static void fifo_push(struct cache_shard *s, struct cache_entry *e, enum cache_fifo_id id) {
+  struct cache_fifo *f = &s->fifos[id];
+  e->fifo = (uint8_t)id;
+  e->newer = NULL;
+  e->older = f->newest;
+  if (f->newest != NULL) {
+    f->newest->newer = e;
+  } else {
+    f->oldest = e;
+  }
+  f->newest = e;
+  f->bytes += e->size;
+}
+
+static void fifo_remove(struct cache_shard *s, struct cache_entry *e) {
+  struct cache_fifo *f = &s->fifos[e->fifo];
+  if (e->older != NULL) {
+    e->older->newer = e->newer;
+  } else {
+    f->oldest = e->newer;
+  }
+  if (e->newer != NULL) {
+    e->newer->older = e->older;
+  } else {
+    f->newest = e->older;
+  }
+  f->bytes -= e->size;
+}
+
+static void shard_unlink(struct cache_shard *s, struct cache_entry *e) {
+  for (struct cache_entry **cur = bucket_of(s, e->hash); *cur != NULL; cur = &(*cur)->next) {
+    if (*cur == e) {
+      *cur = e->next;
+      break;
+    }
+  }
+  fifo_remove(s, e);
+  s->entries--;
+  s->bytes -= e->size;
+  free(e);
+}
+
+static uint32_t ghost_fingerprint(uint64_t hash) {
+  return (uint32_t)(hash >> 26) | 1;  // bits not used for shard and slot, never 0
+}
+
+static void ghost_add(cache_t *c, struct cache_shard *s, uint64_t hash) {
+  s->ghost[hash & c->ghost_mask] = ghost_fingerprint(hash);
+}
+
+static int ghost_take(cache_t *c, struct cache_shard *s, uint64_t hash) {
+  uint32_t *slot = &s->ghost[hash & c->ghost_mask];
+  if (*slot != ghost_fingerprint(hash)) {
+    return 0;
+  }
+  *slot = 0;
+  return 1;
+}
+
+// Evicts an entry or gives one a second chance, so repeated calls free space.
+static void shard_evict_step(cache_t *c, struct cache_shard *s, uint32_t now) {
+  struct cache_fifo *small_fifo = &s->fifos[CACHE_FIFO_SMALL];
+  struct cache_fifo *main_fifo = &s->fifos[CACHE_FIFO_MAIN];
+  if (small_fifo->oldest != NULL &&
+      (small_fifo->bytes > c->small_max_bytes || main_fifo->oldest == NULL)) {
+    struct cache_entry *e = small_fifo->oldest;
+    if (e->freq > 0 && now < e->expire) {
+      fifo_remove(s, e);
+      e->freq = 0;
+      fifo_push(s, e, CACHE_FIFO_MAIN);
+      return;
+    }
+    ghost_add(c, s, e->hash);
+    shard_unlink(s, e);
+    s->evictions++;
+    return;
+  }
+  struct cache_entry *e = main_fifo->oldest;
+  if (e->freq > 0 && now < e->expire) {
+    fifo_remove(s, e);
+    e->freq--;
+    fifo_push(s, e, CACHE_FIFO_MAIN);
+    return;
+  }
+  shard_unlink(s, e);
+  s->evictions++;
+}
+
+static struct cache_entry * shard_find(struct cache_shard *s, uint64_t hash,
+                                       const uint8_t *key, size_t key_length) {
+  for (struct cache_entry *e = *bucket_of(s, hash); e != NULL; e = e->next) {
+    if (e->hash == hash && e->key_length == key_length &&
+        memcmp(entry_key(e), key, key_length) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+cache_t * cache_create(size_t max_bytes) {
+  cache_t *c = (cache_t *)aligned_alloc(CACHE_LINE_SIZE, sizeof(cache_t));
+  if (c == NULL) {
+    FLOG("Out of mem");
+  }
+  memset((void *)c, 0, sizeof(cache_t));
+  c->shard_max_bytes = max_bytes / CACHE_SHARDS;
+  c->small_max_bytes = c->shard_max_bytes * CACHE_SMALL_PERCENT / 100;
+  uint32_t ghost_count = CACHE_MIN_BUCKETS;
+  while (ghost_count < c->shard_max_bytes / CACHE_GHOST_ENTRY_BYTES) {
+    ghost_count *= 2;
+  }
+  c->ghost_mask = ghost_count - 1;
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *s = &c->shards[i];
+    pthread_mutex_init(&s->lock, NULL);
+    s->bucket_count = CACHE_MIN_BUCKETS;
+    s->buckets = buckets_alloc(s->bucket_count);
+    s->ghost = (uint32_t *)calloc(ghost_count, sizeof(uint32_t));
+    if (s->ghost == NULL) {
+      FLOG("Out of mem");
+    }
+  }
+  ILOG("Cache of %zu kB in %d shards", max_bytes / 1024, CACHE_SHARDS);
+  return c;
+}
+
+// Returns a copy of the entry of 'key' with aged TTLs, or NULL.
+static char * lookup_key(cache_t *c, const uint8_t *key, size_t key_length, uint32_t now,
+                         size_t *resp_len, int count_miss) {
+  const uint64_t hash = key_hash(key, key_length);
+  struct cache_shard *s = key_shard(c, hash);
+  char *resp = NULL;
+
+  pthread_mutex_lock(&s->lock);
+  struct cache_entry *e = shard_find(s, hash, key, key_length);
+  if (e != NULL && now >= e->expire) {
+    shard_unlink(s, e);
+    e = NULL;
+  }
+  if (e != NULL) {
+    s->hits++;
+    if (e->freq < CACHE_MAX_FREQ) {
+      e->freq++;
+    }
+    resp = (char *)malloc(e->resp_length);
+    if (resp == NULL) {
+      FLOG("Out of mem");
+    }
+    memcpy(resp, entry_resp(e), e->resp_length);
+    *resp_len = e->resp_length;
+    const uint32_t age = now - e->stored;
+    const uint16_t *ttl_offsets = entry_ttl_offsets(e);
+    for (uint16_t i = 0; i < e->ttl_count; i++) {
+      const uint32_t ttl = dns_wire_u32(resp, ttl_offsets[i]);
+      dns_wire_set_u32(resp, ttl_offsets[i], ttl > age ? ttl - age : 0);
+    }
+  } else if (count_miss) {
+    s->misses++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return resp;
+}
+
+// Finds the client subnet option of a message, returns -1 if it has none.
+static int find_ecs(const char *msg, size_t len, size_t *offset, uint16_t *length) {
+  struct dns_wire_question q;
+  struct dns_wire_rr opt;
+  if (dns_wire_question(msg, len, &q) != 0 || dns_wire_find_opt(msg, len, &q, &opt) != 0) {
+    return -1;
+  }
+  return dns_wire_find_option(msg, &opt, DNS_WIRE_OPTION_ECS, offset, length);
+}
+
+// A response for all clients echoes the client subnet of whoever asked first,
+// replaced by the one of the request. Returns -1 if their lengths differ.
+static int patch_ecs(char *resp, size_t resp_len, const char *req, size_t req_len) {
+  size_t resp_offset = 0;
+  size_t req_offset = 0;
+  uint16_t resp_length = 0;
+  uint16_t req_length = 0;
+  if (find_ecs(resp, resp_len, &resp_offset, &resp_length) != 0) {
+    return 0;  // no option to echo
+  }
+  if (find_ecs(req, req_len, &req_offset, &req_length) != 0 || resp_length != req_length ||
+      req_length < CACHE_KEY_ECS_FIXED_LENGTH + 1) {
+    return -1;
+  }
+  const size_t data = DNS_WIRE_OPTION_HEADER_LENGTH;
+  memcpy(resp + resp_offset + data, req + req_offset + data, CACHE_KEY_ECS_FIXED_LENGTH);
+  memcpy(resp + resp_offset + data + CACHE_KEY_ECS_FIXED_LENGTH + 1,  // keep scope prefix
+         req + req_offset + data + CACHE_KEY_ECS_FIXED_LENGTH + 1,
+         req_length - CACHE_KEY_ECS_FIXED_LENGTH - 1U);
+  return 0;
+}
+
+char * cache_lookup(cache_t *c, const char *req, size_t req_len, size_t *resp_len) {
+  struct dns_wire_question q;
+  uint8_t key[CACHE_MAX_KEY_LENGTH];
+  size_t ecs_offset = 0;
+  const size_t key_length = build_key(req, req_len, &q, key, &ecs_offset);
+  if (key_length == 0) {
+    return NULL;
+  }
+  const uint32_t now = cache_now();
+  char *resp = lookup_key(c, key, key_length, now, resp_len, ecs_offset == 0);
+  if (resp == NULL && ecs_offset != 0) {
+    resp = lookup_key(c, key, global_key(key, ecs_offset), now, resp_len, 1);
+    if (resp != NULL && patch_ecs(resp, *resp_len, req, req_len) != 0) {
+      free(resp);
+      resp = NULL;
+    }
+  }
+  if (resp != NULL) {
+    memcpy(resp, req, sizeof(uint16_t));  // ID
+    memcpy(resp + q.qname_offset, req + q.qname_offset, q.qname_length);  // case of request
+  }
+  return resp;
+}
+
+// Returns a new entry for the response to 'key', NULL if it is not cacheable.
+static struct cache_entry * entry_create(cache_t *c, const uint8_t *key, size_t key_length,
+                                         const char *resp, size_t resp_len, uint32_t now) {
+  if (resp_len < DNS_WIRE_HEADER_LENGTH || resp_len > UINT16_MAX ||
+      !DNS_WIRE_QR(resp) || DNS_WIRE_TC(resp) || DNS_WIRE_OPCODE(resp) != 0 ||
+      (DNS_WIRE_RCODE(resp) != DNS_WIRE_RCODE_NOERROR &&
+       DNS_WIRE_RCODE(resp) != DNS_WIRE_RCODE_NXDOMAIN)) {
+    return NULL;
+  }
+  struct dns_wire_question rq;
+  if (dns_wire_question(resp, resp_len, &rq) != 0 || key_length < 1 + rq.qname_length + 4 ||
+      !dns_wire_name_equal(resp + rq.qname_offset, (const char *)key + 1, rq.qname_length) ||
+      memcmp(resp + rq.end - 4, key + 1 + rq.qname_length, 4) != 0) {
+    return NULL;
+  }
+  const size_t ecs_length = key_length - (1 + rq.qname_length + 4);
+  if (ecs_length != 0 &&
+      (!(key[0] & CACHE_KEY_FLAG_ECS) || ecs_length < CACHE_KEY_ECS_FIXED_LENGTH ||
+       ecs_length != CACHE_KEY_ECS_FIXED_LENGTH + (key[key_length - ecs_length + 2] + 7U) / 8U)) {
+    return NULL;
+  }
+
+  uint16_t ttl_offsets[CACHE_MAX_RECORDS];
+  uint16_t ttl_count = 0;
+  uint32_t min_ttl = CACHE_MAX_TTL;
+  const uint32_t rr_count = (uint32_t)dns_wire_ancount(resp) + dns_wire_nscount(resp) +
+                            dns_wire_arcount(resp);
+  size_t pos = rq.end;
+  for (uint32_t i = 0; i < rr_count; i++) {
+    struct dns_wire_rr rr;
+    if (dns_wire_next_rr(resp, resp_len, &pos, &rr) != 0) {
+      return NULL;
+    }
+    if (rr.type == DNS_WIRE_TYPE_OPT) {
+      continue;  // its TTL field holds flags
+    }
+    if (ttl_count == CACHE_MAX_RECORDS) {
+      return NULL;
+    }
+    ttl_offsets[ttl_count++] = (uint16_t)rr.ttl_offset;
+    if (rr.ttl < min_ttl) {
+      min_ttl = rr.ttl;
+    }
+    if (rr.type == DNS_WIRE_TYPE_SOA && rr.rdlength >= 4) {
+      const uint32_t soa_minimum = dns_wire_u32(resp, rr.rdata_offset + rr.rdlength - 4);
+      if (soa_minimum < min_ttl) {
+        min_ttl = soa_minimum;
+      }
+    }
+  }
+  if (ttl_count == 0 || min_ttl == 0) {
+    return NULL;
+  }
+
+  const size_t size = sizeof(struct cache_entry) + ttl_count * sizeof(uint16_t) +
+                      key_length + resp_len;
+  if (size > c->shard_max_bytes) {
+    return NULL;
+  }
+  struct cache_entry *e = (struct cache_entry *)malloc(size);
+  if (e == NULL) {
+    FLOG("Out of mem");
+  }
+  e->hash = key_hash(key, key_length);
+  e->stored = now;
+  e->expire = now + min_ttl;
+  e->size = (uint32_t)size;
+  e->ttl_count = ttl_count;
+  e->key_length = (uint16_t)key_length;
+  e->resp_length = (uint16_t)resp_len;
+  e->freq = 0;
+  memcpy(entry_ttl_offsets(e), ttl_offsets, ttl_count * sizeof(uint16_t));
+  memcpy(entry_key(e), key, key_length);
+  char *stored_resp = entry_resp(e);
+  memcpy(stored_resp, resp, resp_len);
+  for (uint16_t i = 0; i < ttl_count; i++) {
+    if (dns_wire_u32(stored_resp, ttl_offsets[i]) > CACHE_MAX_TTL) {
+      dns_wire_set_u32(stored_resp, ttl_offsets[i], CACHE_MAX_TTL);
+    }
+  }
+  return e;
+}
+
+static void shard_insert(cache_t *c, struct cache_entry *e, uint32_t now) {
+  struct cache_shard *s = key_shard(c, e->hash);
+  pthread_mutex_lock(&s->lock);
+  struct cache_entry *old = shard_find(s, e->hash, (uint8_t *)entry_key(e), e->key_length);
+  if (old != NULL) {
+    shard_unlink(s, old);
+  }
+  struct cache_entry **bucket = bucket_of(s, e->hash);
+  e->next = *bucket;
+  *bucket = e;
+  fifo_push(s, e, ghost_take(c, s, e->hash) ? CACHE_FIFO_MAIN : CACHE_FIFO_SMALL);
+  s->entries++;
+  s->bytes += e->size;
+  while (s->bytes > c->shard_max_bytes) {
+    shard_evict_step(c, s, now);  // may evict 'e' too
+  }
+  if (s->entries > s->bucket_count) {
+    shard_grow(s);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+void cache_store(cache_t *c, const char *req, size_t req_len,
+                 const char *resp, size_t resp_len) {
+  struct dns_wire_question q;
+  uint8_t key[CACHE_MAX_KEY_LENGTH];
+  size_t ecs_offset = 0;
+  size_t key_length = build_key(req, req_len, &q, key, &ecs_offset);
+  if (key_length == 0) {
+    return;
+  }
+  size_t scope_offset = 0;
+  uint16_t scope_length = 0;
+  if (ecs_offset != 0 &&
+      (find_ecs(resp, resp_len, &scope_offset, &scope_length) != 0 ||
+       scope_length < CACHE_KEY_ECS_FIXED_LENGTH + 1 ||
+       resp[scope_offset + DNS_WIRE_OPTION_HEADER_LENGTH + CACHE_KEY_ECS_FIXED_LENGTH] == 0)) {
+    key_length = global_key(key, ecs_offset);  // scope prefix 0: valid for all clients
+  }
+  const uint32_t now = cache_now();
+  struct cache_entry *e = entry_create(c, key, key_length, resp, resp_len, now);
+  if (e != NULL) {
+    shard_insert(c, e, now);
+  }
+}
+
+int cache_restore(cache_t *c, const char *key, size_t key_length,
+                  const char *resp, size_t resp_len, uint32_t age, uint32_t ttl) {
+  if (key_length > CACHE_MAX_KEY_LENGTH || ttl == 0) {
+    return -1;
+  }
+  const uint32_t now = cache_now();
+  struct cache_entry *e = entry_create(c, (const uint8_t *)key, key_length, resp, resp_len, now);
+  if (e == NULL) {
+    return -1;
+  }
+  if (ttl < e->expire - now) {
+    e->expire = now + ttl;
+  }
+  char *stored_resp = entry_resp(e);
+  const uint16_t *ttl_offsets = entry_ttl_offsets(e);
+  for (uint16_t i = 0; i < e->ttl_count; i++) {
+    const uint32_t record_ttl = dns_wire_u32(stored_resp, ttl_offsets[i]);
+    dns_wire_set_u32(stored_resp, ttl_offsets[i], record_ttl > age ? record_ttl - age : 0);
+  }
+  shard_insert(c, e, now);
+  return 0;
+}
+
+void cache_foreach(cache_t *c, cache_entry_cb cb, void *data) {
+  const uint32_t now = cache_now();
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *s = &c->shards[i];
+    pthread_mutex_lock(&s->lock);
+    for (int f = 0; f < CACHE_FIFO_COUNT; f++) {
+      for (struct cache_entry *e = s->fifos[f].oldest; e != NULL; e = e->newer) {
+        if (now < e->expire) {
+          cb(data, entry_key(e), e->key_length, entry_resp(e), e->resp_length,
+             now - e->stored, e->expire - now);
+        }
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+void cache_stats(cache_t *c, struct cache_stats *stats) {
+  memset(stats, 0, sizeof(struct cache_stats));
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *s = &c->shards[i];
+    pthread_mutex_lock(&s->lock);
+    stats->bytes += s->bytes;
+    stats->entries += s->entries;
+    stats->hits += s->hits;
+    stats->misses += s->misses;
+    stats->evictions += s->evictions;
+    s->hits = 0;
+    s->misses = 0;
+    s->evictions = 0;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+void cache_cleanup(cache_t *c) {
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    struct cache_shard *s = &c->shards[i];
+    for (int f = 0; f < CACHE_FIFO_COUNT; f++) {
+      while (s->fifos[f].oldest != NULL) {
+        shard_unlink(s, s->fifos[f].oldest);
+      }
+    }
+    free(s->ghost);
+    free((void *)s->buckets);
+    pthread_mutex_destroy(&s->lock);
+  }
+  free(c);
+}
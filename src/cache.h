@@ -0,0 +1,64 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+// Response cache shared by all threads.
+//
+// Entries are spread over shards by hash, each with its own lock and hash
+// table, so lookups of different names rarely contend. An entry is a single
+// allocation holding the TTL offsets, the key and the wire format response,
+// so a hit is one memcpy plus patching ID, question name and TTLs.
+//
+// Keys are the lowercase question and the request flags changing the answer
+// (RD, CD, EDNS and its DO bit). Only NOERROR and NXDOMAIN responses are stored, for the
+// lowest TTL of their records (negative answers: RFC 2308 SOA minimum).
+//
+// Requests with EDNS Client Subnet are keyed by their subnet too, unless the
+// response has scope prefix 0: such answers are shared by all subnets and
+// found when there is none for the subnet of the request.
+//
+// Memory is bounded by a byte budget, evicting with S3-FIFO, which keeps
+// entries hit more than once over names queried only once.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct cache_s cache_t;
+
+// 'max_bytes' limits the memory of entries, split evenly between shards.
+cache_t * cache_create(size_t max_bytes);
+
+// Returns a copy of the response to 'req' (to be freed by the caller) or NULL.
+char * cache_lookup(cache_t *c, const char *req, size_t req_len, size_t *resp_len);
+
+// Stores 'resp' as the response to 'req', if cacheable.
+void cache_store(cache_t *c, const char *req, size_t req_len,
+                 const char *resp, size_t resp_len);
+
+// Called for each entry with its key, the response as stored, seconds since
+// it was stored and seconds until it expires.
+typedef void (*cache_entry_cb)(void *data, const char *key, size_t key_length,
+                               const char *resp, size_t resp_len,
+                               uint32_t age, uint32_t ttl);
+
+// Calls 'cb' for every live entry, holding the lock of its shard.
+void cache_foreach(cache_t *c, cache_entry_cb cb, void *data);
+
+// Stores an entry passed to cache_foreach() before, as if it was stored
+// 'age' seconds ago and expires in 'ttl' seconds. The key and response are
+// validated, returns -1 if they are malformed or not cacheable.
+int cache_restore(cache_t *c, const char *key, size_t key_length,
+                  const char *resp, size_t resp_len, uint32_t age, uint32_t ttl);
+
+struct cache_stats {
+  size_t bytes;
+  uint64_t entries;
+  uint64_t hits;  // counters since the previous call
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+void cache_stats(cache_t *c, struct cache_stats *stats);
+
+void cache_cleanup(cache_t *c);
+
+#endif // _CACHE_H_
@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache_snapshot.h"
+#include "logging.h"
+
+// Hack for platforms that don't support O_CLOEXEC.
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+enum {
+  SNAPSHOT_VERSION = 1,
+  SNAPSHOT_LOAD_BATCH = 256,  // records restored per idle callback
+  SNAPSHOT_INITIAL_BUFFER = 64 * 1024,
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'H', 'D', 'P', 'C', 'A', 'C', 'H', 'E'};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_header_size;  // guards against layout changes
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct snapshot_record {
+  int64_t stored;  // wall clock seconds
+  int64_t expire;
+  uint16_t key_length;
+  uint16_t resp_length;
+  uint32_t reserved;
+};  // followed by key and response
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct snapshot_writer {
+  char *data;
+  size_t length;
+  size_t size;
+  int64_t now;
+  uint32_t records;
+};
+
+static void writer_append(struct snapshot_writer *w, const void *data, size_t length) {
+  if (w->size - w->length < length) {
+    size_t size = w->size * 2;
+    while (size - w->length < length) {
+      size *= 2;
+    }
+    w->data = (char *)realloc(w->data, size);
+    if (w->data == NULL) {
+      FLOG("Out of mem");
+    }
+    w->size = size;
+  }
+  memcpy(w->data + w->length, data, length);
+  w->length += length;
+}
+
+static void save_entry_cb(void *data, const char *key, size_t key_length,
+                          const char *resp, size_t resp_len, uint32_t age, uint32_t ttl) {
+  struct snapshot_writer *w = (struct snapshot_writer *)data;
+  struct snapshot_record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.stored = w->now - age;
+  rec.expire = w->now + ttl;
+  rec.key_length = (uint16_t)key_length;
+  rec.resp_length = (uint16_t)resp_len;
+  writer_append(w, &rec, sizeof(rec));
+  writer_append(w, key, key_length);
+  writer_append(w, resp, resp_len);
+  w->records++;
+}
+
+// Serializes the cache, the buffer is to be freed by the caller.
+static void serialize(cache_snapshot_t *s, struct snapshot_writer *w) {
+  w->size = SNAPSHOT_INITIAL_BUFFER;
+  w->data = (char *)malloc(w->size);
+  if (w->data == NULL) {
+    FLOG("Out of mem");
+  }
+  w->length = 0;
+  w->now = (int64_t)time(NULL);
+  w->records = 0;
+  struct snapshot_header header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.record_header_size = sizeof(struct snapshot_record);
+  writer_append(w, &header, sizeof(header));
+  cache_foreach(s->cache, save_entry_cb, w);
+}
+
+// Writes and syncs a temporary file renamed over 'path', returns 0 on
+// success. Does not touch the cache, so it may run in any thread.
+static int write_file(const char *path, const char *data, size_t length) {
+  const size_t tmp_path_size = strlen(path) + sizeof(".tmp");
+  char *tmp_path = (char *)malloc(tmp_path_size);
+  if (tmp_path == NULL) {
+    FLOG("Out of mem");
+  }
+  (void)snprintf(tmp_path, tmp_path_size, "%s.tmp", path);
+
+  FILE *file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    ELOG("Failed to create cache snapshot %s: %s", tmp_path, strerror(errno));
+    free(tmp_path);
+    return -1;
+  }
+  int failed = 0;
+  if (fwrite(data, length, 1, file) != 1 ||
+      fflush(file) != 0 || fsync(fileno(file)) != 0) {
+    failed = 1;
+  }
+  if (fclose(file) != 0) {
+    failed = 1;
+  }
+  if (failed || rename(tmp_path, path) != 0) {
+    ELOG("Failed to write cache snapshot %s: %s", path, strerror(errno));
+    (void)unlink(tmp_path);
+    free(tmp_path);
+    return -1;
+  }
+  free(tmp_path);
+  return 0;
+}
+
+int cache_snapshot_save(cache_snapshot_t *s) {
+  struct snapshot_writer w;
+  serialize(s, &w);
+  const int res = write_file(s->path, w.data, w.length);
+  free(w.data);
+  if (res == 0) {
+    ILOG("Saved %u cache entries to %s", w.records, s->path);
+  }
+  return res;
+}
+
+static void * save_thread(void *arg) {
+  cache_snapshot_t *s = (cache_snapshot_t *)arg;
+  s->save_result = write_file(s->path, s->save_data, s->save_length);
+  ev_async_send(s->loop, &s->save_done);
+  return NULL;
+}
+
+static void save_finish(cache_snapshot_t *s) {
+  pthread_join(s->thread, NULL);
+  s->saving = 0;
+  free(s->save_data);
+  s->save_data = NULL;
+}
+
+static void save_done_cb(struct ev_loop __attribute__((unused)) *loop, ev_async *w,
+                         int __attribute__((unused)) revents) {
+  cache_snapshot_t *s = (cache_snapshot_t *)w->data;
+  if (!s->saving) {
+    return;
+  }
+  save_finish(s);
+  if (s->save_result == 0) {
+    ILOG("Saved %u cache entries to %s", s->save_records, s->path);
+  }
+}
+
+static void load_finish(cache_snapshot_t *s) {
+  ev_idle_stop(s->loop, &s->load_idle);
+  munmap((void *)s->map, s->map_size);
+  s->map = NULL;
+  ILOG("Restored %u cache entries from %s, skipped %u expired and %u invalid",
+       s->restored, s->path, s->expired, s->invalid);
+}
+
+static void load_idle_cb(struct ev_loop __attribute__((unused)) *loop, ev_idle *w,
+                         int __attribute__((unused)) revents) {
+  cache_snapshot_t *s = (cache_snapshot_t *)w->data;
+  const int64_t now = (int64_t)time(NULL);
+  for (int i = 0; i < SNAPSHOT_LOAD_BATCH; i++) {
+    if (s->load_pos == s->map_size) {
+      load_finish(s);
+      return;
+    }
+    struct snapshot_record rec;
+    if (s->map_size - s->load_pos < sizeof(rec)) {
+      WLOG("Cache snapshot %s is truncated", s->path);
+      load_finish(s);
+      return;
+    }
+    memcpy(&rec, s->map + s->load_pos, sizeof(rec));  // records are not aligned
+    const size_t data_length = (size_t)rec.key_length + rec.resp_length;
+    if (s->map_size - s->load_pos - sizeof(rec) < data_length) {
+      WLOG("Cache snapshot %s is truncated", s->path);
+      load_finish(s);
+      return;
+    }
+    const char *key = s->map + s->load_pos + sizeof(rec);
+    s->load_pos += sizeof(rec) + data_length;
+
+    if (rec.expire <= now) {
+      s->expired++;
+      continue;
+    }
+    const int64_t age = rec.stored < now ? now - rec.stored : 0;
+    const int64_t ttl = rec.expire - now;
+    if (age > UINT32_MAX || ttl > UINT32_MAX ||
+        cache_restore(s->cache, key, rec.key_length, key + rec.key_length, rec.resp_length,
+                      (uint32_t)age, (uint32_t)ttl) != 0) {
+      s->invalid++;
+      continue;
+    }
+    s->restored++;
+  }
+}
+
+static void load_start(cache_snapshot_t *s) {
+  int fd = open(s->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      ILOG("Cache snapshot %s does not exist yet", s->path);
+    } else {
+      ELOG("Failed to open cache snapshot %s: %s", s->path, strerror(errno));
+    }
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct snapshot_header)) {
+    WLOG("Ignoring invalid cache snapshot %s", s->path);
+    close(fd);
+    return;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ELOG("Failed to map cache snapshot %s: %s", s->path, strerror(errno));
+    return;
+  }
+  struct snapshot_header header;
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION ||
+      header.record_header_size != sizeof(struct snapshot_record)) {
+    WLOG("Ignoring cache snapshot %s of unknown format", s->path);
+    munmap(map, (size_t)st.st_size);
+    return;
+  }
+  (void)madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  s->map = (const char *)map;
+  s->map_size = (size_t)st.st_size;
+  s->load_pos = sizeof(header);
+  ev_idle_start(s->loop, &s->load_idle);
+  DLOG("Loading cache snapshot %s of %zu bytes", s->path, s->map_size);
+}
+
+static void save_timer_cb(struct ev_loop __attribute__((unused)) *loop, ev_timer *w,
+                          int __attribute__((unused)) revents) {
+  cache_snapshot_t *s = (cache_snapshot_t *)w->data;
+  if (s->saving) {
+    WLOG("Cache snapshot %s is still being written, skipping save", s->path);
+    return;
+  }
+  struct snapshot_writer writer;
+  serialize(s, &writer);
+  s->save_data = writer.data;
+  s->save_length = writer.length;
+  s->save_records = writer.records;
+  s->saving = 1;
+  // signals are handled by the main thread
+  sigset_t all_signals;
+  sigset_t old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+  const int rc = pthread_create(&s->thread, NULL, save_thread, s);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  if (rc != 0) {
+    ELOG("Failed to start cache snapshot save: %s", strerror(rc));
+    free(s->save_data);
+    s->save_data = NULL;
+    s->saving = 0;
+  }
+}
+
+void cache_snapshot_init(cache_snapshot_t *s, struct ev_loop *loop, cache_t *cache,
+                         const char *path, int save_interval) {
+  memset(s, 0, sizeof(cache_snapshot_t));
+  s->loop = loop;
+  s->cache = cache;
+  s->path = path;
+  ev_idle_init(&s->load_idle, load_idle_cb);
+  s->load_idle.data = s;
+  ev_timer_init(&s->save_timer, save_timer_cb, save_interval, save_interval);
+  s->save_timer.data = s;
+  ev_async_init(&s->save_done, save_done_cb);
+  s->save_done.data = s;
+  ev_async_start(loop, &s->save_done);
+  ev_unref(loop);  // does not keep the loop alive
+  if (save_interval > 0) {
+    ev_timer_start(loop, &s->save_timer);
+  }
+  load_start(s);
+}
+
+void cache_snapshot_stop(cache_snapshot_t *s) {
+  ev_timer_stop(s->loop, &s->save_timer);
+  ev_ref(s->loop);
+  ev_async_stop(s->loop, &s->save_done);
+  if (s->saving) {
+    save_finish(s);
+  }
+  if (s->map != NULL) {
+    load_finish(s);
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef _CACHE_SNAPSHOT_H_
+#define _CACHE_SNAPSHOT_H_
+
+// Snapshot of the response cache for warm restarts.
+//
+// The file is a header followed by records of wall clock store and expiry
+// times, key and response, in native byte order. It is written to a
+// temporary file renamed over the snapshot, so a crash never leaves a
+// partial one behind.
+//
+// Periodic saves serialize the cache into memory in the loop thread, the
+// file is written and synced by a helper thread meanwhile the listeners go
+// on. The save on shutdown is done synchronously.
+//
+// Loading memory-maps the file and restores records in batches from an idle
+// watcher, so the listeners are ready right away. Each record is validated
+// only when it is reached, expired ones are skipped.
+
+#include <ev.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+typedef struct {
+  struct ev_loop *loop;
+  cache_t *cache;
+  const char *path;
+
+  ev_timer save_timer;
+  pthread_t thread;
+  uint8_t saving;
+  char *save_data;  // serialized snapshot written by the thread
+  size_t save_length;
+  uint32_t save_records;
+  int save_result;
+  ev_async save_done;
+  ev_idle load_idle;
+  const char *map;  // snapshot being loaded
+  size_t map_size;
+  size_t load_pos;
+  uint32_t restored;
+  uint32_t expired;
+  uint32_t invalid;
+} cache_snapshot_t;
+
+// Starts loading 'path' if it exists and saving it every 'save_interval'
+// seconds, if not 0. 'path' is not copied.
+void cache_snapshot_init(cache_snapshot_t *s, struct ev_loop *loop, cache_t *cache,
+                         const char *path, int save_interval);
+
+// Stops loading and periodic saving, for shutdown. Waits for a save in
+// progress.
+void cache_snapshot_stop(cache_snapshot_t *s);
+
+// Writes the snapshot synchronously, returns 0 on success.
+int cache_snapshot_save(cache_snapshot_t *s);
+
+#endif // _CACHE_SNAPSHOT_H_
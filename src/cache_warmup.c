@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache_warmup.h"
+#include "dns_wire.h"
+#include "logging.h"
+
+enum {
+  WARMUP_TICKS_PER_SECOND = 10,
+  WARMUP_MAX_QUERY_LENGTH = 512,
+};
+
+static void add_query(cache_warmup_t *w, const char *query, uint16_t length) {
+  char *queries = (char *)realloc(w->queries, w->queries_size + sizeof(length) + length);
+  if (queries == NULL) {
+    FLOG("Out of mem");
+  }
+  w->queries = queries;
+  memcpy(w->queries + w->queries_size, &length, sizeof(length));
+  memcpy(w->queries + w->queries_size + sizeof(length), query, length);
+  w->queries_size += sizeof(length) + length;
+  w->count++;
+}
+
+static void read_file(cache_warmup_t *w, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    ELOG("Failed to open warm-up file %s: %s", path, strerror(errno));
+    return;
+  }
+  char *line = NULL;
+  size_t line_size = 0;
+  unsigned line_number = 0;
+  while (getline(&line, &line_size, file) != -1) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char name[DNS_WIRE_MAX_NAME_LENGTH + 1];
+    char type[16] = "A";
+    char extra = 0;
+    const int fields = sscanf(line, "%255s %15s %c", name, type, &extra);  // NOLINT(cert-err34-c)
+    if (fields <= 0) {
+      continue;  // empty
+    }
+    const uint16_t qtype = dns_wire_parse_type(type);
+    char query[WARMUP_MAX_QUERY_LENGTH];
+    const int query_length = dns_wire_build_query(query, sizeof(query), (uint16_t)w->count,
+                                                  name, qtype);
+    if (fields > 2 || qtype == 0 || query_length < 0) {
+      WLOG("Invalid line %u of warm-up file %s", line_number, path);
+      continue;
+    }
+    add_query(w, query, (uint16_t)query_length);
+  }
+  free(line);
+  fclose(file);
+  ILOG("Read %u names to warm up the cache from %s", w->count, path);
+}
+
+static void warmup_timer_cb(struct ev_loop __attribute__((unused)) *loop, ev_timer *t,
+                            int __attribute__((unused)) revents) {
+  cache_warmup_t *w = (cache_warmup_t *)t->data;
+  int queries = w->queries_per_tick;
+  w->carry += w->remainder;
+  if (w->carry >= WARMUP_TICKS_PER_SECOND) {
+    w->carry -= WARMUP_TICKS_PER_SECOND;
+    queries++;
+  }
+  for (int i = 0; i < queries && w->position < w->queries_size; i++) {
+    uint16_t length = 0;
+    memcpy(&length, w->queries + w->position, sizeof(length));
+    char *dns_req = (char *)malloc(length);
+    if (dns_req == NULL) {
+      FLOG("Out of mem");
+    }
+    memcpy(dns_req, w->queries + w->position + sizeof(length), length);
+    w->position += sizeof(length) + length;
+    w->sent++;
+    w->cb(w->cb_data, dns_req, length);
+  }
+  if (w->position == w->queries_size) {
+    ev_timer_stop(w->loop, &w->timer);
+    ILOG("Cache warm-up sent all %u queries", w->sent);
+  }
+}
+
+void cache_warmup_init(cache_warmup_t *w, struct ev_loop *loop, const char *path, int rate,
+                       cache_warmup_fetch_cb cb, void *cb_data) {
+  memset(w, 0, sizeof(cache_warmup_t));
+  w->loop = loop;
+  w->cb = cb;
+  w->cb_data = cb_data;
+  ev_tstamp interval = 1.0 / WARMUP_TICKS_PER_SECOND;
+  if (rate >= WARMUP_TICKS_PER_SECOND) {
+    w->queries_per_tick = rate / WARMUP_TICKS_PER_SECOND;
+    w->remainder = rate % WARMUP_TICKS_PER_SECOND;
+  } else {
+    w->queries_per_tick = 1;
+    interval = 1.0 / rate;
+  }
+  ev_timer_init(&w->timer, warmup_timer_cb, 0, interval);
+  w->timer.data = w;
+  read_file(w, path);
+}
+
+void cache_warmup_start(cache_warmup_t *w) {
+  if (w->started || w->count == 0) {
+    return;
+  }
+  w->started = 1;
+  DLOG("Cache warm-up started");
+  ev_timer_start(w->loop, &w->timer);
+}
+
+void cache_warmup_stop(cache_warmup_t *w) {
+  if (ev_is_active(&w->timer)) {
+    WLOG("Cache warm-up stopped after %u of %u queries", w->sent, w->count);
+  }
+  ev_timer_stop(w->loop, &w->timer);
+}
+
+void cache_warmup_cleanup(cache_warmup_t *w) {
+  free(w->queries);
+  w->queries = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef _CACHE_WARMUP_H_
+#define _CACHE_WARMUP_H_
+
+// Cache warm-up from a list of names.
+//
+// Each line of the file holds a name and optionally a record type (e.g.
+// "example.com AAAA", A by default), '#' starts a comment. The queries are
+// built when the file is read and passed to a callback at a limited rate
+// once cache_warmup_start() is called, typically after bootstrapping.
+
+#include <ev.h>
+#include <stdint.h>
+
+// Takes ownership of 'dns_req', which was allocated by malloc().
+typedef void (*cache_warmup_fetch_cb)(void *data, char *dns_req, size_t dns_req_len);
+
+typedef struct {
+  struct ev_loop *loop;
+  cache_warmup_fetch_cb cb;
+  void *cb_data;
+
+  ev_timer timer;
+  int queries_per_tick;
+  int remainder;  // queries per second left over, spread over the ticks
+  int carry;
+  uint8_t started;
+
+  char *queries;  // length prefixed (uint16_t) queries
+  size_t queries_size;
+  size_t position;
+  uint32_t count;
+  uint32_t sent;
+} cache_warmup_t;
+
+// Reads 'path', invalid lines are logged and skipped. 'rate' is the number of
+// queries per second.
+void cache_warmup_init(cache_warmup_t *w, struct ev_loop *loop, const char *path, int rate,
+                       cache_warmup_fetch_cb cb, void *cb_data);
+
+// Starts sending the queries, only the first call has an effect.
+void cache_warmup_start(cache_warmup_t *w);
+
+// Stops sending, for shutdown.
+void cache_warmup_stop(cache_warmup_t *w);
+
+void cache_warmup_cleanup(cache_warmup_t *w);
+
+#endif // _CACHE_WARMUP_H_
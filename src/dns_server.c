@@ -1,12 +1,197 @@
 #include <ares.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "dns_server.h"
 #include "logging.h"
+#include "uring.h"
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+
+enum {
+  STEERING_QNAME_BYTES = 32,  // hashed prefix of the question name
+  STEERING_INSNS_PER_BYTE = 10,
+  STEERING_INSNS = 4 + STEERING_QNAME_BYTES * STEERING_INSNS_PER_BYTE + 6,
+};
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+#endif
+
+// Size of the SO_REUSEPORT group of listeners, disabled if 0.
+static uint16_t reuseport_group_size = 0;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+// Permissions of Unix socket files, left to the umask if -1.
+static int unix_socket_mode = -1;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+#if HAS_IO_URING == 1
+enum {
+  UDP_URING_BUFFERS = 128,  // datagrams in flight between two loop iterations
+};
+
+struct dns_server_uring_s {
+  uring_t *uring;
+  uring_buf_ring_t *buf_ring;
+  uring_op_t recv_op;
+  struct msghdr msg;  // layout of received buffers: address length
+  uint8_t stopped;
+};
+
+// Response waiting for its sendmsg completion.
+struct udp_send_s {
+  uring_op_t op;
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_storage raddr;
+  char buf[];
+};
+#endif
+
+
+// Binds 'sock' to the Unix domain socket path of 'listen_addrinfo'.
+void dns_server_unix_bind(int sock, struct addrinfo *listen_addrinfo,
+                          const char *type) {
+  const char *path = ((struct sockaddr_un *)listen_addrinfo->ai_addr)->sun_path;
+
+  // Stale socket file from a previous run would make bind() fail. It is
+  // removed only if nobody listens on it, not to take it over from a running
+  // instance.
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    int type_value = SOCK_DGRAM;
+    socklen_t type_len = sizeof(type_value);
+    getsockopt(sock, SOL_SOCKET, SO_TYPE, &type_value, &type_len);
+    int probe = socket(AF_UNIX, type_value | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+      FLOG("Error creating Unix socket: %s (%d)", strerror(errno), errno);
+    }
+    const int res = connect(probe, listen_addrinfo->ai_addr, listen_addrinfo->ai_addrlen);
+    const int probe_errno = errno;
+    close(probe);
+    if (res == 0 || probe_errno != ECONNREFUSED) {
+      close(sock);
+      FLOG("Unix %s socket %s is in use by another process", type, path);
+    }
+    if (unlink(path) != 0) {
+      WLOG("Could not remove stale Unix socket %s: %s (%d)", path, strerror(errno), errno);
+    }
+  }
+
+  if (bind(sock, listen_addrinfo->ai_addr, listen_addrinfo->ai_addrlen) < 0) {
+    close(sock);
+    FLOG("Error binding on Unix %s socket %s: %s (%d)", type, path,
+         strerror(errno), errno);
+  }
+
+  // Clients may run as other users (e.g. dnsmasq), they need write access.
+  if (unix_socket_mode >= 0 && chmod(path, (mode_t)unix_socket_mode) != 0) {
+    WLOG("Could not set permissions of Unix socket %s: %s (%d)", path, strerror(errno), errno);
+  }
+}
+
+// Removes the socket file of a listening Unix domain socket, if any.
+void dns_server_unix_unlink(int sock) {
+  struct sockaddr_un addr;
+  socklen_t addrlen = sizeof(addr);
+  if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) == 0 &&
+      addr.sun_family == AF_UNIX && addrlen > offsetof(struct sockaddr_un, sun_path) &&
+      addr.sun_path[0] != '\0') {
+    if (unlink(addr.sun_path) != 0) {
+      DLOG("Could not remove Unix socket %s: %s (%d)", addr.sun_path, strerror(errno), errno);
+    }
+  }
+}
+
+void dns_server_unix_addrinfo(struct addrinfo *ai, struct sockaddr_un *addr,
+                              const char *path) {
+  memset(ai, 0, sizeof(*ai));
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+  ai->ai_family = AF_UNIX;
+  ai->ai_addr = (struct sockaddr *)addr;
+  ai->ai_addrlen = sizeof(*addr);
+}
+
+void dns_server_unix_mode_init(int mode) {
+  unix_socket_mode = mode;
+}
+
+void dns_server_reuseport_init(uint16_t group_size) {
+  reuseport_group_size = group_size;
+}
+
+void dns_server_reuseport_sock(int sock) {
+  if (reuseport_group_size == 0) {
+    return;
+  }
+  int yes = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+    FLOG("Failed to set SO_REUSEPORT: %s (%d)", strerror(errno), errno);
+  }
+}
+
+// Steers datagrams within the reuseport group by FNV-1a hash of the question
+// name (ignoring case, up to its first zero byte), so the same name is always
+// answered by the same process. The program returns the index of the socket
+// in the group. For too short requests, and names running past the end of
+// the packet, it returns an invalid index and the kernel falls back to
+// hashing the client address, as it does for the whole group if the program
+// could not be attached. Every byte is checked against the packet length
+// before it is loaded: a load out of bounds ends the program with 0, which
+// would steer to the first socket.
+static void attach_qname_steering(int sock) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  struct sock_filter code[STEERING_INSNS];
+  const uint32_t done = STEERING_INSNS - 6;
+  const uint32_t fail = STEERING_INSNS - 1;
+  uint32_t n = 0;
+  // UDP header is already pulled, packet starts with the DNS header
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+  code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, DNS_HEADER_LENGTH + 5, 1, 0);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_IMM, FNV_OFFSET_BASIS);
+  for (uint32_t i = 0; i < STEERING_QNAME_BYTES; i++) {
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, DNS_HEADER_LENGTH + i, 1, 0);
+    code[n] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, fail - (n + 1));
+    n++;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, DNS_HEADER_LENGTH + i);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+    code[n] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, done - (n + 1));
+    n++;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_OR | BPF_K, 0x20);  // lowercase letters
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, FNV_PRIME);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+  }
+  // low bits of FNV-1a are weak, fold the high half in
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TXA, 0);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, reuseport_group_size);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+  code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);  // fail
+
+  struct sock_fprog prog = {
+    .len = (unsigned short)n,
+    .filter = code,
+  };
+  if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+    WLOG("Failed to attach question name steering, kernel hashes client addresses: %s (%d)",
+         strerror(errno), errno);
+    return;
+  }
+  ILOG("Steering UDP requests by question name in a group of %u", reuseport_group_size);
+#else
+  (void)sock;
+  WLOG("Question name steering is not supported, kernel hashes client addresses");
+#endif
+}
 
 // Creates and bind a listening UDP socket for incoming requests.
 static int get_listen_sock(struct addrinfo *listen_addrinfo) {
@@ -23,22 +208,58 @@ static int get_listen_sock(struct addrinfo *listen_addrinfo) {
   } else if (listen_addrinfo->ai_family == AF_INET6) {
     port = ntohs(((struct sockaddr_in6*) listen_addrinfo->ai_addr)->sin6_port);
     inet_ntop(AF_INET6, &((struct sockaddr_in6 *)listen_addrinfo->ai_addr)->sin6_addr, ipstr, sizeof(ipstr));
+  } else if (listen_addrinfo->ai_family == AF_UNIX) {
+    dns_server_unix_bind(sock, listen_addrinfo, "datagram");
+    ILOG("Listening on %s Unix datagram",
+         ((struct sockaddr_un *)listen_addrinfo->ai_addr)->sun_path);
+    return sock;
   } else {
     FLOG("Unknown address family: %d", listen_addrinfo->ai_family);
   }
 
+  dns_server_reuseport_sock(sock);
   int res = bind(sock, listen_addrinfo->ai_addr, listen_addrinfo->ai_addrlen);
   if (res < 0) {
     close(sock);
     FLOG("Error binding on %s:%d UDP: %s (%d)", ipstr, port,
          strerror(errno), errno);
   }
+  if (reuseport_group_size > 0) {
+    attach_qname_steering(sock);
+  }
 
   ILOG("Listening on %s:%d UDP", ipstr, port);
 
   return sock;
 }
 
+static void request_received(dns_server_t *d, const char *buf, ssize_t len,
+                             struct sockaddr_storage *tmp_raddr, socklen_t tmp_addrlen) {
+  if (tmp_addrlen < d->addrlen) {
+    // Unix socket paths are shorter than sockaddr_un, keep the rest zeroed
+    // as the reply is sent with the full address length.
+    memset((char *)tmp_raddr + tmp_addrlen, 0, d->addrlen - tmp_addrlen);
+  }
+  if (len > DNS_REQUEST_BUFFER_SIZE) {
+    WLOG("Unsupported request received, too large: %d. Limit is: %d",
+         len, DNS_REQUEST_BUFFER_SIZE);
+    return;
+  }
+
+  if (len < DNS_HEADER_LENGTH) {
+    WLOG("Malformed request received, too short: %d", len);
+    return;
+  }
+
+  char *dns_req = (char *)malloc((size_t)len);  // To free buffer after https request is complete.
+  if (dns_req == NULL) {
+    FLOG("Out of mem");
+  }
+  memcpy(dns_req, buf, (size_t)len);
+
+  d->cb(d, DNS_TRANSPORT_UDP, d->cb_data, (struct sockaddr*)tmp_raddr, dns_req, (size_t)len);
+}
+
 static void watcher_cb(struct ev_loop __attribute__((unused)) *loop,
                        ev_io *w, int __attribute__((unused)) revents) {
   dns_server_t *d = (dns_server_t *)w->data;
@@ -52,24 +273,93 @@ static void watcher_cb(struct ev_loop __attribute__((unused)) *loop,
     ELOG("recvfrom failed: %s", strerror(errno));
     return;
   }
-  if (len > DNS_REQUEST_BUFFER_SIZE) {
-    WLOG("Unsupported request received, too large: %d. Limit is: %d",
-         len, DNS_REQUEST_BUFFER_SIZE);
-    return;
+  request_received(d, tmp_buf, len, &tmp_raddr, tmp_addrlen);
+}
+
+#if HAS_IO_URING == 1
+static void uring_recv_arm(dns_server_t *d);
+
+static void uring_recv_cb(uring_op_t *op, int32_t res, uint32_t flags) {
+  dns_server_t *d = (dns_server_t *)op->data;
+  struct dns_server_uring_s *u = d->uring_state;
+
+  if (flags & IORING_CQE_F_BUFFER) {
+    const char *buf = uring_buf_ring_buffer(u->buf_ring, flags);
+    if (res >= 0 && !u->stopped) {
+      const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *)buf;
+      const char *name = buf + sizeof(struct io_uring_recvmsg_out);
+      const char *payload = name + u->msg.msg_namelen + u->msg.msg_controllen;
+      struct sockaddr_storage tmp_raddr;
+      socklen_t tmp_addrlen = out->namelen < d->addrlen ? out->namelen : d->addrlen;
+      memcpy(&tmp_raddr, name, tmp_addrlen);
+      request_received(d, payload, (ssize_t)out->payloadlen, &tmp_raddr, tmp_addrlen);
+    }
+    uring_buf_ring_recycle(u->buf_ring, flags);
+  } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+    ELOG("recvmsg failed: %s", strerror(-res));
   }
 
-  if (len < DNS_HEADER_LENGTH) {
-    WLOG("Malformed request received, too short: %d", len);
-    return;
+  // multishot receive stops when buffers run out or on errors
+  if (!(flags & IORING_CQE_F_MORE) && !u->stopped) {
+    uring_recv_arm(d);
   }
+}
 
-  char *dns_req = (char *)malloc((size_t)len);  // To free buffer after https request is complete.
-  if (dns_req == NULL) {
+static void uring_recv_arm(dns_server_t *d) {
+  struct dns_server_uring_s *u = d->uring_state;
+  struct io_uring_sqe *sqe = uring_get_sqe(u->uring, &u->recv_op);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = d->sock;
+  sqe->addr = (uint64_t)(uintptr_t)&u->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_TRUNC;  // real size of too large requests
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = uring_buf_ring_group(u->buf_ring);
+}
+
+static void uring_send_cb(uring_op_t *op, int32_t res, uint32_t __attribute__((unused)) flags) {
+  if (res < 0) {
+    DLOG("sendmsg failed: %s", strerror(-res));
+  }
+  free(op->data);
+}
+
+void dns_server_use_uring(dns_server_t *d, struct uring_s *uring) {
+  struct dns_server_uring_s *u = (struct dns_server_uring_s *)calloc(1, sizeof(struct dns_server_uring_s));
+  if (u == NULL) {
     FLOG("Out of mem");
   }
-  memcpy(dns_req, tmp_buf, (size_t)len);
+  u->uring = uring;
+  u->msg.msg_namelen = sizeof(struct sockaddr_storage);
+  u->buf_ring = uring_buf_ring_create(uring, UDP_URING_BUFFERS,
+    (uint32_t)(sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) +
+               DNS_REQUEST_BUFFER_SIZE));
+  u->recv_op.cb = uring_recv_cb;
+  u->recv_op.data = d;
+  d->uring_state = u;
 
-  d->cb(d, 0, d->cb_data, (struct sockaddr*)&tmp_raddr, dns_req, (size_t)len);
+  ev_io_stop(d->loop, &d->watcher);
+  uring_recv_arm(d);
+}
+#else
+void dns_server_use_uring(dns_server_t __attribute__((unused)) *d,
+                          struct uring_s __attribute__((unused)) *uring) {
+  FLOG("Compiled without io_uring support");
+}
+#endif
+
+void dns_server_set_incoming_cpu(dns_server_t *d, int cpu) {
+#ifdef SO_INCOMING_CPU
+  if (setsockopt(d->sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+    WLOG("Failed to set SO_INCOMING_CPU to %d: %s", cpu, strerror(errno));
+    return;
+  }
+  ILOG("UDP socket prefers packets of CPU %d", cpu);
+#else
+  WLOG("SO_INCOMING_CPU is not supported, ignoring CPU %d", cpu);
+  (void)d;
+#endif
 }
 
 void dns_server_init(dns_server_t *d, struct ev_loop *loop,
@@ -80,6 +370,7 @@ void dns_server_init(dns_server_t *d, struct ev_loop *loop,
   d->addrlen = listen_addrinfo->ai_addrlen;
   d->cb = cb;
   d->cb_data = data;
+  d->uring_state = NULL;
   ev_io_init(&d->watcher, watcher_cb, d->sock, EV_READ);
   d->watcher.data = d;
   ev_io_start(d->loop, &d->watcher);
@@ -212,6 +503,33 @@ void dns_server_respond(dns_server_t *d, struct sockaddr *raddr,
     }
   }
 
+#if HAS_IO_URING == 1
+  if (d->uring_state != NULL && !d->uring_state->stopped) {
+    // submitted together with other responses when the loop iteration ends
+    struct udp_send_s *send = (struct udp_send_s *)malloc(sizeof(struct udp_send_s) + dns_resp_len);
+    if (send == NULL) {
+      FLOG("Out of mem");
+    }
+    memset(send, 0, sizeof(struct udp_send_s));
+    memcpy(send->buf, dns_resp, dns_resp_len);
+    memcpy(&send->raddr, raddr, d->addrlen);
+    send->iov.iov_base = send->buf;
+    send->iov.iov_len = dns_resp_len;
+    send->msg.msg_name = &send->raddr;
+    send->msg.msg_namelen = d->addrlen;
+    send->msg.msg_iov = &send->iov;
+    send->msg.msg_iovlen = 1;
+    send->op.cb = uring_send_cb;
+    send->op.data = send;
+    struct io_uring_sqe *sqe = uring_get_sqe(d->uring_state->uring, &send->op);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = d->sock;
+    sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+    sqe->len = 1;
+    return;
+  }
+#endif
+
   ssize_t len = sendto(d->sock, dns_resp, dns_resp_len, 0, raddr, d->addrlen);
   if(len == -1) {
     DLOG("sendto failed: %s", strerror(errno));
@@ -220,8 +538,16 @@ void dns_server_respond(dns_server_t *d, struct sockaddr *raddr,
 
 void dns_server_stop(dns_server_t *d) {
   ev_io_stop(d->loop, &d->watcher);
+#if HAS_IO_URING == 1
+  if (d->uring_state != NULL) {
+    d->uring_state->stopped = 1;
+    uring_cancel(d->uring_state->uring, &d->uring_state->recv_op);
+  }
+#endif
 }
 
 void dns_server_cleanup(dns_server_t *d) {
+  free(d->uring_state);
+  dns_server_unix_unlink(d->sock);
   close(d->sock);
 }
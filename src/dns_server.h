@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <stdint.h>
@@ -14,9 +15,16 @@ enum {
   DNS_REQUEST_BUFFER_SIZE = 4096  // EDNS default before DNS Flag Day 2020
 };
 
+// Transport of a received request, which determines how to respond.
+enum dns_transport {
+  DNS_TRANSPORT_UDP = 0,  // dns_server_t: dns_server_respond()
+  DNS_TRANSPORT_TCP = 1,  // dns_server_tcp_t (also TLS): dns_server_tcp_respond()
+  DNS_TRANSPORT_HTTPS = 2  // DoH stream handle: dns_server_doh_respond()
+};
+
 struct dns_server_s;
 
-typedef void (*dns_req_received_cb)(void *dns_server, uint8_t is_tcp, void *data,
+typedef void (*dns_req_received_cb)(void *dns_server, uint8_t transport, void *data,
                                     struct sockaddr* addr, char *dns_req, size_t dns_req_len);
 
 typedef struct dns_server_s {
@@ -26,12 +34,45 @@ typedef struct dns_server_s {
   int sock;
   socklen_t addrlen;
   ev_io watcher;
+  struct dns_server_uring_s *uring_state;  // NULL if io_uring is not used
 } dns_server_t;
 
+// Fills 'ai' to describe the Unix domain socket 'path' stored in 'addr',
+// usable as listen address of dns_server_init() and dns_server_tcp_create().
+void dns_server_unix_addrinfo(struct addrinfo *ai, struct sockaddr_un *addr,
+                              const char *path);
+
+// Unix socket files created afterwards get permissions 'mode' instead of the
+// ones of the umask, if not -1.
+void dns_server_unix_mode_init(int mode);
+
+// Listeners of IP addresses created afterwards set SO_REUSEPORT, so
+// 'group_size' processes can serve the same address. UDP requests are steered
+// to a process by a hash of the question name, so the same names meet the
+// same cache.
+void dns_server_reuseport_init(uint16_t group_size);
+
+// Internal: sets SO_REUSEPORT before binding if enabled.
+void dns_server_reuseport_sock(int sock);
+
+// Internal: shared by UDP and TCP servers for Unix domain sockets.
+void dns_server_unix_bind(int sock, struct addrinfo *listen_addrinfo,
+                          const char *type);
+void dns_server_unix_unlink(int sock);
+
 void dns_server_init(dns_server_t *d, struct ev_loop *loop,
                      struct addrinfo *listen_addrinfo,
                      dns_req_received_cb cb, void *data);
 
+// Switches receiving and sending to io_uring: multishot recvmsg into
+// provided buffers, responses are submitted in batches.
+struct uring_s;
+void dns_server_use_uring(dns_server_t *d, struct uring_s *uring);
+
+// Sets SO_INCOMING_CPU, so the socket is preferred for packets processed
+// on 'cpu' (e.g. the CPU handling the interrupts of the NIC).
+void dns_server_set_incoming_cpu(dns_server_t *d, int cpu);
+
 // Sends a DNS response 'buf' of length 'blen' to 'raddr'.
 void dns_server_respond(dns_server_t *d, struct sockaddr *raddr,
     const char *dns_req, const size_t dns_req_len, char *dns_resp, size_t dns_resp_len);
@@ -0,0 +1,685 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dns_server_doh.h"
+#include "dns_server_tcp.h"
+#include "logging.h"
+#include "tls_server.h"
+
+#if HAS_OPENSSL == 1 && HAS_NGHTTP2 == 1
+#include <nghttp2/nghttp2.h>
+#include <openssl/err.h>
+
+// the following macros require to have conn pointer to doh_conn_s structure
+// else: compilation failure will occur
+#define DLOG_CONN(format, args...) DLOG("H-%u: " format, conn->id, ## args)
+#define WLOG_CONN(format, args...) WLOG("H-%u: " format, conn->id, ## args)
+#define FLOG_CONN(format, args...) FLOG("H-%u: " format, conn->id, ## args)
+
+#define DOH_CONTENT_TYPE "application/dns-message"
+#define DOH_QUERY_PARAM "dns="
+
+enum {
+  DOH_IDLE_TIMEOUT_S = 120,
+  DOH_MAX_CONCURRENT_STREAMS = 128,
+  DOH_READ_BUFFER_SIZE = 16384,
+  DOH_MAX_PATH_SIZE = 1024,  // base64url of a 512 byte request + path
+  DOH_MAX_REQUEST_SIZE = UINT16_MAX,
+};
+
+struct doh_stream_s {
+  struct doh_conn_s *conn;  // NULL when connection is gone while waiting for response
+  int32_t stream_id;
+
+  uint8_t is_get;
+  uint8_t is_post;
+  uint8_t waiting;  // passed to callback, response not yet arrived
+  uint16_t error_status;  // HTTP status to reply without DNS processing
+  char *path;
+  char *body;
+  size_t body_len;
+
+  char *resp;
+  size_t resp_len;
+  size_t resp_sent;
+
+  struct doh_stream_s *next;
+};
+
+struct doh_conn_s {
+  dns_server_doh_t *d;
+
+  uint64_t id;
+  int sock;
+  struct sockaddr_storage raddr;
+
+  SSL *ssl;
+  uint8_t tls_want_write;
+  nghttp2_session *session;
+  uint8_t in_recv;  // nghttp2 callbacks are running, sending must wait
+
+  char *out_buf;  // serialized frames the socket did not accept yet
+  size_t out_len;
+
+  ev_io io_watcher;
+  ev_timer timer_watcher;
+
+  struct doh_stream_s *streams;
+  struct doh_conn_s *next;
+};
+
+struct dns_server_doh_s {
+  struct ev_loop *loop;
+
+  dns_req_received_cb cb;
+  void *cb_data;
+
+  int sock;
+  ev_io accept_watcher;
+  SSL_CTX *ssl_ctx;
+
+  uint64_t conn_id;
+  uint16_t conn_count;
+  uint16_t conn_limit;
+  struct doh_conn_s *conns;
+};
+
+static void stream_free(struct doh_stream_s *stream) {
+  free(stream->path);
+  free(stream->body);
+  free(stream->resp);
+  free(stream);
+}
+
+static void stream_unlink(struct doh_stream_s *stream) {
+  struct doh_conn_s *conn = stream->conn;
+  for (struct doh_stream_s **cur = &conn->streams; *cur != NULL; cur = &(*cur)->next) {
+    if (*cur == stream) {
+      *cur = stream->next;
+      break;
+    }
+  }
+  stream->conn = NULL;
+  stream->next = NULL;
+}
+
+// Streams waiting for a response are kept until dns_server_doh_respond(),
+// others are freed.
+static void stream_release(struct doh_stream_s *stream) {
+  stream_unlink(stream);
+  if (!stream->waiting) {
+    stream_free(stream);
+  }
+}
+
+static void remove_conn(struct doh_conn_s *conn) {
+  dns_server_doh_t *d = conn->d;
+
+  DLOG_CONN("Removing connection, socket %d", conn->sock);
+
+  if (d->conn_count == d->conn_limit) {
+    ev_io_start(d->loop, &d->accept_watcher);  // continue accepting new connections
+  }
+  d->conn_count--;
+
+  ev_io_stop(d->loop, &conn->io_watcher);
+  ev_timer_stop(d->loop, &conn->timer_watcher);
+
+  while (conn->streams) {
+    stream_release(conn->streams);
+  }
+  nghttp2_session_del(conn->session);
+  SSL_free(conn->ssl);
+  close(conn->sock);
+  free(conn->out_buf);
+
+  for (struct doh_conn_s **cur = &d->conns; *cur != NULL; cur = &(*cur)->next) {
+    if (*cur == conn) {
+      *cur = conn->next;
+      break;
+    }
+  }
+  free(conn);
+}
+
+// Translates result of SSL_read/SSL_write to recv/send like return value.
+static ssize_t conn_tls_result(struct doh_conn_s *conn, int res, const char *op) {
+  conn->tls_want_write = 0;
+  if (res > 0) {
+    return res;
+  }
+  switch (SSL_get_error(conn->ssl, res)) {
+    case SSL_ERROR_WANT_WRITE:
+      conn->tls_want_write = 1;
+      __attribute__((fallthrough));
+    case SSL_ERROR_WANT_READ:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      return errno == 0 ? 0 : -1;
+    default:
+      tls_server_log_errors(op);
+      errno = EPROTO;
+      return -1;
+  }
+}
+
+static void conn_update_watcher(struct doh_conn_s *conn) {
+  int events = EV_READ | ((conn->out_len > 0 || conn->tls_want_write) ? EV_WRITE : 0);
+  if ((conn->io_watcher.events & (EV_READ | EV_WRITE)) != events) {
+    ev_io_stop(conn->d->loop, &conn->io_watcher);
+    ev_io_set(&conn->io_watcher, conn->sock, events);
+    ev_io_start(conn->d->loop, &conn->io_watcher);
+  }
+}
+
+// Writes pending frames to the TLS connection.
+// Returns 0 on success, -1 if the connection has to be closed.
+static int conn_flush(struct doh_conn_s *conn) {
+  for (;;) {
+    const uint8_t *data = (const uint8_t *)conn->out_buf;
+    ssize_t data_len = (ssize_t)conn->out_len;
+    if (data_len == 0) {
+      data_len = nghttp2_session_mem_send(conn->session, &data);
+      if (data_len < 0) {
+        WLOG_CONN("HTTP/2 send error: %s", nghttp2_strerror((int)data_len));
+        return -1;
+      }
+      if (data_len == 0) {
+        break;
+      }
+    }
+    ERR_clear_error();
+    ssize_t sent = conn_tls_result(conn, SSL_write(conn->ssl, data, (int)data_len), "SSL_write");
+    if (sent < 0 && errno != EAGAIN) {
+      WLOG_CONN("Send error: %s", strerror(errno));
+      return -1;
+    }
+    sent = sent < 0 ? 0 : sent;
+    if (sent < data_len) {
+      // keep the rest, socket will be writable later
+      const size_t rest = (size_t)(data_len - sent);
+      if (data == (const uint8_t *)conn->out_buf) {
+        memmove(conn->out_buf, conn->out_buf + sent, rest);
+      } else {
+        char *new_buf = (char *)realloc(conn->out_buf, rest);
+        if (new_buf == NULL) {
+          FLOG_CONN("Out of mem");
+        }
+        conn->out_buf = new_buf;
+        memcpy(conn->out_buf, data + sent, rest);
+      }
+      conn->out_len = rest;
+      break;
+    }
+    conn->out_len = 0;
+  }
+  conn_update_watcher(conn);
+  if (conn->out_len == 0 &&
+      !nghttp2_session_want_read(conn->session) &&
+      !nghttp2_session_want_write(conn->session)) {
+    DLOG_CONN("HTTP/2 session finished");
+    return -1;
+  }
+  return 0;
+}
+
+static ssize_t stream_read_cb(nghttp2_session __attribute__((unused)) *session,
+                              int32_t __attribute__((unused)) stream_id,
+                              uint8_t *buf, size_t length, uint32_t *data_flags,
+                              nghttp2_data_source *source,
+                              void __attribute__((unused)) *user_data) {
+  struct doh_stream_s *stream = (struct doh_stream_s *)source->ptr;
+  size_t rest = stream->resp_len - stream->resp_sent;
+  if (length > rest) {
+    length = rest;
+  }
+  memcpy(buf, stream->resp + stream->resp_sent, length);
+  stream->resp_sent += length;
+  if (stream->resp_sent == stream->resp_len) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return (ssize_t)length;
+}
+
+#define MAKE_NV(name, value, value_len) \
+  { (uint8_t *)(name), (uint8_t *)(value), sizeof(name) - 1, (value_len), \
+    NGHTTP2_NV_FLAG_NO_COPY_NAME }
+
+static void stream_submit_response(struct doh_stream_s *stream, uint16_t status) {
+  struct doh_conn_s *conn = stream->conn;
+  char status_str[8];
+  char length_str[8];
+  (void)snprintf(status_str, sizeof(status_str), "%03u", status);
+  (void)snprintf(length_str, sizeof(length_str), "%zu", stream->resp_len);
+  nghttp2_nv headers[] = {
+    MAKE_NV(":status", status_str, strlen(status_str)),
+    MAKE_NV("content-type", DOH_CONTENT_TYPE, sizeof(DOH_CONTENT_TYPE) - 1),
+    MAKE_NV("content-length", length_str, strlen(length_str)),
+  };
+  nghttp2_data_provider provider;
+  provider.source.ptr = stream;
+  provider.read_callback = stream_read_cb;
+  // error responses have no body
+  const size_t headers_len = status == 200 ? 3 : 1;
+  int res = nghttp2_submit_response(conn->session, stream->stream_id, headers, headers_len,
+                                    status == 200 ? &provider : NULL);
+  if (res != 0) {
+    WLOG_CONN("Failed to submit response on stream %d: %s", stream->stream_id, nghttp2_strerror(res));
+  }
+}
+
+static int base64url_value(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  }
+  if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  }
+  if (c == '-') {
+    return 62;
+  }
+  if (c == '_') {
+    return 63;
+  }
+  return -1;
+}
+
+// Decodes unpadded base64url 'in' into newly allocated buffer, NULL on error.
+static char * base64url_decode(const char *in, size_t in_len, size_t *out_len) {
+  while (in_len > 0 && in[in_len - 1] == '=') {
+    in_len--;  // padding is not expected, but tolerated
+  }
+  char *out = (char *)malloc(in_len * 3 / 4 + 1);
+  if (out == NULL) {
+    FLOG("Out of mem");
+  }
+  uint32_t acc = 0;
+  int bits = 0;
+  size_t len = 0;
+  for (size_t i = 0; i < in_len; i++) {
+    int v = base64url_value(in[i]);
+    if (v < 0) {
+      free(out);
+      return NULL;
+    }
+    acc = (acc << 6) | (uint32_t)v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out[len++] = (char)((acc >> bits) & 0xFF);
+    }
+  }
+  *out_len = len;
+  return out;
+}
+
+// Extracts DNS request from the ?dns= parameter of the path.
+static char * get_request_from_path(const char *path, size_t *req_len) {
+  const char *query = strchr(path, '?');
+  if (query == NULL) {
+    return NULL;
+  }
+  for (const char *param = query + 1; param != NULL && *param != '\0';) {
+    const char *end = strchr(param, '&');
+    const size_t param_len = end ? (size_t)(end - param) : strlen(param);
+    if (param_len > sizeof(DOH_QUERY_PARAM) - 1 &&
+        strncmp(param, DOH_QUERY_PARAM, sizeof(DOH_QUERY_PARAM) - 1) == 0) {
+      return base64url_decode(param + sizeof(DOH_QUERY_PARAM) - 1,
+                              param_len - (sizeof(DOH_QUERY_PARAM) - 1), req_len);
+    }
+    param = end ? end + 1 : NULL;
+  }
+  return NULL;
+}
+
+static void stream_process_request(struct doh_stream_s *stream) {
+  struct doh_conn_s *conn = stream->conn;
+  dns_server_doh_t *d = conn->d;
+
+  char *dns_req = NULL;
+  size_t dns_req_len = 0;
+  if (stream->error_status == 0) {
+    if (stream->path == NULL ||
+        strncmp(stream->path, DOH_SERVER_PATH, sizeof(DOH_SERVER_PATH) - 1) != 0 ||
+        (stream->path[sizeof(DOH_SERVER_PATH) - 1] != '\0' &&
+         stream->path[sizeof(DOH_SERVER_PATH) - 1] != '?')) {
+      stream->error_status = 404;
+    } else if (stream->is_get) {
+      dns_req = get_request_from_path(stream->path, &dns_req_len);
+    } else if (stream->is_post) {
+      dns_req = stream->body;  // To free buffer after https request is complete.
+      dns_req_len = stream->body_len;
+      stream->body = NULL;
+    } else {
+      stream->error_status = 405;
+    }
+  }
+  if (stream->error_status == 0 && (dns_req == NULL || dns_req_len < DNS_HEADER_LENGTH)) {
+    WLOG_CONN("Malformed request received on stream %d, length: %zu", stream->stream_id, dns_req_len);
+    stream->error_status = 400;
+  }
+  if (stream->error_status != 0) {
+    DLOG_CONN("Stream %d rejected with HTTP status %u", stream->stream_id, stream->error_status);
+    free(dns_req);
+    stream_submit_response(stream, stream->error_status);
+    return;
+  }
+
+  DLOG_CONN("Request received on stream %d, length: %zu", stream->stream_id, dns_req_len);
+  ev_timer_again(d->loop, &conn->timer_watcher);
+  stream->waiting = 1;
+  d->cb(stream, DNS_TRANSPORT_HTTPS, d->cb_data, (struct sockaddr*)&conn->raddr,
+        dns_req, dns_req_len);
+}
+
+static int on_begin_headers_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                               void *user_data) {
+  struct doh_conn_s *conn = (struct doh_conn_s *)user_data;
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+  struct doh_stream_s *stream = (struct doh_stream_s *)calloc(1, sizeof(struct doh_stream_s));
+  if (stream == NULL) {
+    FLOG_CONN("Out of mem");
+  }
+  stream->conn = conn;
+  stream->stream_id = frame->hd.stream_id;
+  stream->next = conn->streams;
+  conn->streams = stream;
+  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+  return 0;
+}
+
+static int on_header_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                        const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen,
+                        uint8_t __attribute__((unused)) flags,
+                        void __attribute__((unused)) *user_data) {
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+    return 0;
+  }
+  struct doh_stream_s *stream = (struct doh_stream_s *)
+    nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (stream == NULL) {
+    return 0;
+  }
+  if (namelen == sizeof(":method") - 1 && memcmp(name, ":method", namelen) == 0) {
+    stream->is_get = valuelen == 3 && memcmp(value, "GET", 3) == 0;
+    stream->is_post = valuelen == 4 && memcmp(value, "POST", 4) == 0;
+  } else if (namelen == sizeof(":path") - 1 && memcmp(name, ":path", namelen) == 0) {
+    if (valuelen > DOH_MAX_PATH_SIZE) {
+      stream->error_status = 414;
+      return 0;
+    }
+    free(stream->path);
+    stream->path = strndup((const char *)value, valuelen);
+    if (stream->path == NULL) {
+      FLOG("Out of mem");
+    }
+  } else if (namelen == sizeof("content-type") - 1 && memcmp(name, "content-type", namelen) == 0) {
+    if (valuelen < sizeof(DOH_CONTENT_TYPE) - 1 ||
+        memcmp(value, DOH_CONTENT_TYPE, sizeof(DOH_CONTENT_TYPE) - 1) != 0) {
+      stream->error_status = 415;
+    }
+  }
+  return 0;
+}
+
+static int on_data_chunk_recv_cb(nghttp2_session *session, uint8_t __attribute__((unused)) flags,
+                                 int32_t stream_id, const uint8_t *data, size_t len,
+                                 void __attribute__((unused)) *user_data) {
+  struct doh_stream_s *stream = (struct doh_stream_s *)
+    nghttp2_session_get_stream_user_data(session, stream_id);
+  if (stream == NULL || stream->error_status != 0) {
+    return 0;
+  }
+  if (stream->body_len + len > DOH_MAX_REQUEST_SIZE) {
+    stream->error_status = 413;
+    return 0;
+  }
+  char *new_body = (char *)realloc(stream->body, stream->body_len + len);
+  if (new_body == NULL) {
+    FLOG("Out of mem");
+  }
+  stream->body = new_body;
+  memcpy(stream->body + stream->body_len, data, len);
+  stream->body_len += len;
+  return 0;
+}
+
+static int on_frame_recv_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                            void __attribute__((unused)) *user_data) {
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+      !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+    return 0;
+  }
+  struct doh_stream_s *stream = (struct doh_stream_s *)
+    nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (stream != NULL) {
+    stream_process_request(stream);
+  }
+  return 0;
+}
+
+static int on_stream_close_cb(nghttp2_session *session, int32_t stream_id,
+                              uint32_t __attribute__((unused)) error_code,
+                              void __attribute__((unused)) *user_data) {
+  struct doh_stream_s *stream = (struct doh_stream_s *)
+    nghttp2_session_get_stream_user_data(session, stream_id);
+  if (stream != NULL) {
+    nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+    stream_release(stream);
+  }
+  return 0;
+}
+
+void dns_server_doh_respond(void *stream_ptr, char *resp, size_t resp_len) {
+  struct doh_stream_s *stream = (struct doh_stream_s *)stream_ptr;
+  struct doh_conn_s *conn = stream->conn;
+  stream->waiting = 0;
+  if (conn == NULL) {
+    DLOG("DoH stream %d closed before response arrived", stream->stream_id);
+    stream_free(stream);
+    return;
+  }
+
+  if (resp != NULL && resp_len >= DNS_HEADER_LENGTH) {
+    DLOG_CONN("Sending %zu bytes on stream %d", resp_len, stream->stream_id);
+    stream->resp = (char *)malloc(resp_len);
+    if (stream->resp == NULL) {
+      FLOG_CONN("Out of mem");
+    }
+    memcpy(stream->resp, resp, resp_len);
+    stream->resp_len = resp_len;
+    stream_submit_response(stream, 200);
+  } else {
+    stream_submit_response(stream, 502);  // upstream failed to answer
+  }
+
+  // when called from a request callback, frames are sent after processing input
+  if (!conn->in_recv && conn_flush(conn) != 0) {
+    remove_conn(conn);
+  }
+}
+
+static void conn_io_cb(struct ev_loop __attribute__((unused)) *loop,
+                       ev_io *w, int __attribute__((unused)) revents) {
+  struct doh_conn_s *conn = (struct doh_conn_s *)w->data;
+
+  // read until TLS layer has no more data, so nothing remains buffered there
+  for (;;) {
+    uint8_t buf[DOH_READ_BUFFER_SIZE];
+    ERR_clear_error();
+    ssize_t len = conn_tls_result(conn, SSL_read(conn->ssl, buf, sizeof(buf)), "SSL_read");
+    if (len < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (len <= 0) {
+      if (len == 0 || errno == ECONNRESET) {
+        DLOG_CONN("Connection closed");
+      } else {
+        WLOG_CONN("Read error: %s", strerror(errno));
+      }
+      remove_conn(conn);
+      return;
+    }
+    conn->in_recv = 1;
+    ssize_t res = nghttp2_session_mem_recv(conn->session, buf, (size_t)len);
+    conn->in_recv = 0;
+    if (res < 0) {
+      WLOG_CONN("HTTP/2 protocol error: %s", nghttp2_strerror((int)res));
+      remove_conn(conn);
+      return;
+    }
+  }
+
+  if (conn_flush(conn) != 0) {
+    remove_conn(conn);
+  }
+}
+
+static void conn_timer_cb(struct ev_loop __attribute__((unused)) *loop,
+                          ev_timer *w, int __attribute__((unused)) revents) {
+  struct doh_conn_s *conn = (struct doh_conn_s *)w->data;
+  DLOG_CONN("HTTPS client timeouted");
+  remove_conn(conn);
+}
+
+static nghttp2_session * create_session(struct doh_conn_s *conn) {
+  nghttp2_session_callbacks *callbacks = NULL;
+  if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+    FLOG_CONN("Out of mem");
+  }
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, on_begin_headers_cb);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header_cb);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv_cb);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv_cb);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_cb);
+
+  nghttp2_session *session = NULL;
+  int res = nghttp2_session_server_new(&session, callbacks, conn);
+  nghttp2_session_callbacks_del(callbacks);
+  if (res != 0) {
+    FLOG_CONN("Failed to create HTTP/2 session: %s", nghttp2_strerror(res));
+  }
+
+  nghttp2_settings_entry settings[] = {
+    {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, DOH_MAX_CONCURRENT_STREAMS},
+  };
+  res = nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings,
+                                sizeof(settings) / sizeof(*settings));
+  if (res != 0) {
+    FLOG_CONN("Failed to submit HTTP/2 settings: %s", nghttp2_strerror(res));
+  }
+  return session;
+}
+
+static void accept_cb(struct ev_loop __attribute__((unused)) *loop,
+                      ev_io *w, int __attribute__((unused)) revents) {
+  dns_server_doh_t *d = (dns_server_doh_t *)w->data;
+
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len = sizeof(client_addr);
+
+  int client_sock = accept(w->fd, (struct sockaddr *)&client_addr, &client_addr_len);
+  if (client_sock == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ELOG("Failed to accept HTTPS client: %s", strerror(errno));
+    }
+    return;
+  }
+  int flags = fcntl(client_sock, F_GETFL, 0);
+  if (flags != -1) {
+    fcntl(client_sock, F_SETFL, flags | O_NONBLOCK);
+  }
+  // responses are small frames, not to be held back by Nagle's algorithm
+  const int one = 1;
+  setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  d->conn_id++;
+  d->conn_count++;
+  if (d->conn_count == d->conn_limit) {
+    ev_io_stop(d->loop, &d->accept_watcher);  // suspend accepting new connections
+  }
+
+  struct doh_conn_s *conn = (struct doh_conn_s *)calloc(1, sizeof(struct doh_conn_s));
+  if (conn == NULL) {
+    FLOG("Out of mem");
+  }
+  conn->d = d;
+  conn->id = d->conn_id;
+  conn->sock = client_sock;
+  memcpy(&conn->raddr, &client_addr, client_addr_len);
+  conn->next = d->conns;
+  d->conns = conn;
+
+  // handshake is done on first read
+  conn->ssl = SSL_new(d->ssl_ctx);
+  if (conn->ssl == NULL || SSL_set_fd(conn->ssl, conn->sock) != 1) {
+    tls_server_log_errors("SSL_new");
+    FLOG_CONN("Failed to create TLS connection");
+  }
+  SSL_set_accept_state(conn->ssl);
+  conn->session = create_session(conn);
+
+  ev_io_init(&conn->io_watcher, conn_io_cb, conn->sock, EV_READ);
+  conn->io_watcher.data = conn;
+  ev_io_start(d->loop, &conn->io_watcher);
+
+  ev_init(&conn->timer_watcher, conn_timer_cb);
+  conn->timer_watcher.repeat = DOH_IDLE_TIMEOUT_S;
+  conn->timer_watcher.data = conn;
+  ev_timer_again(d->loop, &conn->timer_watcher);
+
+  DLOG_CONN("Accepted HTTPS client %u of %u, socket %d", d->conn_count, d->conn_limit, conn->sock);
+}
+
+dns_server_doh_t * dns_server_doh_create(
+    struct ev_loop *loop, struct addrinfo *listen_addrinfo,
+    dns_req_received_cb cb, void *data, uint16_t client_limit,
+    struct ssl_ctx_st *ssl_ctx) {
+  dns_server_doh_t *d = (dns_server_doh_t *)calloc(1, sizeof(dns_server_doh_t));
+  if (d == NULL) {
+    FLOG("Out of mem");
+  }
+  d->loop = loop;
+  d->cb = cb;
+  d->cb_data = data;
+  d->ssl_ctx = ssl_ctx;
+  d->sock = dns_server_tcp_listen_sock(listen_addrinfo, "HTTPS");
+  d->conn_limit = client_limit;
+
+  ev_io_init(&d->accept_watcher, accept_cb, d->sock, EV_READ);
+  d->accept_watcher.data = d;
+  ev_io_start(d->loop, &d->accept_watcher);
+
+  return d;
+}
+
+void dns_server_doh_stop(dns_server_doh_t *d) {
+  while (d->conns) {
+    remove_conn(d->conns);
+  }
+  ev_io_stop(d->loop, &d->accept_watcher);
+}
+
+void dns_server_doh_cleanup(dns_server_doh_t *d) {
+  close(d->sock);
+}
+#else
+void dns_server_doh_respond(void __attribute__((unused)) *stream,
+                            char __attribute__((unused)) *resp,
+                            size_t __attribute__((unused)) resp_len) {
+  FLOG("Compiled without DNS-over-HTTPS server support");
+}
+#endif
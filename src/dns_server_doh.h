@@ -0,0 +1,34 @@
+#ifndef _DNS_SERVER_DOH_H_
+#define _DNS_SERVER_DOH_H_
+
+#include "dns_server.h"
+
+// DNS-over-HTTPS (RFC 8484) server, so other proxies can use this one as
+// resolver. Accepts HTTP/2 over TLS only, both POST and GET requests on the
+// DOH_SERVER_PATH path.
+//
+// Requests are passed to the callback with DNS_TRANSPORT_HTTPS and a stream
+// handle in place of the server. Every handle must be released once with
+// dns_server_doh_respond(), even if the connection is gone in the meantime.
+//
+// Only available if compiled with OpenSSL and nghttp2 (HAS_NGHTTP2).
+
+#define DOH_SERVER_PATH "/dns-query"
+
+typedef struct dns_server_doh_s dns_server_doh_t;
+
+struct ssl_ctx_st;
+dns_server_doh_t * dns_server_doh_create(
+    struct ev_loop *loop, struct addrinfo *listen_addrinfo,
+    dns_req_received_cb cb, void *data, uint16_t client_limit,
+    struct ssl_ctx_st *ssl_ctx);
+
+// Sends DNS response on the stream and releases the stream handle.
+// If 'resp' is NULL, a HTTP error is sent to let the client fail fast.
+void dns_server_doh_respond(void *stream, char *resp, size_t resp_len);
+
+void dns_server_doh_stop(dns_server_doh_t *d);
+
+void dns_server_doh_cleanup(dns_server_doh_t *d);
+
+#endif // _DNS_SERVER_DOH_H_
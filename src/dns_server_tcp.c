@@ -3,10 +3,17 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <unistd.h>
 
 #include "dns_server_tcp.h"
 #include "logging.h"
+#include "tls_server.h"
+#include "uring.h"
+
+#if HAS_OPENSSL == 1
+#include <openssl/err.h>
+#endif
 
 // Platform compatibility
 #ifndef SOCK_NONBLOCK
@@ -30,6 +37,7 @@ enum {
   LISTEN_BACKLOG  =   5,
   IDLE_TIMEOUT_S  = 120,  // "two minutes" according to RFC1035 4.2.2
   RESEND_DELAY_US = 500,  // 0.0005 sec
+  TCP_URING_BUFFERS = 64,  // shared by all clients of a listener
   TCP_DNS_MAX_PAYLOAD = UINT16_MAX - sizeof(uint16_t),  // Max after 2-byte length prefix
 };
 
@@ -46,10 +54,18 @@ struct tcp_client_s {
   uint32_t input_buffer_size;
   uint32_t input_buffer_used;
 
+  struct ssl_st * ssl;  // DNS-over-TLS connection, NULL for plain TCP
+  struct tcp_client_uring_s * uring_state;  // NULL if io_uring is not used
+
   ev_io read_watcher;
   ev_timer timer_watcher;
 
   struct tcp_client_s * next;
+
+  // Callback may respond synchronously (e.g. from cache), removal on send
+  // error is postponed until the callback returned.
+  uint8_t in_callback;
+  uint8_t remove_pending;
 } __attribute__((packed)) __attribute__((aligned(128)));
 
 struct dns_server_tcp_s {
@@ -62,20 +78,77 @@ struct dns_server_tcp_s {
   socklen_t addrlen;
   ev_io accept_watcher;
 
+  struct ssl_ctx_st * ssl_ctx;  // DNS-over-TLS listener, NULL for plain TCP
+  struct dns_server_tcp_uring_s * uring_state;  // NULL if io_uring is not used
+
   uint64_t client_id;
   uint16_t client_count;
   uint16_t client_limit;
   struct tcp_client_s * clients;
 } __attribute__((packed)) __attribute__((aligned(128)));
 
+#if HAS_IO_URING == 1
+struct dns_server_tcp_uring_s {
+  uring_t *uring;
+  uring_buf_ring_t *buf_ring;
+  uring_op_t accept_op;
+  uint8_t accepting;  // accepting is wanted, limit not reached
+  uint8_t accept_ops;  // in flight, cancelled one may still be running
+  uint8_t stopped;
+};
+
+struct tcp_client_uring_s {
+  uring_op_t recv_op;
+  uring_op_t send_op;
+  uint8_t ops;  // operations in flight, removed client is freed after the last one
+  uint8_t removed;
+
+  char * output_buffer;  // length prefixed responses being sent
+  uint32_t output_buffer_size;
+  uint32_t output_buffer_used;
+  char * queued_buffer;  // responses queued while sending, output buffer can not move
+  uint32_t queued_buffer_size;
+  uint32_t queued_buffer_used;
+  uint8_t sending;
+};
+
+static void uring_accept_start(dns_server_tcp_t *d);
+static void uring_accept_stop(dns_server_tcp_t *d);
+static void uring_client_free(struct tcp_client_s *client);
+#endif
+
+static void accept_resume(dns_server_tcp_t *d) {
+#if HAS_IO_URING == 1
+  if (d->uring_state != NULL) {
+    uring_accept_start(d);
+    return;
+  }
+#endif
+  ev_io_start(d->loop, &d->accept_watcher);
+}
+
+static void accept_suspend(dns_server_tcp_t *d) {
+#if HAS_IO_URING == 1
+  if (d->uring_state != NULL) {
+    uring_accept_stop(d);
+    return;
+  }
+#endif
+  ev_io_stop(d->loop, &d->accept_watcher);
+}
+
 
 static void remove_client(struct tcp_client_s * client) {
   dns_server_tcp_t *d = client->d;
+  if (client->in_callback) {
+    client->remove_pending = 1;
+    return;
+  }
 
   DLOG_CLIENT("Removing client, socket %d", client->sock);
 
   if (d->client_count == d->client_limit) {
-    ev_io_start(d->loop, &d->accept_watcher);  // continue accepting new client connections
+    accept_resume(d);  // continue accepting new client connections
   }
   d->client_count--;
 
@@ -84,6 +157,11 @@ static void remove_client(struct tcp_client_s * client) {
 
   free(client->input_buffer);
 
+#if HAS_OPENSSL == 1
+  if (client->ssl) {
+    SSL_free(client->ssl);  // no close_notify, client is gone or idle
+  }
+#endif
   close(client->sock);
 
   // Save next pointer before freeing. Safe because this is single-threaded
@@ -102,6 +180,12 @@ static void remove_client(struct tcp_client_s * client) {
     }
   }
 
+#if HAS_IO_URING == 1
+  if (client->uring_state != NULL) {
+    uring_client_free(client);
+    return;
+  }
+#endif
   free(client);
 }
 
@@ -125,32 +209,88 @@ static int get_dns_request(struct tcp_client_s *client,
   return 1;
 }
 
-static void read_cb(struct ev_loop __attribute__((unused)) *loop,
-                    ev_io *w, int __attribute__((unused)) revents) {
-  struct tcp_client_s *client = (struct tcp_client_s *)w->data;
-  dns_server_tcp_t *d = client->d;
-
-  // Receive data
-  char buf[DNS_REQUEST_BUFFER_SIZE];  // if there would be more data, callback will be called again
-  ssize_t len = recv(w->fd, buf, DNS_REQUEST_BUFFER_SIZE, 0);
-  if (len <= 0) {
-    if (len == 0 || errno == ECONNRESET) {
-      DLOG_CLIENT("Connection closed");
-    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      return;
-    } else {
-      WLOG_CLIENT("Read error: %s", strerror(errno));
+#if HAS_OPENSSL == 1
+// Translates result of SSL_read/SSL_write to recv/send like return value.
+// When TLS layer needs the socket to become writable (handshake or
+// renegotiation), the watcher is extended with write events.
+static ssize_t client_tls_result(struct tcp_client_s *client, int res, const char *op) {
+  int events = EV_READ;
+  ssize_t ret = res;
+  if (res <= 0) {
+    switch (SSL_get_error(client->ssl, res)) {
+      case SSL_ERROR_WANT_READ:
+        errno = EAGAIN;
+        ret = -1;
+        break;
+      case SSL_ERROR_WANT_WRITE:
+        events |= EV_WRITE;
+        errno = EAGAIN;
+        ret = -1;
+        break;
+      case SSL_ERROR_ZERO_RETURN:
+        ret = 0;
+        break;
+      case SSL_ERROR_SYSCALL:
+        ret = errno == 0 ? 0 : -1;  // unexpected EOF or socket error
+        break;
+      default:
+        tls_server_log_errors(op);
+        errno = EPROTO;
+        ret = -1;
     }
-    remove_client(client);
-    return;
   }
+  if ((client->read_watcher.events & (EV_READ | EV_WRITE)) != events) {
+    ev_io_stop(client->d->loop, &client->read_watcher);
+    ev_io_set(&client->read_watcher, client->sock, events);
+    ev_io_start(client->d->loop, &client->read_watcher);
+  }
+  return ret;
+}
+#endif
+
+static ssize_t client_recv(struct tcp_client_s *client, char *buf, size_t len) {
+#if HAS_OPENSSL == 1
+  if (client->ssl) {
+    ERR_clear_error();
+    return client_tls_result(client, SSL_read(client->ssl, buf, (int)len), "SSL_read");
+  }
+#endif
+  return recv(client->sock, buf, len, 0);
+}
+
+static ssize_t client_send(struct tcp_client_s *client, const char *buf, size_t len, int flags) {
+#if HAS_OPENSSL == 1
+  if (client->ssl) {
+    ERR_clear_error();
+    return client_tls_result(client, SSL_write(client->ssl, buf, (int)len), "SSL_write");
+  }
+#endif
+  return send(client->sock, buf, len, flags);
+}
+
+// Returns 1 if decrypted data is buffered in TLS layer, that the socket
+// readiness would not report.
+static int client_recv_pending(struct tcp_client_s *client) {
+#if HAS_OPENSSL == 1
+  if (client->ssl) {
+    return SSL_pending(client->ssl) > 0;
+  }
+#endif
+  (void)client;
+  return 0;
+}
+
+// Appends received data to the input buffer and passes complete requests to
+// the callback. Returns 0 if the client was removed.
+static int client_data_received(struct tcp_client_s *client, const char *buf, ssize_t len) {
+  dns_server_tcp_t *d = client->d;
 
   // Append data into input buffer
   // Check for integer overflow and maximum message size
   if (len > UINT16_MAX || client->input_buffer_used > UINT16_MAX - (uint32_t)len) {
     WLOG_CLIENT("Request too large, dropping client");
     remove_client(client);
-    return;
+    return 0;
   }
   const uint32_t free_space = client->input_buffer_size - client->input_buffer_used;
   const uint32_t needed_space = client->input_buffer_used + (uint32_t)len;
@@ -158,7 +298,7 @@ static void read_cb(struct ev_loop __attribute__((unused)) *loop,
   if (needed_space > TCP_DNS_MAX_PAYLOAD) {
     WLOG_CLIENT("Request too large, dropping client");
     remove_client(client);
-    return;
+    return 0;
   }
   DLOG_CLIENT("Received %d byte, free: %u", len, free_space);
   if (free_space < len) {
@@ -188,16 +328,52 @@ static void read_cb(struct ev_loop __attribute__((unused)) *loop,
       WLOG_CLIENT("Malformed request received, too short: %u", req_size);
       free(dns_req);
       remove_client(client);
-      return;
+      return 0;
     }
 
-    d->cb(d, 1, d->cb_data, (struct sockaddr*)&client->raddr, dns_req, req_size);
+    client->in_callback = 1;
+    d->cb(d, DNS_TRANSPORT_TCP, d->cb_data, (struct sockaddr*)&client->raddr, dns_req, req_size);
+    client->in_callback = 0;
+    if (client->remove_pending) {
+      remove_client(client);
+      return 0;
+    }
     request_received = 1;
   }
 
   if (request_received) {
     ev_timer_again(d->loop, &client->timer_watcher);
   }
+  return 1;
+}
+
+static void read_cb(struct ev_loop __attribute__((unused)) *loop,
+                    ev_io *w, int __attribute__((unused)) revents) {
+  struct tcp_client_s *client = (struct tcp_client_s *)w->data;
+  dns_server_tcp_t *d = client->d;
+
+  // Receive data
+  char buf[DNS_REQUEST_BUFFER_SIZE];  // if there would be more data, callback will be called again
+  ssize_t len = client_recv(client, buf, DNS_REQUEST_BUFFER_SIZE);
+  if (len <= 0) {
+    if (len == 0 || errno == ECONNRESET) {
+      DLOG_CLIENT("Connection closed");
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else {
+      WLOG_CLIENT("Read error: %s", strerror(errno));
+    }
+    remove_client(client);
+    return;
+  }
+
+  if (!client_data_received(client, buf, len)) {
+    return;
+  }
+
+  if (client_recv_pending(client)) {
+    ev_feed_event(d->loop, &client->read_watcher, EV_READ);
+  }
 }
 
 static void timer_cb(struct ev_loop __attribute__((unused)) *loop,
@@ -207,30 +383,161 @@ static void timer_cb(struct ev_loop __attribute__((unused)) *loop,
   remove_client(client);
 }
 
-static void accept_cb(struct ev_loop __attribute__((unused)) *loop,
-                      ev_io *w, int __attribute__((unused)) revents) {
-  dns_server_tcp_t *d = (dns_server_tcp_t *)w->data;
+#if HAS_IO_URING == 1
+static void uring_client_free(struct tcp_client_s *client) {
+  struct tcp_client_uring_s *cu = client->uring_state;
+  if (!cu->removed) {
+    cu->removed = 1;
+    if (cu->ops > 0) {
+      uring_cancel(client->d->uring_state->uring, &cu->recv_op);
+      uring_cancel(client->d->uring_state->uring, &cu->send_op);
+    }
+  }
+  if (cu->ops > 0) {
+    return;  // freed with the last completion
+  }
+  free(cu->output_buffer);
+  free(cu->queued_buffer);
+  free(cu);
+  free(client);
+}
 
-  struct sockaddr_storage client_addr;
-  socklen_t client_addr_len = sizeof(client_addr);
+static void uring_client_recv_arm(struct tcp_client_s *client) {
+  struct tcp_client_uring_s *cu = client->uring_state;
+  struct dns_server_tcp_uring_s *du = client->d->uring_state;
+  struct io_uring_sqe *sqe = uring_get_sqe(du->uring, &cu->recv_op);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->sock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = uring_buf_ring_group(du->buf_ring);
+  cu->ops++;
+}
 
-  int client_sock = accept(w->fd, (struct sockaddr *)&client_addr, &client_addr_len);
-  if (client_sock != -1) {
-    // Set non-blocking mode for macOS compatibility (Linux accept4 does this atomically)
-    int flags = fcntl(client_sock, F_GETFL, 0);
-    if (flags != -1) {
-      fcntl(client_sock, F_SETFL, flags | O_NONBLOCK);
+static void uring_client_recv_cb(uring_op_t *op, int32_t res, uint32_t flags) {
+  struct tcp_client_s *client = (struct tcp_client_s *)op->data;
+  struct tcp_client_uring_s *cu = client->uring_state;
+  uring_buf_ring_t *buf_ring = client->d->uring_state->buf_ring;
+
+  if (flags & IORING_CQE_F_BUFFER) {
+    if (res > 0 && !cu->removed) {
+      client_data_received(client, uring_buf_ring_buffer(buf_ring, flags), res);
     }
+    uring_buf_ring_recycle(buf_ring, flags);
+  }
+  if (!(flags & IORING_CQE_F_MORE)) {
+    cu->ops--;  // client removed above is kept until this point
   }
-  if (client_sock == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-    ELOG("Failed to accept TCP client: %s", strerror(errno));
+  if (cu->removed) {
+    uring_client_free(client);
     return;
   }
+  if (flags & IORING_CQE_F_MORE) {
+    return;
+  }
+  if (res == 0 || res == -ECONNRESET) {
+    DLOG_CLIENT("Connection closed");
+  } else if (res < 0 && res != -ENOBUFS) {
+    WLOG_CLIENT("Read error: %s", strerror(-res));
+  } else {
+    uring_client_recv_arm(client);  // multishot receive stopped, e.g. out of buffers
+    return;
+  }
+  remove_client(client);
+}
+
+static void uring_client_send(struct tcp_client_s *client) {
+  struct tcp_client_uring_s *cu = client->uring_state;
+  struct io_uring_sqe *sqe = uring_get_sqe(client->d->uring_state->uring, &cu->send_op);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = client->sock;
+  sqe->addr = (uint64_t)(uintptr_t)cu->output_buffer;
+  sqe->len = cu->output_buffer_used;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  cu->sending = 1;
+  cu->ops++;
+}
+
+static void uring_buffer_append(char **buffer, uint32_t *size, uint32_t *used,
+                                const char *data, uint32_t len) {
+  if (*used + len > *size) {
+    *buffer = (char *)realloc((void *)*buffer, *used + len);  // NOLINT(bugprone-suspicious-realloc-usage) if realloc fails, program stops
+    if (*buffer == NULL) {
+      FLOG("Out of mem");
+    }
+    *size = *used + len;
+  }
+  memcpy(*buffer + *used, data, len);
+  *used += len;
+}
+
+static void uring_client_send_cb(uring_op_t *op, int32_t res, uint32_t __attribute__((unused)) flags) {
+  struct tcp_client_s *client = (struct tcp_client_s *)op->data;
+  struct tcp_client_uring_s *cu = client->uring_state;
+  cu->ops--;
+  cu->sending = 0;
+  if (cu->removed) {
+    uring_client_free(client);
+    return;
+  }
+  if (res < 0) {
+    WLOG_CLIENT("Send error: %s", strerror(-res));
+    remove_client(client);
+    return;
+  }
+  // responses queued meanwhile are sent with the rest in one go
+  cu->output_buffer_used -= (uint32_t)res;
+  memmove(cu->output_buffer, cu->output_buffer + res, cu->output_buffer_used);
+  if (cu->queued_buffer_used > 0) {
+    uring_buffer_append(&cu->output_buffer, &cu->output_buffer_size, &cu->output_buffer_used,
+                        cu->queued_buffer, cu->queued_buffer_used);
+    cu->queued_buffer_used = 0;
+  }
+  if (cu->output_buffer_used > 0) {
+    uring_client_send(client);
+  }
+}
+
+// Queues a length prefixed response, only one send is in flight per client
+// to keep the order of responses.
+static void uring_client_respond(struct tcp_client_s *client, const char *resp, size_t resp_len) {
+  struct tcp_client_uring_s *cu = client->uring_state;
+  uint16_t resp_size = htons((uint16_t)resp_len);
+  if (cu->sending) {
+    // kernel may still read the output buffer
+    uring_buffer_append(&cu->queued_buffer, &cu->queued_buffer_size, &cu->queued_buffer_used,
+                        (const char *)&resp_size, sizeof(uint16_t));
+    uring_buffer_append(&cu->queued_buffer, &cu->queued_buffer_size, &cu->queued_buffer_used,
+                        resp, (uint32_t)resp_len);
+    return;
+  }
+  uring_buffer_append(&cu->output_buffer, &cu->output_buffer_size, &cu->output_buffer_used,
+                      (const char *)&resp_size, sizeof(uint16_t));
+  uring_buffer_append(&cu->output_buffer, &cu->output_buffer_size, &cu->output_buffer_used,
+                      resp, (uint32_t)resp_len);
+  uring_client_send(client);
+}
+
+static void uring_client_start(struct tcp_client_s *client) {
+  struct tcp_client_uring_s *cu = (struct tcp_client_uring_s *)calloc(1, sizeof(struct tcp_client_uring_s));
+  if (cu == NULL) {
+    FLOG_CLIENT("Out of mem");
+  }
+  cu->recv_op.cb = uring_client_recv_cb;
+  cu->recv_op.data = client;
+  cu->send_op.cb = uring_client_send_cb;
+  cu->send_op.data = client;
+  client->uring_state = cu;
+  uring_client_recv_arm(client);
+}
+#endif
 
+static void client_accepted(dns_server_tcp_t *d, int client_sock,
+                            struct sockaddr_storage *client_addr, socklen_t client_addr_len) {
   d->client_id++;
   d->client_count++;
   if (d->client_count == d->client_limit) {
-    ev_io_stop(d->loop, &d->accept_watcher);  // suspend accepting new client connections
+    accept_suspend(d);  // suspend accepting new client connections
   }
 
   struct tcp_client_s *client = (struct tcp_client_s *)calloc(1, sizeof(struct tcp_client_s));
@@ -240,15 +547,44 @@ static void accept_cb(struct ev_loop __attribute__((unused)) *loop,
   client->d = d;
   client->id = d->client_id;
   client->sock = client_sock;
-  memcpy(&client->raddr, &client_addr, client_addr_len);
-  client->addr_len = client_addr_len;
+  if (client_addr->ss_family == AF_UNIX) {
+    // Unix stream peers are usually unnamed, so every client would have the
+    // same address. Use the unique client id as address to find the client
+    // when the response arrives.
+    struct sockaddr_un *unix_addr = (struct sockaddr_un *)&client->raddr;
+    unix_addr->sun_family = AF_UNIX;
+    memcpy(unix_addr->sun_path, &client->id, sizeof(client->id));
+    client->addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + sizeof(client->id));
+  } else {
+    memcpy(&client->raddr, client_addr, client_addr_len);
+    client->addr_len = client_addr_len;
+  }
   client->input_buffer = NULL;
   client->next = d->clients;
   d->clients = client;
 
+#if HAS_OPENSSL == 1
+  if (d->ssl_ctx) {
+    // handshake is done on first read
+    client->ssl = SSL_new(d->ssl_ctx);
+    if (client->ssl == NULL || SSL_set_fd(client->ssl, client->sock) != 1) {
+      tls_server_log_errors("SSL_new");
+      FLOG_CLIENT("Failed to create TLS connection");
+    }
+    SSL_set_accept_state(client->ssl);
+  }
+#endif
+
   ev_io_init(&client->read_watcher, read_cb, client->sock, EV_READ);
   client->read_watcher.data = client;
-  ev_io_start(d->loop, &client->read_watcher);
+#if HAS_IO_URING == 1
+  if (d->uring_state != NULL) {
+    uring_client_start(client);
+  }
+#endif
+  if (client->uring_state == NULL) {
+    ev_io_start(d->loop, &client->read_watcher);
+  }
 
   ev_init(&client->timer_watcher, timer_cb);
   client->timer_watcher.repeat = IDLE_TIMEOUT_S;
@@ -258,52 +594,170 @@ static void accept_cb(struct ev_loop __attribute__((unused)) *loop,
   DLOG_CLIENT("Accepted client %u of %u, socket %d", d->client_count, d->client_limit, client->sock);
 }
 
+static void accept_cb(struct ev_loop __attribute__((unused)) *loop,
+                      ev_io *w, int __attribute__((unused)) revents) {
+  dns_server_tcp_t *d = (dns_server_tcp_t *)w->data;
+
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len = sizeof(client_addr);
+
+  int client_sock = accept(w->fd, (struct sockaddr *)&client_addr, &client_addr_len);
+  if (client_sock != -1) {
+    // Set non-blocking mode for macOS compatibility (Linux accept4 does this atomically)
+    int flags = fcntl(client_sock, F_GETFL, 0);
+    if (flags != -1) {
+      fcntl(client_sock, F_SETFL, flags | O_NONBLOCK);
+    }
+  }
+  if (client_sock == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ELOG("Failed to accept TCP client: %s", strerror(errno));
+    }
+    return;
+  }
+
+  client_accepted(d, client_sock, &client_addr, client_addr_len);
+}
+
+#if HAS_IO_URING == 1
+static void uring_accept_cb(uring_op_t *op, int32_t res, uint32_t flags) {
+  dns_server_tcp_t *d = (dns_server_tcp_t *)op->data;
+  struct dns_server_tcp_uring_s *du = d->uring_state;
+
+  if (res >= 0) {
+    if (d->client_count >= d->client_limit || du->stopped) {
+      DLOG("Refusing TCP client accepted over limit");
+      close(res);
+    } else {
+      struct sockaddr_storage client_addr;
+      socklen_t client_addr_len = sizeof(client_addr);
+      if (getpeername(res, (struct sockaddr *)&client_addr, &client_addr_len) != 0) {
+        memset(&client_addr, 0, sizeof(client_addr));
+        client_addr_len = sizeof(sa_family_t);
+      }
+      client_accepted(d, res, &client_addr, client_addr_len);
+    }
+  } else if (res != -ECANCELED) {
+    ELOG("Failed to accept TCP client: %s", strerror(-res));
+  }
+
+  if (!(flags & IORING_CQE_F_MORE)) {
+    du->accept_ops--;
+    if (du->accepting) {
+      du->accepting = 0;
+      uring_accept_start(d);  // multishot accept stopped or was cancelled and restarted
+    }
+  }
+}
+
+static void uring_accept_start(dns_server_tcp_t *d) {
+  struct dns_server_tcp_uring_s *du = d->uring_state;
+  if (du->stopped) {
+    return;
+  }
+  du->accepting = 1;
+  if (du->accept_ops > 0) {
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(du->uring, &du->accept_op);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = d->sock;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  du->accept_ops++;
+}
+
+// Connections accepted until cancellation completes are refused in
+// uring_accept_cb().
+static void uring_accept_stop(dns_server_tcp_t *d) {
+  struct dns_server_tcp_uring_s *du = d->uring_state;
+  du->accepting = 0;
+  if (du->accept_ops > 0) {
+    uring_cancel(du->uring, &du->accept_op);
+  }
+}
+
+void dns_server_tcp_use_uring(dns_server_tcp_t *d, struct uring_s *uring) {
+  if (d->ssl_ctx != NULL) {
+    return;  // TLS library reads the socket itself
+  }
+  struct dns_server_tcp_uring_s *du = (struct dns_server_tcp_uring_s *)calloc(1, sizeof(struct dns_server_tcp_uring_s));
+  if (du == NULL) {
+    FLOG("Out of mem");
+  }
+  du->uring = uring;
+  du->buf_ring = uring_buf_ring_create(uring, TCP_URING_BUFFERS, DNS_REQUEST_BUFFER_SIZE);
+  du->accept_op.cb = uring_accept_cb;
+  du->accept_op.data = d;
+  d->uring_state = du;
+
+  ev_io_stop(d->loop, &d->accept_watcher);
+  if (d->client_count < d->client_limit) {
+    uring_accept_start(d);
+  }
+}
+#else
+void dns_server_tcp_use_uring(dns_server_tcp_t __attribute__((unused)) *d,
+                              struct uring_s __attribute__((unused)) *uring) {
+  FLOG("Compiled without io_uring support");
+}
+#endif
+
 // Creates and bind a listening non-blocking TCP socket for incoming requests.
-static int get_tcp_listen_sock(struct addrinfo *listen_addrinfo) {
+int dns_server_tcp_listen_sock(struct addrinfo *listen_addrinfo, const char *proto) {
   int sock = socket(listen_addrinfo->ai_family, SOCK_STREAM, 0);
   if (sock < 0) {
     FLOG("Error creating TCP socket: %s (%d)", strerror(errno), errno);
   }
 
-  int yes = 1;
-  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
-    ELOG("Reuse address failed: %s (%d)", strerror(errno), errno);
-  }
-
-  uint16_t port = 0;
-  char ipstr[INET6_ADDRSTRLEN];
-  if (listen_addrinfo->ai_family == AF_INET) {
-    port = ntohs(((struct sockaddr_in*) listen_addrinfo->ai_addr)->sin_port);
-    inet_ntop(AF_INET, &((struct sockaddr_in *)listen_addrinfo->ai_addr)->sin_addr, ipstr, sizeof(ipstr));
-  } else if (listen_addrinfo->ai_family == AF_INET6) {
-    port = ntohs(((struct sockaddr_in6*) listen_addrinfo->ai_addr)->sin6_port);
-    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)listen_addrinfo->ai_addr)->sin6_addr, ipstr, sizeof(ipstr));
+  // description of listening address for logging, like: 127.0.0.1:53 TCP
+  char where[sizeof(((struct sockaddr_un *)NULL)->sun_path) + sizeof(" Unix stream")];
+  if (listen_addrinfo->ai_family == AF_UNIX) {
+    dns_server_unix_bind(sock, listen_addrinfo, "stream");
+    (void)snprintf(where, sizeof(where), "%s Unix stream",
+                   ((struct sockaddr_un *)listen_addrinfo->ai_addr)->sun_path);
   } else {
-    FLOG("Unknown address family: %d", listen_addrinfo->ai_family);
-  }
+    int yes = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+      ELOG("Reuse address failed: %s (%d)", strerror(errno), errno);
+    }
 
-  int res = bind(sock, listen_addrinfo->ai_addr, listen_addrinfo->ai_addrlen);
-  if (res < 0) {
-    FLOG("Error binding on %s:%d TCP: %s (%d)", ipstr, port,
-         strerror(errno), errno);
+    uint16_t port = 0;
+    char ipstr[INET6_ADDRSTRLEN];
+    if (listen_addrinfo->ai_family == AF_INET) {
+      port = ntohs(((struct sockaddr_in*) listen_addrinfo->ai_addr)->sin_port);
+      inet_ntop(AF_INET, &((struct sockaddr_in *)listen_addrinfo->ai_addr)->sin_addr, ipstr, sizeof(ipstr));
+    } else if (listen_addrinfo->ai_family == AF_INET6) {
+      port = ntohs(((struct sockaddr_in6*) listen_addrinfo->ai_addr)->sin6_port);
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *)listen_addrinfo->ai_addr)->sin6_addr, ipstr, sizeof(ipstr));
+    } else {
+      FLOG("Unknown address family: %d", listen_addrinfo->ai_family);
+    }
+    (void)snprintf(where, sizeof(where), "%s:%d %s", ipstr, port, proto);
+
+    dns_server_reuseport_sock(sock);
+
+    int res = bind(sock, listen_addrinfo->ai_addr, listen_addrinfo->ai_addrlen);
+    if (res < 0) {
+      FLOG("Error binding on %s: %s (%d)", where, strerror(errno), errno);
+    }
   }
 
   if (listen(sock, LISTEN_BACKLOG) == -1) {
-    FLOG("Error listening on %s:%d TCP: %s (%d)", ipstr, port,
-         strerror(errno), errno);
+    FLOG("Error listening on %s: %s (%d)", where, strerror(errno), errno);
   }
 
   int flags = fcntl(sock, F_GETFL, 0);
   if (flags == -1) {
-    FLOG("Error getting TCP socket flags on %s:%d: %s (%d)", ipstr, port,
+    FLOG("Error getting TCP socket flags on %s: %s (%d)", where,
          strerror(errno), errno);
   }
   if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
-    FLOG("Error setting TCP socket to non-blocking on %s:%d: %s (%d)", ipstr, port,
+    FLOG("Error setting TCP socket to non-blocking on %s: %s (%d)", where,
          strerror(errno), errno);
   }
 
-  ILOG("Listening on %s:%d TCP", ipstr, port);
+  ILOG("Listening on %s", where);
 
   return sock;
 }
@@ -311,6 +765,14 @@ static int get_tcp_listen_sock(struct addrinfo *listen_addrinfo) {
 dns_server_tcp_t * dns_server_tcp_create(
     struct ev_loop *loop, struct addrinfo *listen_addrinfo,
     dns_req_received_cb cb, void *data, uint16_t tcp_client_limit) {
+  return dns_server_tcp_create_tls(loop, listen_addrinfo, cb, data,
+                                   tcp_client_limit, NULL);
+}
+
+dns_server_tcp_t * dns_server_tcp_create_tls(
+    struct ev_loop *loop, struct addrinfo *listen_addrinfo,
+    dns_req_received_cb cb, void *data, uint16_t tcp_client_limit,
+    struct ssl_ctx_st *ssl_ctx) {
   dns_server_tcp_t * d = (dns_server_tcp_t *) malloc(sizeof(dns_server_tcp_t));
   if (d == NULL) {
     FLOG("Out of mem");
@@ -318,8 +780,10 @@ dns_server_tcp_t * dns_server_tcp_create(
   d->loop = loop;
   d->cb = cb;
   d->cb_data = data;
-  d->sock = get_tcp_listen_sock(listen_addrinfo);
+  d->sock = dns_server_tcp_listen_sock(listen_addrinfo, ssl_ctx ? "TLS" : "TCP");
   d->addrlen = listen_addrinfo->ai_addrlen;
+  d->ssl_ctx = ssl_ctx;
+  d->uring_state = NULL;
   d->client_id = 0;
   d->client_count = 0;
   d->client_limit = tcp_client_limit;
@@ -363,13 +827,36 @@ void dns_server_tcp_respond(dns_server_tcp_t *d,
 
   DLOG_CLIENT("Sending %u bytes", resp_len);
 
+#if HAS_IO_URING == 1
+  if (client->uring_state != NULL) {
+    uring_client_respond(client, resp, resp_len);
+    ev_timer_again(d->loop, &client->timer_watcher);
+    return;
+  }
+#endif
+
   // send length of response
   uint16_t resp_size = htons((uint16_t)resp_len);
-  ssize_t len = send(client->sock, &resp_size, sizeof(uint16_t), MSG_MORE | MSG_NOSIGNAL);
-  if (len != sizeof(uint16_t)) {
-    WLOG_CLIENT("Send error: %s, len: %d", strerror(errno), len);
-    remove_client(client);
-    return;
+  const char *data = resp;
+  size_t data_len = resp_len;
+  char *tls_data = NULL;
+  if (client->ssl) {
+    // TLS: length and response in the same record
+    tls_data = (char *)malloc(sizeof(uint16_t) + resp_len);
+    if (tls_data == NULL) {
+      FLOG_CLIENT("Out of mem");
+    }
+    memcpy(tls_data, &resp_size, sizeof(uint16_t));
+    memcpy(tls_data + sizeof(uint16_t), resp, resp_len);
+    data = tls_data;
+    data_len = sizeof(uint16_t) + resp_len;
+  } else {
+    ssize_t len = send(client->sock, &resp_size, sizeof(uint16_t), MSG_MORE | MSG_NOSIGNAL);
+    if (len != sizeof(uint16_t)) {
+      WLOG_CLIENT("Send error: %s, len: %d", strerror(errno), len);
+      remove_client(client);
+      return;
+    }
   }
 
   // send the response
@@ -377,10 +864,11 @@ void dns_server_tcp_respond(dns_server_tcp_t *d,
   int attempts = 0;
   for (; attempts < 50; ++attempts)  // 25ms max wait
   {
-    len = send(client->sock, resp + sent, resp_len - (size_t)sent, MSG_NOSIGNAL);
+    ssize_t len = client_send(client, data + sent, data_len - (size_t)sent, MSG_NOSIGNAL);
     if (len < 0) {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         WLOG_CLIENT("Send error: %s", strerror(errno));
+        free(tls_data);
         remove_client(client);
         return;
       }
@@ -388,13 +876,14 @@ void dns_server_tcp_respond(dns_server_tcp_t *d,
       continue;
     }
     sent += len;
-    if (sent == (ssize_t)resp_len) {
+    if (sent == (ssize_t)data_len) {
       break;
     }
     usleep(RESEND_DELAY_US);
   }
-  if (sent != (ssize_t)resp_len) {
-    WLOG_CLIENT("Send timeout after %d attempts, sent %zd/%zu bytes", attempts, sent, resp_len);
+  free(tls_data);
+  if (sent != (ssize_t)data_len) {
+    WLOG_CLIENT("Send timeout after %d attempts, sent %zd/%zu bytes", attempts, sent, data_len);
     remove_client(client);
     return;
   }
@@ -403,6 +892,12 @@ void dns_server_tcp_respond(dns_server_tcp_t *d,
 }
 
 void dns_server_tcp_stop(dns_server_tcp_t *d) {
+#if HAS_IO_URING == 1
+  if (d->uring_state != NULL) {
+    uring_accept_stop(d);
+    d->uring_state->stopped = 1;
+  }
+#endif
   while (d->clients) {
     remove_client(d->clients);  //NOLINT(clang-analyzer-unix.Malloc) false use after free detection
   }
@@ -410,5 +905,7 @@ void dns_server_tcp_stop(dns_server_tcp_t *d) {
 }
 
 void dns_server_tcp_cleanup(dns_server_tcp_t *d) {
+  free(d->uring_state);
+  dns_server_unix_unlink(d->sock);
   close(d->sock);
 }
@@ -9,6 +9,24 @@ dns_server_tcp_t * dns_server_tcp_create(
     struct ev_loop *loop, struct addrinfo *listen_addrinfo,
     dns_req_received_cb cb, void *data, uint16_t tcp_client_limit);
 
+// Same as above, but serves DNS-over-TLS (RFC 7858) with the given OpenSSL
+// server context, which has to remain valid until cleanup.
+struct ssl_ctx_st;
+dns_server_tcp_t * dns_server_tcp_create_tls(
+    struct ev_loop *loop, struct addrinfo *listen_addrinfo,
+    dns_req_received_cb cb, void *data, uint16_t tcp_client_limit,
+    struct ssl_ctx_st *ssl_ctx);
+
+// Internal: creates listening non-blocking stream socket, 'proto' is only
+// used for logging (e.g. "TCP").
+int dns_server_tcp_listen_sock(struct addrinfo *listen_addrinfo, const char *proto);
+
+// Switches a plain TCP listener to io_uring: multishot accept and receive
+// into provided buffers, responses are submitted in batches. TLS listeners
+// are left unchanged.
+struct uring_s;
+void dns_server_tcp_use_uring(dns_server_tcp_t *d, struct uring_s *uring);
+
 void dns_server_tcp_respond(dns_server_tcp_t *d,
     struct sockaddr *raddr, char *resp, size_t resp_len);
 
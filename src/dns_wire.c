@@ -0,0 +1,330 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dns_wire.h"
+
+enum {
+  MAX_LABEL_LENGTH = 63,
+  HEADER_FLAG_RD = 0x0100,
+  HEADER_FLAG_QR = 0x80,  // of the third byte
+  HEADER_FLAG_RA = 0x80,  // of the fourth byte
+};
+
+uint16_t dns_wire_u16(const char *msg, size_t offset) {
+  const uint8_t *p = (const uint8_t *)msg + offset;
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+uint32_t dns_wire_u32(const char *msg, size_t offset) {
+  const uint8_t *p = (const uint8_t *)msg + offset;
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void dns_wire_set_u16(char *msg, size_t offset, uint16_t value) {
+  uint8_t *p = (uint8_t *)msg + offset;
+  p[0] = (uint8_t)(value >> 8);
+  p[1] = (uint8_t)value;
+}
+
+void dns_wire_set_u32(char *msg, size_t offset, uint32_t value) {
+  uint8_t *p = (uint8_t *)msg + offset;
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+uint16_t dns_wire_qdcount(const char *msg) {
+  return dns_wire_u16(msg, 4);
+}
+
+uint16_t dns_wire_ancount(const char *msg) {
+  return dns_wire_u16(msg, 6);
+}
+
+uint16_t dns_wire_nscount(const char *msg) {
+  return dns_wire_u16(msg, 8);
+}
+
+uint16_t dns_wire_arcount(const char *msg) {
+  return dns_wire_u16(msg, 10);
+}
+
+int dns_wire_skip_name(const char *msg, size_t len, size_t *pos) {
+  size_t p = *pos;
+  while (p < len) {
+    const uint8_t label = (uint8_t)msg[p];
+    if (label == 0) {
+      *pos = p + 1;
+      return 0;
+    }
+    if ((label & 0xc0) == 0xc0) {  // pointer ends the name
+      if (p + 2 > len) {
+        return -1;
+      }
+      *pos = p + 2;
+      return 0;
+    }
+    if (label & 0xc0) {
+      return -1;  // extended label types are not used
+    }
+    p += 1 + label;
+  }
+  return -1;
+}
+
+int dns_wire_question(const char *msg, size_t len, struct dns_wire_question *q) {
+  if (len < DNS_WIRE_HEADER_LENGTH || dns_wire_qdcount(msg) != 1) {
+    return -1;
+  }
+  size_t p = DNS_WIRE_HEADER_LENGTH;
+  while (p < len && msg[p] != 0) {
+    const uint8_t label = (uint8_t)msg[p];
+    if (label & 0xc0) {
+      return -1;
+    }
+    p += 1 + label;
+  }
+  if (p >= len) {
+    return -1;
+  }
+  p++;  // root label
+  q->qname_offset = DNS_WIRE_HEADER_LENGTH;
+  q->qname_length = p - DNS_WIRE_HEADER_LENGTH;
+  if (q->qname_length > DNS_WIRE_MAX_NAME_LENGTH || p + 4 > len) {
+    return -1;
+  }
+  q->qtype = dns_wire_u16(msg, p);
+  q->qclass = dns_wire_u16(msg, p + 2);
+  q->end = p + 4;
+  return 0;
+}
+
+int dns_wire_next_rr(const char *msg, size_t len, size_t *pos, struct dns_wire_rr *rr) {
+  size_t p = *pos;
+  rr->offset = p;
+  if (dns_wire_skip_name(msg, len, &p) != 0 || p + DNS_WIRE_RR_FIXED_LENGTH > len) {
+    return -1;
+  }
+  rr->type = dns_wire_u16(msg, p);
+  rr->rclass = dns_wire_u16(msg, p + 2);
+  rr->ttl_offset = p + 4;
+  rr->ttl = dns_wire_u32(msg, p + 4);
+  rr->rdlength = dns_wire_u16(msg, p + 8);
+  rr->rdata_offset = p + DNS_WIRE_RR_FIXED_LENGTH;
+  if (rr->rdata_offset + rr->rdlength > len) {
+    return -1;
+  }
+  *pos = rr->rdata_offset + rr->rdlength;
+  return 0;
+}
+
+int dns_wire_find_opt(const char *msg, size_t len, const struct dns_wire_question *q,
+                      struct dns_wire_rr *opt) {
+  size_t p = q->end;
+  const uint32_t before = (uint32_t)dns_wire_ancount(msg) + dns_wire_nscount(msg);
+  const uint32_t total = before + dns_wire_arcount(msg);
+  for (uint32_t i = 0; i < total; i++) {
+    if (dns_wire_next_rr(msg, len, &p, opt) != 0) {
+      return -1;
+    }
+    if (i >= before && opt->type == DNS_WIRE_TYPE_OPT) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int dns_wire_find_option(const char *msg, const struct dns_wire_rr *opt, uint16_t code,
+                         size_t *offset, uint16_t *length) {
+  size_t p = opt->rdata_offset;
+  const size_t end = opt->rdata_offset + opt->rdlength;
+  while (p + DNS_WIRE_OPTION_HEADER_LENGTH <= end) {
+    const uint16_t option_length = dns_wire_u16(msg, p + 2);
+    if (p + DNS_WIRE_OPTION_HEADER_LENGTH + option_length > end) {
+      return -1;
+    }
+    if (dns_wire_u16(msg, p) == code) {
+      *offset = p;
+      *length = option_length;
+      return 0;
+    }
+    p += DNS_WIRE_OPTION_HEADER_LENGTH + option_length;
+  }
+  return -1;
+}
+
+int dns_wire_message_end(const char *msg, size_t len, const struct dns_wire_question *q,
+                         size_t *end) {
+  size_t p = q->end;
+  const uint32_t total = (uint32_t)dns_wire_ancount(msg) + dns_wire_nscount(msg) +
+                         dns_wire_arcount(msg);
+  for (uint32_t i = 0; i < total; i++) {
+    struct dns_wire_rr rr;
+    if (dns_wire_next_rr(msg, len, &p, &rr) != 0) {
+      return -1;
+    }
+  }
+  *end = p;
+  return 0;
+}
+
+int dns_wire_name_equal(const char *a, const char *b, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+size_t dns_wire_start_response(char *buf, const char *req, const struct dns_wire_question *q,
+                               uint8_t rcode) {
+  memcpy(buf, req, 2);  // ID
+  buf[2] = (char)(HEADER_FLAG_QR | DNS_WIRE_RD(req));
+  buf[3] = (char)(HEADER_FLAG_RA | DNS_WIRE_CD(req) | rcode);
+  dns_wire_set_u16(buf, 4, 1);  // qdcount
+  dns_wire_set_u16(buf, 6, 0);
+  dns_wire_set_u16(buf, 8, 0);
+  dns_wire_set_u16(buf, 10, 0);
+  memcpy(buf + DNS_WIRE_HEADER_LENGTH, req + DNS_WIRE_HEADER_LENGTH,
+         q->end - DNS_WIRE_HEADER_LENGTH);
+  return q->end;
+}
+
+size_t dns_wire_add_opt(char *buf, size_t len) {
+  char *p = buf + len;
+  p[0] = 0;  // root owner
+  dns_wire_set_u16(p, 1, DNS_WIRE_TYPE_OPT);
+  dns_wire_set_u16(p, 3, DNS_WIRE_EDNS_UDP_SIZE);
+  dns_wire_set_u32(p, 5, 0);  // extended rcode, version, flags
+  dns_wire_set_u16(p, 9, 0);  // no options
+  dns_wire_set_u16(buf, 10, (uint16_t)(dns_wire_arcount(buf) + 1));
+  return len + DNS_WIRE_OPT_LENGTH;
+}
+
+size_t dns_wire_add_opt_option(char *buf, size_t len, uint16_t code,
+                               const char *data, uint16_t data_len) {
+  const size_t opt_offset = len;
+  len = dns_wire_add_opt(buf, len);
+  char *p = buf + len;
+  dns_wire_set_u16(p, 0, code);
+  dns_wire_set_u16(p, 2, data_len);
+  memcpy(p + DNS_WIRE_OPTION_HEADER_LENGTH, data, data_len);
+  dns_wire_set_u16(buf, opt_offset + 9, (uint16_t)(DNS_WIRE_OPTION_HEADER_LENGTH + data_len));
+  return len + DNS_WIRE_OPTION_HEADER_LENGTH + data_len;
+}
+
+size_t dns_wire_add_soa(char *buf, size_t len, size_t zone_offset, uint32_t ttl) {
+  static const char rname[] = "\x06nobody\x07invalid";  // with the root label
+  char *p = buf + len;
+  const uint16_t zone_pointer = (uint16_t)(0xc000 | zone_offset);
+  dns_wire_set_u16(p, 0, zone_pointer);
+  dns_wire_set_u16(p, 2, DNS_WIRE_TYPE_SOA);
+  dns_wire_set_u16(p, 4, DNS_WIRE_CLASS_IN);
+  dns_wire_set_u32(p, 6, ttl);
+  dns_wire_set_u16(p, 10, DNS_WIRE_SOA_LENGTH - 2 - DNS_WIRE_RR_FIXED_LENGTH);
+  p += 2 + DNS_WIRE_RR_FIXED_LENGTH;
+  dns_wire_set_u16(p, 0, zone_pointer);  // primary name server
+  memcpy(p + 2, rname, sizeof(rname));
+  p += 2 + sizeof(rname);
+  dns_wire_set_u32(p, 0, 1);  // serial
+  dns_wire_set_u32(p, 4, 3600);  // refresh
+  dns_wire_set_u32(p, 8, 1200);  // retry
+  dns_wire_set_u32(p, 12, 604800);  // expire
+  dns_wire_set_u32(p, 16, ttl);  // minimum
+  dns_wire_set_u16(buf, 8, (uint16_t)(dns_wire_nscount(buf) + 1));
+  return len + DNS_WIRE_SOA_LENGTH;
+}
+
+int dns_wire_encode_name(char *buf, size_t size, const char *name) {
+  const size_t name_length = strlen(name);
+  size_t pos = 0;
+  size_t label_start = 0;
+  for (size_t i = 0; i <= name_length; i++) {
+    if (i < name_length && name[i] != '.') {
+      continue;
+    }
+    const size_t label_length = i - label_start;
+    if (label_length == 0) {
+      if (i == name_length && (i == 0 || name[i - 1] == '.')) {
+        break;  // trailing dot or root
+      }
+      return -1;
+    }
+    if (label_length > MAX_LABEL_LENGTH || pos + 1 + label_length + 1 > DNS_WIRE_MAX_NAME_LENGTH ||
+        pos + 1 + label_length + 1 > size) {
+      return -1;
+    }
+    buf[pos++] = (char)label_length;
+    memcpy(buf + pos, name + label_start, label_length);
+    pos += label_length;
+    label_start = i + 1;
+  }
+  if (pos + 1 > size) {
+    return -1;
+  }
+  buf[pos++] = 0;  // root label
+  return (int)pos;
+}
+
+int dns_wire_build_query(char *buf, size_t size, uint16_t id,
+                         const char *name, uint16_t qtype) {
+  // header, labels, question type and class, root owner of OPT, its fixed part
+  if (size < DNS_WIRE_HEADER_LENGTH + DNS_WIRE_MAX_NAME_LENGTH + 4 + 1 + DNS_WIRE_RR_FIXED_LENGTH) {
+    return -1;
+  }
+  memset(buf, 0, DNS_WIRE_HEADER_LENGTH);
+  dns_wire_set_u16(buf, 0, id);
+  dns_wire_set_u16(buf, 2, HEADER_FLAG_RD);
+  dns_wire_set_u16(buf, 4, 1);  // qdcount
+  dns_wire_set_u16(buf, 10, 1);  // arcount
+
+  const int name_length = dns_wire_encode_name(buf + DNS_WIRE_HEADER_LENGTH,
+                                               DNS_WIRE_MAX_NAME_LENGTH, name);
+  if (name_length < 0) {
+    return -1;
+  }
+  size_t pos = DNS_WIRE_HEADER_LENGTH + (size_t)name_length;
+  dns_wire_set_u16(buf, pos, qtype);
+  dns_wire_set_u16(buf, pos + 2, DNS_WIRE_CLASS_IN);
+  pos += 4;
+
+  buf[pos++] = 0;  // OPT owner: root
+  dns_wire_set_u16(buf, pos, DNS_WIRE_TYPE_OPT);
+  dns_wire_set_u16(buf, pos + 2, DNS_WIRE_EDNS_UDP_SIZE);
+  dns_wire_set_u32(buf, pos + 4, 0);  // extended rcode, version, flags
+  dns_wire_set_u16(buf, pos + 8, 0);  // no options
+  pos += DNS_WIRE_RR_FIXED_LENGTH;
+  return (int)pos;
+}
+
+static const struct {
+  const char *name;
+  uint16_t value;
+} record_types[] = {
+  {"A", DNS_WIRE_TYPE_A}, {"NS", 2}, {"CNAME", DNS_WIRE_TYPE_CNAME},
+  {"SOA", DNS_WIRE_TYPE_SOA}, {"PTR", DNS_WIRE_TYPE_PTR}, {"HINFO", DNS_WIRE_TYPE_HINFO},
+  {"MX", 15}, {"TXT", 16}, {"AAAA", DNS_WIRE_TYPE_AAAA}, {"SRV", 33}, {"NAPTR", 35},
+  {"DS", 43}, {"DNSKEY", 48}, {"SVCB", 64}, {"HTTPS", 65}, {"ANY", DNS_WIRE_TYPE_ANY},
+  {"CAA", 257},
+};
+
+uint16_t dns_wire_parse_type(const char *str) {
+  for (size_t i = 0; i < sizeof(record_types) / sizeof(record_types[0]); i++) {
+    if (strcasecmp(str, record_types[i].name) == 0) {
+      return record_types[i].value;
+    }
+  }
+  if (strncasecmp(str, "TYPE", 4) == 0) {
+    str += 4;
+  }
+  char *end = NULL;
+  unsigned long value = strtoul(str, &end, 10);
+  if (!isdigit((unsigned char)*str) || *end != '\0' || value > UINT16_MAX) {
+    return 0;
+  }
+  return (uint16_t)value;
+}
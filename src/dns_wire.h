@@ -0,0 +1,139 @@
+#ifndef _DNS_WIRE_H_
+#define _DNS_WIRE_H_
+
+// Minimal DNS wire format (RFC 1035 4.1) reader for the request path: no
+// allocations, every offset is bounds checked. Functions return 0 on success
+// and -1 if the message is malformed. Queries of our own can be built too.
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  DNS_WIRE_HEADER_LENGTH = 12,
+  DNS_WIRE_MAX_NAME_LENGTH = 255,
+  DNS_WIRE_TYPE_A = 1,
+  DNS_WIRE_TYPE_CNAME = 5,
+  DNS_WIRE_TYPE_SOA = 6,
+  DNS_WIRE_TYPE_PTR = 12,
+  DNS_WIRE_TYPE_HINFO = 13,
+  DNS_WIRE_TYPE_AAAA = 28,
+  DNS_WIRE_TYPE_OPT = 41,
+  DNS_WIRE_TYPE_ANY = 255,
+  DNS_WIRE_CLASS_IN = 1,
+  DNS_WIRE_EDNS_UDP_SIZE = 1232,  // DNS flag day 2020
+  DNS_WIRE_OPTION_ECS = 8,  // EDNS Client Subnet, RFC 7871
+  DNS_WIRE_OPTION_EDE = 15,  // Extended DNS Errors, RFC 8914
+  DNS_WIRE_OPTION_HEADER_LENGTH = 4,  // code, length
+  DNS_WIRE_RR_FIXED_LENGTH = 10,  // type, class, TTL, rdlength
+  DNS_WIRE_OPT_LENGTH = 1 + DNS_WIRE_RR_FIXED_LENGTH,  // without options
+  // of dns_wire_add_soa(): compressed owner and MNAME, nobody.invalid. and
+  // five 32 bit fields
+  DNS_WIRE_SOA_LENGTH = 2 + DNS_WIRE_RR_FIXED_LENGTH + 2 + 16 + 5 * 4,
+  DNS_WIRE_RCODE_NOERROR = 0,
+  DNS_WIRE_RCODE_SERVFAIL = 2,
+  DNS_WIRE_RCODE_NXDOMAIN = 3,
+  DNS_WIRE_RCODE_REFUSED = 5,
+};
+
+// Header fields
+#define DNS_WIRE_QR(msg) (((const uint8_t *)(msg))[2] & 0x80)
+#define DNS_WIRE_OPCODE(msg) ((((const uint8_t *)(msg))[2] >> 3) & 0x0f)
+#define DNS_WIRE_TC(msg) (((const uint8_t *)(msg))[2] & 0x02)
+#define DNS_WIRE_RD(msg) (((const uint8_t *)(msg))[2] & 0x01)
+#define DNS_WIRE_CD(msg) (((const uint8_t *)(msg))[3] & 0x10)
+#define DNS_WIRE_RCODE(msg) (((const uint8_t *)(msg))[3] & 0x0f)
+
+struct dns_wire_question {
+  size_t qname_offset;  // always DNS_WIRE_HEADER_LENGTH
+  size_t qname_length;  // uncompressed, including the root label
+  uint16_t qtype;
+  uint16_t qclass;
+  size_t end;  // offset of the first resource record
+};
+
+struct dns_wire_rr {
+  size_t offset;  // owner name
+  uint16_t type;
+  uint16_t rclass;
+  uint32_t ttl;
+  size_t ttl_offset;
+  uint16_t rdlength;
+  size_t rdata_offset;
+};
+
+uint16_t dns_wire_u16(const char *msg, size_t offset);
+uint32_t dns_wire_u32(const char *msg, size_t offset);
+void dns_wire_set_u16(char *msg, size_t offset, uint16_t value);
+void dns_wire_set_u32(char *msg, size_t offset, uint32_t value);
+
+// Record counts of the header.
+uint16_t dns_wire_qdcount(const char *msg);
+uint16_t dns_wire_ancount(const char *msg);
+uint16_t dns_wire_nscount(const char *msg);
+uint16_t dns_wire_arcount(const char *msg);
+
+// Skips a possibly compressed name starting at '*pos'.
+int dns_wire_skip_name(const char *msg, size_t len, size_t *pos);
+
+// Parses the only question of a message. Compressed question names are
+// rejected, as the name is compared and copied as is.
+int dns_wire_question(const char *msg, size_t len, struct dns_wire_question *q);
+
+// Parses the resource record at '*pos' and moves '*pos' after it.
+int dns_wire_next_rr(const char *msg, size_t len, size_t *pos, struct dns_wire_rr *rr);
+
+// Finds the EDNS OPT record in the additional section, returns -1 if there
+// is none.
+int dns_wire_find_opt(const char *msg, size_t len, const struct dns_wire_question *q,
+                      struct dns_wire_rr *opt);
+
+// Finds the EDNS option 'code' in the rdata of 'opt'. '*offset' is set to
+// its header, '*length' to the length of its data. Returns -1 if missing.
+int dns_wire_find_option(const char *msg, const struct dns_wire_rr *opt, uint16_t code,
+                         size_t *offset, uint16_t *length);
+
+// Offset after the last resource record, -1 if the message is malformed.
+int dns_wire_message_end(const char *msg, size_t len, const struct dns_wire_question *q,
+                         size_t *end);
+
+// Compares names of equal length case-insensitively.
+int dns_wire_name_equal(const char *a, const char *b, size_t len);
+
+// Writes the header and question of a response to 'req' into 'buf', which
+// must hold 'q->end' bytes. Returns the length; records are added by the
+// caller, updating the counts.
+size_t dns_wire_start_response(char *buf, const char *req, const struct dns_wire_question *q,
+                               uint8_t rcode);
+
+// Appends an OPT record without options to the message of 'len' bytes in
+// 'buf', which must have DNS_WIRE_OPT_LENGTH bytes of room. Returns the new
+// length.
+size_t dns_wire_add_opt(char *buf, size_t len);
+
+// Like dns_wire_add_opt(), with one option. 'buf' must have room for
+// DNS_WIRE_OPTION_HEADER_LENGTH + 'data_len' more bytes.
+size_t dns_wire_add_opt_option(char *buf, size_t len, uint16_t code,
+                               const char *data, uint16_t data_len);
+
+// Appends to the authority section the SOA that RFC 6303 gives locally
+// served zones, so a negative answer is cached by clients (RFC 2308). The
+// zone is the name at 'zone_offset' of 'buf', below 0x4000. 'ttl' is both
+// the record TTL and MINIMUM, the negative caching TTL. 'buf' must have
+// DNS_WIRE_SOA_LENGTH bytes of room. Returns the new length.
+size_t dns_wire_add_soa(char *buf, size_t len, size_t zone_offset, uint32_t ttl);
+
+// Encodes the dotted 'name' as uncompressed labels into 'buf'. Returns the
+// length including the root label, or -1 if 'name' is invalid or does not fit.
+int dns_wire_encode_name(char *buf, size_t size, const char *name);
+
+// Writes a recursive IN class query for the dotted 'name' with an EDNS OPT
+// record into 'buf'. Returns its length, or -1 if 'name' is invalid or does
+// not fit.
+int dns_wire_build_query(char *buf, size_t size, uint16_t id,
+                         const char *name, uint16_t qtype);
+
+// Parses a record type given as mnemonic like AAAA (case-insensitive), as
+// RFC 3597 TYPEnnn or as plain number. Returns 0 if unknown.
+uint16_t dns_wire_parse_type(const char *str);
+
+#endif // _DNS_WIRE_H_
@@ -0,0 +1,132 @@
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns_wire.h"
+#include "ecs.h"
+#include "logging.h"
+
+enum {
+  ECS_FAMILY_IPV4 = 1,
+  ECS_FAMILY_IPV6 = 2,
+  ECS_FIXED_LENGTH = 4,  // family, source prefix, scope prefix
+  ECS_MAX_OPTION_LENGTH = DNS_WIRE_OPTION_HEADER_LENGTH + ECS_FIXED_LENGTH + 16,
+};
+
+// Writes the option into 'buf', returns its length or 0 for non IP clients.
+static size_t build_option(char *buf, const struct sockaddr *addr,
+                           uint8_t ipv4_prefix, uint8_t ipv6_prefix) {
+  uint16_t family = ECS_FAMILY_IPV4;
+  uint8_t prefix = 0;
+  const uint8_t *address = NULL;
+  if (addr == NULL) {
+    // /0: no address bytes
+  } else if (addr->sa_family == AF_INET) {
+    prefix = ipv4_prefix;
+    address = (const uint8_t *)&((const struct sockaddr_in *)(const void *)addr)->sin_addr;
+  } else if (addr->sa_family == AF_INET6) {
+    const struct in6_addr *a6 = &((const struct sockaddr_in6 *)(const void *)addr)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(a6)) {
+      prefix = ipv4_prefix;
+      address = a6->s6_addr + 12;
+    } else {
+      family = ECS_FAMILY_IPV6;
+      prefix = ipv6_prefix;
+      address = a6->s6_addr;
+    }
+  } else {
+    return 0;
+  }
+  const size_t address_length = (prefix + 7U) / 8U;
+  const size_t data_length = ECS_FIXED_LENGTH + address_length;
+  dns_wire_set_u16(buf, 0, DNS_WIRE_OPTION_ECS);
+  dns_wire_set_u16(buf, 2, (uint16_t)data_length);
+  dns_wire_set_u16(buf, 4, family);
+  buf[6] = (char)prefix;
+  buf[7] = 0;  // scope prefix
+  if (address_length > 0) {
+    memcpy(buf + 8, address, address_length);
+    if (prefix % 8 != 0) {
+      buf[8 + address_length - 1] &= (char)(0xff << (8 - prefix % 8));
+    }
+  }
+  return DNS_WIRE_OPTION_HEADER_LENGTH + data_length;
+}
+
+char * ecs_add_client_subnet(const char *req, size_t req_len, const struct sockaddr *addr,
+                             uint8_t ipv4_prefix, uint8_t ipv6_prefix,
+                             size_t *new_len, uint8_t *added) {
+  *added = ECS_NOT_ADDED;
+  char option[ECS_MAX_OPTION_LENGTH];
+  const size_t option_length = build_option(option, addr, ipv4_prefix, ipv6_prefix);
+  struct dns_wire_question q;
+  size_t end = 0;
+  if (option_length == 0 || dns_wire_question(req, req_len, &q) != 0 ||
+      dns_wire_message_end(req, req_len, &q, &end) != 0 || end != req_len) {
+    return NULL;
+  }
+
+  struct dns_wire_rr opt;
+  if (dns_wire_find_opt(req, req_len, &q, &opt) == 0) {
+    size_t offset = 0;
+    uint16_t length = 0;
+    if (dns_wire_find_option(req, &opt, DNS_WIRE_OPTION_ECS, &offset, &length) == 0 ||
+        opt.rdata_offset + opt.rdlength != req_len) {
+      return NULL;  // client subnet of the client, or OPT is not last
+    }
+    char *new_req = (char *)malloc(req_len + option_length);
+    if (new_req == NULL) {
+      FLOG("Out of mem");
+    }
+    memcpy(new_req, req, req_len);
+    memcpy(new_req + req_len, option, option_length);
+    dns_wire_set_u16(new_req, opt.rdata_offset - 2, (uint16_t)(opt.rdlength + option_length));
+    *new_len = req_len + option_length;
+    *added = ECS_ADDED_OPTION;
+    return new_req;
+  }
+
+  const size_t opt_length = 1 + DNS_WIRE_RR_FIXED_LENGTH + option_length;
+  char *new_req = (char *)malloc(req_len + opt_length);
+  if (new_req == NULL) {
+    FLOG("Out of mem");
+  }
+  memcpy(new_req, req, req_len);
+  char *p = new_req + req_len;
+  p[0] = 0;  // root owner
+  dns_wire_set_u16(p, 1, DNS_WIRE_TYPE_OPT);
+  dns_wire_set_u16(p, 3, DNS_WIRE_EDNS_UDP_SIZE);
+  dns_wire_set_u32(p, 5, 0);  // extended rcode, version, flags
+  dns_wire_set_u16(p, 9, (uint16_t)option_length);
+  memcpy(p + 1 + DNS_WIRE_RR_FIXED_LENGTH, option, option_length);
+  dns_wire_set_u16(new_req, 10, (uint16_t)(dns_wire_arcount(req) + 1));
+  *new_len = req_len + opt_length;
+  *added = ECS_ADDED_OPT;
+  return new_req;
+}
+
+static void cut(char *msg, size_t *len, size_t offset, size_t length) {
+  memmove(msg + offset, msg + offset + length, *len - offset - length);
+  *len -= length;
+}
+
+void ecs_strip_response(char *resp, size_t *resp_len, uint8_t added) {
+  struct dns_wire_question q;
+  struct dns_wire_rr opt;
+  if (added == ECS_NOT_ADDED || dns_wire_question(resp, *resp_len, &q) != 0 ||
+      dns_wire_find_opt(resp, *resp_len, &q, &opt) != 0) {
+    return;
+  }
+  if (added == ECS_ADDED_OPT) {
+    cut(resp, resp_len, opt.offset, opt.rdata_offset + opt.rdlength - opt.offset);
+    dns_wire_set_u16(resp, 10, (uint16_t)(dns_wire_arcount(resp) - 1));
+    return;
+  }
+  size_t offset = 0;
+  uint16_t length = 0;
+  if (dns_wire_find_option(resp, &opt, DNS_WIRE_OPTION_ECS, &offset, &length) == 0) {
+    const size_t option_length = DNS_WIRE_OPTION_HEADER_LENGTH + (size_t)length;
+    cut(resp, resp_len, offset, option_length);
+    dns_wire_set_u16(resp, opt.rdata_offset - 2, (uint16_t)(opt.rdlength - option_length));
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef _ECS_H_
+#define _ECS_H_
+
+// EDNS Client Subnet (RFC 7871) for requests forwarded upstream.
+//
+// The client address truncated to a prefix is added to requests which do
+// not carry a client subnet already, adding an OPT record if needed. What
+// was added is taken out of the response again, as clients must not see
+// options they did not send.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+enum ecs_added {
+  ECS_NOT_ADDED = 0,
+  ECS_ADDED_OPTION,  // to the OPT record of the client
+  ECS_ADDED_OPT,  // with a new OPT record
+};
+
+// Returns a new request (to be freed by the caller) with the client subnet
+// of 'addr', or NULL if not added: the client sent one, its address is not
+// IP or the request is malformed. Without 'addr', a /0 subnet asks the
+// upstream for an answer valid for all clients.
+char * ecs_add_client_subnet(const char *req, size_t req_len, const struct sockaddr *addr,
+                             uint8_t ipv4_prefix, uint8_t ipv6_prefix,
+                             size_t *new_len, uint8_t *added);
+
+// Removes what ecs_add_client_subnet() added from the response.
+void ecs_strip_response(char *resp, size_t *resp_len, uint8_t added);
+
+#endif // _ECS_H_
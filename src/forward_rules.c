@@ -0,0 +1,132 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns_wire.h"
+#include "forward_rules.h"
+#include "logging.h"
+
+enum {
+  MAX_LABELS = DNS_WIRE_MAX_NAME_LENGTH / 2,
+  MAX_LABEL_LENGTH = 63,
+  NO_NODE = 0,  // the root is nobody's child or sibling
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct forward_node {
+  uint32_t first_child;
+  uint32_t next_sibling;
+  uint8_t has_rule;
+  uint8_t upstream;
+  uint8_t label_length;
+  char label[MAX_LABEL_LENGTH];  // lowercase
+};
+
+struct forward_rules_s {
+  struct forward_node *nodes;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+// Offsets of the labels of a wire format name, returns their number.
+static int label_offsets(const char *name, size_t length, size_t *offsets) {
+  int count = 0;
+  for (size_t pos = 0; pos < length && name[pos] != 0 && count < MAX_LABELS;
+       pos += 1 + (uint8_t)name[pos]) {
+    offsets[count++] = pos;
+  }
+  return count;
+}
+
+static int label_equal(const struct forward_node *n, const char *label) {
+  if (n->label_length != (uint8_t)label[0]) {
+    return 0;
+  }
+  for (uint8_t i = 0; i < n->label_length; i++) {
+    if (n->label[i] != (char)tolower((unsigned char)label[1 + i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static uint32_t find_child(const forward_rules_t *r, uint32_t parent, const char *label) {
+  for (uint32_t child = r->nodes[parent].first_child; child != NO_NODE;
+       child = r->nodes[child].next_sibling) {
+    if (label_equal(&r->nodes[child], label)) {
+      return child;
+    }
+  }
+  return NO_NODE;
+}
+
+static uint32_t add_node(forward_rules_t *r) {
+  if (r->count == r->capacity) {
+    r->capacity = r->capacity ? r->capacity * 2 : 16;
+    r->nodes = (struct forward_node *)realloc(r->nodes,
+                                              r->capacity * sizeof(struct forward_node));
+    if (r->nodes == NULL) {
+      FLOG("Out of mem");
+    }
+  }
+  memset(&r->nodes[r->count], 0, sizeof(struct forward_node));
+  return r->count++;
+}
+
+forward_rules_t * forward_rules_create(void) {
+  forward_rules_t *r = (forward_rules_t *)calloc(1, sizeof(forward_rules_t));
+  if (r == NULL) {
+    FLOG("Out of mem");
+  }
+  (void)add_node(r);  // root
+  return r;
+}
+
+int forward_rules_add(forward_rules_t *r, const char *domain, uint8_t upstream) {
+  char name[DNS_WIRE_MAX_NAME_LENGTH];
+  const int length = dns_wire_encode_name(name, sizeof(name), domain);
+  if (length <= 1) {  // invalid or root
+    return -1;
+  }
+  size_t offsets[MAX_LABELS];
+  uint32_t node = 0;
+  for (int i = label_offsets(name, (size_t)length, offsets) - 1; i >= 0; i--) {
+    const char *label = name + offsets[i];
+    uint32_t child = find_child(r, node, label);
+    if (child == NO_NODE) {
+      child = add_node(r);  // may move the nodes
+      struct forward_node *n = &r->nodes[child];
+      n->label_length = (uint8_t)label[0];
+      for (uint8_t j = 0; j < n->label_length; j++) {
+        n->label[j] = (char)tolower((unsigned char)label[1 + j]);
+      }
+      n->next_sibling = r->nodes[node].first_child;
+      r->nodes[node].first_child = child;
+    }
+    node = child;
+  }
+  r->nodes[node].has_rule = 1;
+  r->nodes[node].upstream = upstream;
+  return 0;
+}
+
+uint8_t forward_rules_match(const forward_rules_t *r, const char *name, size_t length) {
+  size_t offsets[MAX_LABELS];
+  uint8_t upstream = 0;
+  uint32_t node = 0;
+  for (int i = label_offsets(name, length, offsets) - 1; i >= 0; i--) {
+    node = find_child(r, node, name + offsets[i]);
+    if (node == NO_NODE) {
+      break;
+    }
+    if (r->nodes[node].has_rule) {
+      upstream = r->nodes[node].upstream;
+    }
+  }
+  return upstream;
+}
+
+void forward_rules_free(forward_rules_t *r) {
+  free(r->nodes);
+  free(r);
+}
@@ -0,0 +1,27 @@
+#ifndef _FORWARD_RULES_H_
+#define _FORWARD_RULES_H_
+
+// Forwarding rules: domain suffixes mapped to upstreams, or to other small
+// numbers like the TTL limits of domains.
+//
+// The rules are kept in a trie of labels, walked from the root label of the
+// question name, so the most specific rule wins. Names without a rule go to
+// the default upstream 0.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct forward_rules_s forward_rules_t;
+
+forward_rules_t * forward_rules_create(void);
+
+// Forwards 'domain' and its subdomains to 'upstream'. Returns -1 if the
+// domain is invalid.
+int forward_rules_add(forward_rules_t *r, const char *domain, uint8_t upstream);
+
+// Returns the upstream of a wire format name.
+uint8_t forward_rules_match(const forward_rules_t *r, const char *name, size_t length);
+
+void forward_rules_free(forward_rules_t *r);
+
+#endif // _FORWARD_RULES_H_
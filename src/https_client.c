@@ -1,11 +1,14 @@
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <ev.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -283,8 +286,8 @@ static void https_fetch_ctx_init(https_client_t *client,
   ctx->cb_data = cb_data;
   ctx->buf = NULL;
   ctx->buflen = 0;
-  ctx->next = client->fetches;
-  client->fetches = ctx;
+  ctx->next = client->queued;
+  client->queued = ctx;
 
   ASSERT_CURL_EASY_SETOPT(ctx, CURLOPT_RESOLVE, resolv);
 
@@ -325,42 +328,43 @@ static void https_fetch_ctx_init(https_client_t *client,
   if (client->opt->ca_info) {
     ASSERT_CURL_EASY_SETOPT(ctx, CURLOPT_CAINFO, client->opt->ca_info);
   }
-  CURLMcode multi_code = curl_multi_add_handle(client->curlm, ctx->curl);
-  if (multi_code != CURLM_OK) {
-    ELOG_REQ("curl_multi_add_handle error %d: %s", multi_code, curl_multi_strerror(multi_code));
-    if (multi_code == CURLM_ABORTED_BY_CALLBACK) {
-      WLOG_REQ("Resetting HTTPS client to recover from faulty state!");
-      https_client_reset(client);
-    } else {
-      https_fetch_ctx_cleanup(client, NULL, client->fetches, -1);  // dropping current failed request
-    }
-  }
+  ev_prepare_start(client->loop, &client->submit);
 }
 
-static int https_fetch_ctx_process_response(https_client_t *client,
+static uint8_t https_fetch_ctx_process_response(https_client_t *client,
                                             struct https_fetch_ctx *ctx,
                                             CURLcode curl_result_code)
 {
   CURLcode res = 0;
   long long_resp = 0;
   char *str_resp = NULL;
-  int faulty_response = 1;
+  uint8_t failure = HTTPS_FAILURE_CONNECT;
 
   switch (curl_result_code) {
     case CURLE_OK:
       DLOG_REQ("curl request succeeded");
-      faulty_response = 0;
+      failure = HTTPS_OK;
       break;
     case CURLE_WRITE_ERROR:
       WLOG_REQ("curl request failed with write error (probably response content was too large)");
+      failure = HTTPS_FAILURE_RESPONSE;
       break;
     case CURLE_OPERATION_TIMEDOUT:
       if (!ev_is_active(&client->reset_timer)) {
         ILOG_REQ("Client reset timer started");
         ev_timer_start(client->loop, &client->reset_timer);
       }
+      failure = HTTPS_FAILURE_TIMEOUT;
       __attribute__((fallthrough));
     default:
+      if (curl_result_code == CURLE_SSL_CONNECT_ERROR ||
+          curl_result_code == CURLE_PEER_FAILED_VERIFICATION ||
+          curl_result_code == CURLE_SSL_CERTPROBLEM ||
+          curl_result_code == CURLE_SSL_CIPHER ||
+          curl_result_code == CURLE_SSL_CACERT_BADFILE ||
+          curl_result_code == CURLE_SSL_PINNEDPUBKEYNOTMATCH) {
+        failure = HTTPS_FAILURE_TLS;
+      }
       WLOG_REQ("curl request failed with %d: %s", curl_result_code, curl_easy_strerror(curl_result_code));
       if (ctx->curl_errbuf[0] != 0) {
         WLOG_REQ("curl error message: %s", ctx->curl_errbuf);
@@ -370,9 +374,9 @@ static int https_fetch_ctx_process_response(https_client_t *client,
   res = curl_easy_getinfo(ctx->curl, CURLINFO_RESPONSE_CODE, &long_resp);
   if (res != CURLE_OK) {
     ELOG_REQ("CURLINFO_RESPONSE_CODE: %s", curl_easy_strerror(res));
-    faulty_response = 1;
+    failure = failure != HTTPS_OK ? failure : HTTPS_FAILURE_RESPONSE;
   } else if (long_resp != 200) {
-    faulty_response = 1;
+    failure = failure != HTTPS_OK ? failure : HTTPS_FAILURE_CONNECT;
     if (long_resp == 0) {
       curl_off_t uploaded_bytes = 0;
       if (curl_easy_getinfo(ctx->curl, CURLINFO_SIZE_UPLOAD_T, &uploaded_bytes) == CURLE_OK &&
@@ -393,6 +397,7 @@ static int https_fetch_ctx_process_response(https_client_t *client,
         WLOG_REQ("No response (probably connection has been closed or timed out)");
       }
     } else {
+      failure = HTTPS_FAILURE_HTTP_STATUS;
       WLOG_REQ("curl response code: %d, content length: %zu", long_resp, ctx->buflen);
       if (ctx->buflen > 0) {
         https_log_data(LOG_WARNING, ctx, "", ctx->buf, ctx->buflen);
@@ -400,7 +405,7 @@ static int https_fetch_ctx_process_response(https_client_t *client,
     }
   }
 
-  if (!faulty_response)
+  if (failure == HTTPS_OK)
   {
     res = curl_easy_getinfo(ctx->curl, CURLINFO_CONTENT_TYPE, &str_resp);
     if (res != CURLE_OK) {
@@ -408,17 +413,19 @@ static int https_fetch_ctx_process_response(https_client_t *client,
     } else if (str_resp == NULL ||
         strncmp(str_resp, DOH_CONTENT_TYPE, sizeof(DOH_CONTENT_TYPE) - 1) != 0) {  // at least, start with it
       WLOG_REQ("Invalid response Content-Type: %s", str_resp ? str_resp : "UNSET");
-      faulty_response = 1;
+      failure = HTTPS_FAILURE_RESPONSE;
     }
   }
 
-  if (logging_debug_enabled() || faulty_response || ctx->buflen == 0) {
+  if (logging_debug_enabled() || failure != HTTPS_OK || ctx->buflen == 0) {
     res = curl_easy_getinfo(ctx->curl, CURLINFO_REDIRECT_URL, &str_resp);
     if (res != CURLE_OK) {
       ELOG_REQ("CURLINFO_REDIRECT_URL: %s", curl_easy_strerror(res));
     } else if (str_resp != NULL) {
       WLOG_REQ("Request would be redirected to: %s", str_resp);
-      if (strcmp(str_resp, client->opt->resolver_url) != 0) {
+      char *effective_url = NULL;  // resolver URL of the request
+      if (curl_easy_getinfo(ctx->curl, CURLINFO_EFFECTIVE_URL, &effective_url) == CURLE_OK &&
+          effective_url != NULL && strcmp(str_resp, effective_url) != 0) {
         WLOG("Please update Resolver URL to avoid redirection!");
       }
     }
@@ -502,7 +509,20 @@ static int https_fetch_ctx_process_response(https_client_t *client,
     }
   }
 
-  return faulty_response;
+  return failure;
+}
+
+const char * https_failure_name(uint8_t failure) {
+  static const char *names[] = {
+    [HTTPS_OK] = "ok",
+    [HTTPS_FAILURE_ABORTED] = "aborted",
+    [HTTPS_FAILURE_TIMEOUT] = "timeout",
+    [HTTPS_FAILURE_CONNECT] = "connection",
+    [HTTPS_FAILURE_TLS] = "TLS",
+    [HTTPS_FAILURE_HTTP_STATUS] = "HTTP status",
+    [HTTPS_FAILURE_RESPONSE] = "invalid response",
+  };
+  return failure < sizeof(names) / sizeof(names[0]) ? names[failure] : "unknown";
 }
 
 static void https_fetch_ctx_cleanup(https_client_t *client,
@@ -513,28 +533,32 @@ static void https_fetch_ctx_cleanup(https_client_t *client,
   if (code != CURLM_OK) {
     FLOG_REQ("curl_multi_remove_handle error %d: %s", code, curl_multi_strerror(code));
   }
-  int drop_reply = 0;
+  uint8_t failure = HTTPS_FAILURE_ABORTED;
   if (curl_result_code < 0) {
     WLOG_REQ("Request was aborted");
-    drop_reply = 1;
-  } else if (https_fetch_ctx_process_response(client, ctx, (CURLcode)curl_result_code) != 0) {
-    ILOG_REQ("Response was faulty, skipping DNS reply");
-    drop_reply = 1;
+  } else {
+    failure = https_fetch_ctx_process_response(client, ctx, (CURLcode)curl_result_code);
+    if (failure != HTTPS_OK) {
+      ILOG_REQ("Response was faulty (%s), answering the failure", https_failure_name(failure));
+    } else if (ctx->buf == NULL) {
+      failure = HTTPS_FAILURE_RESPONSE;  // empty
+    }
   }
-  if (drop_reply) {
+  if (failure != HTTPS_OK) {
     free(ctx->buf);
     ctx->buf = NULL;
     ctx->buflen = 0;
   }
-  // callback must be called to avoid memleak
-  ctx->cb(ctx->cb_data, ctx->buf, ctx->buflen);
-  curl_easy_cleanup(ctx->curl);
-  free(ctx->buf);
-  if (prev) {
+  client->in_flight--;
+  if (prev) {  // before the callback, which may start other fetches
     prev->next = ctx->next;
   } else {
     client->fetches = ctx->next;
   }
+  // callback must be called to avoid memleak
+  ctx->cb(ctx->cb_data, ctx->buf, ctx->buflen, failure);
+  curl_easy_cleanup(ctx->curl);
+  free(ctx->buf);
   free(ctx);
 }
 
@@ -592,6 +616,57 @@ static void timer_cb(struct ev_loop __attribute__((unused)) *loop,
   check_multi_info(c);
 }
 
+// Adds the transfers requested during this loop iteration together and
+// drives curl once, so the frames of the new streams go out in as few TLS
+// records and syscalls as possible.
+static void submit_cb(struct ev_loop __attribute__((unused)) *loop,
+                      ev_prepare *w, int __attribute__((unused)) revents) {
+  GET_PTR(https_client_t, c, w->data);
+  ev_prepare_stop(c->loop, &c->submit);
+  struct https_fetch_ctx *queued = NULL;  // in the order requested
+  while (c->queued) {
+    struct https_fetch_ctx *ctx = c->queued;
+    c->queued = ctx->next;
+    ctx->next = queued;
+    queued = ctx;
+  }
+  int added = 0;
+  while (queued) {
+    struct https_fetch_ctx *ctx = queued;
+    queued = ctx->next;
+    ctx->next = c->fetches;
+    c->fetches = ctx;
+    CURLMcode multi_code = curl_multi_add_handle(c->curlm, ctx->curl);
+    if (multi_code == CURLM_OK) {
+      added++;
+      continue;
+    }
+    ELOG_REQ("curl_multi_add_handle error %d: %s", multi_code, curl_multi_strerror(multi_code));
+    if (multi_code == CURLM_ABORTED_BY_CALLBACK) {
+      WLOG_REQ("Resetting HTTPS client to recover from faulty state!");
+      while (queued) {  // aborted by the reset too
+        ctx = queued;
+        queued = ctx->next;
+        ctx->next = c->queued;
+        c->queued = ctx;
+      }
+      https_client_reset(c);
+      return;
+    }
+    https_fetch_ctx_cleanup(c, NULL, c->fetches, -1);  // dropping current failed request
+  }
+  if (added == 0) {
+    return;
+  }
+  DLOG("Submitting %d requests", added);
+  int ignore = 0;
+  CURLMcode code = curl_multi_socket_action(c->curlm, CURL_SOCKET_TIMEOUT, 0, &ignore);
+  if (code != CURLM_OK) {
+    ELOG("curl_multi_socket_action error %d: %s", code, curl_multi_strerror(code));
+  }
+  check_multi_info(c);
+}
+
 static struct ev_io * get_io_event(struct ev_io io_events[], curl_socket_t sock) {
   for (int i = 0; i < HTTPS_SOCKET_LIMIT; i++) {
     if (io_events[i].fd == sock) {
@@ -687,6 +762,8 @@ void https_client_init(https_client_t *c, options_t *opt,
 
   ev_timer_init(&c->reset_timer, reset_timer_cb, (double)opt->conn_loss_time, 0);
   c->reset_timer.data = c;
+  ev_prepare_init(&c->submit, submit_cb);
+  c->submit.data = c;
 
   struct curl_slist *header_list = curl_slist_append(curl_slist_append(NULL,
     "Accept: " DOH_CONTENT_TYPE),
@@ -703,9 +780,27 @@ void https_client_fetch(https_client_t *c, const char *url,
   if (!ctx) {
     FLOG("Out of mem");
   }
+  c->in_flight++;
   https_fetch_ctx_init(c, ctx, url, postdata, postdata_len, resolv, id, cb, data);
 }
 
+int https_client_rtt(https_client_t *c) {
+#ifdef TCP_INFO
+  for (int i = 0; i < HTTPS_SOCKET_LIMIT; i++) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (c->io_events[i].fd > 0 &&
+        getsockopt(c->io_events[i].fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+        info.tcpi_rtt > 0) {
+      return (int)info.tcpi_rtt;
+    }
+  }
+#else
+  (void)c;
+#endif
+  return -1;
+}
+
 void https_client_reset(https_client_t *c) {
   struct curl_slist *header_list = c->header_list;
   c->header_list = NULL;
@@ -714,10 +809,108 @@ void https_client_reset(https_client_t *c) {
 }
 
 void https_client_cleanup(https_client_t *c) {
-  while (c->fetches) {
+  while (c->fetches || c->queued) {
+    while (c->queued) {  // not added yet, aborted alike
+      struct https_fetch_ctx *ctx = c->queued;
+      c->queued = ctx->next;
+      ctx->next = c->fetches;
+      c->fetches = ctx;
+    }
     https_fetch_ctx_cleanup(c, NULL, c->fetches, -1);
   }
+  ev_prepare_stop(c->loop, &c->submit);
   curl_slist_free_all(c->header_list);
   curl_multi_cleanup(c->curlm);
   ev_timer_stop(c->loop, &c->reset_timer);
 }
+
+void https_client_socket_options(int sock, int family, options_t *opt) {
+#if defined(IP_TOS)
+  if (family == AF_INET) {
+    setsockopt(sock, IPPROTO_IP, IP_TOS, &opt->dscp, sizeof(opt->dscp));
+  }
+#if defined(IPV6_TCLASS)
+  else if (family == AF_INET6) {
+    setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &opt->dscp, sizeof(opt->dscp));
+  }
+#endif
+#endif
+  if (opt->source_addr == NULL) {
+    return;
+  }
+  struct sockaddr_storage source;
+  memset(&source, 0, sizeof(source));
+  socklen_t source_len = 0;
+  if (family == AF_INET &&
+      inet_pton(AF_INET, opt->source_addr,
+                &((struct sockaddr_in *)&source)->sin_addr) == 1) {
+    source_len = sizeof(struct sockaddr_in);
+  } else if (family == AF_INET6 &&
+             inet_pton(AF_INET6, opt->source_addr,
+                       &((struct sockaddr_in6 *)&source)->sin6_addr) == 1) {
+    source_len = sizeof(struct sockaddr_in6);
+  }
+  if (source_len == 0) {
+    WLOG("Source address %s is not an address of the resolver's family, ignored",
+         opt->source_addr);
+    return;
+  }
+  source.ss_family = (sa_family_t)family;
+  if (bind(sock, (struct sockaddr *)&source, source_len) != 0) {
+    WLOG("Failed to bind source address %s: %s", opt->source_addr, strerror(errno));
+  }
+}
+
+static int parse_address(const char *str, size_t len, uint16_t port,
+                         struct sockaddr_storage *addr) {
+  char buf[INET6_ADDRSTRLEN];
+  if (len > 1 && str[0] == '[' && str[len - 1] == ']') {
+    str++;
+    len -= 2;
+  }
+  if (len == 0 || len >= sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  memset(addr, 0, sizeof(*addr));
+  struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+  if (inet_pton(AF_INET, buf, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+  } else if (inet_pton(AF_INET6, buf, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int https_client_resolved_addresses(struct curl_slist *resolv, const char *host, uint16_t port,
+                                    struct sockaddr_storage *addrs, int max) {
+  const size_t host_len = strlen(host);
+  if (parse_address(host, host_len, port, &addrs[0]) == 0) {
+    return 1;
+  }
+  int count = 0;
+  for (struct curl_slist *cur = resolv; cur != NULL; cur = cur->next) {
+    const char *entry = cur->data;
+    if (entry == NULL || strncasecmp(entry, host, host_len) != 0 || entry[host_len] != ':') {
+      continue;
+    }
+    const char *list = strchr(entry + host_len + 1, ':');
+    while (list != NULL && count < max) {
+      list++;
+      const char *end = strchr(list, ',');
+      const size_t len = end ? (size_t)(end - list) : strlen(list);
+      if (parse_address(list, len, port, &addrs[count]) == 0) {
+        count++;
+      }
+      list = end;
+    }
+    break;
+  }
+  return count;
+}
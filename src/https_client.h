@@ -2,6 +2,7 @@
 #define _HTTPS_CLIENT_H_
 
 #include <curl/curl.h>
+#include <sys/socket.h>
 
 #include "options.h"
 #include "stat.h"
@@ -11,8 +12,23 @@ enum {
   HTTPS_CONNECTION_LIMIT = 8,
 };
 
-// Callback type for receiving data when a transfer finishes.
-typedef void (*https_response_cb)(void *data, char *buf, size_t buflen);
+// Why a transfer did not deliver a response.
+enum https_failure {
+  HTTPS_OK = 0,
+  HTTPS_FAILURE_ABORTED,  // client reset or shutdown
+  HTTPS_FAILURE_TIMEOUT,
+  HTTPS_FAILURE_CONNECT,  // name resolution, connection or transfer error
+  HTTPS_FAILURE_TLS,
+  HTTPS_FAILURE_HTTP_STATUS,  // other than 200
+  HTTPS_FAILURE_RESPONSE,  // too large or not a DNS message
+};
+
+// Short name of an https_failure for logs.
+const char * https_failure_name(uint8_t failure);
+
+// Callback type for receiving data when a transfer finishes. 'buf' is NULL
+// on failure.
+typedef void (*https_response_cb)(void *data, char *buf, size_t buflen, uint8_t failure);
 
 // Internal: Holds state on an individual transfer.
 struct https_fetch_ctx {
@@ -36,6 +52,8 @@ typedef struct {
   CURLM *curlm;
   struct curl_slist *header_list;
   struct https_fetch_ctx *fetches;
+  struct https_fetch_ctx *queued;  // requested in this loop iteration, not added yet
+  uint32_t in_flight;  // fetches, queued or added
 
   ev_timer timer;
   ev_io io_events[HTTPS_SOCKET_LIMIT];
@@ -45,6 +63,7 @@ typedef struct {
   stat_t *stat;
 
   ev_timer reset_timer;
+  ev_prepare submit;  // adds the queued transfers
 } https_client_t;
 
 void https_client_init(https_client_t *c, options_t *opt,
@@ -55,10 +74,25 @@ void https_client_fetch(https_client_t *c, const char *url,
                         struct curl_slist *resolv, uint16_t id,
                         https_response_cb cb, void *data);
 
+// Smoothed RTT in microseconds of a connection of the client, -1 if there is
+// none or it is unknown.
+int https_client_rtt(https_client_t *c);
+
 // Used to reset state of libcurl because streaming connections + IP changes
 // seem to cause curl to flip out.
 void https_client_reset(https_client_t *c);
 
 void https_client_cleanup(https_client_t *c);
 
+// For engines opening their own sockets: sets the DSCP codepoint and binds
+// the source address of the options.
+void https_client_socket_options(int sock, int family, options_t *opt);
+
+// Addresses of a resolver host, with 'port': the host itself if it is an
+// address, otherwise the ones of its "host:port:addresses" entry in the curl
+// resolve list of the bootstrap. The port of the entry is not compared.
+// Returns the number of addresses stored, at most 'max'.
+int https_client_resolved_addresses(struct curl_slist *resolv, const char *host, uint16_t port,
+                                    struct sockaddr_storage *addrs, int max);
+
 #endif // _HTTPS_CLIENT_H_
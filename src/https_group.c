@@ -0,0 +1,120 @@
+#include <string.h>
+
+#include "https_group.h"
+#include "logging.h"
+
+static void client_init(https_group_t *g, int i) {
+  g->peak_in_flight[i] = 0;
+  if (g->quic) {
+    g->quics[i] = quic_client_create(g->opt, g->stat, g->loop);
+  } else if (g->native) {
+    g->natives[i] = https_native_create(g->opt, g->stat, g->loop);
+  } else {
+    https_client_init(&g->clients[i], g->opt, g->stat, g->loop);
+  }
+}
+
+static uint32_t client_in_flight(https_group_t *g, int i) {
+  if (g->quic) {
+    return quic_client_in_flight(g->quics[i]);
+  }
+  return g->native ? https_native_in_flight(g->natives[i]) : g->clients[i].in_flight;
+}
+
+// RTT of QUIC connections is not known, OpenSSL does not expose it.
+static int client_rtt(https_group_t *g, int i) {
+  if (g->quic) {
+    return -1;
+  }
+  return g->native ? https_native_rtt(g->natives[i]) : https_client_rtt(&g->clients[i]);
+}
+
+static void stats_timer_cb(struct ev_loop __attribute__((unused)) *loop,
+                           ev_timer *w, int __attribute__((unused)) revents) {
+  https_group_t *g = (https_group_t *)w->data;
+  for (int i = 0; i < g->client_count; i++) {
+    const int rtt = client_rtt(g, i);
+    const uint32_t in_flight = client_in_flight(g, i);
+    SLOG("HTTPS connection %d: %u in flight, %u peak, %.1f ms RTT", i + 1,
+         in_flight, g->peak_in_flight[i], rtt >= 0 ? rtt / 1000.0 : 0.0);
+    g->peak_in_flight[i] = in_flight;
+  }
+}
+
+void https_group_init(https_group_t *g, options_t *opt, const char *resolver_url,
+                      stat_t *stat, struct ev_loop *loop) {
+  g->loop = loop;
+  g->opt = opt;
+  g->stat = stat;
+  g->native = opt->https_engine == HTTPS_ENGINE_NGHTTP2;
+  g->quic = strncmp(resolver_url, QUIC_URL_PREFIX, sizeof(QUIC_URL_PREFIX) - 1) == 0;
+  g->max_clients = opt->max_connections;
+  g->streams_per_connection = (uint32_t)opt->streams_per_connection;
+  g->client_count = 1;
+  client_init(g, 0);
+
+  ev_timer_init(&g->stats_timer, stats_timer_cb, opt->stats_interval, opt->stats_interval);
+  g->stats_timer.data = g;
+  if (opt->stats_interval > 0 && g->max_clients > 1) {
+    ev_timer_start(loop, &g->stats_timer);
+    ev_unref(loop);  // does not keep the loop alive
+  }
+}
+
+void https_group_fetch(https_group_t *g, const char *url,
+                       const char* postdata, size_t postdata_len,
+                       struct curl_slist *resolv, uint16_t id,
+                       https_response_cb cb, void *data) {
+  int least = 0;  // outstanding
+  for (int i = 1; i < g->client_count; i++) {
+    if (client_in_flight(g, i) < client_in_flight(g, least)) {
+      least = i;
+    }
+  }
+  if (client_in_flight(g, least) >= g->streams_per_connection &&
+      g->client_count < g->max_clients) {
+    least = g->client_count++;
+    ILOG("Opening HTTPS connection %d, others have %u requests in flight",
+         least + 1, g->streams_per_connection);
+    client_init(g, least);
+  }
+  if (g->quic) {
+    quic_client_fetch(g->quics[least], url, postdata, postdata_len, resolv, id, cb, data);
+  } else if (g->native) {
+    https_native_fetch(g->natives[least], url, postdata, postdata_len, resolv, id, cb, data);
+  } else {
+    https_client_fetch(&g->clients[least], url, postdata, postdata_len, resolv, id, cb, data);
+  }
+  const uint32_t in_flight = client_in_flight(g, least);
+  if (in_flight > g->peak_in_flight[least]) {
+    g->peak_in_flight[least] = in_flight;
+  }
+}
+
+void https_group_reset(https_group_t *g) {
+  for (int i = 0; i < g->client_count; i++) {
+    if (g->quic) {
+      quic_client_reset(g->quics[i]);
+    } else if (g->native) {
+      https_native_reset(g->natives[i]);
+    } else {
+      https_client_reset(&g->clients[i]);
+    }
+  }
+}
+
+void https_group_cleanup(https_group_t *g) {
+  if (ev_is_active(&g->stats_timer)) {
+    ev_ref(g->loop);
+    ev_timer_stop(g->loop, &g->stats_timer);
+  }
+  for (int i = 0; i < g->client_count; i++) {
+    if (g->quic) {
+      quic_client_free(g->quics[i]);
+    } else if (g->native) {
+      https_native_free(g->natives[i]);
+    } else {
+      https_client_cleanup(&g->clients[i]);
+    }
+  }
+}
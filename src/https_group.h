@@ -0,0 +1,62 @@
+#ifndef _HTTPS_GROUP_H_
+#define _HTTPS_GROUP_H_
+
+// Spreads requests over several HTTPS clients, each with its own curl multi
+// handle and so its own HTTP/2 connection, as curl funnels all streams of a
+// multi handle into one connection.
+//
+// A single connection is used until its requests in flight reach
+// 'streams_per_connection'. Then further ones are opened, up to
+// 'max_connections', and each request goes to the connection with the
+// fewest in flight. This relieves the server's MAX_CONCURRENT_STREAMS limit
+// and the head-of-line blocking and congestion window of one TCP connection.
+//
+// With a statistic interval, the requests in flight and the RTT of each
+// connection are printed.
+//
+// The clients are https_client or, with --https-engine nghttp2, https_native
+// ones, which hold a single connection too. For a quic:// resolver they are
+// quic_client ones.
+
+#include "https_client.h"
+#include "https_native.h"
+#include "quic_client.h"
+
+enum {
+  HTTPS_GROUP_MAX_CONNECTIONS = 16,
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+typedef struct {
+  https_client_t clients[HTTPS_GROUP_MAX_CONNECTIONS];
+  https_native_t *natives[HTTPS_GROUP_MAX_CONNECTIONS];  // used instead if 'native'
+  quic_client_t *quics[HTTPS_GROUP_MAX_CONNECTIONS];  // used instead if 'quic'
+  uint8_t native;
+  uint8_t quic;
+  uint32_t peak_in_flight[HTTPS_GROUP_MAX_CONNECTIONS];  // since last printed
+  int client_count;  // opened on demand
+  int max_clients;
+  uint32_t streams_per_connection;
+
+  struct ev_loop *loop;
+  options_t *opt;
+  stat_t *stat;
+  ev_timer stats_timer;
+} https_group_t;
+
+// 'resolver_url' selects the kind of clients, fetches have to go to it.
+void https_group_init(https_group_t *g, options_t *opt, const char *resolver_url,
+                      stat_t *stat, struct ev_loop *loop);
+
+// Same as https_client_fetch().
+void https_group_fetch(https_group_t *g, const char *url,
+                       const char* postdata, size_t postdata_len,
+                       struct curl_slist *resolv, uint16_t id,
+                       https_response_cb cb, void *data);
+
+// Resets every client like https_client_reset().
+void https_group_reset(https_group_t *g);
+
+void https_group_cleanup(https_group_t *g);
+
+#endif // _HTTPS_GROUP_H_
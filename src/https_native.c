@@ -0,0 +1,1007 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "https_native.h"
+#include "logging.h"
+
+#if HAS_OPENSSL == 1 && HAS_NGHTTP2 == 1
+#include <nghttp2/nghttp2.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "tls_server.h"
+
+// the following macros require to have req pointer to native_request structure
+// else: compilation failure will occur
+#define DLOG_REQ(format, args...) DLOG("%04hX: " format, req->id, ## args)
+#define WLOG_REQ(format, args...) WLOG("%04hX: " format, req->id, ## args)
+
+#define DOH_CONTENT_TYPE "application/dns-message"
+#define DOH_USER_AGENT "https_dns_proxy/0.4"
+#define NATIVE_ALPN "\x02h2"
+
+enum {
+  NATIVE_MAX_RESPONSE_SIZE = 65535,
+  NATIVE_READ_BUFFER_SIZE = 16384,
+  NATIVE_MAX_ADDRESSES = 16,
+  NATIVE_HOST_SIZE = 256,
+  NATIVE_TIMEOUT_S = 5,  // of requests, 10 seconds while connecting, like curl
+  NATIVE_HEADER_COUNT = 8,  // content-length is last, set per request
+};
+
+enum conn_state {
+  CONN_CLOSED = 0,
+  CONN_CONNECTING,
+  CONN_HANDSHAKE,
+  CONN_ESTABLISHED,
+};
+
+struct native_request {
+  uint16_t id;
+  int32_t stream_id;  // 0 while waiting to be submitted
+  uint8_t retried;  // refused once by the server already
+
+  https_response_cb cb;
+  void *cb_data;
+
+  const char *body;  // owned by the caller
+  size_t body_len;
+  size_t body_sent;
+
+  uint16_t status;
+  uint8_t content_type_ok;
+  uint8_t too_large;
+  char *buf;
+  size_t buflen;
+
+  ev_tstamp deadline;
+  struct native_request *prev;
+  struct native_request *next;
+};
+
+struct native_list {
+  struct native_request *head;
+  struct native_request *tail;
+};
+
+struct https_native_s {
+  struct ev_loop *loop;
+  options_t *opt;
+  stat_t *stat;
+
+  SSL_CTX *ssl_ctx;
+  SSL_SESSION *tls_session;  // resumed by the next connection
+
+  // resolver, taken from the URL of the first request
+  char *url;
+  char host[NATIVE_HOST_SIZE];  // IPv6 address without brackets
+  char authority[NATIVE_HOST_SIZE + 8];
+  char *path;  // with query
+  uint16_t port;
+  uint8_t host_is_ip;
+  nghttp2_nv headers[NATIVE_HEADER_COUNT];
+  struct sockaddr_storage addrs[NATIVE_MAX_ADDRESSES];
+  int addr_count;
+  int next_addr;  // tried by the next connection, after a failed one
+
+  uint8_t state;  // enum conn_state
+  int sock;
+  SSL *ssl;
+  uint8_t tls_want_write;
+  nghttp2_session *session;
+  char *out_buf;  // serialized frames the socket did not accept yet
+  size_t out_len;
+
+  struct native_list waiting;  // not submitted on a session yet
+  struct native_list sent;
+  uint32_t in_flight;
+
+  ev_tstamp idle_since;  // connection is not reused after max_idle_time, like by curl
+
+  ev_io io_watcher;
+  ev_timer timeout_timer;  // of the request with the earliest deadline
+  ev_timer reset_timer;  // closes connection still timeouting after conn_loss_time
+  ev_prepare flush;  // submits the requests of this loop iteration together
+  int loop_unrefs;
+};
+
+static void list_append(struct native_list *list, struct native_request *req) {
+  req->prev = list->tail;
+  req->next = NULL;
+  if (list->tail) {
+    list->tail->next = req;
+  } else {
+    list->head = req;
+  }
+  list->tail = req;
+}
+
+static void list_remove(struct native_list *list, struct native_request *req) {
+  if (req->prev) {
+    req->prev->next = req->next;
+  } else {
+    list->head = req->next;
+  }
+  if (req->next) {
+    req->next->prev = req->prev;
+  } else {
+    list->tail = req->prev;
+  }
+  req->prev = NULL;
+  req->next = NULL;
+}
+
+// Watchers of an idle connection do not keep the loop alive, only requests
+// in flight do.
+static void update_loop_ref(https_native_t *n) {
+  int unrefs = 0;
+  if (n->state != CONN_CLOSED && n->in_flight == 0) {
+    unrefs = 1 + ev_is_active(&n->reset_timer);
+  }
+  for (; n->loop_unrefs < unrefs; n->loop_unrefs++) {
+    ev_unref(n->loop);
+  }
+  for (; n->loop_unrefs > unrefs; n->loop_unrefs--) {
+    ev_ref(n->loop);
+  }
+}
+
+// Calls the callback of an unlinked request and frees it.
+static void request_complete(https_native_t *n, struct native_request *req, uint8_t failure) {
+  if (failure != HTTPS_OK) {
+    free(req->buf);
+    req->buf = NULL;
+    req->buflen = 0;
+  }
+  n->in_flight--;
+  if (n->in_flight == 0) {
+    n->idle_since = ev_now(n->loop);
+    ev_timer_stop(n->loop, &n->timeout_timer);
+    update_loop_ref(n);
+  }
+  // callback must be called to avoid memleak
+  req->cb(req->cb_data, req->buf, req->buflen, failure);
+  free(req->buf);
+  free(req);
+}
+
+static void update_watcher(https_native_t *n) {
+  int events = EV_READ;
+  if (n->state == CONN_CONNECTING) {
+    events = EV_WRITE;
+  } else if (n->out_len > 0 || n->tls_want_write) {
+    events |= EV_WRITE;
+  }
+  if ((n->io_watcher.events & (EV_READ | EV_WRITE)) != events) {
+    ev_io_stop(n->loop, &n->io_watcher);
+    ev_io_set(&n->io_watcher, n->sock, events);
+    ev_io_start(n->loop, &n->io_watcher);
+  }
+}
+
+// Closes the connection and fails the requests sent on it. Waiting requests
+// are failed too if 'fail_waiting', otherwise sent on the next connection.
+static void conn_close(https_native_t *n, uint8_t failure, uint8_t fail_waiting) {
+  if (n->state != CONN_CLOSED) {
+    DLOG("Closing HTTPS connection, socket %d", n->sock);
+    const uint8_t established = n->state == CONN_ESTABLISHED;
+    n->state = CONN_CLOSED;
+    update_loop_ref(n);  // before stopping watchers
+    ev_io_stop(n->loop, &n->io_watcher);
+    ev_timer_stop(n->loop, &n->reset_timer);
+    nghttp2_session_del(n->session);
+    n->session = NULL;
+    if (established) {
+      // close_notify, OpenSSL does not resume sessions of connections without
+      ERR_clear_error();
+      (void)SSL_shutdown(n->ssl);
+    }
+    SSL_free(n->ssl);
+    n->ssl = NULL;
+    close(n->sock);
+    n->sock = -1;
+    free(n->out_buf);
+    n->out_buf = NULL;
+    n->out_len = 0;
+    n->tls_want_write = 0;
+    if (n->stat) {
+      stat_connection_closed(n->stat);
+    }
+  }
+
+  // callbacks may request again, those go to the lists anew
+  struct native_request *sent = n->sent.head;
+  n->sent.head = n->sent.tail = NULL;
+  struct native_request *waiting = NULL;
+  if (fail_waiting) {
+    waiting = n->waiting.head;
+    n->waiting.head = n->waiting.tail = NULL;
+  }
+  while (sent) {
+    struct native_request *req = sent;
+    sent = req->next;
+    request_complete(n, req, failure);
+  }
+  while (waiting) {
+    struct native_request *req = waiting;
+    waiting = req->next;
+    request_complete(n, req, failure);
+  }
+  if (n->waiting.head) {
+    ev_prepare_start(n->loop, &n->flush);  // on a new connection
+  }
+}
+
+// Translates result of SSL_read/SSL_write to recv/send like return value.
+static ssize_t tls_result(https_native_t *n, int res, const char *op) {
+  n->tls_want_write = 0;
+  if (res > 0) {
+    return res;
+  }
+  switch (SSL_get_error(n->ssl, res)) {
+    case SSL_ERROR_WANT_WRITE:
+      n->tls_want_write = 1;
+      __attribute__((fallthrough));
+    case SSL_ERROR_WANT_READ:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      return errno == 0 ? 0 : -1;
+    default:
+      tls_server_log_errors(op);
+      errno = EPROTO;
+      return -1;
+  }
+}
+
+// Writes pending frames to the TLS connection.
+// Returns 0 on success, -1 if the connection has to be closed.
+static int conn_flush(https_native_t *n) {
+  for (;;) {
+    const uint8_t *data = (const uint8_t *)n->out_buf;
+    ssize_t data_len = (ssize_t)n->out_len;
+    if (data_len == 0) {
+      data_len = nghttp2_session_mem_send(n->session, &data);
+      if (data_len < 0) {
+        WLOG("HTTP/2 send error: %s", nghttp2_strerror((int)data_len));
+        return -1;
+      }
+      if (data_len == 0) {
+        break;
+      }
+    }
+    ERR_clear_error();
+    ssize_t sent = tls_result(n, SSL_write(n->ssl, data, (int)data_len), "SSL_write");
+    if (sent < 0 && errno != EAGAIN) {
+      WLOG("Send error: %s", strerror(errno));
+      return -1;
+    }
+    sent = sent < 0 ? 0 : sent;
+    if (sent < data_len) {
+      // keep the rest, socket will be writable later
+      const size_t rest = (size_t)(data_len - sent);
+      if (data == (const uint8_t *)n->out_buf) {
+        memmove(n->out_buf, n->out_buf + sent, rest);
+      } else {
+        char *new_buf = (char *)realloc(n->out_buf, rest);
+        if (new_buf == NULL) {
+          FLOG("Out of mem");
+        }
+        n->out_buf = new_buf;
+        memcpy(n->out_buf, data + sent, rest);
+      }
+      n->out_len = rest;
+      break;
+    }
+    n->out_len = 0;
+  }
+  update_watcher(n);
+  if (n->out_len == 0 &&
+      !nghttp2_session_want_read(n->session) &&
+      !nghttp2_session_want_write(n->session)) {
+    DLOG("HTTP/2 session finished");
+    return -1;
+  }
+  return 0;
+}
+
+static ssize_t body_read_cb(nghttp2_session *session, int32_t stream_id,
+                            uint8_t *buf, size_t length, uint32_t *data_flags,
+                            nghttp2_data_source __attribute__((unused)) *source,
+                            void __attribute__((unused)) *user_data) {
+  // not source->ptr, request may be gone by a timeout
+  struct native_request *req = (struct native_request *)
+    nghttp2_session_get_stream_user_data(session, stream_id);
+  if (req == NULL) {
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  const size_t rest = req->body_len - req->body_sent;
+  if (length > rest) {
+    length = rest;
+  }
+  memcpy(buf, req->body + req->body_sent, length);
+  req->body_sent += length;
+  if (req->body_sent == req->body_len) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  }
+  return (ssize_t)length;
+}
+
+// Header fields except content-length are the same for every request and
+// not copied by nghttp2. After the first request, HPACK encodes them as
+// indexes of its dynamic table, a byte each.
+static void submit_waiting(https_native_t *n) {
+  if (!nghttp2_session_check_request_allowed(n->session)) {
+    return;  // going away, waiting for the next connection
+  }
+  int submitted = 0;
+  while (n->waiting.head) {
+    struct native_request *req = n->waiting.head;
+    char length_str[8];
+    (void)snprintf(length_str, sizeof(length_str), "%zu", req->body_len);
+    nghttp2_nv headers[NATIVE_HEADER_COUNT];
+    memcpy(headers, n->headers, sizeof(n->headers));
+    headers[NATIVE_HEADER_COUNT - 1].value = (uint8_t *)length_str;
+    headers[NATIVE_HEADER_COUNT - 1].valuelen = strlen(length_str);
+
+    nghttp2_data_provider provider;
+    provider.source.ptr = NULL;
+    provider.read_callback = body_read_cb;
+    req->body_sent = 0;
+    const int32_t stream_id = nghttp2_submit_request(n->session, NULL, headers,
+                                                     NATIVE_HEADER_COUNT, &provider, req);
+    if (stream_id < 0) {
+      WLOG_REQ("Failed to submit request: %s", nghttp2_strerror(stream_id));
+      break;  // retried with the next connection or timeouts
+    }
+    req->stream_id = stream_id;
+    list_remove(&n->waiting, req);
+    list_append(&n->sent, req);
+    DLOG_REQ("Submitted on stream %d", stream_id);
+    if (n->stat && n->state == CONN_ESTABLISHED) {
+      stat_connection_reused(n->stat);
+    }
+    submitted++;
+  }
+  if (submitted > 0) {
+    DLOG("Submitting %d requests", submitted);
+  }
+}
+
+static int on_header_cb(nghttp2_session *session, const nghttp2_frame *frame,
+                        const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen,
+                        uint8_t __attribute__((unused)) flags,
+                        void __attribute__((unused)) *user_data) {
+  if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_RESPONSE) {
+    return 0;
+  }
+  struct native_request *req = (struct native_request *)
+    nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (req == NULL) {
+    return 0;
+  }
+  if (namelen == sizeof(":status") - 1 && memcmp(name, ":status", namelen) == 0) {
+    req->status = 0;
+    for (size_t i = 0; i < valuelen && i < 3; i++) {
+      req->status = (uint16_t)(req->status * 10 + (value[i] - '0'));
+    }
+  } else if (namelen == sizeof("content-type") - 1 && memcmp(name, "content-type", namelen) == 0) {
+    // at least, start with it
+    req->content_type_ok = valuelen >= sizeof(DOH_CONTENT_TYPE) - 1 &&
+      memcmp(value, DOH_CONTENT_TYPE, sizeof(DOH_CONTENT_TYPE) - 1) == 0;
+  }
+  return 0;
+}
+
+static int on_data_chunk_recv_cb(nghttp2_session *session, uint8_t __attribute__((unused)) flags,
+                                 int32_t stream_id, const uint8_t *data, size_t len,
+                                 void __attribute__((unused)) *user_data) {
+  struct native_request *req = (struct native_request *)
+    nghttp2_session_get_stream_user_data(session, stream_id);
+  if (req == NULL || req->too_large) {
+    return 0;
+  }
+  if (req->buflen + len > NATIVE_MAX_RESPONSE_SIZE) {
+    WLOG_REQ("Response size is too large!");
+    req->too_large = 1;
+    return 0;
+  }
+  char *new_buf = (char *)realloc(req->buf, req->buflen + len);
+  if (new_buf == NULL) {
+    FLOG("Out of mem");
+  }
+  req->buf = new_buf;
+  memcpy(req->buf + req->buflen, data, len);
+  req->buflen += len;
+  return 0;
+}
+
+static int on_stream_close_cb(nghttp2_session *session, int32_t stream_id,
+                              uint32_t error_code, void *user_data) {
+  https_native_t *n = (https_native_t *)user_data;
+  struct native_request *req = (struct native_request *)
+    nghttp2_session_get_stream_user_data(session, stream_id);
+  if (req == NULL) {
+    return 0;
+  }
+  nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+  list_remove(&n->sent, req);
+
+  if (error_code == NGHTTP2_REFUSED_STREAM && !req->retried) {
+    // not processed by the server, e.g. sent after its GOAWAY
+    DLOG_REQ("Stream %d refused, sending again", stream_id);
+    req->retried = 1;
+    req->stream_id = 0;
+    list_append(&n->waiting, req);
+    ev_prepare_start(n->loop, &n->flush);
+    return 0;
+  }
+
+  uint8_t failure = HTTPS_OK;
+  if (error_code != NGHTTP2_NO_ERROR) {
+    WLOG_REQ("Stream %d closed with error: %s", stream_id, nghttp2_http2_strerror(error_code));
+    failure = HTTPS_FAILURE_CONNECT;
+  } else if (req->status == 0) {
+    WLOG_REQ("No response (probably connection has been closed or timed out)");
+    failure = HTTPS_FAILURE_CONNECT;
+  } else if (req->status != 200) {
+    WLOG_REQ("Response code: %u, content length: %zu", req->status, req->buflen);
+    failure = HTTPS_FAILURE_HTTP_STATUS;
+  } else if (req->too_large || req->buflen == 0) {
+    failure = HTTPS_FAILURE_RESPONSE;
+  } else if (!req->content_type_ok) {
+    WLOG_REQ("Invalid response Content-Type");
+    failure = HTTPS_FAILURE_RESPONSE;
+  } else {
+    DLOG_REQ("Received %zu bytes on stream %d", req->buflen, stream_id);
+  }
+  if (failure != HTTPS_OK) {
+    ILOG("%04hX: Response was faulty (%s), answering the failure", req->id,
+         https_failure_name(failure));
+  }
+  request_complete(n, req, failure);
+  return 0;
+}
+
+static nghttp2_session * create_session(https_native_t *n) {
+  nghttp2_session_callbacks *callbacks = NULL;
+  if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+    FLOG("Out of mem");
+  }
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header_cb);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv_cb);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_cb);
+
+  nghttp2_session *session = NULL;
+  int res = nghttp2_session_client_new(&session, callbacks, n);
+  nghttp2_session_callbacks_del(callbacks);
+  if (res != 0) {
+    FLOG("Failed to create HTTP/2 session: %s", nghttp2_strerror(res));
+  }
+
+  nghttp2_settings_entry settings[] = {
+    {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+  };
+  res = nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings,
+                                sizeof(settings) / sizeof(*settings));
+  if (res != 0) {
+    FLOG("Failed to submit HTTP/2 settings: %s", nghttp2_strerror(res));
+  }
+  return session;
+}
+
+static void set_socket_options(https_native_t *n, int family) {
+  const int one = 1;
+  setsockopt(n->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  https_client_socket_options(n->sock, family, n->opt);
+}
+
+// Starts connecting, the handshake follows once connected.
+// Returns 0 on success, -1 if connecting failed right away.
+static int conn_open(https_native_t *n) {
+  if (n->addr_count == 0) {
+    ELOG("No address of resolver %s", n->host);
+    return -1;
+  }
+  const struct sockaddr_storage *addr = &n->addrs[n->next_addr % n->addr_count];
+  const socklen_t addr_len = addr->ss_family == AF_INET ?
+    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+  n->sock = socket(addr->ss_family, SOCK_STREAM, 0);
+  if (n->sock == -1) {
+    ELOG("Could not open socket %d:%s", errno, strerror(errno));
+    return -1;
+  }
+  int flags = fcntl(n->sock, F_GETFL, 0);
+  if (flags != -1) {
+    fcntl(n->sock, F_SETFL, flags | O_NONBLOCK);
+  }
+  fcntl(n->sock, F_SETFD, FD_CLOEXEC);
+  set_socket_options(n, addr->ss_family);
+
+  n->ssl = SSL_new(n->ssl_ctx);
+  if (n->ssl == NULL || SSL_set_fd(n->ssl, n->sock) != 1) {
+    tls_server_log_errors("SSL_new");
+    FLOG("Failed to create TLS connection");
+  }
+  SSL_set_app_data(n->ssl, n);
+  if (n->host_is_ip) {
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(n->ssl), n->host);
+  } else {
+    SSL_set_tlsext_host_name(n->ssl, n->host);
+    SSL_set1_host(n->ssl, n->host);
+  }
+  SSL_set_alpn_protos(n->ssl, (const unsigned char *)NATIVE_ALPN, sizeof(NATIVE_ALPN) - 1);
+  if (n->tls_session) {
+    SSL_set_session(n->ssl, n->tls_session);
+  }
+  SSL_set_connect_state(n->ssl);
+
+  n->session = create_session(n);
+  n->state = CONN_CONNECTING;
+  if (n->stat) {
+    stat_connection_opened(n->stat);
+  }
+  DLOG("Connecting to resolver %s, socket %d", n->host, n->sock);
+
+  if (connect(n->sock, (const struct sockaddr *)addr, addr_len) != 0 && errno != EINPROGRESS) {
+    WLOG("Connecting to resolver %s failed: %s", n->host, strerror(errno));
+    n->next_addr++;
+    return -1;
+  }
+  // requests are sent along with the handshake
+  submit_waiting(n);
+  ev_io_set(&n->io_watcher, n->sock, EV_WRITE);
+  ev_io_start(n->loop, &n->io_watcher);
+  return 0;
+}
+
+// Returns 0 while the handshake is in progress or done, -1 if it failed.
+static int conn_handshake(https_native_t *n) {
+  ERR_clear_error();
+  const int res = SSL_do_handshake(n->ssl);
+  if (res != 1) {
+    const int err = SSL_get_error(n->ssl, res);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+      n->tls_want_write = err == SSL_ERROR_WANT_WRITE;
+      update_watcher(n);
+      return 0;
+    }
+    tls_server_log_errors("SSL_do_handshake");
+    const long verify = SSL_get_verify_result(n->ssl);
+    if (verify != X509_V_OK) {
+      WLOG("Certificate verification of resolver %s failed: %s",
+           n->host, X509_verify_cert_error_string(verify));
+    } else {
+      WLOG("TLS handshake with resolver %s failed", n->host);
+    }
+    return -1;
+  }
+  n->tls_want_write = 0;
+  const unsigned char *alpn = NULL;
+  unsigned int alpn_len = 0;
+  SSL_get0_alpn_selected(n->ssl, &alpn, &alpn_len);
+  if (alpn_len != sizeof(NATIVE_ALPN) - 2 || memcmp(alpn, NATIVE_ALPN + 1, alpn_len) != 0) {
+    WLOG("Resolver %s does not support HTTP/2, try to run application with "
+         "--https-engine curl", n->host);
+    return -1;
+  }
+  n->state = CONN_ESTABLISHED;
+  DLOG("Connected to resolver %s, TLS session %s", n->host,
+       SSL_session_reused(n->ssl) ? "resumed" : "new");
+  return 0;
+}
+
+static void conn_read(https_native_t *n) {
+  // read until TLS layer has no more data, so nothing remains buffered there
+  for (;;) {
+    uint8_t buf[NATIVE_READ_BUFFER_SIZE];
+    ERR_clear_error();
+    ssize_t len = tls_result(n, SSL_read(n->ssl, buf, sizeof(buf)), "SSL_read");
+    if (len < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (len <= 0) {
+      if (len == 0 || errno == ECONNRESET) {
+        DLOG("HTTPS connection closed by resolver");
+      } else {
+        WLOG("Read error: %s", strerror(errno));
+      }
+      conn_close(n, HTTPS_FAILURE_CONNECT, 0);
+      return;
+    }
+    if (ev_is_active(&n->reset_timer)) {  // connection is alive
+      ev_timer_stop(n->loop, &n->reset_timer);
+      update_loop_ref(n);
+    }
+    ssize_t res = nghttp2_session_mem_recv(n->session, buf, (size_t)len);
+    if (res < 0) {
+      WLOG("HTTP/2 protocol error: %s", nghttp2_strerror((int)res));
+      conn_close(n, HTTPS_FAILURE_CONNECT, 0);
+      return;
+    }
+  }
+  submit_waiting(n);  // refused ones
+  if (conn_flush(n) != 0) {
+    conn_close(n, HTTPS_FAILURE_CONNECT, 0);
+  }
+}
+
+static void io_cb(struct ev_loop __attribute__((unused)) *loop,
+                  ev_io *w, int __attribute__((unused)) revents) {
+  https_native_t *n = (https_native_t *)w->data;
+  if (n->state == CONN_CONNECTING) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(n->sock, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) {
+      err = errno;
+    }
+    if (err != 0) {
+      WLOG("Connecting to resolver %s failed: %s", n->host, strerror(err));
+      n->next_addr++;
+      conn_close(n, HTTPS_FAILURE_CONNECT, 1);
+      return;
+    }
+    n->state = CONN_HANDSHAKE;
+  }
+  if (n->state == CONN_HANDSHAKE) {
+    if (conn_handshake(n) != 0) {
+      conn_close(n, HTTPS_FAILURE_TLS, 1);
+      return;
+    }
+    if (n->state != CONN_ESTABLISHED) {
+      return;
+    }
+  }
+  conn_read(n);
+}
+
+static void flush_cb(struct ev_loop __attribute__((unused)) *loop,
+                     ev_prepare *w, int __attribute__((unused)) revents) {
+  https_native_t *n = (https_native_t *)w->data;
+  ev_prepare_stop(n->loop, &n->flush);
+  if (n->state == CONN_CLOSED) {
+    if (n->waiting.head && conn_open(n) != 0) {
+      conn_close(n, HTTPS_FAILURE_CONNECT, 1);
+    }
+    return;
+  }
+  submit_waiting(n);
+  if (n->state == CONN_ESTABLISHED && conn_flush(n) != 0) {
+    conn_close(n, HTTPS_FAILURE_CONNECT, 0);
+  }
+}
+
+static ev_tstamp expire_list(https_native_t *n, struct native_list *list,
+                             struct native_list *expired, ev_tstamp now) {
+  ev_tstamp next = 0.;
+  struct native_request *req = list->head;
+  while (req) {
+    struct native_request *cur = req;
+    req = req->next;
+    if (cur->deadline > now) {
+      if (next == 0. || cur->deadline < next) {
+        next = cur->deadline;
+      }
+      continue;
+    }
+    list_remove(list, cur);
+    if (cur->stream_id > 0 && n->session) {
+      nghttp2_session_set_stream_user_data(n->session, cur->stream_id, NULL);
+      nghttp2_submit_rst_stream(n->session, NGHTTP2_FLAG_NONE, cur->stream_id, NGHTTP2_CANCEL);
+    }
+    list_append(expired, cur);
+  }
+  return next;
+}
+
+static void timeout_cb(struct ev_loop __attribute__((unused)) *loop,
+                       ev_timer *w, int __attribute__((unused)) revents) {
+  https_native_t *n = (https_native_t *)w->data;
+  const ev_tstamp now = ev_now(n->loop);
+  struct native_list expired = {NULL, NULL};
+  const ev_tstamp next_sent = expire_list(n, &n->sent, &expired, now);
+  const ev_tstamp next_waiting = expire_list(n, &n->waiting, &expired, now);
+  const ev_tstamp next = (next_sent == 0. || (next_waiting != 0. && next_waiting < next_sent)) ?
+    next_waiting : next_sent;
+  if (next != 0.) {
+    ev_timer_set(&n->timeout_timer, next - now, 0.);
+    ev_timer_start(n->loop, &n->timeout_timer);
+  }
+  if (expired.head == NULL) {
+    return;
+  }
+  if (n->state != CONN_CLOSED && !ev_is_active(&n->reset_timer)) {
+    ILOG("Client reset timer started");
+    ev_timer_start(n->loop, &n->reset_timer);
+    update_loop_ref(n);
+  }
+  ev_prepare_start(n->loop, &n->flush);  // stream resets
+  while (expired.head) {
+    struct native_request *req = expired.head;
+    list_remove(&expired, req);
+    WLOG_REQ("Request timed out");
+    request_complete(n, req, HTTPS_FAILURE_TIMEOUT);
+  }
+}
+
+static void reset_timer_cb(struct ev_loop __attribute__((unused)) *loop,
+                           ev_timer *w, int __attribute__((unused)) revents) {
+  https_native_t *n = (https_native_t *)w->data;
+  ILOG("Client reset timer timeouted");
+  https_native_reset(n);
+}
+
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+  https_native_t *n = (https_native_t *)SSL_get_app_data(ssl);
+  SSL_SESSION_free(n->tls_session);
+  n->tls_session = session;
+  return 1;  // reference is kept
+}
+
+static SSL_CTX * create_ssl_ctx(options_t *opt) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (ctx == NULL) {
+    tls_server_log_errors("SSL_CTX_new");
+    FLOG("Failed to create TLS client context");
+  }
+  // We know Google supports this, so force it.
+  if (SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) != 1) {
+    tls_server_log_errors("SSL_CTX_set_min_proto_version");
+  }
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  if (opt->ca_info) {
+    if (SSL_CTX_load_verify_locations(ctx, opt->ca_info, NULL) != 1) {
+      tls_server_log_errors(opt->ca_info);
+      ELOG("Failed to load CA certificates: %s", opt->ca_info);
+    }
+  } else if (SSL_CTX_set_default_verify_paths(ctx) != 1) {
+    tls_server_log_errors("SSL_CTX_set_default_verify_paths");
+  }
+  // Frames are written from the same buffer again after partial writes.
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                        SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // servers often close idle connections without close_notify
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  // sessions are kept by the client for the next connection
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+  return ctx;
+}
+
+#define MAKE_NV(name, value) \
+  { (uint8_t *)(name), (uint8_t *)(value), sizeof(name) - 1, strlen(value), \
+    NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE }
+
+// Parses the resolver URL and prepares the request header fields.
+// Returns 0 on success, -1 if the URL is not usable.
+static int set_target(https_native_t *n, const char *url_in) {
+  CURLU *url = curl_url();
+  if (url == NULL) {
+    FLOG("Out of mem");
+  }
+  int res = -1;
+  char *scheme = NULL;
+  char *host = NULL;
+  char *port = NULL;
+  char *path = NULL;
+  char *query = NULL;
+  if (curl_url_set(url, CURLUPART_URL, url_in, 0) == CURLUE_OK &&
+      curl_url_get(url, CURLUPART_SCHEME, &scheme, 0) == CURLUE_OK &&
+      strcasecmp(scheme, "https") == 0 &&
+      curl_url_get(url, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+      strlen(host) < sizeof(n->host) &&
+      curl_url_get(url, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK &&
+      curl_url_get(url, CURLUPART_PATH, &path, 0) == CURLUE_OK) {
+    (void)curl_url_get(url, CURLUPART_QUERY, &query, 0);
+
+    n->port = (uint16_t)atoi(port);
+    if (n->port == 443) {
+      (void)snprintf(n->authority, sizeof(n->authority), "%s", host);
+    } else {
+      (void)snprintf(n->authority, sizeof(n->authority), "%s:%u", host, n->port);
+    }
+    const size_t host_len = strlen(host);
+    if (host[0] == '[' && host[host_len - 1] == ']') {
+      (void)snprintf(n->host, sizeof(n->host), "%.*s", (int)(host_len - 2), host + 1);
+    } else {
+      (void)snprintf(n->host, sizeof(n->host), "%s", host);
+    }
+    struct in6_addr ignored;
+    n->host_is_ip = inet_pton(AF_INET, n->host, &ignored) == 1 ||
+                    inet_pton(AF_INET6, n->host, &ignored) == 1;
+
+    free(n->path);
+    const size_t path_size = strlen(path) + (query ? strlen(query) + 1 : 0) + 1;
+    n->path = (char *)malloc(path_size);
+    if (n->path == NULL) {
+      FLOG("Out of mem");
+    }
+    (void)snprintf(n->path, path_size, "%s%s%s", path, query ? "?" : "", query ? query : "");
+
+    const nghttp2_nv headers[NATIVE_HEADER_COUNT] = {
+      MAKE_NV(":method", "POST"),
+      MAKE_NV(":scheme", "https"),
+      MAKE_NV(":authority", n->authority),
+      MAKE_NV(":path", n->path),
+      MAKE_NV("accept", DOH_CONTENT_TYPE),
+      MAKE_NV("content-type", DOH_CONTENT_TYPE),
+      MAKE_NV("user-agent", DOH_USER_AGENT),
+      MAKE_NV("content-length", ""),
+    };
+    memcpy(n->headers, headers, sizeof(headers));
+    n->headers[NATIVE_HEADER_COUNT - 1].flags = NGHTTP2_NV_FLAG_NO_COPY_NAME;
+
+    free(n->url);
+    n->url = strdup(url_in);
+    if (n->url == NULL) {
+      FLOG("Out of mem");
+    }
+    res = 0;
+  }
+  curl_free(scheme);
+  curl_free(host);
+  curl_free(port);
+  curl_free(path);
+  curl_free(query);
+  curl_url_cleanup(url);
+  return res;
+}
+
+static void set_addresses(https_native_t *n, struct curl_slist *resolv) {
+  n->addr_count = https_client_resolved_addresses(resolv, n->host, n->port,
+                                                  n->addrs, NATIVE_MAX_ADDRESSES);
+}
+
+https_native_t * https_native_create(options_t *opt, stat_t *stat, struct ev_loop *loop) {
+  https_native_t *n = (https_native_t *)calloc(1, sizeof(https_native_t));
+  if (n == NULL) {
+    FLOG("Out of mem");
+  }
+  n->loop = loop;
+  n->opt = opt;
+  n->stat = stat;
+  n->sock = -1;
+  n->ssl_ctx = create_ssl_ctx(opt);
+
+  ev_init(&n->io_watcher, io_cb);
+  n->io_watcher.data = n;
+  ev_init(&n->timeout_timer, timeout_cb);
+  n->timeout_timer.data = n;
+  ev_timer_init(&n->reset_timer, reset_timer_cb, (double)opt->conn_loss_time, 0);
+  n->reset_timer.data = n;
+  ev_prepare_init(&n->flush, flush_cb);
+  n->flush.data = n;
+  return n;
+}
+
+void https_native_fetch(https_native_t *n, const char *url,
+                        const char* postdata, size_t postdata_len,
+                        struct curl_slist *resolv, uint16_t id,
+                        https_response_cb cb, void *data) {
+  if (n->url == NULL || strcmp(n->url, url) != 0) {
+    if (n->url != NULL) {
+      WLOG("Resolver URL changed to %s, reconnecting", url);
+      https_native_reset(n);
+    }
+    if (set_target(n, url) != 0) {
+      ELOG("%04hX: Unsupported resolver URL: %s", id, url);
+      cb(data, NULL, 0, HTTPS_FAILURE_CONNECT);
+      return;
+    }
+  }
+  if (n->state == CONN_ESTABLISHED && n->in_flight == 0 &&
+      ev_now(n->loop) - n->idle_since >= n->opt->max_idle_time) {
+    DLOG("Closing idle HTTPS connection");
+    nghttp2_session_terminate_session(n->session, NGHTTP2_NO_ERROR);
+    (void)conn_flush(n);  // GOAWAY, if the socket takes it
+    conn_close(n, HTTPS_FAILURE_ABORTED, 1);
+  }
+  if (n->state == CONN_CLOSED) {
+    set_addresses(n, resolv);  // current list, caller may free it after a reset
+  }
+
+  struct native_request *req = (struct native_request *)calloc(1, sizeof(struct native_request));
+  if (req == NULL) {
+    FLOG("Out of mem");
+  }
+  req->id = id;
+  req->cb = cb;
+  req->cb_data = data;
+  req->body = postdata;
+  req->body_len = postdata_len;
+  const ev_tstamp timeout = n->state == CONN_ESTABLISHED ? NATIVE_TIMEOUT_S : 2 * NATIVE_TIMEOUT_S;
+  req->deadline = ev_now(n->loop) + timeout;
+  list_append(&n->waiting, req);
+  n->in_flight++;
+  update_loop_ref(n);
+
+  if (!ev_is_active(&n->timeout_timer) ||
+      ev_timer_remaining(n->loop, &n->timeout_timer) > timeout) {
+    ev_timer_stop(n->loop, &n->timeout_timer);
+    ev_timer_set(&n->timeout_timer, timeout, 0.);
+    ev_timer_start(n->loop, &n->timeout_timer);
+  }
+  ev_prepare_start(n->loop, &n->flush);
+}
+
+uint32_t https_native_in_flight(https_native_t *n) {
+  return n->in_flight;
+}
+
+int https_native_rtt(https_native_t *n) {
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (n->state == CONN_ESTABLISHED &&
+      getsockopt(n->sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+      info.tcpi_rtt > 0) {
+    return (int)info.tcpi_rtt;
+  }
+#else
+  (void)n;
+#endif
+  return -1;
+}
+
+void https_native_reset(https_native_t *n) {
+  conn_close(n, HTTPS_FAILURE_ABORTED, 1);
+}
+
+void https_native_free(https_native_t *n) {
+  conn_close(n, HTTPS_FAILURE_ABORTED, 1);
+  ev_timer_stop(n->loop, &n->timeout_timer);
+  ev_prepare_stop(n->loop, &n->flush);
+  SSL_SESSION_free(n->tls_session);
+  SSL_CTX_free(n->ssl_ctx);
+  free(n->url);
+  free(n->path);
+  free(n);
+}
+#else
+https_native_t * https_native_create(options_t __attribute__((unused)) *opt,
+                                     stat_t __attribute__((unused)) *stat,
+                                     struct ev_loop __attribute__((unused)) *loop) {
+  FLOG("Compiled without nghttp2 HTTPS engine support");
+  return NULL;
+}
+
+void https_native_fetch(https_native_t __attribute__((unused)) *n,
+                        const char __attribute__((unused)) *url,
+                        const char __attribute__((unused)) *postdata,
+                        size_t __attribute__((unused)) postdata_len,
+                        struct curl_slist __attribute__((unused)) *resolv,
+                        uint16_t __attribute__((unused)) id,
+                        https_response_cb __attribute__((unused)) cb,
+                        void __attribute__((unused)) *data) {
+}
+
+uint32_t https_native_in_flight(https_native_t __attribute__((unused)) *n) {
+  return 0;
+}
+
+int https_native_rtt(https_native_t __attribute__((unused)) *n) {
+  return -1;
+}
+
+void https_native_reset(https_native_t __attribute__((unused)) *n) {
+}
+
+void https_native_free(https_native_t __attribute__((unused)) *n) {
+}
+#endif
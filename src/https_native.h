@@ -0,0 +1,45 @@
+#ifndef _HTTPS_NATIVE_H_
+#define _HTTPS_NATIVE_H_
+
+// HTTPS client speaking HTTP/2 over one connection with nghttp2 and OpenSSL
+// directly, without the per-transfer setup of libcurl: requests become
+// streams of a persistent session, their header fields are prepared once per
+// resolver and each response is delivered by its stream.
+//
+// Same interface as https_client, selected with --https-engine. All fetches of
+// a client have to go to the same resolver URL, as upstreams do. Address of
+// a resolver host name is taken from the curl resolve list of the bootstrap.
+//
+// Only available if compiled with OpenSSL and nghttp2 (HAS_OPENSSL,
+// HAS_NGHTTP2), options check it.
+
+#include <curl/curl.h>
+
+#include "https_client.h"
+#include "options.h"
+#include "stat.h"
+
+typedef struct https_native_s https_native_t;
+
+https_native_t * https_native_create(options_t *opt, stat_t *stat, struct ev_loop *loop);
+
+// Same as https_client_fetch(). 'postdata' has to remain valid until the
+// callback is called.
+void https_native_fetch(https_native_t *n, const char *url,
+                        const char* postdata, size_t postdata_len,
+                        struct curl_slist *resolv, uint16_t id,
+                        https_response_cb cb, void *data);
+
+uint32_t https_native_in_flight(https_native_t *n);
+
+// Same as https_client_rtt().
+int https_native_rtt(https_native_t *n);
+
+// Closes the connection, aborting the requests in flight. The next request
+// opens a new one, to the address resolved then.
+void https_native_reset(https_native_t *n);
+
+// Aborts the requests in flight and frees the client.
+void https_native_free(https_native_t *n);
+
+#endif // _HTTPS_NATIVE_H_
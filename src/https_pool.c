@@ -0,0 +1,288 @@
+//NOLINTNEXTLINE(bugprone-reserved-identifier,cert-dcl37-c,cert-dcl51-cpp)
+#define _GNU_SOURCE  // needed for pthread_setname_np()
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "https_group.h"
+#include "https_pool.h"
+#include "logging.h"
+#include "mpsc_queue.h"
+
+enum job_type {
+  JOB_FETCH,
+  JOB_RESOLV,
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct https_pool_job {
+  struct mpsc_node node;  // must be first
+  enum job_type type;
+  struct https_worker_s *worker;
+
+  // JOB_FETCH
+  const char *url;
+  const char *postdata;
+  size_t postdata_len;
+  uint16_t id;
+  https_response_cb cb;
+  void *cb_data;
+  char *resp;  // copy of response, passed back to pool loop
+  size_t resp_len;
+  uint8_t failure;
+
+  // JOB_RESOLV
+  struct curl_slist *resolv;
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct https_worker_s {
+  https_pool_t *pool;
+  int id;
+  pthread_t thread;
+  options_t *opt;
+  const char *resolver_url;
+  stat_t *stat;
+
+  struct ev_loop *loop;
+  ev_async wakeup;
+  struct mpsc_queue jobs;
+  atomic_int stopping;
+
+  https_group_t client;
+  struct curl_slist *resolv;  // own copy, pool loop may replace its list any time
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct https_pool_s {
+  struct ev_loop *loop;
+  ev_async wakeup;
+  struct mpsc_queue done;
+  uint32_t in_flight;  // each one holds a reference of the loop
+
+  sem_t started;  // worker initialized its loop and client
+  int next_worker;
+  int worker_count;
+  struct https_worker_s workers[HTTPS_POOL_MAX_THREADS];
+};
+
+static struct https_pool_job * job_create(enum job_type type, struct https_worker_s *w) {
+  struct https_pool_job *job = (struct https_pool_job *)calloc(1, sizeof(struct https_pool_job));
+  if (job == NULL) {
+    FLOG("Out of mem");
+  }
+  job->type = type;
+  job->worker = w;
+  return job;
+}
+
+static void job_send(struct https_worker_s *w, struct https_pool_job *job) {
+  mpsc_queue_push(&w->jobs, &job->node);
+  ev_async_send(w->loop, &w->wakeup);
+}
+
+// Worker thread: response of a fetch, handed over to the pool loop.
+static void worker_response_cb(void *data, char *buf, size_t buflen, uint8_t failure) {
+  struct https_pool_job *job = (struct https_pool_job *)data;
+  https_pool_t *p = job->worker->pool;
+  job->failure = failure;
+  if (buf != NULL) {
+    job->resp = (char *)malloc(buflen);
+    if (job->resp == NULL) {
+      FLOG("Out of mem");
+    }
+    memcpy(job->resp, buf, buflen);
+    job->resp_len = buflen;
+  }
+  mpsc_queue_push(&p->done, &job->node);
+  ev_async_send(p->loop, &p->wakeup);
+}
+
+// Worker thread: processes jobs sent by the pool loop.
+static void worker_wakeup_cb(struct ev_loop *loop, ev_async *w,
+                             int __attribute__((unused)) revents) {
+  struct https_worker_s *worker = (struct https_worker_s *)w->data;
+  if (atomic_load(&worker->stopping)) {
+    ev_break(loop, EVBREAK_ALL);
+    return;
+  }
+  struct mpsc_node *node = NULL;
+  while ((node = mpsc_queue_pop(&worker->jobs)) != NULL) {
+    struct https_pool_job *job = (struct https_pool_job *)node;
+    switch (job->type) {
+      case JOB_FETCH:
+        https_group_fetch(&worker->client, job->url, job->postdata, job->postdata_len,
+                           worker->resolv, job->id, worker_response_cb, job);
+        break;
+      case JOB_RESOLV:
+        curl_slist_free_all(worker->resolv);
+        worker->resolv = job->resolv;
+        https_group_reset(&worker->client);
+        free(job);
+        break;
+      default:
+        FLOG("Unknown job type: %d", job->type);
+    }
+  }
+}
+
+static void * worker_run(void *data) {
+  struct https_worker_s *w = (struct https_worker_s *)data;
+  char name[16];
+  (void)snprintf(name, sizeof(name), "https-%d", w->id);
+  (void)pthread_setname_np(pthread_self(), name);
+  if (w->opt->upstream_cpus != NULL) {
+    affinity_pin_self(w->opt->upstream_cpus, w->id, name);
+  }
+
+  // allocated after pinning to be local to the NUMA node of the thread
+  w->loop = ev_loop_new(EVFLAG_AUTO);
+  if (w->loop == NULL) {
+    FLOG("Failed to create loop of HTTPS worker %d", w->id);
+  }
+  ev_async_init(&w->wakeup, worker_wakeup_cb);
+  w->wakeup.data = w;
+  ev_async_start(w->loop, &w->wakeup);
+  https_group_init(&w->client, w->opt, w->resolver_url, w->stat, w->loop);
+  sem_post(&w->pool->started);
+
+  DLOG("HTTPS worker %d started", w->id);
+  ev_run(w->loop, 0);
+  https_group_cleanup(&w->client);  // aborted requests are passed back too
+  curl_slist_free_all(w->resolv);
+  ev_async_stop(w->loop, &w->wakeup);
+  ev_loop_destroy(w->loop);
+  DLOG("HTTPS worker %d finished", w->id);
+  return NULL;
+}
+
+// Pool loop: calls callbacks of finished fetches.
+static void pool_wakeup_cb(struct ev_loop __attribute__((unused)) *loop, ev_async *w,
+                           int __attribute__((unused)) revents) {
+  https_pool_t *p = (https_pool_t *)w->data;
+  struct mpsc_node *node = NULL;
+  while ((node = mpsc_queue_pop(&p->done)) != NULL) {
+    struct https_pool_job *job = (struct https_pool_job *)node;
+    p->in_flight--;
+    ev_unref(p->loop);
+    job->cb(job->cb_data, job->resp, job->resp_len, job->failure);
+    free(job->resp);
+    free(job);
+  }
+}
+
+https_pool_t * https_pool_create(options_t *opt, const char *resolver_url, stat_t *stat,
+                                 struct ev_loop *loop, int threads) {
+  if (threads < 1 || threads > HTTPS_POOL_MAX_THREADS) {
+    FLOG("Invalid number of HTTPS threads: %d", threads);
+  }
+  https_pool_t *p = (https_pool_t *)calloc(1, sizeof(https_pool_t));
+  if (p == NULL) {
+    FLOG("Out of mem");
+  }
+  p->loop = loop;
+  p->worker_count = threads;
+  mpsc_queue_init(&p->done);
+  ev_async_init(&p->wakeup, pool_wakeup_cb);
+  p->wakeup.data = p;
+  ev_async_start(loop, &p->wakeup);
+  ev_unref(loop);  // only requests in flight keep the loop alive
+
+  // signals are handled by the main thread
+  sigset_t all_signals;
+  sigset_t old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+  if (sem_init(&p->started, 0, 0) != 0) {
+    FLOG("Failed to init semaphore: %s", strerror(errno));
+  }
+  for (int i = 0; i < threads; i++) {
+    struct https_worker_s *w = &p->workers[i];
+    w->pool = p;
+    w->id = i;
+    w->opt = opt;
+    w->resolver_url = resolver_url;
+    w->stat = stat;
+    mpsc_queue_init(&w->jobs);
+    atomic_init(&w->stopping, 0);
+
+    int res = pthread_create(&w->thread, NULL, worker_run, w);
+    if (res != 0) {
+      FLOG("Failed to start HTTPS worker %d: %s", i, strerror(res));
+    }
+    (void)sem_wait(&p->started);  // signals are blocked, can not be interrupted
+  }
+  sem_destroy(&p->started);
+
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  ILOG("Using %d HTTPS worker threads", threads);
+  return p;
+}
+
+void https_pool_fetch(https_pool_t *p, const char *url,
+                      const char* postdata, size_t postdata_len, uint16_t id,
+                      https_response_cb cb, void *data) {
+  struct https_worker_s *w = &p->workers[p->next_worker];
+  p->next_worker = (p->next_worker + 1) % p->worker_count;
+
+  struct https_pool_job *job = job_create(JOB_FETCH, w);
+  job->failure = HTTPS_FAILURE_ABORTED;  // unless a worker gets to it
+  job->url = url;
+  job->postdata = postdata;
+  job->postdata_len = postdata_len;
+  job->id = id;
+  job->cb = cb;
+  job->cb_data = data;
+
+  p->in_flight++;
+  ev_ref(p->loop);
+  job_send(w, job);
+}
+
+void https_pool_set_resolv(https_pool_t *p, struct curl_slist *resolv) {
+  for (int i = 0; i < p->worker_count; i++) {
+    struct https_pool_job *job = job_create(JOB_RESOLV, &p->workers[i]);
+    for (struct curl_slist *cur = resolv; cur != NULL; cur = cur->next) {
+      job->resolv = curl_slist_append(job->resolv, cur->data);
+      if (job->resolv == NULL) {
+        FLOG("Out of mem");
+      }
+    }
+    job_send(&p->workers[i], job);
+  }
+}
+
+void https_pool_cleanup(https_pool_t *p) {
+  for (int i = 0; i < p->worker_count; i++) {
+    struct https_worker_s *w = &p->workers[i];
+    atomic_store(&w->stopping, 1);
+    ev_async_send(w->loop, &w->wakeup);
+    pthread_join(w->thread, NULL);
+
+    // jobs sent but not started yet
+    struct mpsc_node *node = NULL;
+    while ((node = mpsc_queue_pop(&w->jobs)) != NULL) {
+      struct https_pool_job *job = (struct https_pool_job *)node;
+      if (job->type == JOB_FETCH) {
+        mpsc_queue_push(&p->done, &job->node);
+      } else {
+        curl_slist_free_all(job->resolv);
+        free(job);
+      }
+    }
+  }
+  pool_wakeup_cb(p->loop, &p->wakeup, 0);  // aborted requests
+  if (p->in_flight > 0) {
+    WLOG("%u HTTPS requests were lost in worker threads", p->in_flight);
+  }
+  ev_ref(p->loop);
+  ev_async_stop(p->loop, &p->wakeup);
+  free(p);
+}
@@ -0,0 +1,41 @@
+#ifndef _HTTPS_POOL_H_
+#define _HTTPS_POOL_H_
+
+// Split mode: HTTPS clients run in worker threads, each with its own libev
+// loop and curl multi handle, so TLS and HTTP/2 processing does not delay
+// receiving requests on the main thread.
+//
+// Requests and responses are passed through lock-free queues and the
+// receiving loop is woken with ev_async. Response callbacks are called on the
+// thread of the loop given to https_pool_create().
+//
+// With --upstream-cpus each worker is pinned to one CPU of the list (round
+// robin) and allocates its loop and client after pinning.
+
+#include "https_client.h"
+
+enum {
+  HTTPS_POOL_MAX_THREADS = 16,
+};
+
+typedef struct https_pool_s https_pool_t;
+
+// Fetches have to go to 'resolver_url', like with https_group_init().
+https_pool_t * https_pool_create(options_t *opt, const char *resolver_url, stat_t *stat,
+                                 struct ev_loop *loop, int threads);
+
+// Same as https_client_fetch(), 'postdata' has to remain valid until the
+// callback is called. Resolve list is set with https_pool_set_resolv().
+void https_pool_fetch(https_pool_t *p, const char *url,
+                      const char* postdata, size_t postdata_len, uint16_t id,
+                      https_response_cb cb, void *data);
+
+// Passes a copy of 'resolv' to every worker, which resets its client like
+// https_client_reset().
+void https_pool_set_resolv(https_pool_t *p, struct curl_slist *resolv);
+
+// Stops and joins workers. Requests in flight are aborted, so callbacks are
+// called with NULL response.
+void https_pool_cleanup(https_pool_t *p);
+
+#endif // _HTTPS_POOL_H_
@@ -0,0 +1,813 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dns_wire.h"
+#include "local_zone.h"
+#include "logging.h"
+
+enum {
+  LOCAL_HOSTS_TTL = 60,
+  LOCAL_ZONE_DEFAULT_TTL = 3600,
+  LOCAL_MAX_CNAME_CHAIN = 8,
+  LOCAL_MAX_RECORDS_PER_NAME = UINT16_MAX,
+  LOCAL_MAX_ORIGINS = 64,
+  LOCAL_MAX_TOKENS = 32,  // address and names of a hosts line
+  LOCAL_INITIAL_RESPONSE_SIZE = 512,
+  LOCAL_MAX_TCP_RESPONSE = UINT16_MAX,
+  HEADER_FLAG_AA = 0x04,  // of the third byte
+  HEADER_FLAG_TC = 0x02,
+  NAME_POINTER = 0xc000,
+  MAX_NAME_POINTER = 0x3fff,
+};
+
+#define NO_INDEX UINT32_MAX
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct local_name {
+  uint32_t hash;
+  uint32_t name_offset;  // lowercase wire format in the pool
+  uint16_t name_length;
+  uint16_t record_count;
+  uint32_t first;  // record, or pending record while loading
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct local_record {
+  uint16_t type;
+  uint16_t rdlength;
+  uint32_t ttl;
+  uint32_t rdata_offset;
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct pending_record {
+  struct local_record rr;
+  uint32_t next;
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct local_origin {
+  uint32_t name_offset;
+  uint16_t name_length;
+  uint32_t ttl;  // $TTL at the $ORIGIN line, for negative answers
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct local_zone_data {
+  char *pool;
+  size_t pool_size;
+  size_t pool_capacity;
+
+  struct local_name *names;
+  uint32_t name_count;
+  uint32_t name_capacity;
+  uint32_t *index;  // name number + 1, 0 if empty
+  uint32_t index_mask;
+
+  struct local_record *records;
+  uint32_t record_count;
+
+  struct local_origin origins[LOCAL_MAX_ORIGINS];
+  uint32_t origin_count;
+
+  // only while loading
+  struct pending_record *pending;
+  uint32_t pending_capacity;
+};
+
+static uint32_t name_hash(const char *name, size_t length) {
+  uint32_t hash = 2166136261U;  // FNV-1a
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+// Label length bytes are below 'A', so the whole name can be lowercased.
+static void name_lower(char *dst, const char *src, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    dst[i] = (char)tolower((unsigned char)src[i]);
+  }
+}
+
+static uint32_t find_name(const struct local_zone_data *d, const char *name, size_t length,
+                          uint32_t hash) {
+  for (uint32_t slot = hash & d->index_mask; d->index[slot] != 0;
+       slot = (slot + 1) & d->index_mask) {
+    const struct local_name *n = &d->names[d->index[slot] - 1];
+    if (n->hash == hash && n->name_length == length &&
+        memcmp(d->pool + n->name_offset, name, length) == 0) {
+      return d->index[slot] - 1;
+    }
+  }
+  return NO_INDEX;
+}
+
+// Returns the origin 'name' is below, NULL if none. '*offset' is where the
+// origin starts in 'name'.
+static const struct local_origin * find_origin(const struct local_zone_data *d,
+                                               const char *name, size_t length,
+                                               size_t *offset) {
+  for (uint32_t i = 0; i < d->origin_count; i++) {
+    const struct local_origin *o = &d->origins[i];
+    for (size_t pos = 0; pos < length && length - pos >= o->name_length;
+         pos += 1 + (uint8_t)name[pos]) {
+      if (length - pos == o->name_length &&
+          memcmp(name + pos, d->pool + o->name_offset, o->name_length) == 0) {
+        *offset = pos;
+        return o;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Loading
+
+static uint32_t pool_add(struct local_zone_data *d, const char *data, size_t length) {
+  if (d->pool_size + length > d->pool_capacity) {
+    size_t capacity = d->pool_capacity ? d->pool_capacity * 2 : 4096;
+    while (capacity < d->pool_size + length) {
+      capacity *= 2;
+    }
+    char *pool = (char *)realloc(d->pool, capacity);
+    if (pool == NULL) {
+      FLOG("Out of mem");
+    }
+    d->pool = pool;
+    d->pool_capacity = capacity;
+  }
+  const uint32_t offset = (uint32_t)d->pool_size;
+  memcpy(d->pool + offset, data, length);
+  d->pool_size += length;
+  return offset;
+}
+
+static void index_rebuild(struct local_zone_data *d, uint32_t slots) {
+  free(d->index);
+  d->index = (uint32_t *)calloc(slots, sizeof(uint32_t));
+  if (d->index == NULL) {
+    FLOG("Out of mem");
+  }
+  d->index_mask = slots - 1;
+  for (uint32_t i = 0; i < d->name_count; i++) {
+    uint32_t slot = d->names[i].hash & d->index_mask;
+    while (d->index[slot] != 0) {
+      slot = (slot + 1) & d->index_mask;
+    }
+    d->index[slot] = i + 1;
+  }
+}
+
+static uint32_t intern_name(struct local_zone_data *d, const char *name, size_t length) {
+  const uint32_t hash = name_hash(name, length);
+  const uint32_t found = find_name(d, name, length, hash);
+  if (found != NO_INDEX) {
+    return found;
+  }
+  if (d->name_count == d->name_capacity) {
+    d->name_capacity = d->name_capacity ? d->name_capacity * 2 : 256;
+    d->names = (struct local_name *)realloc(d->names, d->name_capacity * sizeof(struct local_name));
+    if (d->names == NULL) {
+      FLOG("Out of mem");
+    }
+  }
+  struct local_name *n = &d->names[d->name_count++];
+  n->hash = hash;
+  n->name_offset = pool_add(d, name, length);
+  n->name_length = (uint16_t)length;
+  n->record_count = 0;
+  n->first = NO_INDEX;
+  if ((d->name_count * 2) > d->index_mask + 1) {  // at most half full
+    index_rebuild(d, (d->index_mask + 1) * 2);
+  } else {
+    uint32_t slot = hash & d->index_mask;
+    while (d->index[slot] != 0) {
+      slot = (slot + 1) & d->index_mask;
+    }
+    d->index[slot] = d->name_count;
+  }
+  return d->name_count - 1;
+}
+
+// Duplicates, e.g. the same name on several lines of a hosts file, are
+// dropped.
+static void add_record(struct local_zone_data *d, const char *name, size_t length,
+                       uint16_t type, uint32_t ttl, const char *rdata, uint16_t rdlength) {
+  const uint32_t name_number = intern_name(d, name, length);
+  uint32_t last = NO_INDEX;
+  for (uint32_t i = d->names[name_number].first; i != NO_INDEX; i = d->pending[i].next) {
+    const struct local_record *rr = &d->pending[i].rr;
+    if (rr->type == type && rr->rdlength == rdlength &&
+        memcmp(d->pool + rr->rdata_offset, rdata, rdlength) == 0) {
+      return;
+    }
+    last = i;
+  }
+  struct local_name *n = &d->names[name_number];
+  if (n->record_count == LOCAL_MAX_RECORDS_PER_NAME) {
+    return;
+  }
+  if (d->record_count == d->pending_capacity) {
+    d->pending_capacity = d->pending_capacity ? d->pending_capacity * 2 : 256;
+    d->pending = (struct pending_record *)realloc(
+        d->pending, d->pending_capacity * sizeof(struct pending_record));
+    if (d->pending == NULL) {
+      FLOG("Out of mem");
+    }
+  }
+  struct pending_record *p = &d->pending[d->record_count];
+  p->rr.type = type;
+  p->rr.rdlength = rdlength;
+  p->rr.ttl = ttl;
+  p->rr.rdata_offset = pool_add(d, rdata, rdlength);
+  p->next = NO_INDEX;
+  if (last == NO_INDEX) {
+    n->first = d->record_count;
+  } else {
+    d->pending[last].next = d->record_count;
+  }
+  d->record_count++;
+  n->record_count++;
+}
+
+// Orders the records by name, so the records of a name are adjacent.
+static void finish_records(struct local_zone_data *d) {
+  d->records = (struct local_record *)malloc(
+      (d->record_count ? d->record_count : 1) * sizeof(struct local_record));
+  if (d->records == NULL) {
+    FLOG("Out of mem");
+  }
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < d->name_count; i++) {
+    struct local_name *n = &d->names[i];
+    uint32_t next = n->first;
+    n->first = count;
+    while (next != NO_INDEX) {
+      d->records[count++] = d->pending[next].rr;
+      next = d->pending[next].next;
+    }
+  }
+  free(d->pending);
+  d->pending = NULL;
+}
+
+static struct local_zone_data * data_create(void) {
+  struct local_zone_data *d = (struct local_zone_data *)calloc(1, sizeof(struct local_zone_data));
+  if (d == NULL) {
+    FLOG("Out of mem");
+  }
+  index_rebuild(d, 256);
+  return d;
+}
+
+static void data_free(struct local_zone_data *d) {
+  if (d == NULL) {
+    return;
+  }
+  free(d->pool);
+  free(d->names);
+  free(d->index);
+  free(d->records);
+  free(d->pending);
+  free(d);
+}
+
+// Encodes a dotted name into lowercase wire format, returns its length or -1.
+static int encode_name(char *buf, const char *name) {
+  const int length = dns_wire_encode_name(buf, DNS_WIRE_MAX_NAME_LENGTH, name);
+  if (length > 0) {
+    name_lower(buf, buf, (size_t)length);
+  }
+  return length;
+}
+
+// Owner name of PTR records, e.g. 4.3.2.1.in-addr.arpa for 1.2.3.4.
+static int reverse_name(char *buf, int family, const uint8_t *addr) {
+  char text[DNS_WIRE_MAX_NAME_LENGTH + 1];
+  size_t pos = 0;
+  if (family == AF_INET) {
+    for (int i = 3; i >= 0; i--) {
+      pos += (size_t)snprintf(text + pos, sizeof(text) - pos, "%u.", addr[i]);
+    }
+    (void)snprintf(text + pos, sizeof(text) - pos, "in-addr.arpa");
+  } else {
+    for (int i = 15; i >= 0; i--) {
+      pos += (size_t)snprintf(text + pos, sizeof(text) - pos, "%x.%x.",
+                              addr[i] & 0x0fU, (unsigned)addr[i] >> 4);
+    }
+    (void)snprintf(text + pos, sizeof(text) - pos, "ip6.arpa");
+  }
+  return encode_name(buf, text);
+}
+
+static int is_unspecified(int family, const uint8_t *addr) {
+  const size_t length = family == AF_INET ? 4 : 16;
+  for (size_t i = 0; i < length; i++) {
+    if (addr[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Splits 'line' at whitespace, returns the number of tokens.
+static int tokenize(char *line, char **tokens) {
+  int count = 0;
+  char *save = NULL;
+  for (char *token = strtok_r(line, " \t\r\n", &save); token != NULL;
+       token = strtok_r(NULL, " \t\r\n", &save)) {
+    if (count == LOCAL_MAX_TOKENS) {
+      return LOCAL_MAX_TOKENS + 1;
+    }
+    tokens[count++] = token;
+  }
+  return count;
+}
+
+// Returns the number of invalid lines skipped, -1 if the file can't be read.
+static int load_hosts(struct local_zone_data *d, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    ELOG("Failed to open hosts file %s: %s", path, strerror(errno));
+    return -1;
+  }
+  char *line = NULL;
+  size_t line_size = 0;
+  unsigned line_number = 0;
+  unsigned invalid = 0;
+  while (getline(&line, &line_size, file) != -1) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char *tokens[LOCAL_MAX_TOKENS + 1];
+    const int count = tokenize(line, tokens);
+    if (count == 0) {
+      continue;
+    }
+    if (count > LOCAL_MAX_TOKENS) {
+      invalid++;
+      WLOG("Too many names on line %u of hosts file %s", line_number, path);
+      continue;
+    }
+    uint8_t addr[16];
+    int family = AF_INET;
+    if (inet_pton(AF_INET, tokens[0], addr) != 1) {
+      family = AF_INET6;
+      if (inet_pton(AF_INET6, tokens[0], addr) != 1) {
+        invalid++;
+        WLOG("Invalid address on line %u of hosts file %s", line_number, path);
+        continue;
+      }
+    }
+    const uint16_t type = family == AF_INET ? DNS_WIRE_TYPE_A : DNS_WIRE_TYPE_AAAA;
+    const uint16_t addr_length = family == AF_INET ? 4 : 16;
+    for (int i = 1; i < count; i++) {
+      char name[DNS_WIRE_MAX_NAME_LENGTH];
+      const int length = encode_name(name, tokens[i]);
+      if (length <= 1) {  // invalid or root
+        invalid++;
+        WLOG("Invalid name %s on line %u of hosts file %s", tokens[i], line_number, path);
+        continue;
+      }
+      add_record(d, name, (size_t)length, type, LOCAL_HOSTS_TTL, (const char *)addr, addr_length);
+      if (i == 1 && !is_unspecified(family, addr)) {  // canonical name
+        char reverse[DNS_WIRE_MAX_NAME_LENGTH];
+        const int reverse_length = reverse_name(reverse, family, addr);
+        if (reverse_length > 0) {
+          add_record(d, reverse, (size_t)reverse_length, DNS_WIRE_TYPE_PTR, LOCAL_HOSTS_TTL,
+                     name, (uint16_t)length);
+        }
+      }
+    }
+  }
+  free(line);
+  fclose(file);
+  return (int)invalid;
+}
+
+// Zone file names: absolute with a trailing dot, otherwise relative to the
+// origin. "@" is the origin itself.
+static int zone_name(char *buf, const char *name, const char *origin) {
+  const size_t length = strlen(name);
+  if (strcmp(name, "@") == 0) {
+    return *origin != '\0' ? encode_name(buf, origin) : -1;
+  }
+  if (*origin == '\0' || (length > 0 && name[length - 1] == '.')) {
+    return encode_name(buf, name);
+  }
+  char absolute[2 * (DNS_WIRE_MAX_NAME_LENGTH + 1)];
+  (void)snprintf(absolute, sizeof(absolute), "%s.%s", name, origin);
+  return encode_name(buf, absolute);
+}
+
+static int parse_ttl(const char *str, uint32_t *ttl) {
+  if (!isdigit((unsigned char)*str)) {
+    return -1;
+  }
+  char *end = NULL;
+  const unsigned long value = strtoul(str, &end, 10);
+  if (*end != '\0' || value > INT32_MAX) {
+    return -1;
+  }
+  *ttl = (uint32_t)value;
+  return 0;
+}
+
+// Parses "[owner] [ttl] [IN] type rdata", returns -1 if the line is invalid.
+static int zone_record(struct local_zone_data *d, char **tokens, int count, int has_owner,
+                       const char *origin, uint32_t default_ttl,
+                       char *owner, int *owner_length) {
+  int i = 0;
+  if (has_owner) {
+    *owner_length = zone_name(owner, tokens[i++], origin);
+  }
+  if (*owner_length <= 0) {
+    return -1;
+  }
+  uint32_t ttl = default_ttl;
+  for (; i < count; i++) {
+    if (strcasecmp(tokens[i], "IN") != 0 && parse_ttl(tokens[i], &ttl) != 0) {
+      break;
+    }
+  }
+  if (i >= count) {
+    return -1;
+  }
+  const char *type = tokens[i++];
+  if (strcasecmp(type, "SOA") == 0 || strcasecmp(type, "NS") == 0) {
+    return 0;  // zone apex data of no use for answers
+  }
+  if (i + 1 != count) {
+    return -1;  // single rdata field
+  }
+  const char *rdata = tokens[i];
+  uint8_t addr[16];
+  char target[DNS_WIRE_MAX_NAME_LENGTH];
+  if (strcasecmp(type, "A") == 0 && inet_pton(AF_INET, rdata, addr) == 1) {
+    add_record(d, owner, (size_t)*owner_length, DNS_WIRE_TYPE_A, ttl, (const char *)addr, 4);
+  } else if (strcasecmp(type, "AAAA") == 0 && inet_pton(AF_INET6, rdata, addr) == 1) {
+    add_record(d, owner, (size_t)*owner_length, DNS_WIRE_TYPE_AAAA, ttl, (const char *)addr, 16);
+  } else if (strcasecmp(type, "CNAME") == 0 || strcasecmp(type, "PTR") == 0) {
+    const int target_length = zone_name(target, rdata, origin);
+    if (target_length <= 0) {
+      return -1;
+    }
+    add_record(d, owner, (size_t)*owner_length,
+               strcasecmp(type, "PTR") == 0 ? DNS_WIRE_TYPE_PTR : DNS_WIRE_TYPE_CNAME, ttl,
+               target, (uint16_t)target_length);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int zone_origin(struct local_zone_data *d, const char *name, char *origin,
+                       uint32_t ttl) {
+  char wire[DNS_WIRE_MAX_NAME_LENGTH];
+  const int length = zone_name(wire, name, origin);
+  if (length <= 1 || d->origin_count == LOCAL_MAX_ORIGINS) {
+    return -1;
+  }
+  // keep the text absolute, so relative names can be appended to it
+  char absolute[DNS_WIRE_MAX_NAME_LENGTH + 2];
+  const size_t name_length = strlen(name);
+  if (name[name_length - 1] == '.' || *origin == '\0') {
+    (void)snprintf(absolute, sizeof(absolute), "%s", name);
+  } else {
+    (void)snprintf(absolute, sizeof(absolute), "%s.%s", name, origin);
+  }
+  (void)snprintf(origin, DNS_WIRE_MAX_NAME_LENGTH + 2, "%s", absolute);
+  struct local_origin *o = &d->origins[d->origin_count++];
+  o->name_offset = pool_add(d, wire, (size_t)length);
+  o->name_length = (uint16_t)length;
+  o->ttl = ttl;
+  return 0;
+}
+
+// Returns the number of invalid lines skipped, -1 if the file can't be read.
+static int load_zone(struct local_zone_data *d, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    ELOG("Failed to open zone file %s: %s", path, strerror(errno));
+    return -1;
+  }
+  char origin[DNS_WIRE_MAX_NAME_LENGTH + 2] = "";
+  uint32_t default_ttl = LOCAL_ZONE_DEFAULT_TTL;
+  char owner[DNS_WIRE_MAX_NAME_LENGTH];
+  int owner_length = -1;
+  int in_parentheses = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  unsigned line_number = 0;
+  unsigned invalid = 0;
+  while (getline(&line, &line_size, file) != -1) {
+    line_number++;
+    char *comment = strchr(line, ';');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    // multi-line records, e.g. SOA, are skipped
+    if (in_parentheses || strchr(line, '(') != NULL) {
+      in_parentheses = strchr(line, ')') == NULL;
+      continue;
+    }
+    const int has_owner = !isspace((unsigned char)line[0]);
+    char *tokens[LOCAL_MAX_TOKENS + 1];
+    const int count = tokenize(line, tokens);
+    int rc = 0;
+    if (count == 0) {
+      continue;
+    } else if (count > LOCAL_MAX_TOKENS) {
+      rc = -1;
+    } else if (strcasecmp(tokens[0], "$ORIGIN") == 0) {
+      rc = count == 2 ? zone_origin(d, tokens[1], origin, default_ttl) : -1;
+    } else if (strcasecmp(tokens[0], "$TTL") == 0) {
+      rc = count == 2 ? parse_ttl(tokens[1], &default_ttl) : -1;
+    } else {
+      rc = zone_record(d, tokens, count, has_owner, origin, default_ttl, owner, &owner_length);
+    }
+    if (rc != 0) {
+      invalid++;
+      WLOG("Invalid line %u of zone file %s", line_number, path);
+    }
+  }
+  free(line);
+  fclose(file);
+  return (int)invalid;
+}
+
+// Returns NULL if a file can't be read, so local names are not left to be
+// forwarded by a partial table.
+static struct local_zone_data * data_load(const char *hosts_path, const char *zone_path) {
+  struct local_zone_data *d = data_create();
+  const int hosts_invalid = hosts_path != NULL ? load_hosts(d, hosts_path) : 0;
+  const int zone_invalid = zone_path != NULL ? load_zone(d, zone_path) : 0;
+  if (hosts_invalid < 0 || zone_invalid < 0) {
+    data_free(d);
+    return NULL;
+  }
+  const int invalid = hosts_invalid + zone_invalid;
+  finish_records(d);
+  ILOG("Loaded %u local records of %u names, skipped %d invalid",
+       d->record_count, d->name_count, invalid);
+  return d;
+}
+
+// Answers
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct response_writer {
+  char *buf;
+  size_t len;
+  size_t size;
+  size_t limit;
+};
+
+static int writer_reserve(struct response_writer *w, size_t length) {
+  if (w->len + length > w->limit) {
+    return -1;
+  }
+  if (w->len + length > w->size) {
+    size_t size = w->size * 2;
+    while (size < w->len + length) {
+      size *= 2;
+    }
+    char *buf = (char *)realloc(w->buf, size);
+    if (buf == NULL) {
+      FLOG("Out of mem");
+    }
+    w->buf = buf;
+    w->size = size;
+  }
+  return 0;
+}
+
+// Writes a record owned by the name at 'owner', returns -1 if it does not fit.
+static int write_record(struct response_writer *w, const struct local_zone_data *d,
+                        size_t owner, const struct local_record *rr) {
+  if (owner > MAX_NAME_POINTER ||
+      writer_reserve(w, 2 + DNS_WIRE_RR_FIXED_LENGTH + rr->rdlength) != 0) {
+    return -1;
+  }
+  char *p = w->buf + w->len;
+  dns_wire_set_u16(p, 0, (uint16_t)(NAME_POINTER | owner));
+  dns_wire_set_u16(p, 2, rr->type);
+  dns_wire_set_u16(p, 4, DNS_WIRE_CLASS_IN);
+  dns_wire_set_u32(p, 6, rr->ttl);
+  dns_wire_set_u16(p, 10, rr->rdlength);
+  memcpy(p + 2 + DNS_WIRE_RR_FIXED_LENGTH, d->pool + rr->rdata_offset, rr->rdlength);
+  w->len += 2 + DNS_WIRE_RR_FIXED_LENGTH + rr->rdlength;
+  dns_wire_set_u16(w->buf, 6, (uint16_t)(dns_wire_ancount(w->buf) + 1));
+  return 0;
+}
+
+// Writes the SOA of 'origin', whose name is at 'zone' of the response, so
+// the negative answer is cached. Returns -1 if it does not fit.
+static int write_soa(struct response_writer *w, const struct local_origin *origin,
+                     size_t zone) {
+  if (zone > MAX_NAME_POINTER || writer_reserve(w, DNS_WIRE_SOA_LENGTH) != 0) {
+    return -1;
+  }
+  w->len = dns_wire_add_soa(w->buf, w->len, zone, origin->ttl);
+  return 0;
+}
+
+// Follows CNAME records within the local names. Returns the rcode, or -1 if
+// the response is truncated.
+static int write_answers(struct response_writer *w, const struct local_zone_data *d,
+                         uint32_t name, uint16_t qtype) {
+  size_t owner = DNS_WIRE_HEADER_LENGTH;  // question name
+  for (int chain = 0; chain <= LOCAL_MAX_CNAME_CHAIN; chain++) {
+    const struct local_name *n = &d->names[name];
+    const struct local_record *cname = NULL;
+    int answered = 0;
+    for (uint32_t i = n->first; i < n->first + n->record_count; i++) {
+      const struct local_record *rr = &d->records[i];
+      if (rr->type == qtype || qtype == DNS_WIRE_TYPE_ANY) {
+        if (write_record(w, d, owner, rr) != 0) {
+          return -1;
+        }
+        answered = 1;
+      } else if (rr->type == DNS_WIRE_TYPE_CNAME) {
+        cname = rr;
+      }
+    }
+    if (answered) {
+      return DNS_WIRE_RCODE_NOERROR;
+    }
+    if (cname == NULL) {  // NODATA
+      size_t offset = 0;
+      const struct local_origin *origin = find_origin(d, d->pool + n->name_offset,
+                                                      n->name_length, &offset);
+      if (origin != NULL && write_soa(w, origin, owner + offset) != 0) {
+        return -1;
+      }
+      return DNS_WIRE_RCODE_NOERROR;
+    }
+    if (write_record(w, d, owner, cname) != 0) {
+      return -1;
+    }
+    owner = w->len - cname->rdlength;  // the target name just written
+    const char *target = d->pool + cname->rdata_offset;
+    name = find_name(d, target, cname->rdlength, name_hash(target, cname->rdlength));
+    if (name == NO_INDEX) {
+      size_t offset = 0;
+      const struct local_origin *origin = find_origin(d, target, cname->rdlength, &offset);
+      if (origin == NULL) {
+        return DNS_WIRE_RCODE_NOERROR;
+      }
+      return write_soa(w, origin, owner + offset) == 0 ? DNS_WIRE_RCODE_NXDOMAIN : -1;
+    }
+  }
+  return DNS_WIRE_RCODE_NOERROR;
+}
+
+char * local_zone_answer(local_zone_t *lz, const char *req, size_t req_len,
+                         int udp, size_t *resp_len) {
+  const struct local_zone_data *d = lz->data;
+  struct dns_wire_question q;
+  if (d == NULL || req_len < DNS_WIRE_HEADER_LENGTH || DNS_WIRE_QR(req) ||
+      DNS_WIRE_OPCODE(req) != 0 || dns_wire_question(req, req_len, &q) != 0 ||
+      q.qclass != DNS_WIRE_CLASS_IN) {
+    return NULL;
+  }
+  char qname[DNS_WIRE_MAX_NAME_LENGTH];
+  name_lower(qname, req + q.qname_offset, q.qname_length);
+  const uint32_t name = find_name(d, qname, q.qname_length, name_hash(qname, q.qname_length));
+  size_t origin_offset = 0;
+  const struct local_origin *origin = name != NO_INDEX ? NULL :
+      find_origin(d, qname, q.qname_length, &origin_offset);
+  if (name == NO_INDEX && origin == NULL) {
+    return NULL;
+  }
+
+  struct dns_wire_rr opt;
+  const int edns = dns_wire_find_opt(req, req_len, &q, &opt) == 0;
+  struct response_writer w = {
+    .buf = NULL,
+    .len = 0,
+    .size = LOCAL_INITIAL_RESPONSE_SIZE,
+    .limit = LOCAL_MAX_TCP_RESPONSE,
+  };
+  if (udp) {
+    w.limit = edns && opt.rclass > LOCAL_INITIAL_RESPONSE_SIZE ? opt.rclass :
+                                                                 LOCAL_INITIAL_RESPONSE_SIZE;
+    if (w.limit > DNS_WIRE_EDNS_UDP_SIZE) {
+      w.limit = DNS_WIRE_EDNS_UDP_SIZE;
+    }
+  }
+  if (edns) {
+    w.limit -= DNS_WIRE_OPT_LENGTH;  // room for our OPT record
+  }
+  w.buf = (char *)malloc(w.size);
+  if (w.buf == NULL) {
+    FLOG("Out of mem");
+  }
+  w.len = dns_wire_start_response(w.buf, req, &q, DNS_WIRE_RCODE_NOERROR);
+  w.buf[2] |= HEADER_FLAG_AA;
+
+  int rcode = DNS_WIRE_RCODE_NXDOMAIN;
+  if (name != NO_INDEX) {
+    rcode = write_answers(&w, d, name, q.qtype);
+  } else if (write_soa(&w, origin, DNS_WIRE_HEADER_LENGTH + origin_offset) != 0) {
+    rcode = -1;
+  }
+  if (rcode < 0) {
+    w.buf[2] |= HEADER_FLAG_TC;  // retry over TCP
+    rcode = DNS_WIRE_RCODE_NOERROR;
+  }
+  w.buf[3] |= (char)rcode;
+
+  if (edns) {
+    w.limit += DNS_WIRE_OPT_LENGTH;
+    (void)writer_reserve(&w, DNS_WIRE_OPT_LENGTH);
+    w.len = dns_wire_add_opt(w.buf, w.len);
+  }
+  *resp_len = w.len;
+  return w.buf;
+}
+
+// Reloading
+
+static void * reload_thread(void *arg) {
+  local_zone_t *lz = (local_zone_t *)arg;
+  lz->reloaded = data_load(lz->hosts_path, lz->zone_path);
+  ev_async_send(lz->loop, &lz->reload_done);
+  return NULL;
+}
+
+static void reload_done_cb(struct ev_loop __attribute__((unused)) *loop, ev_async *w,
+                           int __attribute__((unused)) revents) {
+  local_zone_t *lz = (local_zone_t *)w->data;
+  if (!lz->reloading) {
+    return;
+  }
+  pthread_join(lz->thread, NULL);
+  lz->reloading = 0;
+  if (lz->reloaded == NULL) {
+    ELOG("Local zone reload failed, keeping the old one");
+    return;
+  }
+  data_free(lz->data);
+  lz->data = lz->reloaded;
+  lz->reloaded = NULL;
+}
+
+void local_zone_init(local_zone_t *lz, struct ev_loop *loop,
+                     const char *hosts_path, const char *zone_path) {
+  memset(lz, 0, sizeof(local_zone_t));
+  lz->loop = loop;
+  lz->hosts_path = hosts_path;
+  lz->zone_path = zone_path;
+  ev_async_init(&lz->reload_done, reload_done_cb);
+  lz->reload_done.data = lz;
+  ev_async_start(loop, &lz->reload_done);
+  ev_unref(loop);  // does not keep the loop alive
+  lz->data = data_load(hosts_path, zone_path);
+  if (lz->data == NULL) {  // nothing to keep, answers nothing
+    lz->data = data_create();
+    finish_records(lz->data);
+  }
+}
+
+void local_zone_reload(local_zone_t *lz) {
+  if (lz->reloading) {
+    WLOG("Local zone reload is in progress already");
+    return;
+  }
+  ILOG("Reloading local zone");
+  lz->reloading = 1;
+  // signals are handled by the main thread
+  sigset_t all_signals;
+  sigset_t old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+  const int rc = pthread_create(&lz->thread, NULL, reload_thread, lz);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  if (rc != 0) {
+    ELOG("Failed to start local zone reload: %s", strerror(rc));
+    lz->reloading = 0;
+  }
+}
+
+void local_zone_cleanup(local_zone_t *lz) {
+  ev_ref(lz->loop);
+  ev_async_stop(lz->loop, &lz->reload_done);
+  if (lz->reloading) {
+    pthread_join(lz->thread, NULL);
+    data_free(lz->reloaded);
+    lz->reloading = 0;
+  }
+  data_free(lz->data);
+  lz->data = NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef _LOCAL_ZONE_H_
+#define _LOCAL_ZONE_H_
+
+// Local answers from a hosts file and a simple zone file.
+//
+// Both files are compiled into a read-only table of wire format names with
+// an open addressing hash index, consulted before anything is forwarded.
+// A, AAAA, CNAME and PTR records are supported; hosts entries also get PTR
+// records for their address. Names below an $ORIGIN of the zone file which
+// are not in it are answered with NXDOMAIN, so they never leave the host.
+// These answers, and NODATA answers for names below an $ORIGIN, carry an
+// SOA of the origin, its TTL the $TTL in effect at the $ORIGIN line, so
+// clients cache them as negative answers (RFC 2308).
+//
+// local_zone_reload() rebuilds the table in a thread, the new one replaces
+// the old one in the loop thread, between two lookups. If a file can't be
+// read, the old table is kept.
+
+#include <ev.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct local_zone_data;
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+typedef struct {
+  struct ev_loop *loop;
+  const char *hosts_path;  // NULL if not used
+  const char *zone_path;  // NULL if not used
+
+  struct local_zone_data *data;  // used by the loop thread only
+
+  pthread_t thread;
+  uint8_t reloading;
+  struct local_zone_data *reloaded;  // handed over by the thread
+  ev_async reload_done;
+} local_zone_t;
+
+// Loads the files, errors are logged and the invalid lines skipped. Nothing
+// is answered locally if a file can't be read.
+void local_zone_init(local_zone_t *lz, struct ev_loop *loop,
+                     const char *hosts_path, const char *zone_path);
+
+// Starts rebuilding the table from the files, if not in progress already.
+// Keeps the old table if a file can't be read.
+void local_zone_reload(local_zone_t *lz);
+
+// Returns a response (to be freed by the caller) if the question of 'req'
+// is answered locally, NULL if it is to be forwarded. Responses over UDP
+// are limited to the EDNS buffer size of the request.
+char * local_zone_answer(local_zone_t *lz, const char *req, size_t req_len,
+                         int udp, size_t *resp_len);
+
+void local_zone_cleanup(local_zone_t *lz);
+
+#endif // _LOCAL_ZONE_H_
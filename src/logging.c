@@ -1,4 +1,5 @@
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,6 +22,8 @@ static ev_signal sigusr2;                            // NOLINT(cppcoreguidelines
 static ev_async flight_recorder_async;               // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 static struct ev_loop *logging_loop = NULL;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 static struct ring_buffer * flight_recorder = NULL;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+// HTTPS worker threads log too, serializes output and flight recorder
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 static const char * const SeverityStr[] = {
   "[D]",
@@ -42,7 +45,9 @@ void logging_timer_cb(struct ev_loop __attribute__((unused)) *loop,
 void logging_flight_recorder_dump(void) {
   if (flight_recorder) {
     ILOG("Flight recorder dump");  // will be also at the end of the dump :)
+    pthread_mutex_lock(&log_mutex);  // against worker threads pushing
     ring_buffer_dump(flight_recorder, logfile);
+    pthread_mutex_unlock(&log_mutex);
   } else {
     ILOG("Flight recorder is disabled");
   }
@@ -124,14 +129,6 @@ void _log(const char *file, int line, int severity, const char *fmt, ...) {
   if (severity < 0 || severity >= LOG_MAX) {
     FLOG("Unknown log severity: %d", severity);
   }
-  if (!logfile) {
-    logfile = fdopen(STDOUT_FILENO, "w");
-    if (!logfile) {
-      // Can't even log to stdout, abort
-      abort();
-    }
-  }
-
   struct timeval tv;
   gettimeofday(&tv, NULL);
 
@@ -158,11 +155,21 @@ void _log(const char *file, int line, int severity, const char *fmt, ...) {
     buff[buff_pos - 1] = '$'; // indicate truncation
   }
 
+  pthread_mutex_lock(&log_mutex);
+  if (!logfile) {
+    logfile = fdopen(STDOUT_FILENO, "w");
+    if (!logfile) {
+      // Can't even log to stdout, abort
+      abort();
+    }
+  }
+
   if (flight_recorder) {
     ring_buffer_push_back(flight_recorder, buff, buff_pos);
   }
 
   if (severity < loglevel) {
+    pthread_mutex_unlock(&log_mutex);
     return;
   }
   (void)fprintf(logfile, "%s\n", buff);
@@ -174,10 +181,12 @@ void _log(const char *file, int line, int severity, const char *fmt, ...) {
     if (flight_recorder) {
       ring_buffer_dump(flight_recorder, logfile);
     }
+    pthread_mutex_unlock(&log_mutex);  // exit handlers and other threads may log
 #ifdef DEBUG
     abort();
 #else
     exit(1);
 #endif
   }
+  pthread_mutex_unlock(&log_mutex);
 }
@@ -13,32 +13,83 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+#include "admission.h"
+#include "affinity.h"
+#include "blocklist.h"
+#include "cache.h"
+#include "cache_snapshot.h"
+#include "cache_warmup.h"
 #include "dns_poller.h"
 #include "dns_server.h"
+#include "dns_server_doh.h"
 #include "dns_server_tcp.h"
+#include "dns_wire.h"
+#include "ecs.h"
+#include "forward_rules.h"
 #include "https_client.h"
+#include "https_group.h"
+#include "https_pool.h"
+#include "local_zone.h"
 #include "logging.h"
 #include "options.h"
+#include "rate_limit.h"
 #include "stat.h"
+#include "synthesis.h"
+#include "tls_server.h"
+#include "ttl_policy.h"
+#include "uring.h"
 
-// Holds app state required for dns_server_cb.
+// Holds an upstream resolver with its own connections and bootstrapping.
 // NOLINTNEXTLINE(altera-struct-pack-align)
 typedef struct {
-  https_client_t *https_client;
-  struct curl_slist *resolv;
   const char *resolver_url;
-  stat_t *stat;
+  https_group_t https_group;
+  https_pool_t *https_pool;  // if not NULL, used instead of https_group
+  struct curl_slist *resolv;
   uint8_t using_dns_poller;
+  dns_poller_t dns_poller;
+  char hostname[255];  // Domain names shouldn't exceed 253 chars.
+  struct app_state_s *app;
+} upstream_t;
+
+// Holds app state required for dns_server_cb.
+// NOLINTNEXTLINE(altera-struct-pack-align)
+typedef struct app_state_s {
+  upstream_t *upstreams;  // the first one is the default
+  uint8_t upstream_count;
+  uint8_t bootstrap_pending;  // upstreams waiting for their first addresses
+  forward_rules_t *forward_rules;  // NULL if everything goes to the default
+  cache_t *cache;  // NULL if disabled
+  local_zone_t *local_zone;  // NULL if disabled
+  synthesis_t *synthesis;  // NULL if disabled
+  ttl_policy_t *ttl_policy;  // NULL if disabled
+  uint8_t failure_answer;  // enum failure_answer
+  admission_t *admission;  // NULL if upstream requests are not limited
+  rate_limit_t *rate_limit;  // NULL if clients are not limited
+  blocklist_t *blocklist;  // NULL if disabled
+  cache_warmup_t *cache_warmup;  // started after bootstrapping, NULL if disabled
+  stat_t *stat;
+  uint8_t ecs_enabled;
+  uint8_t ecs_ipv4_prefix;
+  uint8_t ecs_ipv6_prefix;
   socklen_t addrlen;
 } app_state_t;
 
 // NOLINTNEXTLINE(altera-struct-pack-align)
 typedef struct {
   void *dns_server;
-  uint8_t is_tcp;
+  uint8_t transport;
   char* dns_req;
   size_t dns_req_len;
+  char *upstream_req;  // dns_req, or a copy with client subnet added
+  size_t upstream_req_len;
+  uint8_t ecs_added;
+  upstream_t *upstream;
+  ttl_policy_t *ttl_policy;
+  uint8_t failure_answer;
+  admission_t *admission;
   stat_t *stat;
+  cache_t *cache;
   ev_tstamp start_tstamp;
   uint16_t tx_id;
   struct sockaddr_storage raddr;
@@ -54,7 +105,7 @@ static int hostname_from_url(const char* url_in,
   int res = 0;
   CURLU *url = curl_url();
   if (url != NULL) {
-    CURLUcode rc = curl_url_set(url, CURLUPART_URL, url_in, 0);
+    CURLUcode rc = curl_url_set(url, CURLUPART_URL, url_in, CURLU_NON_SUPPORT_SCHEME);  // quic://
     if (rc == CURLUE_OK) {
       char *host = NULL;
       rc = curl_url_get(url, CURLUPART_HOST, &host, 0);
@@ -89,7 +140,94 @@ static void sigpipe_cb(struct ev_loop __attribute__((__unused__)) *loop,
   ELOG("Received SIGPIPE. Ignoring.");
 }
 
-static void https_resp_cb(void *data, char *buf, size_t buflen) {
+static void sighup_cb(struct ev_loop __attribute__((__unused__)) *loop,
+                      ev_signal *w, int __attribute__((__unused__)) revents) {
+  app_state_t *app = (app_state_t *)w->data;
+  if (app->local_zone != NULL) {
+    local_zone_reload(app->local_zone);
+  }
+  if (app->blocklist != NULL) {
+    blocklist_reload(app->blocklist);
+  }
+}
+
+static void respond(void *dns_server, uint8_t transport, struct sockaddr *raddr,
+                    char *dns_req, size_t dns_req_len, char *buf, size_t buflen) {
+  if (transport == DNS_TRANSPORT_TCP) {
+    dns_server_tcp_respond((dns_server_tcp_t *)dns_server, raddr, buf, buflen);
+  } else if (transport == DNS_TRANSPORT_HTTPS) {
+    dns_server_doh_respond(dns_server, buf, buflen);
+  } else {
+    dns_server_respond((dns_server_t *)dns_server, raddr, dns_req, dns_req_len, buf, buflen);
+  }
+}
+
+// Extended DNS Errors (RFC 8914) of upstream failures.
+static const struct {
+  uint16_t info_code;
+  const char *text;
+} failure_errors[] = {
+  [HTTPS_OK] = {0, ""},
+  [HTTPS_FAILURE_ABORTED] = {0, "upstream request aborted"},  // Other Error
+  [HTTPS_FAILURE_TIMEOUT] = {22, "upstream timed out"},  // No Reachable Authority
+  [HTTPS_FAILURE_CONNECT] = {23, "upstream connection failed"},  // Network Error
+  [HTTPS_FAILURE_TLS] = {23, "upstream TLS failure"},
+  [HTTPS_FAILURE_HTTP_STATUS] = {23, "upstream HTTP error status"},
+  [HTTPS_FAILURE_RESPONSE] = {0, "invalid upstream response"},
+};
+
+// Answers SERVFAIL, or REFUSED, right away, so the client does not wait for
+// its own timeout before retrying.
+static void respond_failure(request_t *req, uint8_t rcode, uint16_t info_code,
+                            const char *text) {
+  if (req->transport == DNS_TRANSPORT_HTTPS) {
+    dns_server_doh_respond(req->dns_server, NULL, 0);  // HTTP error status instead of silence
+    if (req->stat) {
+      stat_request_end(req->stat, 0, ev_now(req->stat->loop) - req->start_tstamp,
+                       req->transport != DNS_TRANSPORT_UDP);
+    }
+    return;
+  }
+  struct dns_wire_question q;
+  if (req->failure_answer == FAILURE_ANSWER_DROP ||
+      dns_wire_question(req->dns_req, req->dns_req_len, &q) != 0) {
+    return;
+  }
+  char resp[DNS_WIRE_HEADER_LENGTH + DNS_WIRE_MAX_NAME_LENGTH + 4 + DNS_WIRE_OPT_LENGTH +
+            DNS_WIRE_OPTION_HEADER_LENGTH + 2 + 32];
+  size_t resp_len = dns_wire_start_response(resp, req->dns_req, &q, rcode);
+  struct dns_wire_rr opt;
+  if (dns_wire_find_opt(req->dns_req, req->dns_req_len, &q, &opt) == 0) {
+    if (req->failure_answer == FAILURE_ANSWER_EDE) {
+      char ede[2 + 32];
+      const size_t text_len = strlen(text);
+      dns_wire_set_u16(ede, 0, info_code);
+      memcpy(ede + 2, text, text_len);
+      resp_len = dns_wire_add_opt_option(resp, resp_len, DNS_WIRE_OPTION_EDE,
+                                         ede, (uint16_t)(2 + text_len));
+    } else {
+      resp_len = dns_wire_add_opt(resp, resp_len);
+    }
+  }
+  DLOG("%04hX: Answered %s, %s", req->tx_id,
+       rcode == DNS_WIRE_RCODE_REFUSED ? "REFUSED" : "SERVFAIL", text);
+  respond(req->dns_server, req->transport, (struct sockaddr*)&req->raddr,
+          req->dns_req, req->dns_req_len, resp, resp_len);
+  if (req->stat) {
+    stat_request_end(req->stat, resp_len, ev_now(req->stat->loop) - req->start_tstamp,
+                     req->transport != DNS_TRANSPORT_UDP);
+  }
+}
+
+static void request_free(request_t *req) {
+  if (req->upstream_req != req->dns_req) {
+    free(req->upstream_req);
+  }
+  free((void*)req->dns_req);
+  free(req);
+}
+
+static void https_resp_cb(void *data, char *buf, size_t buflen, uint8_t failure) {
   request_t *req = (request_t *)data;
   if (req == NULL) {
     FLOG("Request data is NULL (buflen: %zu)", buflen);
@@ -99,29 +237,115 @@ static void https_resp_cb(void *data, char *buf, size_t buflen) {
   if (buf != NULL) { // May be NULL for timeout, DNS failure, or something similar.
     if (buflen < DNS_HEADER_LENGTH) {
       WLOG("%04hX: Malformed response received, too short: %u", req->tx_id, buflen);
+      failure = HTTPS_FAILURE_RESPONSE;
     } else {
       const uint16_t response_id = ntohs(*((uint16_t*)buf));
       if (req->tx_id != response_id) {
         WLOG("DNS request and response IDs are not matching: %hX != %hX",
              req->tx_id, response_id);
+        failure = HTTPS_FAILURE_RESPONSE;
       } else {
-        if (req->is_tcp) {
-          dns_server_tcp_respond((dns_server_tcp_t *)req->dns_server, (struct sockaddr*)&req->raddr, buf, buflen);
-        } else {
-          dns_server_respond((dns_server_t *)req->dns_server, (struct sockaddr*)&req->raddr,
-            req->dns_req, req->dns_req_len, buf, buflen);
+        if (req->ttl_policy) {
+          ttl_policy_apply(req->ttl_policy, buf, buflen);  // cached clamped too
+        }
+        if (req->cache) {
+          cache_store(req->cache, req->upstream_req, req->upstream_req_len, buf, buflen);
+        }
+        ecs_strip_response(buf, &buflen, req->ecs_added);
+        if (req->dns_server != NULL) {  // NULL for cache warm-up
+          respond(req->dns_server, req->transport, (struct sockaddr*)&req->raddr,
+                  req->dns_req, req->dns_req_len, buf, buflen);
+        }
+        if (req->transport == DNS_TRANSPORT_HTTPS) {
+          req->dns_server = NULL;  // stream released
         }
         if (req->stat) {
-          stat_request_end(req->stat, buflen, ev_now(req->stat->loop) - req->start_tstamp, req->is_tcp);
+          stat_request_end(req->stat, buflen, ev_now(req->stat->loop) - req->start_tstamp,
+                           req->transport != DNS_TRANSPORT_UDP);
         }
       }
     }
   }
-  free((void*)req->dns_req);
-  free(req);
+  if (failure != HTTPS_OK && req->dns_server != NULL) {
+    respond_failure(req, DNS_WIRE_RCODE_SERVFAIL, failure_errors[failure].info_code,
+                    failure_errors[failure].text);
+  }
+  admission_t *admission = req->admission;
+  request_free(req);
+  if (admission != NULL) {
+    admission_done(admission);  // may start the next request
+  }
+}
+
+// Returns the request to forward and look up in the cache.
+static char * upstream_request(app_state_t *app, char *dns_req, size_t dns_req_len,
+                               struct sockaddr *raddr, size_t *upstream_req_len,
+                               uint8_t *ecs_added) {
+  *upstream_req_len = dns_req_len;
+  *ecs_added = ECS_NOT_ADDED;
+  if (!app->ecs_enabled) {
+    return dns_req;
+  }
+  char *ecs_req = ecs_add_client_subnet(dns_req, dns_req_len, raddr, app->ecs_ipv4_prefix,
+                                        app->ecs_ipv6_prefix, upstream_req_len, ecs_added);
+  return ecs_req != NULL ? ecs_req : dns_req;
+}
+
+// Returns the upstream of the most specific forwarding rule of the question.
+static upstream_t * select_upstream(app_state_t *app, const char *dns_req, size_t dns_req_len) {
+  struct dns_wire_question q;
+  if (app->forward_rules == NULL || dns_wire_question(dns_req, dns_req_len, &q) != 0) {
+    return &app->upstreams[0];
+  }
+  return &app->upstreams[forward_rules_match(app->forward_rules, dns_req + q.qname_offset,
+                                             q.qname_length)];
 }
 
-static void dns_server_cb(void *dns_server, uint8_t is_tcp, void *data,
+static void request_fetch(request_t *req) {
+  upstream_t *upstream = req->upstream;
+  if (upstream->https_pool != NULL) {
+    https_pool_fetch(upstream->https_pool, upstream->resolver_url, req->upstream_req,
+                     req->upstream_req_len, req->tx_id, https_resp_cb, req);
+    return;
+  }
+  https_group_fetch(&upstream->https_group, upstream->resolver_url, req->upstream_req,
+                    req->upstream_req_len, upstream->resolv, req->tx_id, https_resp_cb, req);
+}
+
+static void admission_start(void __attribute__((unused)) *data, void *item) {
+  request_fetch((request_t *)item);
+}
+
+static const char * const shed_texts[] = {
+  [ADMISSION_SHED_FULL] = "proxy overloaded",
+  [ADMISSION_SHED_EXPIRED] = "proxy overloaded, query expired",
+  [ADMISSION_SHED_STOPPED] = "proxy shutting down",
+};
+
+static void admission_shed(void __attribute__((unused)) *data, void *item, uint8_t reason) {
+  request_t *req = (request_t *)item;
+  DLOG("%04hX: Shed, %s", req->tx_id, shed_texts[reason]);
+  if (req->dns_server != NULL) {
+    respond_failure(req, DNS_WIRE_RCODE_SERVFAIL, 0, shed_texts[reason]);  // Other Error
+  }
+  request_free(req);
+}
+
+// Answers with a response built by the proxy itself, and frees both.
+static void respond_local(app_state_t *app, void *dns_server, uint8_t transport,
+                          struct sockaddr *addr, char *dns_req, size_t dns_req_len,
+                          char *resp, size_t resp_len, const char *what) {
+  DLOG("%04hX: %s", ntohs(*((uint16_t*)dns_req)), what);
+  if (app->stat) {
+    stat_request_begin(app->stat, dns_req_len, transport != DNS_TRANSPORT_UDP);
+    stat_request_end(app->stat, resp_len, 0, transport != DNS_TRANSPORT_UDP);
+  }
+  respond(dns_server, transport, addr, dns_req, dns_req_len, resp, resp_len);
+  free(resp);
+  free(dns_req);
+}
+
+static void dns_server_cb(void *dns_server, uint8_t transport, void *data,
                           struct sockaddr* tmp_remote_addr,
                           char *dns_req, size_t dns_req_len) {
   app_state_t *app = (app_state_t *)data;
@@ -129,11 +353,74 @@ static void dns_server_cb(void *dns_server, uint8_t is_tcp, void *data,
   uint16_t tx_id = ntohs(*((uint16_t*)dns_req));
   DLOG("Received request for id: %hX, len: %d", tx_id, dns_req_len);
 
+  if (app->local_zone) {
+    size_t resp_len = 0;
+    char *resp = local_zone_answer(app->local_zone, dns_req, dns_req_len,
+                                   transport == DNS_TRANSPORT_UDP, &resp_len);
+    if (resp != NULL) {
+      respond_local(app, dns_server, transport, tmp_remote_addr, dns_req, dns_req_len,
+                    resp, resp_len, "Answered from local zone");
+      return;
+    }
+  }
+
+  if (app->synthesis) {
+    size_t resp_len = 0;
+    char *resp = synthesis_answer(app->synthesis, dns_req, dns_req_len, &resp_len);
+    if (resp != NULL) {
+      respond_local(app, dns_server, transport, tmp_remote_addr, dns_req, dns_req_len,
+                    resp, resp_len, "Synthesized");
+      return;
+    }
+  }
+
+  if (app->blocklist) {
+    size_t resp_len = 0;
+    char *resp = blocklist_answer(app->blocklist, dns_req, dns_req_len, &resp_len);
+    if (resp != NULL) {
+      respond_local(app, dns_server, transport, tmp_remote_addr, dns_req, dns_req_len,
+                    resp, resp_len, "Blocked");
+      return;
+    }
+  }
+
+  size_t upstream_req_len = 0;
+  uint8_t ecs_added = ECS_NOT_ADDED;
+  char *upstream_req = upstream_request(app, dns_req, dns_req_len, tmp_remote_addr,
+                                        &upstream_req_len, &ecs_added);
+
+  if (app->cache) {
+    size_t resp_len = 0;
+    char *resp = cache_lookup(app->cache, upstream_req, upstream_req_len, &resp_len);
+    if (resp != NULL) {
+      DLOG("%04hX: Answered from cache", tx_id);
+      if (app->stat) {
+        stat_request_begin(app->stat, dns_req_len, transport != DNS_TRANSPORT_UDP);
+        stat_request_end(app->stat, resp_len, 0, transport != DNS_TRANSPORT_UDP);
+      }
+      ecs_strip_response(resp, &resp_len, ecs_added);
+      respond(dns_server, transport, tmp_remote_addr, dns_req, dns_req_len, resp, resp_len);
+      free(resp);
+      if (upstream_req != dns_req) {
+        free(upstream_req);
+      }
+      free(dns_req);
+      return;
+    }
+  }
+
   // If we're not yet bootstrapped, don't answer. libcurl will fall back to
   // gethostbyname() which can cause a DNS loop due to the nameserver listed
   // in resolv.conf being or depending on https_dns_proxy itself.
-  if(app->using_dns_poller && (app->resolv == NULL || app->resolv->data == NULL)) {
+  upstream_t *upstream = select_upstream(app, dns_req, dns_req_len);
+  if(upstream->using_dns_poller && (upstream->resolv == NULL || upstream->resolv->data == NULL)) {
     WLOG("%04hX: Query received before bootstrapping is completed, discarding.", tx_id);
+    if (transport == DNS_TRANSPORT_HTTPS) {
+      dns_server_doh_respond(dns_server, NULL, 0);
+    }
+    if (upstream_req != dns_req) {
+      free(upstream_req);
+    }
     free(dns_req);
     return;
   }
@@ -145,17 +432,58 @@ static void dns_server_cb(void *dns_server, uint8_t is_tcp, void *data,
   req->tx_id = tx_id;
   memcpy(&req->raddr, tmp_remote_addr, app->addrlen);
   req->dns_server = dns_server;
-  req->is_tcp = is_tcp;
+  req->transport = transport;
   req->dns_req = dns_req;  // To free buffer after https request is complete.
   req->dns_req_len = dns_req_len;
+  req->upstream_req = upstream_req;
+  req->upstream_req_len = upstream_req_len;
+  req->ecs_added = ecs_added;
+  req->upstream = upstream;
+  req->ttl_policy = app->ttl_policy;
+  req->failure_answer = app->failure_answer;
+  req->admission = app->admission;
   req->stat = app->stat;
+  req->cache = app->cache;
 
   if (req->stat) {
     req->start_tstamp = ev_now(app->stat->loop);
-    stat_request_begin(app->stat, dns_req_len, is_tcp);
+    stat_request_begin(app->stat, dns_req_len, transport != DNS_TRANSPORT_UDP);
+  }
+  if (app->rate_limit != NULL && !rate_limit_allow(app->rate_limit, tmp_remote_addr)) {
+    respond_failure(req, DNS_WIRE_RCODE_REFUSED, 0, "client over rate limit");  // Other Error
+    request_free(req);
+    return;
+  }
+  if (req->admission != NULL) {
+    admission_submit(req->admission, req, rate_limit_client_hash(tmp_remote_addr), 1);
+  } else {
+    request_fetch(req);
+  }
+}
+
+static void warmup_fetch_cb(void *data, char *dns_req, size_t dns_req_len) {
+  app_state_t *app = (app_state_t *)data;
+  request_t *req = (request_t *)calloc(1, sizeof(request_t));
+  if (req == NULL) {
+    FLOG("Out of mem");
+  }
+  req->tx_id = ntohs(*((uint16_t*)dns_req));
+  req->dns_server = NULL;  // nobody to respond to
+  req->transport = DNS_TRANSPORT_UDP;
+  req->dns_req = dns_req;
+  req->dns_req_len = dns_req_len;
+  // with client subnets, a /0 one asks for answers shared by all clients
+  req->upstream_req = upstream_request(app, dns_req, dns_req_len, NULL,
+                                       &req->upstream_req_len, &req->ecs_added);
+  req->upstream = select_upstream(app, dns_req, dns_req_len);  // all are bootstrapped
+  req->ttl_policy = app->ttl_policy;
+  req->admission = app->admission;
+  req->cache = app->cache;
+  if (req->admission != NULL) {
+    admission_submit(req->admission, req, 0, 0);  // not worth waiting for
+  } else {
+    request_fetch(req);
   }
-  https_client_fetch(app->https_client, app->resolver_url,
-                     req->dns_req, dns_req_len, app->resolv, req->tx_id, https_resp_cb, req);
 }
 
 static void systemd_notify_ready(void) {
@@ -208,7 +536,8 @@ static int addr_list_reduced(const char* full_list, const char* list) {
 
 static void dns_poll_cb(const char* hostname, void *data,
                         const char* addr_list) {
-  app_state_t *app = (app_state_t *)data;
+  upstream_t *upstream = (upstream_t *)data;
+  app_state_t *app = upstream->app;
   char buf[255 + (sizeof(":443:") - 1) + POLLER_ADDR_LIST_SIZE];
   memset(buf, 0, sizeof(buf));
   if (strlen(hostname) > 254) { FLOG("Hostname too long."); }
@@ -217,11 +546,9 @@ static void dns_poll_cb(const char* hostname, void *data,
     abort();  // must be impossible
   }
   (void)snprintf(buf + ip_start, sizeof(buf) - 1 - (uint32_t)ip_start, "%s", addr_list);
-  if (app->resolv == NULL) {
-    systemd_notify_ready();
-  }
-  if (app->resolv && app->resolv->data) {
-    char * old_addr_list = strstr(app->resolv->data, ":443:");
+  const uint8_t bootstrapped = (upstream->resolv == NULL);
+  if (upstream->resolv && upstream->resolv->data) {
+    char * old_addr_list = strstr(upstream->resolv->data, ":443:");
     if (old_addr_list) {
       old_addr_list += sizeof(":443:") - 1;
       if (!addr_list_reduced(addr_list, old_addr_list)) {
@@ -233,11 +560,99 @@ static void dns_poll_cb(const char* hostname, void *data,
   }
   free((void*)addr_list);
   DLOG("Received new DNS server IP '%s'", buf + ip_start);
-  curl_slist_free_all(app->resolv);
-  app->resolv = curl_slist_append(NULL, buf);
+  curl_slist_free_all(upstream->resolv);
+  upstream->resolv = curl_slist_append(NULL, buf);
   // Resets curl or it gets in a mess due to IP of streaming connection not
   // matching that of configured DNS.
-  https_client_reset(app->https_client);
+  if (upstream->https_pool != NULL) {
+    https_pool_set_resolv(upstream->https_pool, upstream->resolv);
+  } else {
+    https_group_reset(&upstream->https_group);
+  }
+  if (bootstrapped && --app->bootstrap_pending == 0) {
+    systemd_notify_ready();
+    if (app->cache_warmup != NULL) {
+      cache_warmup_start(app->cache_warmup);
+    }
+  }
+}
+
+// Copies the next of the comma-separated domains ending at 'end' into 'buf',
+// returns the position after it.
+static const char * next_domain(const char *domain, const char *end,
+                                char buf[DNS_WIRE_MAX_NAME_LENGTH + 1]) {
+  const char *comma = domain;
+  while (comma < end && *comma != ',') {
+    comma++;
+  }
+  const size_t len = (size_t)(comma - domain);
+  if (len > DNS_WIRE_MAX_NAME_LENGTH) {
+    FLOG("Domain too long: %.*s", (int)len, domain);
+  }
+  memcpy(buf, domain, len);
+  buf[len] = '\0';
+  return comma + 1;
+}
+
+// Creates the upstreams of the resolver URL and of the forwarding rules,
+// rules with the same URL share an upstream.
+static void upstreams_create(app_state_t *app, struct Options *opt) {
+  app->upstreams = (upstream_t *)calloc(1 + (size_t)opt->forward_count, sizeof(upstream_t));
+  if (app->upstreams == NULL) {
+    FLOG("Out of mem");
+  }
+  app->upstreams[0].resolver_url = opt->resolver_url;
+  app->upstream_count = 1;
+  app->forward_rules = NULL;
+  for (int i = 0; i < opt->forward_count; i++) {
+    const char *domains = opt->forwards[i];
+    const char *url = strchr(domains, '=') + 1;  // checked by options
+    uint8_t index = 0;
+    while (index < app->upstream_count && strcmp(app->upstreams[index].resolver_url, url) != 0) {
+      index++;
+    }
+    if (index == app->upstream_count) {
+      app->upstreams[app->upstream_count++].resolver_url = url;
+    }
+    if (app->forward_rules == NULL) {
+      app->forward_rules = forward_rules_create();
+    }
+    for (const char *domain = domains; domain < url; ) {
+      char buf[DNS_WIRE_MAX_NAME_LENGTH + 1];
+      domain = next_domain(domain, url - 1, buf);
+      if (forward_rules_add(app->forward_rules, buf, index) != 0) {
+        FLOG("Invalid forwarded domain: %s", buf);
+      }
+      ILOG("Forwarding %s to %s", buf, url);
+    }
+  }
+  for (uint8_t i = 0; i < app->upstream_count; i++) {
+    app->upstreams[i].app = app;
+  }
+}
+
+static ttl_policy_t * ttl_policy_from_options(struct Options *opt) {
+  if (opt->min_ttl == 0 && opt->max_ttl == 0 && opt->ttl_override_count == 0) {
+    return NULL;
+  }
+  ttl_policy_t *p = ttl_policy_create((uint32_t)opt->min_ttl, (uint32_t)opt->max_ttl);
+  for (int i = 0; i < opt->ttl_override_count; i++) {
+    const char *domains = opt->ttl_overrides[i];
+    const char *limits = strchr(domains, '=');  // checked by options
+    unsigned min_ttl = 0;
+    unsigned max_ttl = 0;
+    if (sscanf(limits + 1, "%u:%u", &min_ttl, &max_ttl) != 2) {  // NOLINT(cert-err34-c)
+      FLOG("Invalid TTL override: %s", domains);
+    }
+    for (const char *domain = domains; domain < limits + 1; ) {
+      char buf[DNS_WIRE_MAX_NAME_LENGTH + 1];
+      domain = next_domain(domain, limits, buf);
+      if (ttl_policy_add_override(p, buf, min_ttl, max_ttl) != 0) {
+        FLOG("Invalid TTL override domain: %s", buf);
+      }
+    }
+  }
+  return p;
 }
 
 static int proxy_supports_name_resolution(const char *proxy)
@@ -256,7 +671,7 @@ static int proxy_supports_name_resolution(const char *proxy)
   return 0;
 }
 
-static struct addrinfo * get_listen_address(const char *listen_addr) {
+static struct addrinfo * get_listen_address(const char *listen_addr, int listen_port) {
   struct addrinfo *ai = NULL;
   struct addrinfo hints;
   memset(&hints, 0, sizeof(struct addrinfo));
@@ -269,6 +684,12 @@ static struct addrinfo * get_listen_address(const char *listen_addr) {
          listen_addr, gai_strerror(res));
   }
 
+  if (ai->ai_family == AF_INET) {
+    ((struct sockaddr_in*) ai->ai_addr)->sin_port = htons((uint16_t)listen_port);
+  } else if (ai->ai_family == AF_INET6) {
+    ((struct sockaddr_in6*) ai->ai_addr)->sin6_port = htons((uint16_t)listen_port);
+  }
+
   return ai;
 }
 
@@ -320,6 +741,18 @@ int main(int argc, char *argv[]) {
 
   logging_init(opt.logfd, opt.loglevel, (uint32_t)opt.flight_recorder_size);
 
+  if (opt.compile_blocklist != NULL) {
+    const int64_t count = blocklist_compile(opt.compile_blocklist, opt.blocklist_sources,
+                                            opt.blocklist_source_count);
+    if (count >= 0) {
+      printf("Compiled %lld domains into %s\n", (long long)count, opt.compile_blocklist);
+      (void)fflush(stdout);  // before logging closes it
+    }
+    logging_cleanup();
+    options_cleanup(&opt);
+    return count >= 0 ? 0 : 1;
+  }
+
   ILOG("Version: %s", sw_version());
   ILOG("Built: " __DATE__ " " __TIME__);
   ILOG("System ev library: %d.%d", ev_version_major(), ev_version_minor());
@@ -356,36 +789,170 @@ int main(int argc, char *argv[]) {
   stat_t stat;
   stat_init(&stat, loop, opt.stats_interval);
 
-  https_client_t https_client;
-  https_client_init(&https_client, &opt, (opt.stats_interval ? &stat : NULL), loop);
+  app_state_t app;
+  upstreams_create(&app, &opt);
+  for (uint8_t i = 0; i < app.upstream_count && opt.upstream_threads > 0; i++) {
+    app.upstreams[i].https_pool = https_pool_create(&opt, app.upstreams[i].resolver_url,
+                                                    (opt.stats_interval ? &stat : NULL),
+                                                    loop, opt.upstream_threads);
+  }
+  // after starting upstream threads, which would inherit it
+  if (opt.listener_cpus != NULL) {
+    affinity_pin_self(opt.listener_cpus, -1, "listener");
+  }
+  for (uint8_t i = 0; i < app.upstream_count; i++) {
+    if (app.upstreams[i].https_pool == NULL) {
+      https_group_init(&app.upstreams[i].https_group, &opt, app.upstreams[i].resolver_url,
+                       (opt.stats_interval ? &stat : NULL), loop);
+    }
+  }
 
-  struct addrinfo *listen_addrinfo = get_listen_address(opt.listen_addr);
+  struct addrinfo *listen_addrinfo = get_listen_address(opt.listen_addr, opt.listen_port);
 
-  if (listen_addrinfo->ai_family == AF_INET) {
-    ((struct sockaddr_in*) listen_addrinfo->ai_addr)->sin_port = htons((uint16_t)opt.listen_port);
-  } else if (listen_addrinfo->ai_family == AF_INET6) {
-    ((struct sockaddr_in6*) listen_addrinfo->ai_addr)->sin6_port = htons((uint16_t)opt.listen_port);
+  app.cache = NULL;
+  if (opt.cache_size > 0) {
+    app.cache = cache_create((size_t)opt.cache_size * 1024);
+    stat.cache = app.cache;
   }
-
-  app_state_t app;
-  app.https_client = &https_client;
-  app.resolv = NULL;
-  app.resolver_url = opt.resolver_url;
-  app.using_dns_poller = 0;
+  cache_snapshot_t cache_snapshot;
+  if (opt.cache_file != NULL) {
+    cache_snapshot_init(&cache_snapshot, loop, app.cache, opt.cache_file,
+                        opt.cache_save_interval);
+  }
+  local_zone_t local_zone;
+  app.local_zone = NULL;
+  if (opt.hosts_file != NULL || opt.zone_file != NULL) {
+    local_zone_init(&local_zone, loop, opt.hosts_file, opt.zone_file);
+    app.local_zone = &local_zone;
+  }
+  app.synthesis = NULL;
+  if (opt.synthesis != 0 || opt.nodata_types != NULL) {
+    uint16_t nodata_types[SYNTHESIS_MAX_NODATA_TYPES];
+    const int nodata_type_count = opt.nodata_types != NULL ?
+        synthesis_parse_types(opt.nodata_types, nodata_types) : 0;  // checked by options
+    app.synthesis = synthesis_create((uint8_t)opt.synthesis, nodata_types, nodata_type_count);
+    stat.synthesis = app.synthesis;
+  }
+  app.ttl_policy = ttl_policy_from_options(&opt);
+  app.failure_answer = (uint8_t)opt.failure_answer;
+  app.admission = NULL;
+  if (opt.max_in_flight > 0) {
+    app.admission = admission_create(loop, (uint32_t)opt.max_in_flight,
+                                     (uint32_t)opt.max_pending, opt.queue_timeout / 1000.,
+                                     admission_start, admission_shed, &app);
+    stat.admission = app.admission;
+  }
+  app.rate_limit = NULL;
+  if (opt.rate_limit > 0) {
+    app.rate_limit = rate_limit_create(loop, (uint32_t)opt.rate_limit,
+                                       (uint32_t)(opt.rate_limit_burst > 0 ?
+                                                  opt.rate_limit_burst : 2 * opt.rate_limit));
+    stat.rate_limit = app.rate_limit;
+  }
+  blocklist_t blocklist;
+  app.blocklist = NULL;
+  if (opt.blocklist != NULL) {
+    blocklist_init(&blocklist, opt.blocklist, (uint8_t)opt.blocklist_answer);
+    app.blocklist = &blocklist;
+  }
+  cache_warmup_t cache_warmup;
+  app.cache_warmup = NULL;
+  if (opt.warmup_file != NULL) {
+    cache_warmup_init(&cache_warmup, loop, opt.warmup_file, opt.warmup_rate,
+                      warmup_fetch_cb, &app);
+    app.cache_warmup = &cache_warmup;
+  }
+  app.bootstrap_pending = 0;
+  app.ecs_enabled = (opt.ecs_ipv4_prefix >= 0);
+  app.ecs_ipv4_prefix = (uint8_t)opt.ecs_ipv4_prefix;
+  app.ecs_ipv6_prefix = (uint8_t)opt.ecs_ipv6_prefix;
   app.stat = (opt.stats_interval ? &stat : NULL);
   app.addrlen = listen_addrinfo->ai_addrlen;
 
+  if (opt.reuseport > 0) {
+    dns_server_reuseport_init((uint16_t)opt.reuseport);
+  }
+  dns_server_unix_mode_init(opt.unix_mode);
   dns_server_t dns_server;
   dns_server_init(&dns_server, loop, listen_addrinfo, dns_server_cb, &app);
+  if (opt.udp_incoming_cpu >= 0) {
+    dns_server_set_incoming_cpu(&dns_server, opt.udp_incoming_cpu);
+  }
 
   dns_server_tcp_t * dns_server_tcp = NULL;
   if (opt.tcp_client_limit > 0) {
     dns_server_tcp = dns_server_tcp_create(loop, listen_addrinfo, dns_server_cb, &app, (uint16_t)opt.tcp_client_limit);
   }
 
+  // Unix domain sockets for co-located clients. Remote addresses of requests
+  // are copied with the largest address length of all listeners.
+  struct addrinfo unix_addrinfo;
+  struct sockaddr_un unix_addr;
+  dns_server_t dns_server_unix;
+  uint8_t using_dns_server_unix = 0;
+  if (opt.unix_dgram_path != NULL) {
+    dns_server_unix_addrinfo(&unix_addrinfo, &unix_addr, opt.unix_dgram_path);
+    dns_server_init(&dns_server_unix, loop, &unix_addrinfo, dns_server_cb, &app);
+    using_dns_server_unix = 1;
+    app.addrlen = app.addrlen > unix_addrinfo.ai_addrlen ? app.addrlen : unix_addrinfo.ai_addrlen;
+  }
+  dns_server_tcp_t * dns_server_unix_stream = NULL;
+  if (opt.unix_stream_path != NULL) {
+    dns_server_unix_addrinfo(&unix_addrinfo, &unix_addr, opt.unix_stream_path);
+    dns_server_unix_stream = dns_server_tcp_create(loop, &unix_addrinfo, dns_server_cb, &app, (uint16_t)opt.tcp_client_limit);
+    app.addrlen = app.addrlen > unix_addrinfo.ai_addrlen ? app.addrlen : unix_addrinfo.ai_addrlen;
+  }
+
   freeaddrinfo(listen_addrinfo);
   listen_addrinfo = NULL;
 
+  dns_server_tcp_t * dns_server_dot = NULL;
+#if HAS_OPENSSL == 1
+  SSL_CTX *dot_ssl_ctx = NULL;
+  if (opt.dot_port > 0) {
+    dot_ssl_ctx = tls_server_ctx_create(opt.tls_cert, opt.tls_key, "dot");
+    listen_addrinfo = get_listen_address(opt.listen_addr, opt.dot_port);
+    dns_server_dot = dns_server_tcp_create_tls(loop, listen_addrinfo, dns_server_cb, &app,
+                                               (uint16_t)opt.tcp_client_limit, dot_ssl_ctx);
+    freeaddrinfo(listen_addrinfo);
+    listen_addrinfo = NULL;
+  }
+#endif
+
+  dns_server_doh_t * dns_server_doh = NULL;
+#if HAS_OPENSSL == 1 && HAS_NGHTTP2 == 1
+  SSL_CTX *doh_ssl_ctx = NULL;
+  if (opt.doh_port > 0) {
+    doh_ssl_ctx = tls_server_ctx_create(opt.tls_cert, opt.tls_key, "h2");
+    listen_addrinfo = get_listen_address(opt.listen_addr, opt.doh_port);
+    dns_server_doh = dns_server_doh_create(loop, listen_addrinfo, dns_server_cb, &app,
+                                           (uint16_t)opt.tcp_client_limit, doh_ssl_ctx);
+    freeaddrinfo(listen_addrinfo);
+    listen_addrinfo = NULL;
+  }
+#endif
+
+#if HAS_IO_URING == 1
+  uring_t *uring = NULL;
+  if (opt.io_uring) {
+    uring = uring_create(loop, URING_ENTRIES);
+  }
+  if (uring != NULL) {
+    dns_server_use_uring(&dns_server, uring);
+    if (dns_server_tcp != NULL) {
+      dns_server_tcp_use_uring(dns_server_tcp, uring);
+    }
+    if (using_dns_server_unix) {
+      dns_server_use_uring(&dns_server_unix, uring);
+    }
+    if (dns_server_unix_stream != NULL) {
+      dns_server_tcp_use_uring(dns_server_unix_stream, uring);
+    }
+  } else if (opt.io_uring) {
+    WLOG("Falling back to epoll");
+  }
+#endif
+
   if (opt.gid != (uid_t)-1 && setgroups(1, &opt.gid)) {
     FLOG("Failed to set groups");
   }
@@ -415,36 +982,54 @@ int main(int argc, char *argv[]) {
   ev_signal_init(&sigterm, signal_shutdown_cb, SIGTERM);
   ev_signal_start(loop, &sigterm);
 
+  ev_signal sighup;
+  ev_signal_init(&sighup, sighup_cb, SIGHUP);
+  sighup.data = &app;
+  if (app.local_zone != NULL || app.blocklist != NULL) {
+    ev_signal_start(loop, &sighup);
+  }
+
   logging_events_init(loop);
 
-  dns_poller_t dns_poller;
-  char hostname[255] = {0};  // Domain names shouldn't exceed 253 chars.
-  if (!proxy_supports_name_resolution(opt.curl_proxy)) {
-    if (hostname_from_url(opt.resolver_url, hostname, sizeof(hostname))) {
-      app.using_dns_poller = 1;
-      dns_poller_init(&dns_poller, loop, opt.bootstrap_dns,
+  const int name_resolution_by_proxy = proxy_supports_name_resolution(opt.curl_proxy);
+  for (uint8_t i = 0; i < app.upstream_count && !name_resolution_by_proxy; i++) {
+    upstream_t *upstream = &app.upstreams[i];
+    if (hostname_from_url(upstream->resolver_url, upstream->hostname,
+                          sizeof(upstream->hostname))) {
+      upstream->using_dns_poller = 1;
+      app.bootstrap_pending++;
+      dns_poller_init(&upstream->dns_poller, loop, opt.bootstrap_dns,
                       opt.bootstrap_dns_polling_interval, opt.source_addr,
-                      hostname,
+                      upstream->hostname,
                       opt.ipv4 ? AF_INET : AF_UNSPEC,
-                      dns_poll_cb, &app);
-      ILOG("DNS polling initialized for '%s'", hostname);
+                      dns_poll_cb, upstream);
+      ILOG("DNS polling initialized for '%s'", upstream->hostname);
     } else {
       ILOG("Resolver prefix '%s' doesn't appear to contain a "
-           "hostname. DNS polling disabled.", opt.resolver_url);
-
+           "hostname. DNS polling disabled.", upstream->resolver_url);
+    }
+  }
+  if (app.bootstrap_pending == 0) {  // no bootstrapping to wait for
+    if (!name_resolution_by_proxy) {
       systemd_notify_ready();
     }
+    if (app.cache_warmup != NULL) {
+      cache_warmup_start(app.cache_warmup);
+    }
   }
 
   ev_run(loop, 0);
   DLOG("loop breaked");
 
-  if (app.using_dns_poller) {
-    dns_poller_cleanup(&dns_poller);
+  for (uint8_t i = 0; i < app.upstream_count; i++) {
+    if (app.upstreams[i].using_dns_poller) {
+      dns_poller_cleanup(&app.upstreams[i].dns_poller);
+    }
+    curl_slist_free_all(app.upstreams[i].resolv);
   }
-  curl_slist_free_all(app.resolv);
 
   logging_events_cleanup(loop);
+  ev_signal_stop(loop, &sighup);
   ev_signal_stop(loop, &sigterm);
   ev_signal_stop(loop, &sigint);
   ev_signal_stop(loop, &sigpipe);
@@ -452,20 +1037,119 @@ int main(int argc, char *argv[]) {
   if (dns_server_tcp != NULL) {
     dns_server_tcp_stop(dns_server_tcp);
   }
+  if (using_dns_server_unix) {
+    dns_server_stop(&dns_server_unix);
+  }
+  if (dns_server_unix_stream != NULL) {
+    dns_server_tcp_stop(dns_server_unix_stream);
+  }
+  if (dns_server_dot != NULL) {
+    dns_server_tcp_stop(dns_server_dot);
+  }
+  if (dns_server_doh != NULL) {
+    dns_server_doh_stop(dns_server_doh);
+  }
   stat_stop(&stat);
+  if (opt.cache_file != NULL) {
+    cache_snapshot_stop(&cache_snapshot);
+  }
+  if (app.cache_warmup != NULL) {
+    cache_warmup_stop(app.cache_warmup);
+  }
 
   DLOG("re-entering loop");
   ev_run(loop, 0);
   DLOG("loop finished all events");
 
+  if (app.admission != NULL) {
+    admission_stop(app.admission);
+  }
+
+  for (uint8_t i = 0; i < app.upstream_count; i++) {
+    if (app.upstreams[i].https_pool != NULL) {
+      // before listeners, aborted requests are answered
+      https_pool_cleanup(app.upstreams[i].https_pool);
+      app.upstreams[i].https_pool = NULL;
+    }
+  }
+  if (opt.cache_file != NULL) {
+    (void)cache_snapshot_save(&cache_snapshot);  // including responses of the second phase
+  }
+
+#if HAS_IO_URING == 1
+  if (uring != NULL) {
+    uring_cleanup(uring);  // before listeners, cancelled operations may complete
+    uring = NULL;
+  }
+#endif
   dns_server_cleanup(&dns_server);
   if (dns_server_tcp != NULL) {
     dns_server_tcp_cleanup(dns_server_tcp);
     free(dns_server_tcp);
     dns_server_tcp = NULL;
   }
-  https_client_cleanup(&https_client);
+  if (using_dns_server_unix) {
+    dns_server_cleanup(&dns_server_unix);
+  }
+  if (dns_server_unix_stream != NULL) {
+    dns_server_tcp_cleanup(dns_server_unix_stream);
+    free(dns_server_unix_stream);
+    dns_server_unix_stream = NULL;
+  }
+  if (dns_server_dot != NULL) {
+    dns_server_tcp_cleanup(dns_server_dot);
+    free(dns_server_dot);
+    dns_server_dot = NULL;
+  }
+  if (dns_server_doh != NULL) {
+    dns_server_doh_cleanup(dns_server_doh);
+    free(dns_server_doh);
+    dns_server_doh = NULL;
+  }
+#if HAS_OPENSSL == 1
+  if (dot_ssl_ctx != NULL) {
+    tls_server_ctx_free(dot_ssl_ctx);
+  }
+#endif
+#if HAS_OPENSSL == 1 && HAS_NGHTTP2 == 1
+  if (doh_ssl_ctx != NULL) {
+    tls_server_ctx_free(doh_ssl_ctx);
+  }
+#endif
+  if (opt.upstream_threads == 0) {
+    for (uint8_t i = 0; i < app.upstream_count; i++) {
+      https_group_cleanup(&app.upstreams[i].https_group);
+    }
+  }
+  free(app.upstreams);
+  if (app.forward_rules != NULL) {
+    forward_rules_free(app.forward_rules);
+  }
   stat_cleanup(&stat);
+  if (app.admission != NULL) {
+    admission_free(app.admission);
+  }
+  if (app.rate_limit != NULL) {
+    rate_limit_free(app.rate_limit);
+  }
+  if (app.cache_warmup != NULL) {
+    cache_warmup_cleanup(app.cache_warmup);
+  }
+  if (app.local_zone != NULL) {
+    local_zone_cleanup(app.local_zone);
+  }
+  if (app.synthesis != NULL) {
+    synthesis_free(app.synthesis);
+  }
+  if (app.ttl_policy != NULL) {
+    ttl_policy_free(app.ttl_policy);
+  }
+  if (app.blocklist != NULL) {
+    blocklist_cleanup(app.blocklist);
+  }
+  if (app.cache != NULL) {
+    cache_cleanup(app.cache);
+  }
 
   ev_loop_destroy(loop);
   DLOG("loop destroyed");
@@ -0,0 +1,43 @@
+#include <stddef.h>
+
+#include "mpsc_queue.h"
+
+void mpsc_queue_init(struct mpsc_queue *q) {
+  atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+  atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+  q->tail = &q->stub;
+}
+
+void mpsc_queue_push(struct mpsc_queue *q, struct mpsc_node *node) {
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  struct mpsc_node *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+struct mpsc_node * mpsc_queue_pop(struct mpsc_queue *q) {
+  struct mpsc_node *tail = q->tail;
+  struct mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &q->stub) {
+    if (next == NULL) {
+      return NULL;  // empty
+    }
+    q->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&next->next, memory_order_acquire);
+  }
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+    return NULL;  // push in progress
+  }
+  // last item: put stub back to be able to detach it
+  mpsc_queue_push(q, &q->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
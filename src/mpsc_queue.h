@@ -0,0 +1,30 @@
+#ifndef _MPSC_QUEUE_H_
+#define _MPSC_QUEUE_H_
+
+// Intrusive lock-free multi-producer single-consumer FIFO queue
+// (D. Vyukov's algorithm). Any thread may push, only one thread may pop.
+//
+// Pop can miss an item while a concurrent push is half done, so producers
+// have to wake the consumer after pushing (e.g. with ev_async_send()), which
+// makes the consumer try again.
+
+#include <stdatomic.h>
+
+struct mpsc_node {
+  _Atomic(struct mpsc_node *) next;
+};
+
+struct mpsc_queue {
+  _Atomic(struct mpsc_node *) head;  // last pushed, producers side
+  struct mpsc_node *tail;  // next to pop, consumer side
+  struct mpsc_node stub;
+};
+
+void mpsc_queue_init(struct mpsc_queue *q);
+
+void mpsc_queue_push(struct mpsc_queue *q, struct mpsc_node *node);
+
+// Returns NULL if queue is empty (or the next push is in progress).
+struct mpsc_node * mpsc_queue_pop(struct mpsc_queue *q);
+
+#endif // _MPSC_QUEUE_H_
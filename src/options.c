@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <getopt.h>
 #include <grp.h>
 #include <pwd.h>
 #include <stdio.h>
@@ -7,8 +8,14 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "blocklist.h"
+#include "dns_server_doh.h"
+#include "https_group.h"
+#include "https_pool.h"
 #include "logging.h"
 #include "options.h"
+#include "synthesis.h"
 
 // Hack for platforms that don't support O_CLOEXEC.
 #ifndef O_CLOEXEC
@@ -17,13 +24,128 @@
 
 enum {
 DEFAULT_HTTP_VERSION = 2,
-MAX_TCP_CLIENTS = 200
+MAX_TCP_CLIENTS = 200,
+MAX_REUSEPORT_GROUP = 256,
+MAX_CACHE_SIZE_KB = 16 * 1024 * 1024,
+MAX_WARMUP_RATE = 10000,
+MAX_FORWARDS = OPTIONS_MAX_FORWARDS,
+MAX_TTL = 7 * 86400,
+MAX_IN_FLIGHT = 65536,
+MAX_PENDING = 1024 * 1024,
+MAX_QUEUE_TIMEOUT_MS = 60000,
+MAX_RATE_LIMIT = 100000,
+MAX_CONNECTIONS = HTTPS_GROUP_MAX_CONNECTIONS,
+MAX_STREAMS_PER_CONNECTION = 10000
 };
 
+// Options without short form, values are out of the range of characters.
+enum {
+OPT_UNIX_DGRAM = 0x100,
+OPT_UNIX_STREAM,
+OPT_UNIX_MODE,
+OPT_DOT_PORT,
+OPT_TLS_CERT,
+OPT_TLS_KEY,
+OPT_DOH_PORT,
+OPT_IO_URING,
+OPT_UPSTREAM_THREADS,
+OPT_LISTENER_CPUS,
+OPT_UPSTREAM_CPUS,
+OPT_UDP_INCOMING_CPU,
+OPT_REUSEPORT,
+OPT_CACHE_SIZE,
+OPT_CACHE_FILE,
+OPT_CACHE_SAVE_INTERVAL,
+OPT_WARMUP_FILE,
+OPT_WARMUP_RATE,
+OPT_ECS_PREFIX,
+OPT_HOSTS_FILE,
+OPT_ZONE_FILE,
+OPT_BLOCKLIST,
+OPT_BLOCKLIST_ANSWER,
+OPT_COMPILE_BLOCKLIST,
+OPT_FORWARD,
+OPT_SYNTHESIZE,
+OPT_NODATA_TYPES,
+OPT_MIN_TTL,
+OPT_MAX_TTL,
+OPT_TTL_OVERRIDE,
+OPT_FAILURE_ANSWER,
+OPT_MAX_IN_FLIGHT,
+OPT_MAX_PENDING,
+OPT_QUEUE_TIMEOUT,
+OPT_RATE_LIMIT,
+OPT_RATE_LIMIT_BURST,
+OPT_MAX_CONNECTIONS,
+OPT_STREAMS_PER_CONNECTION,
+OPT_HTTPS_ENGINE
+};
+
+static const struct option long_options[] = {
+  {"unix-dgram", required_argument, NULL, OPT_UNIX_DGRAM},
+  {"unix-stream", required_argument, NULL, OPT_UNIX_STREAM},
+  {"unix-mode", required_argument, NULL, OPT_UNIX_MODE},
+  {"dot-port", required_argument, NULL, OPT_DOT_PORT},
+  {"doh-port", required_argument, NULL, OPT_DOH_PORT},
+  {"io-uring", no_argument, NULL, OPT_IO_URING},
+  {"tls-cert", required_argument, NULL, OPT_TLS_CERT},
+  {"tls-key", required_argument, NULL, OPT_TLS_KEY},
+  {"upstream-threads", required_argument, NULL, OPT_UPSTREAM_THREADS},
+  {"listener-cpus", required_argument, NULL, OPT_LISTENER_CPUS},
+  {"upstream-cpus", required_argument, NULL, OPT_UPSTREAM_CPUS},
+  {"udp-incoming-cpu", required_argument, NULL, OPT_UDP_INCOMING_CPU},
+  {"reuseport", required_argument, NULL, OPT_REUSEPORT},
+  {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+  {"cache-file", required_argument, NULL, OPT_CACHE_FILE},
+  {"cache-save-interval", required_argument, NULL, OPT_CACHE_SAVE_INTERVAL},
+  {"warmup-file", required_argument, NULL, OPT_WARMUP_FILE},
+  {"warmup-rate", required_argument, NULL, OPT_WARMUP_RATE},
+  {"ecs-prefix", required_argument, NULL, OPT_ECS_PREFIX},
+  {"hosts-file", required_argument, NULL, OPT_HOSTS_FILE},
+  {"zone-file", required_argument, NULL, OPT_ZONE_FILE},
+  {"blocklist", required_argument, NULL, OPT_BLOCKLIST},
+  {"blocklist-answer", required_argument, NULL, OPT_BLOCKLIST_ANSWER},
+  {"compile-blocklist", required_argument, NULL, OPT_COMPILE_BLOCKLIST},
+  {"forward", required_argument, NULL, OPT_FORWARD},
+  {"synthesize", required_argument, NULL, OPT_SYNTHESIZE},
+  {"nodata-types", required_argument, NULL, OPT_NODATA_TYPES},
+  {"min-ttl", required_argument, NULL, OPT_MIN_TTL},
+  {"max-ttl", required_argument, NULL, OPT_MAX_TTL},
+  {"ttl-override", required_argument, NULL, OPT_TTL_OVERRIDE},
+  {"failure-answer", required_argument, NULL, OPT_FAILURE_ANSWER},
+  {"max-in-flight", required_argument, NULL, OPT_MAX_IN_FLIGHT},
+  {"max-pending", required_argument, NULL, OPT_MAX_PENDING},
+  {"queue-timeout", required_argument, NULL, OPT_QUEUE_TIMEOUT},
+  {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+  {"rate-limit-burst", required_argument, NULL, OPT_RATE_LIMIT_BURST},
+  {"max-connections", required_argument, NULL, OPT_MAX_CONNECTIONS},
+  {"streams-per-connection", required_argument, NULL, OPT_STREAMS_PER_CONNECTION},
+  {"https-engine", required_argument, NULL, OPT_HTTPS_ENGINE},
+  {"help", no_argument, NULL, 'h'},
+  {"version", no_argument, NULL, 'V'},
+  {NULL, 0, NULL, 0}
+};
+
+static int is_quic_url(const char *url) {
+  return strncmp(url, QUIC_URL_PREFIX, sizeof(QUIC_URL_PREFIX) - 1) == 0;
+}
+
+static int is_resolver_url(const char *url) {
+  return strncmp(url, "https://", 8) == 0 || is_quic_url(url);
+}
+
 void options_init(struct Options *opt) {
   opt->listen_addr = "127.0.0.1";
   opt->listen_port = 5053;
   opt->tcp_client_limit = 20;
+  opt->unix_dgram_path = NULL;
+  opt->unix_stream_path = NULL;
+  opt->unix_mode = -1;
+  opt->dot_port = 0;
+  opt->doh_port = 0;
+  opt->io_uring = 0;
+  opt->tls_cert = NULL;
+  opt->tls_key = NULL;
   opt->logfile = "-";
   opt->logfd = STDOUT_FILENO;
   opt->loglevel = LOG_ERROR;
@@ -46,6 +168,40 @@ void options_init(struct Options *opt) {
   opt->stats_interval = 0;
   opt->ca_info = NULL;
   opt->flight_recorder_size = 0;
+  opt->upstream_threads = 0;
+  opt->listener_cpus = NULL;
+  opt->upstream_cpus = NULL;
+  opt->udp_incoming_cpu = -1;
+  opt->reuseport = 0;
+  opt->cache_size = 0;
+  opt->cache_file = NULL;
+  opt->cache_save_interval = 0;
+  opt->warmup_file = NULL;
+  opt->warmup_rate = 50;
+  opt->ecs_ipv4_prefix = -1;
+  opt->ecs_ipv6_prefix = -1;
+  opt->hosts_file = NULL;
+  opt->zone_file = NULL;
+  opt->synthesis = 0;
+  opt->nodata_types = NULL;
+  opt->blocklist = NULL;
+  opt->blocklist_answer = BLOCKLIST_NXDOMAIN;
+  opt->compile_blocklist = NULL;
+  opt->blocklist_sources = NULL;
+  opt->blocklist_source_count = 0;
+  opt->forward_count = 0;
+  opt->min_ttl = 0;
+  opt->max_ttl = 0;
+  opt->ttl_override_count = 0;
+  opt->failure_answer = FAILURE_ANSWER_EDE;
+  opt->max_in_flight = 1024;
+  opt->max_pending = 4096;
+  opt->queue_timeout = 2000;
+  opt->rate_limit = 0;
+  opt->rate_limit_burst = 0;
+  opt->max_connections = 4;
+  opt->streams_per_connection = 64;
+  opt->https_engine = HTTPS_ENGINE_CURL;
 }
 
 int parse_int(char * str) {
@@ -59,7 +215,8 @@ int parse_int(char * str) {
 
 enum OptionsParseResult options_parse_args(struct Options *opt, int argc, char **argv) {
   int c = 0;
-  while ((c = getopt(argc, argv, "a:c:p:T:du:g:b:i:4r:e:t:l:vxqm:L:s:S:C:F:hV")) != -1) {
+  while ((c = getopt_long(argc, argv, "a:c:p:T:du:g:b:i:4r:e:t:l:vxqm:L:s:S:C:F:hV",
+                          long_options, NULL)) != -1) {
     switch (c) {
     case 'a': // listen_addr
       opt->listen_addr = optarg;
@@ -133,6 +290,205 @@ enum OptionsParseResult options_parse_args(struct Options *opt, int argc, char *
     case 'F': // Flight recorder size
       opt->flight_recorder_size = parse_int(optarg);
       break;
+    case OPT_UNIX_DGRAM:
+      opt->unix_dgram_path = optarg;
+      break;
+    case OPT_UNIX_STREAM:
+      opt->unix_stream_path = optarg;
+      break;
+    case OPT_UNIX_MODE: {
+      char *endptr = NULL;
+      long mode = strtol(optarg, &endptr, 8);
+      if (*optarg == '\0' || *endptr != '\0' || mode < 0 || mode > 0777) {
+        printf("Unix socket mode must be an octal number up to 777.\n");
+        return OPR_OPTION_ERROR;
+      }
+      opt->unix_mode = (int)mode;
+      break;
+    }
+    case OPT_DOT_PORT:
+      opt->dot_port = parse_int(optarg);
+      break;
+    case OPT_DOH_PORT:
+      opt->doh_port = parse_int(optarg);
+      break;
+    case OPT_IO_URING:
+      opt->io_uring = 1;
+      break;
+    case OPT_TLS_CERT:
+      opt->tls_cert = optarg;
+      break;
+    case OPT_TLS_KEY:
+      opt->tls_key = optarg;
+      break;
+    case OPT_UPSTREAM_THREADS:
+      opt->upstream_threads = parse_int(optarg);
+      break;
+    case OPT_LISTENER_CPUS:
+      opt->listener_cpus = optarg;
+      break;
+    case OPT_UPSTREAM_CPUS:
+      opt->upstream_cpus = optarg;
+      break;
+    case OPT_CACHE_SIZE:
+      opt->cache_size = parse_int(optarg);
+      break;
+    case OPT_CACHE_FILE:
+      opt->cache_file = optarg;
+      break;
+    case OPT_CACHE_SAVE_INTERVAL:
+      opt->cache_save_interval = parse_int(optarg);
+      break;
+    case OPT_WARMUP_FILE:
+      opt->warmup_file = optarg;
+      break;
+    case OPT_WARMUP_RATE:
+      opt->warmup_rate = parse_int(optarg);
+      break;
+    case OPT_ECS_PREFIX: {
+      char extra = 0;
+      if (sscanf(optarg, "%d,%d%c", &opt->ecs_ipv4_prefix,  // NOLINT(cert-err34-c)
+                 &opt->ecs_ipv6_prefix, &extra) != 2 ||
+          opt->ecs_ipv4_prefix < 0 || opt->ecs_ipv4_prefix > 32 ||
+          opt->ecs_ipv6_prefix < 0 || opt->ecs_ipv6_prefix > 128) {
+        printf("Invalid client subnet prefix lengths: %s\n", optarg);
+        return OPR_OPTION_ERROR;
+      }
+      break;
+    }
+    case OPT_HOSTS_FILE:
+      opt->hosts_file = optarg;
+      break;
+    case OPT_ZONE_FILE:
+      opt->zone_file = optarg;
+      break;
+    case OPT_SYNTHESIZE: {
+      uint8_t categories = 0;
+      if (synthesis_parse_categories(optarg, &categories) != 0) {
+        printf("Invalid synthesized categories: %s\n", optarg);
+        return OPR_OPTION_ERROR;
+      }
+      opt->synthesis = categories;
+      break;
+    }
+    case OPT_NODATA_TYPES: {
+      uint16_t types[SYNTHESIS_MAX_NODATA_TYPES];
+      if (synthesis_parse_types(optarg, types) < 0) {
+        printf("Invalid NODATA query types, at most %d are allowed: %s\n",
+               SYNTHESIS_MAX_NODATA_TYPES, optarg);
+        return OPR_OPTION_ERROR;
+      }
+      opt->nodata_types = optarg;
+      break;
+    }
+    case OPT_BLOCKLIST:
+      opt->blocklist = optarg;
+      break;
+    case OPT_BLOCKLIST_ANSWER:
+      if (strcmp(optarg, "nxdomain") == 0) {
+        opt->blocklist_answer = BLOCKLIST_NXDOMAIN;
+      } else if (strcmp(optarg, "null") == 0) {
+        opt->blocklist_answer = BLOCKLIST_NULL;
+      } else {
+        printf("Blocklist answer must be nxdomain or null.\n");
+        return OPR_OPTION_ERROR;
+      }
+      break;
+    case OPT_COMPILE_BLOCKLIST:
+      opt->compile_blocklist = optarg;
+      break;
+    case OPT_FORWARD: {
+      const char *url = strchr(optarg, '=');
+      if (url == NULL || url == optarg || !is_resolver_url(url + 1)) {
+        printf("Forwarding rule (%s) must be domains=https:// or quic:// address.\n", optarg);
+        return OPR_OPTION_ERROR;
+      }
+      if (opt->forward_count == MAX_FORWARDS) {
+        printf("Number of forwarding rules must be at most %d.\n", MAX_FORWARDS);
+        return OPR_OPTION_ERROR;
+      }
+      opt->forwards[opt->forward_count++] = optarg;
+      break;
+    }
+    case OPT_MIN_TTL:
+      opt->min_ttl = parse_int(optarg);
+      break;
+    case OPT_MAX_TTL:
+      opt->max_ttl = parse_int(optarg);
+      break;
+    case OPT_TTL_OVERRIDE: {
+      const char *limits = strchr(optarg, '=');
+      int min_ttl = 0;
+      int max_ttl = 0;
+      char extra = 0;
+      if (limits == NULL || limits == optarg ||
+          sscanf(limits + 1, "%d:%d%c", &min_ttl, &max_ttl, &extra) != 2 ||  // NOLINT(cert-err34-c)
+          min_ttl < 0 || min_ttl > MAX_TTL || max_ttl < 0 || max_ttl > MAX_TTL ||
+          (max_ttl != 0 && max_ttl < min_ttl)) {
+        printf("TTL override (%s) must be domains=min:max, between 0 and %d.\n",
+               optarg, MAX_TTL);
+        return OPR_OPTION_ERROR;
+      }
+      if (opt->ttl_override_count == OPTIONS_MAX_TTL_OVERRIDES) {
+        printf("Number of TTL overrides must be at most %d.\n", OPTIONS_MAX_TTL_OVERRIDES);
+        return OPR_OPTION_ERROR;
+      }
+      opt->ttl_overrides[opt->ttl_override_count++] = optarg;
+      break;
+    }
+    case OPT_MAX_IN_FLIGHT:
+      opt->max_in_flight = parse_int(optarg);
+      break;
+    case OPT_MAX_PENDING:
+      opt->max_pending = parse_int(optarg);
+      break;
+    case OPT_QUEUE_TIMEOUT:
+      opt->queue_timeout = parse_int(optarg);
+      break;
+    case OPT_MAX_CONNECTIONS:
+      opt->max_connections = parse_int(optarg);
+      break;
+    case OPT_STREAMS_PER_CONNECTION:
+      opt->streams_per_connection = parse_int(optarg);
+      break;
+    case OPT_HTTPS_ENGINE:
+      if (strcmp(optarg, "curl") == 0) {
+        opt->https_engine = HTTPS_ENGINE_CURL;
+      } else if (strcmp(optarg, "nghttp2") == 0) {
+        opt->https_engine = HTTPS_ENGINE_NGHTTP2;
+      } else {
+        printf("HTTPS engine must be curl or nghttp2.\n");
+        return OPR_OPTION_ERROR;
+      }
+      break;
+    case OPT_RATE_LIMIT:
+      opt->rate_limit = parse_int(optarg);
+      break;
+    case OPT_RATE_LIMIT_BURST:
+      opt->rate_limit_burst = parse_int(optarg);
+      break;
+    case OPT_FAILURE_ANSWER:
+      if (strcmp(optarg, "drop") == 0) {
+        opt->failure_answer = FAILURE_ANSWER_DROP;
+      } else if (strcmp(optarg, "servfail") == 0) {
+        opt->failure_answer = FAILURE_ANSWER_SERVFAIL;
+      } else if (strcmp(optarg, "ede") == 0) {
+        opt->failure_answer = FAILURE_ANSWER_EDE;
+      } else {
+        printf("Failure answer must be drop, servfail or ede.\n");
+        return OPR_OPTION_ERROR;
+      }
+      break;
+    case OPT_REUSEPORT:
+      opt->reuseport = parse_int(optarg);
+      break;
+    case OPT_UDP_INCOMING_CPU:
+      opt->udp_incoming_cpu = parse_int(optarg);
+      if (opt->udp_incoming_cpu < 0) {
+        printf("Invalid UDP incoming CPU: %s\n", optarg);
+        return OPR_OPTION_ERROR;
+      }
+      break;
     case 'h':
       return OPR_HELP;
     case 'V': // version
@@ -143,6 +499,15 @@ enum OptionsParseResult options_parse_args(struct Options *opt, int argc, char *
     }
   }
 
+  if (opt->compile_blocklist != NULL) {
+    opt->blocklist_sources = argv + optind;
+    opt->blocklist_source_count = argc - optind;
+    if (opt->blocklist_source_count == 0) {
+      printf("Compiling a blocklist requires list files as arguments.\n");
+      return OPR_OPTION_ERROR;
+    }
+    return OPR_SUCCESS;  // nothing else is used
+  }
   if (opt->user) {
     struct passwd *p = getpwnam(opt->user);
     if (!p || !p->pw_uid) {
@@ -180,12 +545,17 @@ enum OptionsParseResult options_parse_args(struct Options *opt, int argc, char *
       printf("Could not open logfile '%s' for writing.\n", opt->logfile);
     }
   }
-  if (opt->resolver_url == NULL ||
-      strncmp(opt->resolver_url, "https://", 8) != 0) {
-    printf("Resolver prefix (%s) must be a https:// address.\n",
+  if (opt->resolver_url == NULL || !is_resolver_url(opt->resolver_url)) {
+    printf("Resolver prefix (%s) must be a https:// or quic:// address.\n",
            opt->resolver_url);
     return OPR_OPTION_ERROR;
   }
+  if (opt->min_ttl < 0 || opt->min_ttl > MAX_TTL ||
+      opt->max_ttl < 0 || opt->max_ttl > MAX_TTL ||
+      (opt->max_ttl != 0 && opt->max_ttl < opt->min_ttl)) {
+    printf("TTL limits must be between 0 and %d, maximum not below minimum.\n", MAX_TTL);
+    return OPR_OPTION_ERROR;
+  }
   if (opt->bootstrap_dns_polling_interval < 5 ||
       opt->bootstrap_dns_polling_interval > 3600) {
     printf("DNS servers polling interval must be between 5 and 3600.\n");
@@ -218,6 +588,177 @@ enum OptionsParseResult options_parse_args(struct Options *opt, int argc, char *
     printf("TCP client limit must be between 0 and %u.\n", MAX_TCP_CLIENTS);
     return OPR_OPTION_ERROR;
   }
+  const char *unix_paths[] = {opt->unix_dgram_path, opt->unix_stream_path};
+  for (size_t i = 0; i < sizeof(unix_paths) / sizeof(*unix_paths); i++) {
+    if (unix_paths[i] != NULL &&
+        (unix_paths[i][0] == '\0' || strlen(unix_paths[i]) >= UNIX_PATH_MAX_LEN)) {
+      printf("Unix socket path must be between 1 and %d characters.\n", UNIX_PATH_MAX_LEN - 1);
+      return OPR_OPTION_ERROR;
+    }
+  }
+  if (opt->unix_dgram_path != NULL && opt->unix_stream_path != NULL &&
+      strcmp(opt->unix_dgram_path, opt->unix_stream_path) == 0) {
+    printf("Unix datagram and stream sockets must have different paths.\n");
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->unix_stream_path != NULL && opt->tcp_client_limit == 0) {
+    printf("Unix stream socket requires TCP client limit to be at least 1.\n");
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->dot_port < 0 || opt->dot_port > UINT16_MAX) {
+    printf("DNS-over-TLS port must be between 0 and %u.\n", UINT16_MAX);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->dot_port > 0) {
+#if HAS_OPENSSL == 1
+    if (opt->tls_cert == NULL || opt->tls_key == NULL) {
+      printf("DNS-over-TLS listener requires TLS certificate and key.\n");
+      return OPR_OPTION_ERROR;
+    }
+    if (opt->dot_port == opt->listen_port) {
+      printf("DNS-over-TLS port must differ from listen port.\n");
+      return OPR_OPTION_ERROR;
+    }
+    if (opt->tcp_client_limit == 0) {
+      printf("DNS-over-TLS listener requires TCP client limit to be at least 1.\n");
+      return OPR_OPTION_ERROR;
+    }
+#else
+    printf("DNS-over-TLS listener is not supported, compiled without OpenSSL.\n");
+    return OPR_OPTION_ERROR;
+#endif
+  }
+  if (opt->doh_port < 0 || opt->doh_port > UINT16_MAX) {
+    printf("DNS-over-HTTPS port must be between 0 and %u.\n", UINT16_MAX);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->doh_port > 0) {
+#if HAS_OPENSSL == 1 && HAS_NGHTTP2 == 1
+    if (opt->tls_cert == NULL || opt->tls_key == NULL) {
+      printf("DNS-over-HTTPS listener requires TLS certificate and key.\n");
+      return OPR_OPTION_ERROR;
+    }
+    if (opt->doh_port == opt->listen_port || opt->doh_port == opt->dot_port) {
+      printf("DNS-over-HTTPS port must differ from listen and DNS-over-TLS ports.\n");
+      return OPR_OPTION_ERROR;
+    }
+    if (opt->tcp_client_limit == 0) {
+      printf("DNS-over-HTTPS listener requires TCP client limit to be at least 1.\n");
+      return OPR_OPTION_ERROR;
+    }
+#else
+    printf("DNS-over-HTTPS listener is not supported, compiled without OpenSSL or nghttp2.\n");
+    return OPR_OPTION_ERROR;
+#endif
+  }
+  if (opt->https_engine == HTTPS_ENGINE_NGHTTP2) {
+#if HAS_OPENSSL == 1 && HAS_NGHTTP2 == 1
+    if (opt->use_http_version != DEFAULT_HTTP_VERSION) {
+      printf("HTTPS engine nghttp2 supports only HTTP/2, not -x or -q.\n");
+      return OPR_OPTION_ERROR;
+    }
+    if (opt->curl_proxy != NULL) {
+      printf("HTTPS engine nghttp2 does not support proxies, use curl with -t.\n");
+      return OPR_OPTION_ERROR;
+    }
+#else
+    printf("HTTPS engine nghttp2 is not supported, compiled without OpenSSL or nghttp2.\n");
+    return OPR_OPTION_ERROR;
+#endif
+  }
+  int quic = is_quic_url(opt->resolver_url);
+  for (int i = 0; i < opt->forward_count; i++) {
+    quic |= is_quic_url(strchr(opt->forwards[i], '=') + 1);
+  }
+  if (quic) {
+#if HAS_OPENSSL_QUIC == 1
+    if (opt->curl_proxy != NULL) {
+      printf("DNS-over-QUIC resolvers do not support proxies.\n");
+      return OPR_OPTION_ERROR;
+    }
+#else
+    printf("DNS-over-QUIC resolvers are not supported, compiled without OpenSSL 3.2 or newer.\n");
+    return OPR_OPTION_ERROR;
+#endif
+  }
+  if (opt->upstream_threads < 0 || opt->upstream_threads > HTTPS_POOL_MAX_THREADS) {
+    printf("Number of upstream threads must be between 0 and %d.\n", HTTPS_POOL_MAX_THREADS);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->cache_size < 0 || opt->cache_size > MAX_CACHE_SIZE_KB) {
+    printf("Cache size must be between 0 and %d kB.\n", MAX_CACHE_SIZE_KB);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->cache_file != NULL && opt->cache_size == 0) {
+    printf("Cache file requires a cache size.\n");
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->cache_save_interval < 0 || opt->cache_save_interval > 86400) {
+    printf("Cache save interval must be between 0 and 86400 seconds.\n");
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->cache_save_interval > 0 && opt->cache_file == NULL) {
+    printf("Cache save interval requires a cache file.\n");
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->warmup_file != NULL && opt->cache_size == 0) {
+    printf("Warm-up file requires a cache size.\n");
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->max_in_flight < 0 || opt->max_in_flight > MAX_IN_FLIGHT) {
+    printf("Maximum of in-flight requests must be between 0 and %d.\n", MAX_IN_FLIGHT);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->max_pending < 0 || opt->max_pending > MAX_PENDING) {
+    printf("Maximum of pending requests must be between 0 and %d.\n", MAX_PENDING);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->queue_timeout < 1 || opt->queue_timeout > MAX_QUEUE_TIMEOUT_MS) {
+    printf("Queue timeout must be between 1 and %d milliseconds.\n", MAX_QUEUE_TIMEOUT_MS);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->max_connections < 1 || opt->max_connections > MAX_CONNECTIONS) {
+    printf("Maximum of connections must be between 1 and %d.\n", MAX_CONNECTIONS);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->streams_per_connection < 1 ||
+      opt->streams_per_connection > MAX_STREAMS_PER_CONNECTION) {
+    printf("Streams per connection must be between 1 and %d.\n", MAX_STREAMS_PER_CONNECTION);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->rate_limit < 0 || opt->rate_limit > MAX_RATE_LIMIT ||
+      opt->rate_limit_burst < 0 || opt->rate_limit_burst > MAX_RATE_LIMIT) {
+    printf("Rate limit and its burst must be between 0 and %d queries.\n", MAX_RATE_LIMIT);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->warmup_rate < 1 || opt->warmup_rate > MAX_WARMUP_RATE) {
+    printf("Warm-up rate must be between 1 and %d queries per second.\n", MAX_WARMUP_RATE);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->reuseport < 0 || opt->reuseport > MAX_REUSEPORT_GROUP) {
+    printf("Reuseport group size must be between 0 and %d.\n", MAX_REUSEPORT_GROUP);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->listener_cpus != NULL && affinity_check(opt->listener_cpus) != 0) {
+    printf("Invalid listener CPU list: %s\n", opt->listener_cpus);
+    return OPR_OPTION_ERROR;
+  }
+  if (opt->upstream_cpus != NULL) {
+    if (affinity_check(opt->upstream_cpus) != 0) {
+      printf("Invalid upstream CPU list: %s\n", opt->upstream_cpus);
+      return OPR_OPTION_ERROR;
+    }
+    if (opt->upstream_threads == 0) {
+      printf("Upstream CPU list requires upstream threads.\n");
+      return OPR_OPTION_ERROR;
+    }
+  }
+#if HAS_IO_URING != 1
+  if (opt->io_uring) {
+    printf("io_uring is not supported, compiled without it.\n");
+    return OPR_OPTION_ERROR;
+  }
+#endif
   return OPR_SUCCESS;
 }
 
@@ -225,10 +766,27 @@ void options_show_usage(int __attribute__((unused)) argc, char **argv) {
   struct Options defaults;
   options_init(&defaults);
   printf("Usage: %s [-a <listen_addr>] [-p <listen_port>] [-T <tcp_client_limit>]\n", argv[0]);
+  printf("        [--unix-dgram <path>] [--unix-stream <path>] [--unix-mode <mode>] [--io-uring]\n");
+  printf("        [--dot-port <port>] [--doh-port <port>] [--tls-cert <cert_path>] [--tls-key <key_path>]\n");
   printf("        [-b <dns_servers>] [-i <polling_interval>] [-4]\n");
-  printf("        [-r <resolver_url>] [-t <proxy_server>] [-S <source_addr>] [-x] [-q] [-C <ca_path>] [-c <dscp_codepoint>]\n");
+  printf("        [-r <resolver_url>] [--forward <domains>=<resolver_url>]...\n");
+  printf("        [-t <proxy_server>] [-S <source_addr>] [-x] [-q] [-C <ca_path>] [-c <dscp_codepoint>]\n");
+  printf("        [--upstream-threads <threads>] [--listener-cpus <cpus>] [--upstream-cpus <cpus>]\n");
+  printf("        [--max-connections <connections>] [--streams-per-connection <requests>]\n");
+  printf("        [--https-engine <curl|nghttp2>]\n");
+  printf("        [--udp-incoming-cpu <cpu>] [--reuseport <processes>] [--cache-size <kilobytes>]\n");
+  printf("        [--cache-file <path>] [--cache-save-interval <seconds>]\n");
+  printf("        [--warmup-file <path>] [--warmup-rate <queries>] [--ecs-prefix <ipv4,ipv6>]\n");
+  printf("        [--hosts-file <path>] [--zone-file <path>] [--synthesize <categories>]\n");
+  printf("        [--nodata-types <types>] [--min-ttl <seconds>] [--max-ttl <seconds>]\n");
+  printf("        [--ttl-override <domains>=<min>:<max>]...\n");
+  printf("        [--failure-answer <drop|servfail|ede>] [--max-in-flight <requests>]\n");
+  printf("        [--max-pending <requests>] [--queue-timeout <milliseconds>]\n");
+  printf("        [--rate-limit <queries>] [--rate-limit-burst <queries>]\n");
+  printf("        [--blocklist <path>] [--blocklist-answer <nxdomain|null>]\n");
   printf("        [-d] [-u <user>] [-g <group>] \n");
   printf("        [-v]+ [-l <logfile>] [-s <statistic_interval>] [-F <log_limit>] [-V] [-h]\n");
+  printf("   or: %s --compile-blocklist <path> <list_file>...\n", argv[0]);
   printf("\n DNS server\n");
   printf("  -a listen_addr         Local IPv4/v6 address to bind to. (Default: %s)\n",
          defaults.listen_addr);
@@ -236,6 +794,93 @@ void options_show_usage(int __attribute__((unused)) argc, char **argv) {
          defaults.listen_port);
   printf("  -T tcp_client_limit    Number of TCP clients to serve. (Default: %d, Disabled: 0, Min: 1, Max: %d)\n",
          defaults.tcp_client_limit, MAX_TCP_CLIENTS);
+  printf("  --unix-dgram path      Optional Unix domain datagram socket to listen on.\n"\
+         "                         Clients must bind to a filesystem path to receive replies.\n");
+  printf("  --unix-stream path     Optional Unix domain stream socket to listen on.\n"\
+         "                         Uses the same client limit as the TCP listener.\n");
+  printf("  --unix-mode mode       Octal permissions of the Unix socket files, e.g. 660 to let\n"\
+         "                         a group of clients connect. (Default: from umask)\n");
+  printf("  --io-uring             Use io_uring instead of epoll for UDP and plain TCP listeners.\n"\
+         "                         Falls back to epoll if kernel does not support it.\n");
+  printf("  --dot-port port        Optional DNS-over-TLS port to listen on listen_addr. (e.g. 853)\n"\
+         "                         Uses the same client limit as the TCP listener.\n"\
+         "                         (Default: %d, Disabled: 0)\n",
+         defaults.dot_port);
+  printf("  --doh-port port        Optional DNS-over-HTTPS (HTTP/2) port to listen on listen_addr.\n"\
+         "                         Serves path %s, uses the same client limit as the TCP listener.\n"\
+         "                         (Default: %d, Disabled: 0)\n",
+         DOH_SERVER_PATH, defaults.doh_port);
+  printf("  --tls-cert cert_path   PEM certificate chain of downstream TLS listeners.\n");
+  printf("  --tls-key key_path     PEM private key of downstream TLS listeners.\n");
+  printf("  --listener-cpus cpus   Pin the listener thread to CPUs, e.g. 0-1,4. Its buffers are\n"\
+         "                         allocated after pinning, so they are local to the NUMA node.\n");
+  printf("  --reuseport processes  Share listen ports (SO_REUSEPORT) by a group of processes, UDP requests\n"\
+         "                         are steered to a process by question name. (Default: %d, Disabled: 0, Max: %d)\n",
+         defaults.reuseport, MAX_REUSEPORT_GROUP);
+  printf("  --udp-incoming-cpu cpu Set SO_INCOMING_CPU of the UDP socket, e.g. to the CPU receiving\n"\
+         "                         the interrupts of the NIC.\n");
+  printf("  --cache-size kilobytes Memory of the response cache, shared by all threads.\n"\
+         "                         (Default: %d, Disabled: 0, Max: %d)\n",
+         defaults.cache_size, MAX_CACHE_SIZE_KB);
+  printf("  --cache-file path      Snapshot of the response cache, restored in the background on\n"\
+         "                         start and written on exit. Must be writable by user.\n");
+  printf("  --cache-save-interval seconds\n"\
+         "                         Also write the cache snapshot periodically.\n"\
+         "                         (Default: %d, Disabled: 0, Max: 86400)\n",
+         defaults.cache_save_interval);
+  printf("  --warmup-file path     Resolve names of this file into the cache after bootstrapping,\n"\
+         "                         one per line with optional record type, e.g. \"example.com AAAA\".\n");
+  printf("  --warmup-rate queries  Warm-up queries per second. (Default: %d, Min: 1, Max: %d)\n",
+         defaults.warmup_rate, MAX_WARMUP_RATE);
+  printf("  --ecs-prefix ipv4,ipv6 Add EDNS Client Subnet of these prefix lengths, e.g. 24,56, to\n"\
+         "                         requests without one, so CDNs answer for the client network.\n");
+  printf("  --hosts-file path      Answer names of this hosts format file locally, including PTR\n"\
+         "                         queries of their addresses. Reloaded on SIGHUP.\n");
+  printf("  --zone-file path       Answer A, AAAA, CNAME and PTR records of this zone file locally,\n"\
+         "                         other names below its $ORIGIN with NXDOMAIN. Reloaded on SIGHUP.\n");
+  printf("  --synthesize categories\n"\
+         "                         Answer these comma-separated categories, or all, locally: localhost\n"\
+         "                         (loopback addresses), invalid and local (NXDOMAIN), private-ptr\n"\
+         "                         (reverse zones of private addresses, RFC 6303) and any (RFC 8482).\n");
+  printf("  --nodata-types types   Answer queries of these comma-separated types with NODATA locally,\n"\
+         "                         e.g. AAAA,HTTPS,SVCB on IPv4-only networks.\n");
+  printf("  --min-ttl seconds      Raise lower TTLs of upstream responses, including the negative\n"\
+         "                         caching TTL, so downstream caches keep them. (Default: %d, Max: %d)\n",
+         defaults.min_ttl, MAX_TTL);
+  printf("  --max-ttl seconds      Lower higher TTLs of upstream responses.\n"\
+         "                         (Default: %d, Disabled: 0, Max: %d)\n",
+         defaults.max_ttl, MAX_TTL);
+  printf("  --ttl-override domains=min:max\n"\
+         "                         TTL limits of comma-separated domains and their subdomains instead\n"\
+         "                         of the above, e.g. cdn.example=0:60. Repeatable, up to %d times.\n",
+         OPTIONS_MAX_TTL_OVERRIDES);
+  printf("  --failure-answer answer\n"\
+         "                         Answer queries failed upstream with nothing (drop), servfail, or\n"\
+         "                         ede: SERVFAIL with an Extended DNS Error telling why if the client\n"\
+         "                         sent EDNS. Queries shed under load are answered alike.\n"\
+         "                         (Default: ede)\n");
+  printf("  --max-in-flight requests\n"\
+         "                         Upstream requests sent at a time, others wait in a queue.\n"\
+         "                         (Default: %d, Unlimited: 0, Max: %d)\n",
+         defaults.max_in_flight, MAX_IN_FLIGHT);
+  printf("  --max-pending requests Requests waiting in the queue, the oldest is shed when it is\n"\
+         "                         full. (Default: %d, Max: %d)\n",
+         defaults.max_pending, MAX_PENDING);
+  printf("  --queue-timeout milliseconds\n"\
+         "                         Shed requests waiting longer in the queue.\n"\
+         "                         (Default: %d, Max: %d)\n",
+         defaults.queue_timeout, MAX_QUEUE_TIMEOUT_MS);
+  printf("  --rate-limit queries   Queries per second each client (IPv4 address or IPv6 /64) may\n"\
+         "                         send upstream, REFUSED above. Waiting requests are started by\n"\
+         "                         turns of their clients regardless. (Default: %d, Unlimited: 0)\n",
+         defaults.rate_limit);
+  printf("  --rate-limit-burst queries\n"\
+         "                         Queries each client may send at once. (Default: twice the rate)\n");
+  printf("  --blocklist path       Block the domains, and their subdomains, of this blocklist compiled\n"\
+         "                         by --compile-blocklist. Reloaded on SIGHUP.\n");
+  printf("  --blocklist-answer answer\n"\
+         "                         Answer blocked names with nxdomain, or null addresses: 0.0.0.0\n"\
+         "                         and ::. (Default: nxdomain)\n");
   printf("\n DNS client\n");
   printf("  -b dns_servers         Comma-separated IPv4/v6 addresses and ports (addr:port)\n");
   printf("                         of DNS servers to resolve resolver host (e.g. dns.google).\n"\
@@ -247,8 +892,14 @@ void options_show_usage(int __attribute__((unused)) argc, char **argv) {
          defaults.bootstrap_dns_polling_interval);
   printf("  -4                     Force IPv4 hostnames for DNS resolvers non IPv6 networks.\n");
   printf("\n HTTPS client\n");
-  printf("  -r resolver_url        The HTTPS path to the resolver URL. (Default: %s)\n",
+  printf("  -r resolver_url        The HTTPS path to the resolver URL, or quic://host[:port] of a\n"\
+         "                         DNS-over-QUIC resolver, port 853 by default. (Default: %s)\n",
          defaults.resolver_url);
+  printf("  --forward domains=resolver_url\n"\
+         "                         Forward comma-separated domains, and their subdomains, to another\n"\
+         "                         resolver with its own connections, e.g. corp.example=https://10.0.0.1/dns-query\n"\
+         "                         The most specific domain wins. Repeatable, up to %d times.\n",
+         MAX_FORWARDS);
   printf("  -t proxy_server        Optional HTTP proxy. e.g. socks5://127.0.0.1:1080\n");
   printf("                         Remote name resolution will be used if the protocol\n");
   printf("                         supports it (http, https, socks4a, socks5h), otherwise\n");
@@ -269,8 +920,26 @@ void options_show_usage(int __attribute__((unused)) argc, char **argv) {
   printf("  -C ca_path             Optional file containing CA certificates.\n");
   printf("  -c dscp_codepoint      Optional DSCP codepoint to set on upstream HTTPS server\n");
   printf("                         connections. (Min: 0, Max: 63)\n");
+  printf("  --max-connections n    HTTP/2 connections to an upstream (per thread), opened when the\n"\
+         "                         others are busy. Requests go to the one with the fewest in flight.\n"\
+         "                         (Default: %d, Max: %d)\n",
+         defaults.max_connections, MAX_CONNECTIONS);
+  printf("  --streams-per-connection n\n"\
+         "                         Requests in flight on every connection before another one is\n"\
+         "                         opened. (Default: %d)\n", defaults.streams_per_connection);
+  printf("  --https-engine name   HTTPS client implementation: curl, or nghttp2 which keeps an HTTP/2\n"\
+         "                         session with nghttp2 and OpenSSL directly, without per-request setup\n"\
+         "                         of curl. nghttp2 supports neither -x, -q nor -t. (Default: curl)\n");
+  printf("  --upstream-threads n   Run HTTPS clients in n worker threads, so TLS and HTTP/2 processing\n"\
+         "                         does not delay the listeners. (Default: %d, Disabled: 0, Max: %d)\n",
+         defaults.upstream_threads, HTTPS_POOL_MAX_THREADS);
+  printf("  --upstream-cpus cpus   Pin upstream threads to CPUs of the list, one CPU each (round robin).\n"\
+         "                         Each thread allocates its loop and HTTPS client after pinning.\n");
   printf("\n Process\n");
   printf("  -d                     Daemonize.\n");
+  printf("  --compile-blocklist path\n"\
+         "                         Compile domain lists into a blocklist and exit. Lists hold a domain\n"\
+         "                         per line, hosts format or Adblock style (||example.com^) entries.\n");
   printf("  -u user                Optional user to drop to if launched as root.\n");
   printf("  -g group               Optional group to drop to if launched as root.\n");
   printf("\n Logging\n");
@@ -3,6 +3,27 @@
 #define _OPTIONS_H_
 
 #include <stdint.h>
+#include <sys/types.h>
+
+enum {
+  // Size of sun_path in struct sockaddr_un on Linux and BSDs (smallest of them).
+  UNIX_PATH_MAX_LEN = 104,
+  OPTIONS_MAX_FORWARDS = 32,
+  OPTIONS_MAX_TTL_OVERRIDES = 32
+};
+
+// Answer to clients when the upstream request failed.
+enum failure_answer {
+  FAILURE_ANSWER_DROP = 0,
+  FAILURE_ANSWER_SERVFAIL,
+  FAILURE_ANSWER_EDE,  // SERVFAIL with an Extended DNS Error if the client sent EDNS
+};
+
+// Implementation of the upstream HTTPS clients.
+enum https_engine {
+  HTTPS_ENGINE_CURL = 0,
+  HTTPS_ENGINE_NGHTTP2,  // HTTP/2 only, with nghttp2 and OpenSSL directly
+};
 
 struct Options {
   const char *listen_addr;
@@ -10,6 +31,25 @@ struct Options {
 
   int tcp_client_limit;
 
+  // Optional Unix domain socket paths for co-located clients.
+  const char *unix_dgram_path;
+  const char *unix_stream_path;
+  // Permissions of their socket files, from the umask if -1.
+  int unix_mode;
+
+  // DNS-over-TLS listener port, disabled if 0.
+  int dot_port;
+
+  // DNS-over-HTTPS listener port, disabled if 0.
+  int doh_port;
+
+  // Use io_uring instead of epoll for UDP and plain TCP listeners.
+  int io_uring;
+
+  // Certificate and key files of downstream TLS listeners.
+  const char *tls_cert;
+  const char *tls_key;
+
   // Logfile.
   const char *logfile;
   int logfd;
@@ -36,9 +76,35 @@ struct Options {
 
   int dscp; // mark packet with DSCP
 
-  // Resolver URL prefix to use. Must start with https://.
+  // Resolver URL prefix to use. Must start with https://, or quic:// for
+  // DNS-over-QUIC.
   const char *resolver_url;
 
+  // Forwarding rules "domains=resolver_url", domains are comma-separated.
+  const char *forwards[OPTIONS_MAX_FORWARDS];
+  int forward_count;
+
+  // Limits of response TTLs, no upper limit if max_ttl is 0, and overrides
+  // "domains=min:max" of them.
+  int min_ttl;
+  int max_ttl;
+  const char *ttl_overrides[OPTIONS_MAX_TTL_OVERRIDES];
+  int ttl_override_count;
+
+  // enum failure_answer
+  int failure_answer;
+
+  // Upstream requests in flight at a time, unlimited if 0, and requests
+  // waiting for them at most queue_timeout milliseconds.
+  int max_in_flight;
+  int max_pending;
+  int queue_timeout;
+
+  // Queries per second and burst of each client sent upstream, unlimited if
+  // 0. A burst of 0 means twice the rate.
+  int rate_limit;
+  int rate_limit_burst;
+
   // Optional http proxy if required.
   // e.g. "socks5://127.0.0.1:1080"
   const char *curl_proxy;
@@ -51,6 +117,61 @@ struct Options {
   // 3 = Use only HTTP/3 QUIC
   int use_http_version;
 
+  // enum https_engine
+  int https_engine;
+
+  // HTTP/2 connections per upstream and thread, another one is opened when
+  // the requests in flight of all reach streams_per_connection.
+  int max_connections;
+  int streams_per_connection;
+
+  // Number of worker threads running HTTPS clients, disabled if 0.
+  int upstream_threads;
+
+  // CPU lists (e.g. "0-3,8") to pin listener and upstream threads to.
+  const char *listener_cpus;
+  const char *upstream_cpus;
+
+  // Memory budget of the response cache in kilobytes, disabled if 0.
+  int cache_size;
+
+  // Snapshot of the response cache loaded on start and saved on exit.
+  const char *cache_file;
+  // Seconds between saving the cache snapshot, only on exit if 0.
+  int cache_save_interval;
+
+  // Names to resolve into the cache after bootstrapping, at a rate per second.
+  const char *warmup_file;
+  int warmup_rate;
+
+  // Prefix lengths of EDNS Client Subnet added to requests, disabled if -1.
+  int ecs_ipv4_prefix;
+  int ecs_ipv6_prefix;
+
+  // Local answers from a hosts file and a zone file, reloaded on SIGHUP.
+  const char *hosts_file;
+  const char *zone_file;
+
+  // Categories of answers synthesized locally, bits of enum synthesis_category.
+  int synthesis;
+  // Query types answered with NODATA locally, e.g. "AAAA,HTTPS".
+  const char *nodata_types;
+
+  // Compiled blocklist, reloaded on SIGHUP, and the answer to blocked names.
+  const char *blocklist;
+  int blocklist_answer;
+
+  // Compile the list files given as arguments into a blocklist and exit.
+  const char *compile_blocklist;
+  char **blocklist_sources;
+  int blocklist_source_count;
+
+  // Number of processes sharing the listen ports, disabled if 0.
+  int reuseport;
+
+  // SO_INCOMING_CPU of the UDP listener, disabled if -1.
+  int udp_incoming_cpu;
+
   int max_idle_time;
 
   int conn_loss_time;
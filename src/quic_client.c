@@ -0,0 +1,805 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "quic_client.h"
+
+#if HAS_OPENSSL_QUIC == 1
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "dns_wire.h"
+#include "tls_server.h"
+
+// the following macros require to have req pointer to quic_request structure
+// else: compilation failure will occur
+#define DLOG_REQ(format, args...) DLOG("%04hX: " format, req->id, ## args)
+#define WLOG_REQ(format, args...) WLOG("%04hX: " format, req->id, ## args)
+
+#define QUIC_ALPN "\x03" "doq"
+
+enum {
+  QUIC_DEFAULT_PORT = 853,
+  QUIC_LENGTH_SIZE = 2,  // prefix of messages on streams
+  QUIC_MAX_RESPONSE_SIZE = QUIC_LENGTH_SIZE + 65535,
+  QUIC_READ_BUFFER_SIZE = 4096,
+  QUIC_MAX_ADDRESSES = 16,
+  QUIC_HOST_SIZE = 256,
+  QUIC_TIMEOUT_S = 5,  // of requests, 10 seconds while connecting, like https_native
+  // RFC 9250 error codes
+  DOQ_NO_ERROR = 0x0,
+  DOQ_PROTOCOL_ERROR = 0x2,
+  DOQ_REQUEST_CANCELLED = 0x3,
+};
+
+enum conn_state {
+  CONN_CLOSED = 0,
+  CONN_HANDSHAKE,
+  CONN_ESTABLISHED,
+};
+
+struct quic_request {
+  uint16_t id;
+  SSL *stream;  // NULL while waiting for the handshake or stream credit
+  uint8_t failure;  // once it is done
+
+  https_response_cb cb;
+  void *cb_data;
+
+  char *query;  // length prefixed, message ID 0 (RFC 9250 4.2.1)
+  size_t query_len;
+  size_t query_sent;
+
+  char *buf;  // length prefixed response
+  size_t buflen;
+
+  ev_tstamp deadline;
+  struct quic_request *prev;
+  struct quic_request *next;
+};
+
+struct quic_list {
+  struct quic_request *head;
+  struct quic_request *tail;
+};
+
+struct quic_client_s {
+  struct ev_loop *loop;
+  options_t *opt;
+  stat_t *stat;
+
+  SSL_CTX *ssl_ctx;
+  SSL_SESSION *tls_session;  // resumed by the next connection
+
+  // resolver, taken from the URL of the first request
+  char *url;
+  char host[QUIC_HOST_SIZE];  // IPv6 address without brackets
+  uint16_t port;
+  uint8_t host_is_ip;
+  struct sockaddr_storage addrs[QUIC_MAX_ADDRESSES];
+  int addr_count;
+  int next_addr;  // tried by the next connection, after a failed one
+
+  uint8_t state;  // enum conn_state
+  int sock;
+  SSL *ssl;
+  uint8_t conn_used;  // carried a request already
+
+  struct quic_list waiting;  // for the handshake or a stream
+  struct quic_list sent;  // on a stream
+  uint32_t in_flight;
+
+  ev_tstamp idle_since;  // connection is not reused after max_idle_time
+
+  // Connection watchers do not keep the loop alive, the timeout timer of the
+  // requests in flight does.
+  ev_io io_watcher;
+  ev_timer event_timer;  // retransmission, ACK and idle timers of QUIC
+  ev_timer timeout_timer;  // of the request with the earliest deadline
+  ev_timer reset_timer;  // closes connection still timeouting after conn_loss_time
+  ev_prepare flush;  // sends the requests of this loop iteration together
+};
+
+static void list_append(struct quic_list *list, struct quic_request *req) {
+  req->prev = list->tail;
+  req->next = NULL;
+  if (list->tail) {
+    list->tail->next = req;
+  } else {
+    list->head = req;
+  }
+  list->tail = req;
+}
+
+static void list_remove(struct quic_list *list, struct quic_request *req) {
+  if (req->prev) {
+    req->prev->next = req->next;
+  } else {
+    list->head = req->next;
+  }
+  if (req->next) {
+    req->next->prev = req->prev;
+  } else {
+    list->tail = req->prev;
+  }
+  req->prev = NULL;
+  req->next = NULL;
+}
+
+static void io_update(quic_client_t *q, int events) {
+  if (ev_is_active(&q->io_watcher)) {
+    if ((q->io_watcher.events & (EV_READ | EV_WRITE)) == events) {
+      return;
+    }
+    ev_ref(q->loop);
+    ev_io_stop(q->loop, &q->io_watcher);
+  }
+  if (events != 0) {
+    ev_io_set(&q->io_watcher, q->sock, events);
+    ev_io_start(q->loop, &q->io_watcher);
+    ev_unref(q->loop);
+  }
+}
+
+static void event_timer_stop(quic_client_t *q) {
+  if (ev_is_active(&q->event_timer)) {
+    ev_ref(q->loop);
+    ev_timer_stop(q->loop, &q->event_timer);
+  }
+}
+
+// Watches the socket and the next QUIC timer, as wanted by OpenSSL after
+// each call on the connection.
+static void conn_update(quic_client_t *q) {
+  io_update(q, EV_READ | (SSL_net_write_desired(q->ssl) ? EV_WRITE : 0));
+  event_timer_stop(q);
+  struct timeval tv;
+  int infinite = 1;
+  if (SSL_get_event_timeout(q->ssl, &tv, &infinite) == 1 && !infinite) {
+    ev_timer_set(&q->event_timer, (ev_tstamp)tv.tv_sec + (ev_tstamp)tv.tv_usec / 1e6, 0.);
+    ev_timer_start(q->loop, &q->event_timer);
+    ev_unref(q->loop);
+  }
+}
+
+// Calls the callback of an unlinked request and frees it.
+static void request_complete(quic_client_t *q, struct quic_request *req, uint8_t failure) {
+  SSL_free(req->stream);
+  req->stream = NULL;
+  char *resp = NULL;
+  size_t resp_len = 0;
+  if (failure == HTTPS_OK) {
+    resp = req->buf + QUIC_LENGTH_SIZE;
+    resp_len = req->buflen - QUIC_LENGTH_SIZE;
+    dns_wire_set_u16(resp, 0, req->id);  // 0 on the wire
+  }
+  q->in_flight--;
+  if (q->in_flight == 0) {
+    q->idle_since = ev_now(q->loop);
+    ev_timer_stop(q->loop, &q->timeout_timer);
+  }
+  // callback must be called to avoid memleak
+  req->cb(req->cb_data, resp, resp_len, failure);
+  free(req->query);
+  free(req->buf);
+  free(req);
+}
+
+static void complete_list(quic_client_t *q, struct quic_request *req, uint8_t failure) {
+  while (req) {
+    struct quic_request *cur = req;
+    req = req->next;
+    request_complete(q, cur, failure);
+  }
+}
+
+// Closes the connection and fails the requests sent on it. Waiting requests
+// are failed too if 'fail_waiting', otherwise sent on the next connection.
+static void conn_close(quic_client_t *q, uint8_t failure, uint8_t fail_waiting) {
+  if (q->state != CONN_CLOSED) {
+    DLOG("Closing QUIC connection, socket %d", q->sock);
+    q->state = CONN_CLOSED;
+    io_update(q, 0);
+    event_timer_stop(q);
+    ev_timer_stop(q->loop, &q->reset_timer);
+    for (struct quic_request *req = q->sent.head; req != NULL; req = req->next) {
+      SSL_free(req->stream);
+      req->stream = NULL;
+    }
+    // CONNECTION_CLOSE right away, without waiting for the resolver
+    SSL_SHUTDOWN_EX_ARGS args;
+    memset(&args, 0, sizeof(args));
+    args.quic_error_code = DOQ_NO_ERROR;
+    ERR_clear_error();
+    (void)SSL_shutdown_ex(q->ssl, SSL_SHUTDOWN_FLAG_RAPID | SSL_SHUTDOWN_FLAG_NO_BLOCK,
+                          &args, sizeof(args));
+    ERR_clear_error();
+    SSL_free(q->ssl);
+    q->ssl = NULL;
+    close(q->sock);
+    q->sock = -1;
+    if (q->stat) {
+      stat_connection_closed(q->stat);
+    }
+  }
+
+  // callbacks may request again, those go to the lists anew
+  struct quic_request *sent = q->sent.head;
+  q->sent.head = q->sent.tail = NULL;
+  struct quic_request *waiting = NULL;
+  if (fail_waiting) {
+    waiting = q->waiting.head;
+    q->waiting.head = q->waiting.tail = NULL;
+  }
+  complete_list(q, sent, failure);
+  complete_list(q, waiting, failure);
+  if (q->waiting.head) {
+    ev_prepare_start(q->loop, &q->flush);  // on a new connection
+  }
+}
+
+// Returns 0 while the handshake is in progress or done, -1 if it failed.
+static int conn_handshake(quic_client_t *q) {
+  ERR_clear_error();
+  const int res = SSL_connect(q->ssl);
+  if (res != 1) {
+    const int err = SSL_get_error(q->ssl, res);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+      return 0;
+    }
+    tls_server_log_errors("SSL_connect");
+    const long verify = SSL_get_verify_result(q->ssl);
+    if (verify != X509_V_OK) {
+      WLOG("Certificate verification of resolver %s failed: %s",
+           q->host, X509_verify_cert_error_string(verify));
+    } else {
+      WLOG("QUIC handshake with resolver %s failed, does it support DNS-over-QUIC?", q->host);
+    }
+    return -1;
+  }
+  q->state = CONN_ESTABLISHED;
+  DLOG("Connected to resolver %s over QUIC, TLS session %s", q->host,
+       SSL_session_reused(q->ssl) ? "resumed" : "new");
+  return 0;
+}
+
+// Opens a stream for each waiting request, as many as the resolver allows.
+static void open_streams(quic_client_t *q) {
+  int opened = 0;
+  while (q->waiting.head) {
+    struct quic_request *req = q->waiting.head;
+    ERR_clear_error();
+    req->stream = SSL_new_stream(q->ssl, SSL_STREAM_FLAG_NO_BLOCK);
+    if (req->stream == NULL) {
+      ERR_clear_error();
+      break;  // out of stream credit, retried once the resolver grants more
+    }
+    SSL_set_mode(req->stream, SSL_MODE_ENABLE_PARTIAL_WRITE);
+    list_remove(&q->waiting, req);
+    list_append(&q->sent, req);
+    DLOG_REQ("Sending on QUIC stream %llu",
+             (unsigned long long)SSL_get_stream_id(req->stream));
+    if (q->stat && q->conn_used) {
+      stat_connection_reused(q->stat);
+    }
+    q->conn_used = 1;
+    opened++;
+  }
+  if (opened > 0) {
+    DLOG("Opened %d QUIC streams", opened);
+  }
+}
+
+// Writes the rest of the query and the end of the stream.
+// Returns 0 on success or if the stream is blocked, -1 on failure.
+static int stream_write(struct quic_request *req) {
+  if (req->query_sent == req->query_len) {
+    return 0;
+  }
+  size_t written = 0;
+  ERR_clear_error();
+  if (SSL_write_ex2(req->stream, req->query + req->query_sent, req->query_len - req->query_sent,
+                    SSL_WRITE_FLAG_CONCLUDE, &written) == 1) {
+    req->query_sent += written;
+    return 0;
+  }
+  if (SSL_get_error(req->stream, 0) == SSL_ERROR_WANT_WRITE) {
+    return 0;
+  }
+  tls_server_log_errors("SSL_write_ex2");
+  WLOG_REQ("Sending on QUIC stream failed");
+  return -1;
+}
+
+static uint8_t response_complete(const struct quic_request *req) {
+  return req->buflen >= QUIC_LENGTH_SIZE &&
+         req->buflen >= QUIC_LENGTH_SIZE + (((size_t)(uint8_t)req->buf[0] << 8) |
+                                            (uint8_t)req->buf[1]);
+}
+
+// Reads the response received so far.
+// Returns 1 when the request is done, with 'req->failure' set, 0 otherwise.
+static int stream_read(struct quic_request *req) {
+  for (;;) {
+    char buf[QUIC_READ_BUFFER_SIZE];
+    size_t len = 0;
+    ERR_clear_error();
+    if (SSL_read_ex(req->stream, buf, sizeof(buf), &len) == 1) {
+      if (req->buflen + len > QUIC_MAX_RESPONSE_SIZE) {
+        WLOG_REQ("Response size is too large!");
+        req->failure = HTTPS_FAILURE_RESPONSE;
+        return 1;
+      }
+      char *new_buf = (char *)realloc(req->buf, req->buflen + len);
+      if (new_buf == NULL) {
+        FLOG("Out of mem");
+      }
+      req->buf = new_buf;
+      memcpy(req->buf + req->buflen, buf, len);
+      req->buflen += len;
+      if (response_complete(req)) {
+        break;  // not waiting for the end of the stream, there is nothing else on it
+      }
+      continue;
+    }
+    switch (SSL_get_error(req->stream, 0)) {
+      case SSL_ERROR_WANT_READ:
+        return 0;
+      case SSL_ERROR_ZERO_RETURN:  // end of the stream
+        if (response_complete(req)) {
+          break;
+        }
+        WLOG_REQ("QUIC stream ended with an incomplete response");
+        req->failure = HTTPS_FAILURE_RESPONSE;
+        return 1;
+      default:
+        if (SSL_get_stream_read_state(req->stream) == SSL_STREAM_STATE_RESET_REMOTE) {
+          uint64_t code = 0;
+          (void)SSL_get_stream_read_error_code(req->stream, &code);
+          WLOG_REQ("QUIC stream reset by resolver, error %llu", (unsigned long long)code);
+        } else {
+          tls_server_log_errors("SSL_read_ex");
+        }
+        req->failure = HTTPS_FAILURE_CONNECT;
+        return 1;
+    }
+    break;
+  }
+  req->buflen = QUIC_LENGTH_SIZE + (((size_t)(uint8_t)req->buf[0] << 8) | (uint8_t)req->buf[1]);
+  if (req->buflen < QUIC_LENGTH_SIZE + DNS_WIRE_HEADER_LENGTH) {
+    req->failure = HTTPS_FAILURE_RESPONSE;
+  } else {
+    DLOG_REQ("Received %zu bytes over QUIC", req->buflen - QUIC_LENGTH_SIZE);
+    req->failure = HTTPS_OK;
+  }
+  return 1;
+}
+
+// Moves the requests done to 'done', their callbacks are called by the caller.
+static void streams_process(quic_client_t *q, struct quic_list *done) {
+  struct quic_request *req = q->sent.head;
+  while (req) {
+    struct quic_request *cur = req;
+    req = req->next;
+    if (stream_write(cur) != 0) {
+      cur->failure = HTTPS_FAILURE_CONNECT;
+    } else if (!stream_read(cur)) {
+      continue;
+    }
+    list_remove(&q->sent, cur);
+    list_append(done, cur);
+  }
+}
+
+// Proceeds with the handshake, the streams and the connection after OpenSSL
+// handled network events or timers.
+static void conn_process(quic_client_t *q) {
+  if (q->state == CONN_HANDSHAKE && conn_handshake(q) != 0) {
+    conn_close(q, HTTPS_FAILURE_TLS, 1);
+    return;
+  }
+  struct quic_list done = {NULL, NULL};
+  if (q->state == CONN_ESTABLISHED) {
+    open_streams(q);
+    streams_process(q, &done);
+    if (done.head && ev_is_active(&q->reset_timer)) {  // connection is alive
+      ev_timer_stop(q->loop, &q->reset_timer);
+    }
+  }
+  SSL_CONN_CLOSE_INFO info;
+  if (SSL_get_conn_close_info(q->ssl, &info, sizeof(info)) == 1) {
+    if (info.error_code == DOQ_NO_ERROR) {
+      DLOG("QUIC connection closed by resolver");
+    } else {
+      WLOG("QUIC connection closed, error %llu: %.*s", (unsigned long long)info.error_code,
+           (int)info.reason_len, info.reason ? info.reason : "");
+    }
+    conn_close(q, HTTPS_FAILURE_CONNECT, q->state != CONN_ESTABLISHED);
+  } else {
+    conn_update(q);
+  }
+  // last, callbacks may request again
+  while (done.head) {
+    struct quic_request *req = done.head;
+    list_remove(&done, req);
+    if (req->failure != HTTPS_OK) {
+      ILOG("%04hX: Response was faulty (%s), answering the failure", req->id,
+           https_failure_name(req->failure));
+    }
+    request_complete(q, req, req->failure);
+  }
+}
+
+// Starts the handshake, requests wait for it.
+// Returns 0 on success, -1 if connecting failed right away.
+static int conn_open(quic_client_t *q) {
+  if (q->addr_count == 0) {
+    ELOG("No address of resolver %s", q->host);
+    return -1;
+  }
+  const struct sockaddr_storage *addr = &q->addrs[q->next_addr % q->addr_count];
+  const socklen_t addr_len = addr->ss_family == AF_INET ?
+    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+  q->sock = socket(addr->ss_family, SOCK_DGRAM, 0);
+  if (q->sock == -1) {
+    ELOG("Could not open socket %d:%s", errno, strerror(errno));
+    return -1;
+  }
+  int flags = fcntl(q->sock, F_GETFL, 0);
+  if (flags != -1) {
+    fcntl(q->sock, F_SETFL, flags | O_NONBLOCK);
+  }
+  fcntl(q->sock, F_SETFD, FD_CLOEXEC);
+  https_client_socket_options(q->sock, addr->ss_family, q->opt);
+
+  BIO *bio = BIO_new_dgram(q->sock, BIO_NOCLOSE);
+  BIO_ADDR *peer = BIO_ADDR_new();
+  q->ssl = SSL_new(q->ssl_ctx);
+  if (bio == NULL || peer == NULL || q->ssl == NULL) {
+    tls_server_log_errors("SSL_new");
+    FLOG("Failed to create QUIC connection");
+  }
+  SSL_set_bio(q->ssl, bio, bio);
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+  const int peer_set = addr->ss_family == AF_INET ?
+    BIO_ADDR_rawmake(peer, AF_INET, &sin->sin_addr, sizeof(sin->sin_addr), sin->sin_port) :
+    BIO_ADDR_rawmake(peer, AF_INET6, &sin6->sin6_addr, sizeof(sin6->sin6_addr), sin6->sin6_port);
+  if (peer_set != 1 || SSL_set1_initial_peer_addr(q->ssl, peer) != 1 ||
+      SSL_set_blocking_mode(q->ssl, 0) != 1 ||
+      SSL_set_default_stream_mode(q->ssl, SSL_DEFAULT_STREAM_MODE_NONE) != 1 ||
+      // only the client opens streams
+      SSL_set_incoming_stream_policy(q->ssl, SSL_INCOMING_STREAM_POLICY_REJECT,
+                                     DOQ_PROTOCOL_ERROR) != 1) {
+    tls_server_log_errors("SSL_set1_initial_peer_addr");
+    FLOG("Failed to set up QUIC connection");
+  }
+  BIO_ADDR_free(peer);
+  if (q->host_is_ip) {
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(q->ssl), q->host);
+  } else {
+    SSL_set_tlsext_host_name(q->ssl, q->host);
+    SSL_set1_host(q->ssl, q->host);
+  }
+  SSL_set_alpn_protos(q->ssl, (const unsigned char *)QUIC_ALPN, sizeof(QUIC_ALPN) - 1);
+  if (q->tls_session) {
+    SSL_set_session(q->ssl, q->tls_session);
+  }
+  SSL_set_connect_state(q->ssl);
+
+  q->state = CONN_HANDSHAKE;
+  q->conn_used = 0;
+  if (q->stat) {
+    stat_connection_opened(q->stat);
+  }
+  DLOG("Connecting to resolver %s over QUIC, socket %d", q->host, q->sock);
+
+  if (connect(q->sock, (const struct sockaddr *)addr, addr_len) != 0) {
+    WLOG("Connecting to resolver %s failed: %s", q->host, strerror(errno));
+    q->next_addr++;
+    return -1;
+  }
+  conn_process(q);  // sends the first flight
+  return 0;
+}
+
+static void io_cb(struct ev_loop __attribute__((unused)) *loop,
+                  ev_io *w, int __attribute__((unused)) revents) {
+  quic_client_t *q = (quic_client_t *)w->data;
+  ERR_clear_error();
+  (void)SSL_handle_events(q->ssl);
+  conn_process(q);
+}
+
+static void event_timer_cb(struct ev_loop *loop,
+                           ev_timer *w, int __attribute__((unused)) revents) {
+  quic_client_t *q = (quic_client_t *)w->data;
+  ev_ref(loop);  // stopped by libev, it was not counted
+  ERR_clear_error();
+  (void)SSL_handle_events(q->ssl);
+  conn_process(q);
+}
+
+static void flush_cb(struct ev_loop __attribute__((unused)) *loop,
+                     ev_prepare *w, int __attribute__((unused)) revents) {
+  quic_client_t *q = (quic_client_t *)w->data;
+  ev_prepare_stop(q->loop, &q->flush);
+  if (q->state == CONN_CLOSED) {
+    if (q->waiting.head && conn_open(q) != 0) {
+      conn_close(q, HTTPS_FAILURE_CONNECT, 1);
+    }
+    return;
+  }
+  conn_process(q);
+}
+
+static ev_tstamp expire_list(struct quic_list *list, struct quic_list *expired, ev_tstamp now) {
+  ev_tstamp next = 0.;
+  struct quic_request *req = list->head;
+  while (req) {
+    struct quic_request *cur = req;
+    req = req->next;
+    if (cur->deadline > now) {
+      if (next == 0. || cur->deadline < next) {
+        next = cur->deadline;
+      }
+      continue;
+    }
+    list_remove(list, cur);
+    if (cur->stream) {
+      SSL_STREAM_RESET_ARGS args;
+      memset(&args, 0, sizeof(args));
+      args.quic_error_code = DOQ_REQUEST_CANCELLED;
+      ERR_clear_error();
+      (void)SSL_stream_reset(cur->stream, &args, sizeof(args));
+      ERR_clear_error();
+    }
+    list_append(expired, cur);
+  }
+  return next;
+}
+
+static void timeout_cb(struct ev_loop __attribute__((unused)) *loop,
+                       ev_timer *w, int __attribute__((unused)) revents) {
+  quic_client_t *q = (quic_client_t *)w->data;
+  const ev_tstamp now = ev_now(q->loop);
+  struct quic_list expired = {NULL, NULL};
+  const ev_tstamp next_sent = expire_list(&q->sent, &expired, now);
+  const ev_tstamp next_waiting = expire_list(&q->waiting, &expired, now);
+  const ev_tstamp next = (next_sent == 0. || (next_waiting != 0. && next_waiting < next_sent)) ?
+    next_waiting : next_sent;
+  if (next != 0.) {
+    ev_timer_set(&q->timeout_timer, next - now, 0.);
+    ev_timer_start(q->loop, &q->timeout_timer);
+  }
+  if (expired.head == NULL) {
+    return;
+  }
+  if (q->state != CONN_CLOSED) {
+    if (!ev_is_active(&q->reset_timer)) {
+      ILOG("Client reset timer started");
+      ev_timer_start(q->loop, &q->reset_timer);
+    }
+    ev_prepare_start(q->loop, &q->flush);  // stream resets
+  }
+  while (expired.head) {
+    struct quic_request *req = expired.head;
+    list_remove(&expired, req);
+    WLOG_REQ("Request timed out");
+    request_complete(q, req, HTTPS_FAILURE_TIMEOUT);
+  }
+}
+
+static void reset_timer_cb(struct ev_loop __attribute__((unused)) *loop,
+                           ev_timer *w, int __attribute__((unused)) revents) {
+  quic_client_t *q = (quic_client_t *)w->data;
+  ILOG("Client reset timer timeouted");
+  quic_client_reset(q);
+}
+
+// The SSL_CTX is the client's own. Sessions are reported on the TLS object
+// inside the QUIC connection by some OpenSSL versions, not on the connection.
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+  quic_client_t *q = (quic_client_t *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  SSL_SESSION_free(q->tls_session);
+  q->tls_session = session;
+  return 1;  // reference is kept
+}
+
+static SSL_CTX * create_ssl_ctx(quic_client_t *q) {
+  SSL_CTX *ctx = SSL_CTX_new(OSSL_QUIC_client_method());
+  if (ctx == NULL) {
+    tls_server_log_errors("SSL_CTX_new");
+    FLOG("Failed to create QUIC client context");
+  }
+  SSL_CTX_set_app_data(ctx, q);
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  if (q->opt->ca_info) {
+    if (SSL_CTX_load_verify_locations(ctx, q->opt->ca_info, NULL) != 1) {
+      tls_server_log_errors(q->opt->ca_info);
+      ELOG("Failed to load CA certificates: %s", q->opt->ca_info);
+    }
+  } else if (SSL_CTX_set_default_verify_paths(ctx) != 1) {
+    tls_server_log_errors("SSL_CTX_set_default_verify_paths");
+  }
+  // sessions are kept by the client for the next connection
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+  return ctx;
+}
+
+// Parses the quic://host[:port] resolver URL, a path is ignored.
+// Returns 0 on success, -1 if the URL is not usable.
+static int set_target(quic_client_t *q, const char *url_in) {
+  CURLU *url = curl_url();
+  if (url == NULL) {
+    FLOG("Out of mem");
+  }
+  int res = -1;
+  char *scheme = NULL;
+  char *host = NULL;
+  char *port = NULL;
+  if (curl_url_set(url, CURLUPART_URL, url_in, CURLU_NON_SUPPORT_SCHEME) == CURLUE_OK &&
+      curl_url_get(url, CURLUPART_SCHEME, &scheme, 0) == CURLUE_OK &&
+      strcasecmp(scheme, "quic") == 0 &&
+      curl_url_get(url, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+      strlen(host) < sizeof(q->host)) {
+    q->port = curl_url_get(url, CURLUPART_PORT, &port, 0) == CURLUE_OK ?
+      (uint16_t)atoi(port) : QUIC_DEFAULT_PORT;
+    const size_t host_len = strlen(host);
+    if (host[0] == '[' && host[host_len - 1] == ']') {
+      (void)snprintf(q->host, sizeof(q->host), "%.*s", (int)(host_len - 2), host + 1);
+    } else {
+      (void)snprintf(q->host, sizeof(q->host), "%s", host);
+    }
+    struct in6_addr ignored;
+    q->host_is_ip = inet_pton(AF_INET, q->host, &ignored) == 1 ||
+                    inet_pton(AF_INET6, q->host, &ignored) == 1;
+
+    free(q->url);
+    q->url = strdup(url_in);
+    if (q->url == NULL) {
+      FLOG("Out of mem");
+    }
+    res = 0;
+  }
+  curl_free(scheme);
+  curl_free(host);
+  curl_free(port);
+  curl_url_cleanup(url);
+  return res;
+}
+
+quic_client_t * quic_client_create(options_t *opt, stat_t *stat, struct ev_loop *loop) {
+  quic_client_t *q = (quic_client_t *)calloc(1, sizeof(quic_client_t));
+  if (q == NULL) {
+    FLOG("Out of mem");
+  }
+  q->loop = loop;
+  q->opt = opt;
+  q->stat = stat;
+  q->sock = -1;
+  q->ssl_ctx = create_ssl_ctx(q);
+
+  ev_init(&q->io_watcher, io_cb);
+  q->io_watcher.data = q;
+  ev_init(&q->event_timer, event_timer_cb);
+  q->event_timer.data = q;
+  ev_init(&q->timeout_timer, timeout_cb);
+  q->timeout_timer.data = q;
+  ev_timer_init(&q->reset_timer, reset_timer_cb, (double)opt->conn_loss_time, 0);
+  q->reset_timer.data = q;
+  ev_prepare_init(&q->flush, flush_cb);
+  q->flush.data = q;
+  return q;
+}
+
+void quic_client_fetch(quic_client_t *q, const char *url,
+                       const char* postdata, size_t postdata_len,
+                       struct curl_slist *resolv, uint16_t id,
+                       https_response_cb cb, void *data) {
+  if (q->url == NULL || strcmp(q->url, url) != 0) {
+    if (q->url != NULL) {
+      WLOG("Resolver URL changed to %s, reconnecting", url);
+      quic_client_reset(q);
+    }
+    if (set_target(q, url) != 0) {
+      ELOG("%04hX: Unsupported resolver URL: %s", id, url);
+      cb(data, NULL, 0, HTTPS_FAILURE_CONNECT);
+      return;
+    }
+  }
+  if (q->state == CONN_ESTABLISHED && q->in_flight == 0 &&
+      ev_now(q->loop) - q->idle_since >= q->opt->max_idle_time) {
+    DLOG("Closing idle QUIC connection");
+    conn_close(q, HTTPS_FAILURE_ABORTED, 1);
+  }
+  if (q->state == CONN_CLOSED) {
+    // current list, caller may free it after a reset
+    q->addr_count = https_client_resolved_addresses(resolv, q->host, q->port,
+                                                    q->addrs, QUIC_MAX_ADDRESSES);
+  }
+
+  struct quic_request *req = (struct quic_request *)calloc(1, sizeof(struct quic_request));
+  if (req == NULL) {
+    FLOG("Out of mem");
+  }
+  req->id = id;
+  req->cb = cb;
+  req->cb_data = data;
+  req->query_len = QUIC_LENGTH_SIZE + postdata_len;
+  req->query = (char *)malloc(req->query_len);
+  if (req->query == NULL) {
+    FLOG("Out of mem");
+  }
+  dns_wire_set_u16(req->query, 0, (uint16_t)postdata_len);
+  memcpy(req->query + QUIC_LENGTH_SIZE, postdata, postdata_len);
+  dns_wire_set_u16(req->query, QUIC_LENGTH_SIZE, 0);  // message ID
+  const ev_tstamp timeout = q->state == CONN_ESTABLISHED ? QUIC_TIMEOUT_S : 2 * QUIC_TIMEOUT_S;
+  req->deadline = ev_now(q->loop) + timeout;
+  list_append(&q->waiting, req);
+  q->in_flight++;
+
+  if (!ev_is_active(&q->timeout_timer) ||
+      ev_timer_remaining(q->loop, &q->timeout_timer) > timeout) {
+    ev_timer_stop(q->loop, &q->timeout_timer);
+    ev_timer_set(&q->timeout_timer, timeout, 0.);
+    ev_timer_start(q->loop, &q->timeout_timer);
+  }
+  ev_prepare_start(q->loop, &q->flush);
+}
+
+uint32_t quic_client_in_flight(quic_client_t *q) {
+  return q->in_flight;
+}
+
+void quic_client_reset(quic_client_t *q) {
+  conn_close(q, HTTPS_FAILURE_ABORTED, 1);
+}
+
+void quic_client_free(quic_client_t *q) {
+  conn_close(q, HTTPS_FAILURE_ABORTED, 1);
+  ev_timer_stop(q->loop, &q->timeout_timer);
+  ev_prepare_stop(q->loop, &q->flush);
+  SSL_SESSION_free(q->tls_session);
+  SSL_CTX_free(q->ssl_ctx);
+  free(q->url);
+  free(q);
+}
+#else
+quic_client_t * quic_client_create(options_t __attribute__((unused)) *opt,
+                                   stat_t __attribute__((unused)) *stat,
+                                   struct ev_loop __attribute__((unused)) *loop) {
+  FLOG("Compiled without DNS-over-QUIC support");
+  return NULL;
+}
+
+void quic_client_fetch(quic_client_t __attribute__((unused)) *q,
+                       const char __attribute__((unused)) *url,
+                       const char __attribute__((unused)) *postdata,
+                       size_t __attribute__((unused)) postdata_len,
+                       struct curl_slist __attribute__((unused)) *resolv,
+                       uint16_t __attribute__((unused)) id,
+                       https_response_cb __attribute__((unused)) cb,
+                       void __attribute__((unused)) *data) {
+}
+
+uint32_t quic_client_in_flight(quic_client_t __attribute__((unused)) *q) {
+  return 0;
+}
+
+void quic_client_reset(quic_client_t __attribute__((unused)) *q) {
+}
+
+void quic_client_free(quic_client_t __attribute__((unused)) *q) {
+}
+#endif
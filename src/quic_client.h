@@ -0,0 +1,44 @@
+#ifndef _QUIC_CLIENT_H_
+#define _QUIC_CLIENT_H_
+
+// DNS-over-QUIC (RFC 9250) client for quic://host[:port] resolvers, port 853
+// by default. Each query goes on its own bidirectional stream of one QUIC
+// connection, so a lost packet delays only the queries it carried, and there
+// is no HTTP framing around the messages. TLS sessions are resumed by the next
+// connection.
+//
+// Same interface as https_client, used by https_group for quic:// resolver
+// URLs. Address of a resolver host name is taken from the curl resolve list
+// of the bootstrap, like https_native does.
+//
+// Only available if compiled with OpenSSL 3.2 or newer, which has a QUIC
+// client (HAS_OPENSSL_QUIC), options check it.
+
+#include <curl/curl.h>
+
+#include "https_client.h"
+#include "options.h"
+#include "stat.h"
+
+#define QUIC_URL_PREFIX "quic://"
+
+typedef struct quic_client_s quic_client_t;
+
+quic_client_t * quic_client_create(options_t *opt, stat_t *stat, struct ev_loop *loop);
+
+// Same as https_client_fetch(). 'postdata' is copied.
+void quic_client_fetch(quic_client_t *q, const char *url,
+                       const char* postdata, size_t postdata_len,
+                       struct curl_slist *resolv, uint16_t id,
+                       https_response_cb cb, void *data);
+
+uint32_t quic_client_in_flight(quic_client_t *q);
+
+// Closes the connection, aborting the requests in flight. The next request
+// opens a new one, to the address resolved then.
+void quic_client_reset(quic_client_t *q);
+
+// Aborts the requests in flight and frees the client.
+void quic_client_free(quic_client_t *q);
+
+#endif // _QUIC_CLIENT_H_
@@ -0,0 +1,131 @@
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "rate_limit.h"
+
+enum {
+  RATE_LIMIT_SETS = 1024,  // power of 2
+  RATE_LIMIT_WAYS = 4,
+  CLIENT_KEY_LENGTH = 8,  // IPv4 address or IPv6 /64 prefix
+};
+
+struct client_key {
+  uint8_t family;  // AF_INET or AF_INET6, 0 for other clients
+  uint8_t bytes[CLIENT_KEY_LENGTH];
+};
+
+struct bucket {
+  struct client_key key;  // family 0 if unused
+  uint32_t limited_epoch;  // when it last refused a query
+  double tokens;
+  ev_tstamp last;
+};
+
+struct rate_limit_s {
+  struct ev_loop *loop;
+  double rate;
+  double burst;
+  uint32_t epoch;  // advanced by each rate_limit_stats() call
+  struct rate_limit_stats stats;
+  struct bucket buckets[RATE_LIMIT_SETS * RATE_LIMIT_WAYS];
+};
+
+static struct client_key client_key(const struct sockaddr *addr) {
+  struct client_key key;
+  memset(&key, 0, sizeof(key));
+  if (addr->sa_family == AF_INET) {
+    key.family = AF_INET;
+    memcpy(key.bytes, &((const struct sockaddr_in *)(const void *)addr)->sin_addr, 4);
+  } else if (addr->sa_family == AF_INET6) {
+    const struct in6_addr *a6 = &((const struct sockaddr_in6 *)(const void *)addr)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(a6)) {  // of dual-stack listeners
+      key.family = AF_INET;
+      memcpy(key.bytes, a6->s6_addr + 12, 4);
+    } else {
+      key.family = AF_INET6;
+      memcpy(key.bytes, a6->s6_addr, CLIENT_KEY_LENGTH);
+    }
+  }
+  return key;
+}
+
+static uint32_t key_hash(const struct client_key *key) {
+  uint32_t hash = 2166136261U;  // FNV-1a
+  hash = (hash ^ key->family) * 16777619U;
+  for (size_t i = 0; i < CLIENT_KEY_LENGTH; i++) {
+    hash = (hash ^ key->bytes[i]) * 16777619U;
+  }
+  return hash;
+}
+
+uint32_t rate_limit_client_hash(const struct sockaddr *addr) {
+  const struct client_key key = client_key(addr);
+  return key.family != 0 ? key_hash(&key) : 0;
+}
+
+rate_limit_t * rate_limit_create(struct ev_loop *loop, uint32_t rate, uint32_t burst) {
+  rate_limit_t *rl = (rate_limit_t *)calloc(1, sizeof(rate_limit_t));
+  if (rl == NULL) {
+    FLOG("Out of mem");
+  }
+  rl->loop = loop;
+  rl->rate = rate;
+  rl->burst = burst;
+  rl->epoch = 1;
+  return rl;
+}
+
+static struct bucket * find_bucket(rate_limit_t *rl, const struct client_key *key,
+                                   ev_tstamp now) {
+  struct bucket *set = &rl->buckets[(key_hash(key) & (RATE_LIMIT_SETS - 1)) * RATE_LIMIT_WAYS];
+  struct bucket *idlest = &set[0];
+  for (int i = 0; i < RATE_LIMIT_WAYS; i++) {
+    if (memcmp(&set[i].key, key, sizeof(*key)) == 0) {
+      return &set[i];
+    }
+    if (set[i].last < idlest->last) {  // unused ones first
+      idlest = &set[i];
+    }
+  }
+  idlest->key = *key;
+  idlest->limited_epoch = 0;
+  idlest->tokens = rl->burst;
+  idlest->last = now;
+  return idlest;
+}
+
+int rate_limit_allow(rate_limit_t *rl, const struct sockaddr *addr) {
+  const struct client_key key = client_key(addr);
+  if (key.family == 0) {
+    return 1;
+  }
+  const ev_tstamp now = ev_now(rl->loop);
+  struct bucket *b = find_bucket(rl, &key, now);
+  b->tokens += (now - b->last) * rl->rate;
+  if (b->tokens > rl->burst) {
+    b->tokens = rl->burst;
+  }
+  b->last = now;
+  if (b->tokens >= 1.) {
+    b->tokens -= 1.;
+    return 1;
+  }
+  rl->stats.refused++;
+  if (b->limited_epoch != rl->epoch) {
+    b->limited_epoch = rl->epoch;
+    rl->stats.limited_clients++;
+  }
+  return 0;
+}
+
+void rate_limit_stats(rate_limit_t *rl, struct rate_limit_stats *stats) {
+  *stats = rl->stats;
+  memset(&rl->stats, 0, sizeof(rl->stats));
+  rl->epoch++;
+}
+
+void rate_limit_free(rate_limit_t *rl) {
+  free(rl);
+}
@@ -0,0 +1,38 @@
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+// Per-client token buckets, so a single misbehaving client, like a looping
+// device or a scanner, cannot take the upstream capacity of all others.
+//
+// Clients are IPv4 addresses and IPv6 /64 prefixes. Their buckets live in a
+// fixed-size table hashed by client, 4-way set associative: a full set
+// reuses the bucket idle the longest, so idle clients age out without any
+// cleanup. Clients of Unix sockets are not limited.
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <ev.h>
+
+typedef struct rate_limit_s rate_limit_t;
+
+// Each client may send 'rate' queries per second on average, and bursts of
+// up to 'burst' queries.
+rate_limit_t * rate_limit_create(struct ev_loop *loop, uint32_t rate, uint32_t burst);
+
+// Takes a token of the client's bucket. Returns 0 if there is none left.
+int rate_limit_allow(rate_limit_t *rl, const struct sockaddr *addr);
+
+// Hash of the client of 'addr', 0 for clients of Unix sockets. Usable
+// without a rate limit, to tell clients apart.
+uint32_t rate_limit_client_hash(const struct sockaddr *addr);
+
+struct rate_limit_stats {
+  uint64_t refused;  // counters since the previous call
+  uint64_t limited_clients;
+};
+
+void rate_limit_stats(rate_limit_t *rl, struct rate_limit_stats *stats);
+
+void rate_limit_free(rate_limit_t *rl);
+
+#endif // _RATE_LIMIT_H_
@@ -1,3 +1,5 @@
+#include <stdio.h>
+
 #include "stat.h"
 #include "logging.h"
 
@@ -8,9 +10,10 @@ static void reset_counters(stat_t *s) {
   s->responses = 0;
   s->query_times_sum = 0;
 
-  s->connections_opened = 0;
-  s->connections_closed = 0;
-  s->connections_reused = 0;
+  // updated by HTTPS worker threads too
+  __atomic_store_n(&s->connections_opened, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->connections_closed, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->connections_reused, 0, __ATOMIC_RELAXED);
 
   s->tcp_requests_size = 0;
   s->tcp_responses_size = 0;
@@ -23,10 +26,48 @@ static void stat_print(stat_t *s) {
   SLOG("%llu %llu %llu %zu %zu %llu %llu %llu %llu %llu %llu %zu %zu",
        s->requests, s->responses, s->query_times_sum,
        s->requests_size, s->responses_size,
-       s->connections_opened, s->connections_closed,
-       s->connections_reused,
+       __atomic_load_n(&s->connections_opened, __ATOMIC_RELAXED),
+       __atomic_load_n(&s->connections_closed, __ATOMIC_RELAXED),
+       __atomic_load_n(&s->connections_reused, __ATOMIC_RELAXED),
        s->tcp_requests, s->tcp_responses, s->tcp_query_times_sum,
        s->tcp_requests_size, s->tcp_responses_size);
+  if (s->cache != NULL) {
+    struct cache_stats cs;
+    cache_stats(s->cache, &cs);
+    const uint64_t lookups = cs.hits + cs.misses;
+    SLOG("Cache: %zu bytes, %llu entries, %llu hits, %llu misses, %.1f%% hit ratio, "
+         "%llu evictions", cs.bytes, (unsigned long long)cs.entries,
+         (unsigned long long)cs.hits, (unsigned long long)cs.misses,
+         lookups ? 100.0 * (double)cs.hits / (double)lookups : 0.0,
+         (unsigned long long)cs.evictions);
+  }
+  if (s->synthesis != NULL) {
+    uint64_t counts[SYNTHESIS_CATEGORY_COUNT];
+    synthesis_counts(s->synthesis, counts);
+    char line[256];
+    size_t len = 0;
+    for (uint8_t i = 0; i < SYNTHESIS_CATEGORY_COUNT && len < sizeof(line); i++) {
+      const int n = snprintf(line + len, sizeof(line) - len, "%s%llu %s", i ? ", " : "",
+                             (unsigned long long)counts[i], synthesis_category_name(i));
+      len += n > 0 ? (size_t)n : 0;
+    }
+    SLOG("Synthesized: %s", line);
+  }
+  if (s->admission != NULL) {
+    struct admission_stats as;
+    admission_stats(s->admission, &as);
+    SLOG("Admission: %u in flight, %u queued, %u max queued, %.1f ms average wait, "
+         "%llu shed full, %llu shed expired", as.in_flight, as.queued, as.max_queued,
+         as.dequeued ? as.wait_sum * 1000 / (double)as.dequeued : 0.0,
+         (unsigned long long)as.shed[ADMISSION_SHED_FULL],
+         (unsigned long long)as.shed[ADMISSION_SHED_EXPIRED]);
+  }
+  if (s->rate_limit != NULL) {
+    struct rate_limit_stats rs;
+    rate_limit_stats(s->rate_limit, &rs);
+    SLOG("Rate limit: %llu refused, %llu clients limited",
+         (unsigned long long)rs.refused, (unsigned long long)rs.limited_clients);
+  }
   reset_counters(s);
 }
 
@@ -39,6 +80,10 @@ static void stat_timer_cb(struct ev_loop __attribute__((unused)) *loop,
 void stat_init(stat_t *s, struct ev_loop *loop, int stats_interval) {
   s->loop = loop;
   s->stats_interval = stats_interval;
+  s->cache = NULL;
+  s->synthesis = NULL;
+  s->admission = NULL;
+  s->rate_limit = NULL;
   reset_counters(s);
   ev_timer_init(&s->stats_timer, stat_timer_cb,
                 s->stats_interval, s->stats_interval);
@@ -80,17 +125,17 @@ void stat_request_end(stat_t *s, size_t resp_len, ev_tstamp latency, uint8_t is_
 
 void stat_connection_opened(stat_t *s)
 {
-  s->connections_opened++;
+  __atomic_fetch_add(&s->connections_opened, 1, __ATOMIC_RELAXED);
 }
 
 void stat_connection_closed(stat_t *s)
 {
-  s->connections_closed++;
+  __atomic_fetch_add(&s->connections_closed, 1, __ATOMIC_RELAXED);
 }
 
 void stat_connection_reused(stat_t *s)
 {
-  s->connections_reused++;
+  __atomic_fetch_add(&s->connections_reused, 1, __ATOMIC_RELAXED);
 }
 
 void stat_stop(stat_t *s) {
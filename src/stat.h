@@ -8,6 +8,8 @@
 // stat_cleanup() prints the final measurement.
 // stat_request_(begin|end) and
 // stat_connection_(open|closed|reused) update the tallies.
+// Counters of the response cache, of synthesized answers, of admission
+// control and of rate limiting, if set, are printed on separate lines.
 //
 
 #ifndef _STAT_H_
@@ -16,6 +18,11 @@
 #include <stdint.h>
 #include <ev.h>
 
+#include "admission.h"
+#include "cache.h"
+#include "rate_limit.h"
+#include "synthesis.h"
+
 typedef struct {
   struct ev_loop *loop;
   int stats_interval;
@@ -36,6 +43,11 @@ typedef struct {
   uint64_t tcp_requests;
   uint64_t tcp_responses;
   uint64_t tcp_query_times_sum;
+
+  cache_t *cache;  // optional, its counters are printed on a separate line
+  synthesis_t *synthesis;  // optional, likewise
+  admission_t *admission;  // optional, likewise
+  rate_limit_t *rate_limit;  // optional, likewise
 } stat_t;
 
 void stat_init(stat_t *s, struct ev_loop *loop, int stats_interval);
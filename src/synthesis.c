@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns_wire.h"
+#include "logging.h"
+#include "synthesis.h"
+
+enum {
+  SYNTHESIS_TTL = 3600,
+  MAX_LABELS = DNS_WIRE_MAX_NAME_LENGTH / 2,
+  MAX_ZONE_LENGTH = 80,  // of the encoded names below
+};
+
+static const char *category_names[SYNTHESIS_CATEGORY_COUNT] = {
+  "localhost", "invalid", "local", "private-ptr", "any", "nodata",
+};
+
+static const struct {
+  const char *name;
+  uint8_t category;
+} special_zones[] = {
+  {"localhost", SYNTHESIS_LOCALHOST},
+  {"invalid", SYNTHESIS_INVALID},
+  {"local", SYNTHESIS_LOCAL},
+  {"10.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"16.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"17.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"18.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"19.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"20.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"21.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"22.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"23.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"24.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"25.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"26.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"27.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"28.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"29.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"30.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"31.172.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"168.192.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"0.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"127.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"254.169.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"2.0.192.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"100.51.198.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"113.0.203.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"255.255.255.255.in-addr.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa",
+   SYNTHESIS_PRIVATE_PTR},  // ::
+  {"1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.ip6.arpa",
+   SYNTHESIS_PRIVATE_PTR},  // ::1
+  {"d.f.ip6.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"8.e.f.ip6.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"9.e.f.ip6.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"a.e.f.ip6.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"b.e.f.ip6.arpa", SYNTHESIS_PRIVATE_PTR},
+  {"8.b.d.0.1.0.0.2.ip6.arpa", SYNTHESIS_PRIVATE_PTR},
+};
+
+enum {
+  SPECIAL_ZONE_COUNT = sizeof(special_zones) / sizeof(special_zones[0])
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct synthesis_zone {
+  uint8_t category;
+  uint8_t length;
+  char name[MAX_ZONE_LENGTH];  // wire format
+};
+
+// NOLINTNEXTLINE(altera-struct-pack-align)
+struct synthesis_s {
+  uint8_t categories;
+  int nodata_type_count;
+  uint16_t nodata_types[SYNTHESIS_MAX_NODATA_TYPES];
+  int zone_count;
+  struct synthesis_zone zones[SPECIAL_ZONE_COUNT];  // of enabled categories
+  uint64_t counts[SYNTHESIS_CATEGORY_COUNT];
+};
+
+int synthesis_parse_categories(const char *list, uint8_t *categories) {
+  *categories = 0;
+  if (strcmp(list, "all") == 0) {
+    *categories = (1U << SYNTHESIS_NODATA) - 1;
+    return 0;
+  }
+  const char *name = list;
+  while (1) {
+    const char *end = strchr(name, ',');
+    const size_t len = end ? (size_t)(end - name) : strlen(name);
+    uint8_t category = 0;
+    while (category < SYNTHESIS_NODATA &&
+           (strlen(category_names[category]) != len ||
+            strncmp(category_names[category], name, len) != 0)) {
+      category++;
+    }
+    if (category == SYNTHESIS_NODATA) {
+      return -1;
+    }
+    *categories |= (uint8_t)(1U << category);
+    if (end == NULL) {
+      return 0;
+    }
+    name = end + 1;
+  }
+}
+
+int synthesis_parse_types(const char *list, uint16_t *types) {
+  int count = 0;
+  const char *name = list;
+  while (1) {
+    const char *end = strchr(name, ',');
+    const size_t len = end ? (size_t)(end - name) : strlen(name);
+    char buf[16];
+    if (len == 0 || len >= sizeof(buf) || count == SYNTHESIS_MAX_NODATA_TYPES) {
+      return -1;
+    }
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    types[count] = dns_wire_parse_type(buf);
+    if (types[count] == 0) {
+      return -1;
+    }
+    count++;
+    if (end == NULL) {
+      return count;
+    }
+    name = end + 1;
+  }
+}
+
+const char * synthesis_category_name(uint8_t category) {
+  return category < SYNTHESIS_CATEGORY_COUNT ? category_names[category] : "unknown";
+}
+
+synthesis_t * synthesis_create(uint8_t categories, const uint16_t *nodata_types,
+                               int nodata_type_count) {
+  synthesis_t *s = (synthesis_t *)calloc(1, sizeof(synthesis_t));
+  if (s == NULL) {
+    FLOG("Out of mem");
+  }
+  s->categories = categories;
+  s->nodata_type_count = nodata_type_count;
+  memcpy(s->nodata_types, nodata_types, (size_t)nodata_type_count * sizeof(uint16_t));
+  for (size_t i = 0; i < SPECIAL_ZONE_COUNT; i++) {
+    if (!(categories & (1U << special_zones[i].category))) {
+      continue;
+    }
+    struct synthesis_zone *zone = &s->zones[s->zone_count];
+    const int length = dns_wire_encode_name(zone->name, sizeof(zone->name),
+                                            special_zones[i].name);
+    if (length < 0) {
+      FLOG("Invalid special zone: %s", special_zones[i].name);  // must not happen
+    }
+    zone->category = special_zones[i].category;
+    zone->length = (uint8_t)length;
+    s->zone_count++;
+  }
+  return s;
+}
+
+// Returns the zone containing the wire format 'name', NULL if none. Its
+// suffix of 'name' starts at 'zone_offset'.
+static const struct synthesis_zone * find_zone(const synthesis_t *s, const char *name,
+                                               size_t length, size_t *zone_offset) {
+  size_t pos = 0;
+  for (int labels = 0; pos < length && name[pos] != 0 && labels < MAX_LABELS; labels++) {
+    const size_t suffix_length = length - pos;
+    for (int i = 0; i < s->zone_count; i++) {
+      const struct synthesis_zone *zone = &s->zones[i];
+      if (zone->length == suffix_length &&
+          dns_wire_name_equal(name + pos, zone->name, suffix_length)) {
+        *zone_offset = pos;
+        return zone;
+      }
+    }
+    pos += 1 + (uint8_t)name[pos];
+  }
+  return NULL;
+}
+
+char * synthesis_answer(synthesis_t *s, const char *req, size_t req_len, size_t *resp_len) {
+  struct dns_wire_question q;
+  if (req_len < DNS_WIRE_HEADER_LENGTH || DNS_WIRE_QR(req) || DNS_WIRE_OPCODE(req) != 0 ||
+      dns_wire_question(req, req_len, &q) != 0 || q.qclass != DNS_WIRE_CLASS_IN) {
+    return NULL;
+  }
+  int nodata = 0;
+  for (int i = 0; i < s->nodata_type_count && !nodata; i++) {
+    nodata = (q.qtype == s->nodata_types[i]);
+  }
+  size_t zone_offset = 0;
+  const struct synthesis_zone *zone = nodata ? NULL :
+      find_zone(s, req + q.qname_offset, q.qname_length, &zone_offset);
+  uint8_t category = 0;
+  uint8_t rcode = DNS_WIRE_RCODE_NXDOMAIN;
+  uint16_t rdlength = 0;
+  if (nodata) {
+    category = SYNTHESIS_NODATA;
+    rcode = DNS_WIRE_RCODE_NOERROR;
+  } else if (zone != NULL) {
+    category = zone->category;
+    if (category == SYNTHESIS_LOCALHOST) {
+      rcode = DNS_WIRE_RCODE_NOERROR;
+      rdlength = q.qtype == DNS_WIRE_TYPE_A ? 4 : q.qtype == DNS_WIRE_TYPE_AAAA ? 16 : 0;
+    } else if (category == SYNTHESIS_PRIVATE_PTR && zone_offset == 0) {
+      rcode = DNS_WIRE_RCODE_NOERROR;  // the zone exists, empty
+    }
+  } else if (q.qtype == DNS_WIRE_TYPE_ANY && (s->categories & (1U << SYNTHESIS_ANY))) {
+    category = SYNTHESIS_ANY;
+    rcode = DNS_WIRE_RCODE_NOERROR;
+    rdlength = 1 + sizeof("RFC8482") - 1 + 1;  // CPU and empty OS strings
+  } else {
+    return NULL;
+  }
+
+  struct dns_wire_rr opt;
+  const int edns = dns_wire_find_opt(req, req_len, &q, &opt) == 0;
+  char *resp = (char *)malloc(q.end + 2 + DNS_WIRE_RR_FIXED_LENGTH + rdlength +
+                              DNS_WIRE_SOA_LENGTH + DNS_WIRE_OPT_LENGTH);
+  if (resp == NULL) {
+    FLOG("Out of mem");
+  }
+  size_t len = dns_wire_start_response(resp, req, &q, rcode);
+  if (rdlength > 0) {
+    char *p = resp + len;
+    const uint16_t type = category == SYNTHESIS_ANY ? DNS_WIRE_TYPE_HINFO : q.qtype;
+    dns_wire_set_u16(p, 0, 0xc000 | DNS_WIRE_HEADER_LENGTH);  // question name
+    dns_wire_set_u16(p, 2, type);
+    dns_wire_set_u16(p, 4, DNS_WIRE_CLASS_IN);
+    dns_wire_set_u32(p, 6, SYNTHESIS_TTL);
+    dns_wire_set_u16(p, 10, rdlength);
+    char *rdata = p + 2 + DNS_WIRE_RR_FIXED_LENGTH;
+    memset(rdata, 0, rdlength);
+    if (type == DNS_WIRE_TYPE_A) {
+      rdata[0] = 127;
+      rdata[3] = 1;
+    } else if (type == DNS_WIRE_TYPE_AAAA) {
+      rdata[15] = 1;
+    } else {
+      rdata[0] = sizeof("RFC8482") - 1;
+      memcpy(rdata + 1, "RFC8482", sizeof("RFC8482") - 1);
+    }
+    len += 2 + DNS_WIRE_RR_FIXED_LENGTH + rdlength;
+    dns_wire_set_u16(resp, 6, 1);
+  } else {
+    // NODATA types have no zone of their own, the question name stands in
+    len = dns_wire_add_soa(resp, len, DNS_WIRE_HEADER_LENGTH + zone_offset, SYNTHESIS_TTL);
+  }
+  if (edns) {
+    len = dns_wire_add_opt(resp, len);
+  }
+  s->counts[category]++;
+  *resp_len = len;
+  return resp;
+}
+
+void synthesis_counts(const synthesis_t *s, uint64_t counts[SYNTHESIS_CATEGORY_COUNT]) {
+  memcpy(counts, s->counts, sizeof(s->counts));
+}
+
+void synthesis_free(synthesis_t *s) {
+  free(s);
+}
@@ -0,0 +1,57 @@
+#ifndef _SYNTHESIS_H_
+#define _SYNTHESIS_H_
+
+// Answers for queries which must not leave the box, synthesized without
+// asking upstream: special-use names of RFC 6761, reverse lookups of the
+// locally served zones of RFC 6303 and ANY queries answered minimally as
+// RFC 8482 allows. Query types useless to the clients, like AAAA on IPv4-only
+// networks, can be answered with NODATA too.
+//
+// Answers without records carry the SOA of their zone as RFC 6303 gives it,
+// so clients cache them as RFC 2308 negative answers for an hour. NODATA
+// answers to the configured types use the question name as zone.
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum synthesis_category {
+  SYNTHESIS_LOCALHOST = 0,  // loopback addresses
+  SYNTHESIS_INVALID,  // NXDOMAIN
+  SYNTHESIS_LOCAL,  // multicast DNS names, NXDOMAIN
+  SYNTHESIS_PRIVATE_PTR,  // reverse zones of private and special addresses, NXDOMAIN
+  SYNTHESIS_ANY,  // HINFO "RFC8482"
+  SYNTHESIS_NODATA,  // of the NODATA types, not parsed as a category
+  SYNTHESIS_CATEGORY_COUNT
+};
+
+enum {
+  SYNTHESIS_MAX_NODATA_TYPES = 8
+};
+
+typedef struct synthesis_s synthesis_t;
+
+// Parses a comma-separated list of category names, or "all", into a bit
+// mask of categories. Returns -1 on unknown names.
+int synthesis_parse_categories(const char *list, uint8_t *categories);
+
+// Parses a comma-separated list of query types, as names like AAAA or
+// numbers, into 'types'. Returns their number, -1 on unknown names or if
+// there are more than SYNTHESIS_MAX_NODATA_TYPES.
+int synthesis_parse_types(const char *list, uint16_t *types);
+
+const char * synthesis_category_name(uint8_t category);
+
+// Creates synthesis of 'categories' and of NODATA answers to 'nodata_types'.
+synthesis_t * synthesis_create(uint8_t categories, const uint16_t *nodata_types,
+                               int nodata_type_count);
+
+// Returns a response (to be freed by the caller) if 'req' falls into an
+// enabled category, NULL otherwise.
+char * synthesis_answer(synthesis_t *s, const char *req, size_t req_len, size_t *resp_len);
+
+// Number of answers per category since start.
+void synthesis_counts(const synthesis_t *s, uint64_t counts[SYNTHESIS_CATEGORY_COUNT]);
+
+void synthesis_free(synthesis_t *s);
+
+#endif // _SYNTHESIS_H_
@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include "logging.h"
+#include "tls_server.h"
+
+#if HAS_OPENSSL == 1
+#include <openssl/err.h>
+
+enum {
+  TLS_SESSION_TIMEOUT_S = 7200,  // lifetime of session tickets
+  TLS_ERROR_STRING_SIZE = 256
+};
+
+void tls_server_log_errors(const char *prefix) {
+  unsigned long err = 0;
+  while ((err = ERR_get_error()) != 0) {
+    char buf[TLS_ERROR_STRING_SIZE];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    WLOG("%s: %s", prefix, buf);
+  }
+}
+
+static int alpn_select_cb(SSL __attribute__((unused)) *ssl,
+                          const unsigned char **out, unsigned char *outlen,
+                          const unsigned char *in, unsigned int inlen, void *arg) {
+  const char *alpn = (const char *)arg;
+  const size_t alpn_len = strlen(alpn);
+  // client protocols are length prefixed strings
+  for (unsigned int i = 0; i < inlen; i += 1U + in[i]) {
+    if (in[i] == alpn_len && i + 1U + in[i] <= inlen &&
+        memcmp(&in[i + 1], alpn, alpn_len) == 0) {
+      *out = &in[i + 1];
+      *outlen = in[i];
+      return SSL_TLSEXT_ERR_OK;
+    }
+  }
+  // clients not offering our protocol are tolerated
+  return SSL_TLSEXT_ERR_NOACK;
+}
+
+SSL_CTX * tls_server_ctx_create(const char *cert_file, const char *key_file,
+                                const char *alpn) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    tls_server_log_errors("SSL_CTX_new");
+    FLOG("Failed to create TLS server context");
+  }
+  if (SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) != 1) {
+    tls_server_log_errors("SSL_CTX_set_min_proto_version");
+  }
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1) {
+    tls_server_log_errors(cert_file);
+    FLOG("Failed to load TLS certificate: %s", cert_file);
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+    tls_server_log_errors(key_file);
+    FLOG("Failed to load TLS private key: %s", key_file);
+  }
+  if (SSL_CTX_check_private_key(ctx) != 1) {
+    tls_server_log_errors("SSL_CTX_check_private_key");
+    FLOG("TLS private key does not match certificate: %s", cert_file);
+  }
+
+  // Resumed sessions skip the certificate exchange and asymmetric crypto.
+  // Tickets are encrypted with a random key generated for this context,
+  // so no server side session cache is needed.
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT_S);
+
+  // Responses are written from the same buffer again after partial writes.
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                        SSL_MODE_RELEASE_BUFFERS);
+
+  SSL_CTX_set_alpn_select_cb(ctx, alpn_select_cb, (void *)alpn);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // DNS clients often close idle connections without close_notify
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  DLOG("TLS server context created with certificate %s", cert_file);
+  return ctx;
+}
+
+void tls_server_ctx_free(SSL_CTX *ctx) {
+  SSL_CTX_free(ctx);
+}
+#endif
@@ -0,0 +1,24 @@
+// Server side TLS support for downstream listeners (DNS-over-TLS).
+//
+// Only available if compiled with OpenSSL (HAS_OPENSSL), callers must check.
+
+#ifndef _TLS_SERVER_H_
+#define _TLS_SERVER_H_
+
+#if HAS_OPENSSL == 1
+#include <openssl/ssl.h>
+
+// Creates server context with certificate chain and private key loaded from
+// PEM files. Stateless session ticket resumption is enabled.
+// 'alpn' is the application protocol to negotiate (e.g. "dot"), the
+// string has to remain valid until the context is freed.
+SSL_CTX * tls_server_ctx_create(const char *cert_file, const char *key_file,
+                                const char *alpn);
+
+void tls_server_ctx_free(SSL_CTX *ctx);
+
+// Logs and clears the OpenSSL error queue. 'prefix' describes the operation.
+void tls_server_log_errors(const char *prefix);
+#endif
+
+#endif // _TLS_SERVER_H_
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+
+#include "dns_wire.h"
+#include "forward_rules.h"
+#include "logging.h"
+#include "ttl_policy.h"
+
+enum {
+  TTL_POLICY_MAX_OVERRIDES = 32,
+};
+
+struct ttl_limits {
+  uint32_t min;
+  uint32_t max;  // 0 for none
+};
+
+struct ttl_policy_s {
+  forward_rules_t *overrides;  // domains to limits, NULL if there are none
+  uint8_t limit_count;
+  struct ttl_limits limits[1 + TTL_POLICY_MAX_OVERRIDES];  // the first is the default
+};
+
+ttl_policy_t * ttl_policy_create(uint32_t min_ttl, uint32_t max_ttl) {
+  ttl_policy_t *p = (ttl_policy_t *)calloc(1, sizeof(ttl_policy_t));
+  if (p == NULL) {
+    FLOG("Out of mem");
+  }
+  p->limits[0].min = min_ttl;
+  p->limits[0].max = max_ttl;
+  p->limit_count = 1;
+  return p;
+}
+
+int ttl_policy_add_override(ttl_policy_t *p, const char *domain,
+                            uint32_t min_ttl, uint32_t max_ttl) {
+  uint8_t index = 1;  // domains with the same limits share them
+  while (index < p->limit_count &&
+         (p->limits[index].min != min_ttl || p->limits[index].max != max_ttl)) {
+    index++;
+  }
+  if (index == 1 + TTL_POLICY_MAX_OVERRIDES) {
+    return -1;
+  }
+  if (p->overrides == NULL) {
+    p->overrides = forward_rules_create();
+  }
+  if (forward_rules_add(p->overrides, domain, index) != 0) {
+    return -1;
+  }
+  if (index == p->limit_count) {
+    p->limits[index].min = min_ttl;
+    p->limits[index].max = max_ttl;
+    p->limit_count++;
+  }
+  return 0;
+}
+
+static uint32_t clamp(const struct ttl_limits *limits, uint32_t ttl) {
+  if (ttl < limits->min) {
+    return limits->min;
+  }
+  if (limits->max != 0 && ttl > limits->max) {
+    return limits->max;
+  }
+  return ttl;
+}
+
+void ttl_policy_apply(const ttl_policy_t *p, char *resp, size_t resp_len) {
+  struct dns_wire_question q;
+  if (dns_wire_question(resp, resp_len, &q) != 0) {
+    return;
+  }
+  const struct ttl_limits *limits = &p->limits[0];
+  if (p->overrides != NULL) {
+    limits = &p->limits[forward_rules_match(p->overrides, resp + q.qname_offset,
+                                            q.qname_length)];
+  }
+  if (limits->min == 0 && limits->max == 0) {
+    return;
+  }
+  const uint32_t authority_end = (uint32_t)dns_wire_ancount(resp) + dns_wire_nscount(resp);
+  const uint32_t rr_count = authority_end + dns_wire_arcount(resp);
+  size_t pos = q.end;
+  for (uint32_t i = 0; i < rr_count; i++) {
+    struct dns_wire_rr rr;
+    if (dns_wire_next_rr(resp, resp_len, &pos, &rr) != 0) {
+      return;  // the records before are fine
+    }
+    if (rr.type == DNS_WIRE_TYPE_OPT) {
+      continue;  // its TTL field holds flags
+    }
+    dns_wire_set_u32(resp, rr.ttl_offset, clamp(limits, rr.ttl));
+    if (rr.type == DNS_WIRE_TYPE_SOA && i >= dns_wire_ancount(resp) && i < authority_end &&
+        rr.rdlength >= 4) {
+      const size_t minimum_offset = rr.rdata_offset + rr.rdlength - 4;
+      dns_wire_set_u32(resp, minimum_offset, clamp(limits, dns_wire_u32(resp, minimum_offset)));
+    }
+  }
+}
+
+void ttl_policy_free(ttl_policy_t *p) {
+  if (p->overrides != NULL) {
+    forward_rules_free(p->overrides);
+  }
+  free(p);
+}
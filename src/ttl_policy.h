@@ -0,0 +1,29 @@
+#ifndef _TTL_POLICY_H_
+#define _TTL_POLICY_H_
+
+// Clamps the TTLs of upstream responses, rewriting them in place, so
+// downstream caches keep answers long enough to be useful. The negative
+// caching TTL, the MINIMUM field of an SOA record in the authority section,
+// is clamped too. Domains can override the limits, the most specific one
+// wins.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct ttl_policy_s ttl_policy_t;
+
+// A 'max_ttl' of 0 means no upper limit.
+ttl_policy_t * ttl_policy_create(uint32_t min_ttl, uint32_t max_ttl);
+
+// Applies other limits to 'domain' and its subdomains. Returns -1 if the
+// domain is invalid or there are too many different limits.
+int ttl_policy_add_override(ttl_policy_t *p, const char *domain,
+                            uint32_t min_ttl, uint32_t max_ttl);
+
+// Clamps the TTLs of all records but OPT. Records after a malformed one are
+// left as they are.
+void ttl_policy_apply(const ttl_policy_t *p, char *resp, size_t resp_len);
+
+void ttl_policy_free(ttl_policy_t *p);
+
+#endif // _TTL_POLICY_H_
@@ -0,0 +1,396 @@
+#include "uring.h"
+
+#if HAS_IO_URING == 1
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+enum {
+  URING_DRAIN_TIMEOUT_S = 1,
+};
+
+struct uring_buf_ring_s {
+  struct io_uring_buf_ring *ring;
+  size_t ring_size;
+  char *buffers;
+  uint32_t buffer_size;
+  uint16_t count;
+  uint16_t group;
+  struct uring_buf_ring_s *next;
+};
+
+struct uring_s {
+  struct ev_loop *loop;
+  int fd;
+
+  // submission queue
+  void *sq_ptr;
+  size_t sq_size;
+  uint32_t *sq_khead;
+  uint32_t *sq_ktail;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  uint32_t sqe_head;  // first entry not yet submitted to kernel
+  uint32_t sqe_tail;  // next free entry
+
+  // completion queue
+  void *cq_ptr;
+  size_t cq_size;
+  uint32_t *cq_khead;
+  uint32_t *cq_ktail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+
+  uint32_t in_flight;  // operations without their last completion
+
+  int event_fd;
+  ev_io event_watcher;
+  ev_prepare prepare_watcher;
+
+  uint16_t buf_group;
+  uring_buf_ring_t *buf_rings;
+};
+
+static int uring_setup(uint32_t entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Returns 1 if buffer rings can be registered, which came with multishot receive.
+static int uring_probe_buf_ring(int fd) {
+  struct io_uring_buf_ring *ring = (struct io_uring_buf_ring *)mmap(
+    NULL, sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring == MAP_FAILED) {
+    return 0;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring;
+  reg.ring_entries = 1;
+  int supported = uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+  if (supported) {
+    uring_register(fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  }
+  munmap(ring, sizeof(struct io_uring_buf));
+  return supported;
+}
+
+static void uring_submit(uring_t *u) {
+  const uint32_t to_submit = u->sqe_tail - u->sqe_head;
+  if (to_submit == 0) {
+    return;
+  }
+  __atomic_store_n(u->sq_ktail, u->sqe_tail, __ATOMIC_RELEASE);
+  int res = uring_enter(u->fd, to_submit, 0, 0);
+  if (res < 0) {
+    // entries stay in the queue and are retried with the next submission
+    WLOG("io_uring submit failed: %s", strerror(errno));
+    return;
+  }
+  u->sqe_head += (uint32_t)res;
+}
+
+static void uring_process_completions(uring_t *u) {
+  uint32_t head = *u->cq_khead;
+  for (;;) {
+    const uint32_t tail = __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      break;
+    }
+    const struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    uring_op_t *op = (uring_op_t *)(uintptr_t)cqe->user_data;
+    const int32_t res = cqe->res;
+    const uint32_t flags = cqe->flags;
+    head++;
+    // release the entry first, callback may submit new operations
+    __atomic_store_n(u->cq_khead, head, __ATOMIC_RELEASE);
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+      u->in_flight--;
+    }
+    if (op != NULL) {
+      op->cb(op, res, flags);
+    }
+  }
+}
+
+static void event_cb(struct ev_loop __attribute__((unused)) *loop,
+                     ev_io *w, int __attribute__((unused)) revents) {
+  uring_t *u = (uring_t *)w->data;
+  uint64_t value = 0;
+  if (read(u->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    WLOG("io_uring eventfd read failed: %s", strerror(errno));
+  }
+  uring_process_completions(u);
+}
+
+static void prepare_cb(struct ev_loop __attribute__((unused)) *loop,
+                       ev_prepare *w, int __attribute__((unused)) revents) {
+  uring_submit((uring_t *)w->data);
+}
+
+static void uring_unmap(uring_t *u) {
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqes_size);
+  }
+  if (u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr) {
+    munmap(u->cq_ptr, u->cq_size);
+  }
+  if (u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED) {
+    munmap(u->sq_ptr, u->sq_size);
+  }
+}
+
+static int uring_map(uring_t *u, const struct io_uring_params *p) {
+  u->sq_size = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+  u->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    u->sq_size = u->sq_size > u->cq_size ? u->sq_size : u->cq_size;
+    u->cq_size = u->sq_size;
+  }
+  u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ptr == MAP_FAILED) {
+    return -1;
+  }
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ptr = u->sq_ptr;
+  } else {
+    u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ptr == MAP_FAILED) {
+      return -1;
+    }
+  }
+  u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    return -1;
+  }
+
+  char *sq = (char *)u->sq_ptr;
+  u->sq_khead = (uint32_t *)(sq + p->sq_off.head);
+  u->sq_ktail = (uint32_t *)(sq + p->sq_off.tail);
+  u->sq_mask = *(uint32_t *)(sq + p->sq_off.ring_mask);
+  u->sq_entries = p->sq_entries;
+  uint32_t *sq_array = (uint32_t *)(sq + p->sq_off.array);
+  for (uint32_t i = 0; i < p->sq_entries; i++) {
+    sq_array[i] = i;  // entries are always submitted in order
+  }
+  u->sqe_head = u->sqe_tail = *u->sq_ktail;
+
+  char *cq = (char *)u->cq_ptr;
+  u->cq_khead = (uint32_t *)(cq + p->cq_off.head);
+  u->cq_ktail = (uint32_t *)(cq + p->cq_off.tail);
+  u->cq_mask = *(uint32_t *)(cq + p->cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+  return 0;
+}
+
+uring_t * uring_create(struct ev_loop *loop, uint32_t entries) {
+  uring_t *u = (uring_t *)calloc(1, sizeof(uring_t));
+  if (u == NULL) {
+    FLOG("Out of mem");
+  }
+  u->loop = loop;
+  u->event_fd = -1;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_SUBMIT_ALL;
+  u->fd = uring_setup(entries, &p);
+  if (u->fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));  // flags unknown to older kernels
+    u->fd = uring_setup(entries, &p);
+  }
+  if (u->fd < 0) {
+    WLOG("io_uring is not available: %s", strerror(errno));
+    free(u);
+    return NULL;
+  }
+  if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    WLOG("io_uring is too old, kernel 5.11 or newer required");
+    close(u->fd);
+    free(u);
+    return NULL;
+  }
+  if (!uring_probe_buf_ring(u->fd)) {
+    WLOG("io_uring lacks provided buffer rings, kernel 6.0 or newer required");
+    close(u->fd);
+    free(u);
+    return NULL;
+  }
+  if (uring_map(u, &p) != 0) {
+    WLOG("io_uring ring mapping failed: %s", strerror(errno));
+    uring_unmap(u);
+    close(u->fd);
+    free(u);
+    return NULL;
+  }
+
+  u->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (u->event_fd < 0 || uring_register(u->fd, IORING_REGISTER_EVENTFD, &u->event_fd, 1) != 0) {
+    FLOG("Failed to register io_uring eventfd: %s", strerror(errno));
+  }
+
+  // Watchers do not keep the loop alive, as listeners do not do it either
+  // once they are stopped.
+  ev_io_init(&u->event_watcher, event_cb, u->event_fd, EV_READ);
+  u->event_watcher.data = u;
+  ev_io_start(loop, &u->event_watcher);
+  ev_unref(loop);
+  ev_prepare_init(&u->prepare_watcher, prepare_cb);
+  u->prepare_watcher.data = u;
+  ev_prepare_start(loop, &u->prepare_watcher);
+  ev_unref(loop);
+
+  ILOG("Using io_uring with %u entries", p.sq_entries);
+  return u;
+}
+
+struct io_uring_sqe * uring_get_sqe(uring_t *u, uring_op_t *op) {
+  if (u->sqe_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+    uring_submit(u);  // queue is full, kernel consumes entries while submitting
+    if (u->sqe_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+      FLOG("io_uring submission queue overflow");
+    }
+  }
+  struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+  u->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uint64_t)(uintptr_t)op;
+  u->in_flight++;
+  return sqe;
+}
+
+void uring_cancel(uring_t *u, uring_op_t *op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(u, NULL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)op;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+
+uring_buf_ring_t * uring_buf_ring_create(uring_t *u, uint16_t count, uint32_t size) {
+  uring_buf_ring_t *br = (uring_buf_ring_t *)calloc(1, sizeof(uring_buf_ring_t));
+  if (br == NULL) {
+    FLOG("Out of mem");
+  }
+  br->count = count;
+  br->buffer_size = size;
+  br->group = u->buf_group++;
+  br->ring_size = count * sizeof(struct io_uring_buf);
+  br->ring = (struct io_uring_buf_ring *)mmap(NULL, br->ring_size, PROT_READ | PROT_WRITE,
+                                              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  br->buffers = (char *)malloc((size_t)count * size);
+  if (br->ring == MAP_FAILED || br->buffers == NULL) {
+    FLOG("Out of mem");
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+  reg.ring_entries = count;
+  reg.bgid = br->group;
+  if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    FLOG("Failed to register io_uring buffer ring: %s", strerror(errno));
+  }
+
+  for (uint16_t bid = 0; bid < count; bid++) {
+    struct io_uring_buf *buf = &br->ring->bufs[bid];
+    buf->addr = (uint64_t)(uintptr_t)(br->buffers + (size_t)bid * size);
+    buf->len = size;
+    buf->bid = bid;
+  }
+  __atomic_store_n(&br->ring->tail, count, __ATOMIC_RELEASE);
+
+  br->next = u->buf_rings;
+  u->buf_rings = br;
+  return br;
+}
+
+uint16_t uring_buf_ring_group(uring_buf_ring_t *br) {
+  return br->group;
+}
+
+char * uring_buf_ring_buffer(uring_buf_ring_t *br, uint32_t cqe_flags) {
+  const uint16_t bid = (uint16_t)(cqe_flags >> IORING_CQE_BUFFER_SHIFT);
+  return br->buffers + (size_t)bid * br->buffer_size;
+}
+
+void uring_buf_ring_recycle(uring_buf_ring_t *br, uint32_t cqe_flags) {
+  const uint16_t bid = (uint16_t)(cqe_flags >> IORING_CQE_BUFFER_SHIFT);
+  const uint16_t tail = br->ring->tail;
+  struct io_uring_buf *buf = &br->ring->bufs[tail & (br->count - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(br->buffers + (size_t)bid * br->buffer_size);
+  buf->len = br->buffer_size;
+  buf->bid = bid;
+  __atomic_store_n(&br->ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static void drain_timeout_cb(uring_op_t *op, int32_t __attribute__((unused)) res,
+                             uint32_t __attribute__((unused)) flags) {
+  *(uint8_t *)op->data = 1;
+}
+
+void uring_cleanup(uring_t *u) {
+  ev_ref(u->loop);
+  ev_io_stop(u->loop, &u->event_watcher);
+  ev_ref(u->loop);
+  ev_prepare_stop(u->loop, &u->prepare_watcher);
+
+  // process completions of cancelled operations, a timeout limits waiting
+  uint8_t drained = 0;
+  uring_op_t timeout_op = { drain_timeout_cb, &drained };
+  struct __kernel_timespec ts = { .tv_sec = URING_DRAIN_TIMEOUT_S, .tv_nsec = 0 };
+  struct io_uring_sqe *sqe = uring_get_sqe(u, &timeout_op);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)&ts;
+  sqe->len = 1;
+  uring_submit(u);
+  uint8_t timeout_cancelled = 0;
+  while (!drained) {
+    if (u->in_flight == 1 && !timeout_cancelled) {
+      uring_cancel(u, &timeout_op);  // only the timeout is left
+      timeout_cancelled = 1;
+    }
+    uring_submit(u);
+    if (uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      break;
+    }
+    uring_process_completions(u);
+  }
+  if (u->in_flight > 0) {
+    DLOG("io_uring released with %u operations in flight", u->in_flight);
+  }
+
+  close(u->event_fd);
+  uring_unmap(u);
+  close(u->fd);  // releases registered buffer rings too
+  while (u->buf_rings) {
+    uring_buf_ring_t *br = u->buf_rings;
+    u->buf_rings = br->next;
+    munmap(br->ring, br->ring_size);
+    free(br->buffers);
+    free(br);
+  }
+  free(u);
+}
+#endif
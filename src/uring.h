@@ -0,0 +1,60 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+// Minimal io_uring wrapper (raw syscalls, no liburing) driven by the libev
+// loop: completions are signaled via an eventfd registered to the ring, and
+// submissions are collected during a loop iteration and flushed with one
+// io_uring_enter() right before the loop blocks.
+//
+// Only available if compiled with HAS_IO_URING.
+
+#include <ev.h>
+#include <stdint.h>
+
+#if HAS_IO_URING == 1
+#include <linux/io_uring.h>
+
+enum {
+  URING_ENTRIES = 256,  // submission queue size, completion queue is twice as large
+};
+
+typedef struct uring_s uring_t;
+typedef struct uring_buf_ring_s uring_buf_ring_t;
+typedef struct uring_op_s uring_op_t;
+
+// Called for every completion of an operation. Multishot operations keep
+// running while IORING_CQE_F_MORE is set in 'flags'.
+typedef void (*uring_cb)(uring_op_t *op, int32_t res, uint32_t flags);
+
+// Identifies a submitted operation, must remain valid until its last
+// completion arrived.
+struct uring_op_s {
+  uring_cb cb;
+  void *data;
+};
+
+// Returns NULL if io_uring or a required feature is not supported.
+uring_t * uring_create(struct ev_loop *loop, uint32_t entries);
+
+// Returns a zeroed submission queue entry bound to 'op'.
+struct io_uring_sqe * uring_get_sqe(uring_t *u, uring_op_t *op);
+
+// Requests cancellation of all in-flight operations of 'op'.
+void uring_cancel(uring_t *u, uring_op_t *op);
+
+// Provided buffer ring of 'count' (power of 2) buffers with 'size' bytes
+// each, released with the ring.
+uring_buf_ring_t * uring_buf_ring_create(uring_t *u, uint16_t count, uint32_t size);
+uint16_t uring_buf_ring_group(uring_buf_ring_t *br);
+char * uring_buf_ring_buffer(uring_buf_ring_t *br, uint32_t cqe_flags);
+void uring_buf_ring_recycle(uring_buf_ring_t *br, uint32_t cqe_flags);
+
+// Stops the watchers and waits a short time for in-flight operations
+// (cancelled ones are expected to finish), then releases everything.
+// Has to be called after the loop finished, but before the listeners are
+// cleaned up, as their operations may still complete.
+void uring_cleanup(uring_t *u);
+
+#endif
+
+#endif // _URING_H_
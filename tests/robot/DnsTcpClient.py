@@ -14,6 +14,7 @@ class DnsTcpClient:
 
     def __init__(self):
         self.client_socket = None
+        self.received = b''  # beyond the responses returned so far
 
     def open_tcp_client_connection(self, host, port):
         try:
@@ -24,6 +25,15 @@ class DnsTcpClient:
         except Exception as e:
             raise Exception(f"Failed to open TCP connection: {e}")
 
+    def open_unix_client_connection(self, path):
+        try:
+            self.client_socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.client_socket.settimeout(10)
+            self.client_socket.connect(path)
+            print(f"Successfully connected to {path}")
+        except Exception as e:
+            raise Exception(f"Failed to open Unix connection: {e}")
+
     def send_tcp_request_parts(self, *parts):
         if not self.client_socket:
             raise Exception("No TCP connection open. Call 'Open Tcp Client Connection' first.")
@@ -39,27 +49,24 @@ class DnsTcpClient:
     def receive_tcp_response(self):
         if not self.client_socket:
             raise Exception("No TCP connection open. Call 'Open Tcp Client Connection' first.")
-        msg = b''
-        run = True
-        dnslen = 0
-        while run:
+        msg = self.received
+        while len(msg) < 2 or len(msg) < msg[0] * 256 + msg[1] + 2:
             try:
                 data = self.client_socket.recv(1024)
                 if not data:
                     raise Exception(f"Connection closed!")
                 print(f"Received {len(data)} bytes")
                 msg += data
-                if not dnslen:
-                    dnslen = msg[0] * 256 + msg[1]
-                    print(f"DNS response length: {dnslen} bytes")
-                if len(msg) == dnslen + 2:
-                    run = False
             except Exception as e:
                 raise Exception(f"Failed to receive message: {e}") from e
-        return msg[2:]
+        dnslen = msg[0] * 256 + msg[1]
+        print(f"DNS response length: {dnslen} bytes")
+        self.received = msg[dnslen + 2:]  # responses sent together
+        return msg[2:dnslen + 2]
 
     def close_tcp_client_connection(self):
         if self.client_socket:
             self.client_socket.close()
             self.client_socket = None
+            self.received = b''
             print("TCP connection closed.")
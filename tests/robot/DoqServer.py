@@ -0,0 +1,121 @@
+import asyncio
+import struct
+import threading
+
+try:
+    from aioquic.asyncio import QuicConnectionProtocol, serve
+    from aioquic.quic.configuration import QuicConfiguration
+    from aioquic.quic.events import StreamDataReceived
+except ImportError:
+    QuicConnectionProtocol = object
+
+
+class DoqProtocol(QuicConnectionProtocol):
+    # One DNS-over-QUIC (RFC 9250) connection: every query arrives on its own
+    # stream with a 2 byte length prefix, and is answered on the same stream.
+
+    def __init__(self, *args, server, **kwargs):
+        super().__init__(*args, **kwargs)
+        self.server = server
+        self.streams = {}
+        server.connections.append(self)
+
+    def quic_event_received(self, event):
+        if not isinstance(event, StreamDataReceived):
+            return
+        data = self.streams.pop(event.stream_id, b'') + event.data
+        if not event.end_stream:
+            self.streams[event.stream_id] = data
+            return
+        if len(data) < 14 or len(data) != data[0] * 256 + data[1] + 2 or data[2:4] != b'\x00\x00':
+            self.server.errors += 1  # message ID has to be 0 on the wire
+            self._quic.close(error_code=2)  # DOQ_PROTOCOL_ERROR
+        else:
+            self.server.queries += 1
+            response = DoqServer.answer(data[2:])
+            self._quic.send_stream_data(event.stream_id, struct.pack('>H', len(response)) + response,
+                                        end_stream=True)
+        self.transmit()
+
+
+class DoqServer:
+    # Stand-in DNS-over-QUIC resolver for tests, answers every A query with
+    # 192.0.2.1 and other types with NODATA. Runs on its own asyncio loop.
+
+    ROBOT_LIBRARY_SCOPE = 'GLOBAL'
+
+    def __init__(self):
+        self.loop = None
+        self.thread = None
+        self.quic_server = None
+        self.connections = []
+        self.tickets = {}
+        self.queries = 0
+        self.errors = 0
+
+    @staticmethod
+    def answer(query):
+        end = 12
+        while query[end]:
+            end += 1 + query[end]
+        end += 5  # root label, type and class
+        qtype = struct.unpack('>H', query[end - 4:end - 2])[0]
+        response = struct.pack('>HHHHHH', 0, 0x8180, 1, 1 if qtype == 1 else 0, 0, 0) + query[12:end]
+        if qtype == 1:
+            response += struct.pack('>HHHIH4B', 0xc00c, 1, 1, 60, 4, 192, 0, 2, 1)
+        return response
+
+    def aioquic_is_available(self):
+        return QuicConnectionProtocol is not object
+
+    def start_doq_server(self, port, cert, key):
+        configuration = QuicConfiguration(is_client=False, alpn_protocols=['doq'])
+        configuration.load_cert_chain(cert, key)
+        self.loop = asyncio.new_event_loop()
+        started = threading.Event()
+
+        def run():
+            asyncio.set_event_loop(self.loop)
+            self.quic_server = self.loop.run_until_complete(serve(
+                '127.0.0.1', int(port), configuration=configuration,
+                create_protocol=lambda *args, **kwargs: DoqProtocol(*args, server=self, **kwargs),
+                session_ticket_fetcher=self.tickets.get,
+                session_ticket_handler=lambda ticket: self.tickets.update({ticket.ticket: ticket})))
+            started.set()
+            self.loop.run_forever()
+
+        self.thread = threading.Thread(target=run, daemon=True)
+        self.thread.start()
+        if not started.wait(5):
+            raise Exception(f"DNS-over-QUIC server did not start on port {port}")
+        print(f"DNS-over-QUIC server listening on 127.0.0.1:{port}")
+
+    def close_doq_connections(self):
+        done = threading.Event()
+
+        def close():
+            for connection in self.connections:
+                connection.close()
+            self.connections.clear()
+            done.set()
+
+        self.loop.call_soon_threadsafe(close)
+        done.wait(5)
+
+    def doq_server_should_have_answered(self, queries):
+        if self.errors:
+            raise Exception(f"{self.errors} malformed queries received")
+        if self.queries < int(queries):
+            raise Exception(f"{self.queries} queries answered, expected at least {queries}")
+
+    def stop_doq_server(self):
+        if self.loop is None:
+            return
+
+        def stop():
+            self.quic_server.close()
+            self.loop.stop()
+
+        self.loop.call_soon_threadsafe(stop)
+        self.thread.join(5)
+        self.loop = None